@@ -1,10 +1,57 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <cassert>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <new>
+#include <stdexcept>
 #include <ostream>
 #include <iostream>
 #include <vector>
 #include <limits>
 #include <string>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <random>
+#include <list>
+#include <map>
+#include <set>
+#include <optional>
+#include <unordered_map>
+#include <tuple>
+#include <type_traits>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 using namespace std::literals::string_literals;
 
 //==============================================================================
@@ -25,437 +72,12978 @@ constexpr void for_each_adjacent_pair(Iter first, Iter last, Func func)
 }
 
 //==============================================================================
-// Matrix
+// NumaTopology
 //==============================================================================
-class Matrix {
+// NUMA nodes of the machine and the CPUs of each, as sysfs lists them, nodes
+// without CPUs (memory only) left out. Nodes are numbered 0..get_num_nodes()-1
+// here; the kernel's numbers, which can have gaps, are get_os_node(). The
+// default topology is one node of all hardware threads.
+class NumaTopology {
 public:
-    constexpr Matrix(int nrow, int ncol);
+    NumaTopology();
+    explicit NumaTopology(std::vector<std::vector<int>> node_cpus, std::vector<int> os_nodes = {});
 
-    constexpr int get_nrow() const;
-    constexpr int get_ncol() const;
-    constexpr int get_flops() const;
+    int get_num_nodes() const;
+    const std::vector<int>& get_cpus(int node) const;
+    int get_os_node(int node) const;
 
-    constexpr Matrix operator+(const Matrix& other) const;
-    constexpr Matrix operator*(const Matrix& other) const;
-    constexpr Matrix& operator+=(const Matrix& other);
-    constexpr Matrix& operator*=(const Matrix& other);
-    constexpr bool operator==(const Matrix& other) const;
-
-    friend std::ostream& operator<<(std::ostream& os, const Matrix& mat);
+    static std::vector<int> parse_cpu_list(const std::string& list);
+    static NumaTopology detect(const std::filesystem::path& sysfs_dir = "/sys/devices/system/node");
+    static const NumaTopology& system();
 
 private:
-    constexpr Matrix(int nrow, int ncol, int flops);
-
-    int m_nrow;
-    int m_ncol;
-    int m_flops;
+    std::vector<std::vector<int>> m_node_cpus;
+    std::vector<int> m_os_nodes;
 };
 
 //==============================================================================
-// calc_mat_add_flops ()
+// NumaTopology ()
 //==============================================================================
-static constexpr int calc_mat_add_flops(const Matrix& A, const Matrix& B)
+NumaTopology::NumaTopology()
+    : m_node_cpus(1),
+      m_os_nodes(1, 0)
 {
-    return (A.get_nrow() * B.get_ncol());
+    for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++) {
+        m_node_cpus[0].push_back(int(cpu));
+    }
 }
 
 //==============================================================================
-// calc_mat_mult_flops ()
+// NumaTopology ()
 //==============================================================================
-static constexpr int calc_mat_mult_flops(const Matrix& A, const Matrix& B)
+// os_nodes defaults to 0..node_cpus.size()-1
+NumaTopology::NumaTopology(std::vector<std::vector<int>> node_cpus, std::vector<int> os_nodes)
+    : m_node_cpus(std::move(node_cpus)),
+      m_os_nodes(std::move(os_nodes))
 {
-    return (A.get_nrow() * A.get_ncol() * (2 * B.get_ncol() - 1));
+    if (m_node_cpus.empty()) {
+        throw std::logic_error("numa: no node");
+    }
+    if (m_os_nodes.empty()) {
+        for (std::size_t node = 0; node < m_node_cpus.size(); node++) {
+            m_os_nodes.push_back(int(node));
+        }
+    }
+    if (m_os_nodes.size() != m_node_cpus.size()) {
+        throw std::logic_error("numa: " + std::to_string(m_os_nodes.size()) + " os nodes for " +
+                               std::to_string(m_node_cpus.size()) + " nodes");
+    }
 }
 
 //==============================================================================
-// Matrix ()
+// get_num_nodes ()
 //==============================================================================
-constexpr Matrix::Matrix(int nrow, int ncol, int flops)
-    : m_nrow(nrow),
-      m_ncol(ncol),
-      m_flops(flops)
+int NumaTopology::get_num_nodes() const
 {
+    return int(m_node_cpus.size());
 }
 
 //==============================================================================
-// Matrix ()
+// get_cpus ()
 //==============================================================================
-constexpr Matrix::Matrix(int nrow, int ncol)
-    : Matrix(nrow, ncol, 0)
+const std::vector<int>& NumaTopology::get_cpus(int node) const
 {
+    return m_node_cpus[node];
 }
 
 //==============================================================================
-// get_nrow ()
+// get_os_node ()
 //==============================================================================
-constexpr int Matrix::get_nrow() const
+int NumaTopology::get_os_node(int node) const
 {
-    return m_nrow;
+    return m_os_nodes[node];
 }
 
 //==============================================================================
-// get_ncol ()
+// parse_cpu_list ()
 //==============================================================================
-constexpr int Matrix::get_ncol() const
+// CPUs of a sysfs list such as "0-3,8,10-11"
+std::vector<int> NumaTopology::parse_cpu_list(const std::string& list)
 {
-    return m_ncol;
+    std::vector<int> cpus;
+    std::istringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        range.erase(std::remove_if(range.begin(), range.end(),
+                                   [](char c) { return c == ' ' || c == '\t' || c == '\n'; }),
+                    range.end());
+        if (range.empty()) {
+            continue;
+        }
+
+        int first = -1;
+        int last = -1;
+        std::size_t pos = 0;
+        try {
+            first = std::stoi(range, &pos);
+            last = first;
+            if (pos < range.size() && range[pos] == '-') {
+                std::size_t last_pos = 0;
+                last = std::stoi(range.substr(pos + 1), &last_pos);
+                pos += 1 + last_pos;
+            }
+        } catch (const std::logic_error&) {
+            pos = 0;  // std::invalid_argument or std::out_of_range
+        }
+        if (pos != range.size() || first < 0 || last < first) {
+            throw std::runtime_error("numa: bad cpu list \"" + list + "\"");
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    return cpus;
 }
 
 //==============================================================================
-// get_flops ()
+// detect ()
 //==============================================================================
-constexpr int Matrix::get_flops() const
+// Topology under sysfs_dir, the default one where it lists no node with CPUs
+NumaTopology NumaTopology::detect(const std::filesystem::path& sysfs_dir)
 {
-    return m_flops;
+    std::vector<std::pair<int, std::vector<int>>> nodes;
+    std::error_code error;
+    for (std::filesystem::directory_iterator it(sysfs_dir, error), end; !error && it != end; it.increment(error)) {
+        const std::string name = it->path().filename().string();
+        if (name.size() < 5 || name.compare(0, 4, "node") != 0 ||
+            name.find_first_not_of("0123456789", 4) != std::string::npos) {
+            continue;
+        }
+
+        std::ifstream in(it->path() / "cpulist");
+        std::string list;
+        if (std::getline(in, list)) {
+            std::vector<int> cpus = parse_cpu_list(list);
+            if (!cpus.empty()) {
+                nodes.emplace_back(std::stoi(name.substr(4)), std::move(cpus));
+            }
+        }
+    }
+    if (nodes.empty()) {
+        return NumaTopology();
+    }
+
+    std::sort(nodes.begin(), nodes.end());
+    std::vector<std::vector<int>> node_cpus;
+    std::vector<int> os_nodes;
+    for (auto& [os_node, cpus] : nodes) {
+        node_cpus.push_back(std::move(cpus));
+        os_nodes.push_back(os_node);
+    }
+
+    return NumaTopology(std::move(node_cpus), std::move(os_nodes));
 }
 
 //==============================================================================
-// diff_dims_error ()
+// system ()
 //==============================================================================
-std::string diff_dims_error(const Matrix& A, const Matrix& B)
+const NumaTopology& NumaTopology::system()
 {
-    return std::string("A: ") + std::to_string(A.get_nrow()) + "x" + std::to_string(A.get_ncol()) +
-          ", B: " + std::to_string(B.get_nrow()) + "x" + std::to_string(B.get_ncol());
+    static const NumaTopology topology = detect();
+
+    return topology;
 }
 
 //==============================================================================
-// operator+ ()
+// pin_current_thread ()
 //==============================================================================
-constexpr Matrix Matrix::operator+(const Matrix& other) const
+// Restricts the calling thread to cpus. Returns false where the OS refuses
+// (CPUs outside the process's cpuset) or cannot.
+bool pin_current_thread(const std::vector<int>& cpus)
 {
-    // static_assert
-    if (m_nrow != other.m_nrow || this->m_ncol != other.m_ncol) {
-        throw std::logic_error(("add: dimensions do not match: " + diff_dims_error(*this, other)).c_str());
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
     }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
 
-    return {
-        this->m_nrow,
-        this->m_ncol,
-        this->m_flops + other.m_flops + calc_mat_add_flops(*this, other)
+//==============================================================================
+// ThreadPool
+//==============================================================================
+// Work-stealing pool: every worker owns a task deque, pushes and pops its own
+// tasks at the back and, once out of work, steals from the front of the other
+// deques. Threads outside the pool submit to an extra shared deque. A thread
+// waiting on a TaskGroup keeps running tasks instead of blocking, so tasks can
+// spawn and wait on subtasks.
+// Built on a NumaTopology, the workers are split in contiguous blocks over its
+// nodes and pinned to the CPUs of theirs; every node has a deque for tasks
+// submitted to it, and workers steal on their own node before the others.
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(unsigned nworkers);
+    ThreadPool(unsigned nworkers, const NumaTopology& topology);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned get_concurrency() const;
+    const NumaTopology& get_topology() const;
+    int get_current_node() const;
+
+    void submit(Task task, int node = -1);
+    bool try_run_one();
+    void resize(unsigned nworkers);
+
+    static ThreadPool& global();
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
     };
+
+    void start(unsigned nworkers);
+    void stop();
+    std::size_t self_index() const;
+    void worker_loop(std::size_t self);
+
+    const NumaTopology m_topology;  // one node unless pinned
+    const bool m_pinned;
+    std::vector<int> m_worker_nodes;
+    // one per worker, one for outside threads, then one per node
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::vector<std::size_t>> m_steal_orders;  // of the queues, by worker (outside threads last)
+    std::vector<std::thread> m_threads;
+    std::atomic<std::size_t> m_queued;
+    std::atomic<bool> m_stop;
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_sleep_cv;
+};
+
+//==============================================================================
+// TaskGroup
+//==============================================================================
+// Set of tasks run on a ThreadPool. wait() returns once all of them are done
+// and rethrows the first exception any of them threw.
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool);
+    ~TaskGroup();
+
+    template <typename Func>
+    void run(Func&& func, int node = -1);
+    void wait();
+
+private:
+    ThreadPool& m_pool;
+    std::atomic<std::size_t> m_pending;
+    std::mutex m_error_mutex;
+    std::exception_ptr m_error;
+};
+
+// pool and queue of the calling thread, if it is a pool worker
+static thread_local const ThreadPool *t_pool = nullptr;
+static thread_local std::size_t t_pool_index = 0;
+
+class TraceScope;
+
+// innermost active scope of the calling thread, see TraceScope
+static thread_local TraceScope *t_trace_scope = nullptr;
+
+//==============================================================================
+// ThreadPool ()
+//==============================================================================
+ThreadPool::ThreadPool(unsigned nworkers)
+    : m_pinned(false),
+      m_queued(0),
+      m_stop(false)
+{
+    start(nworkers);
 }
 
 //==============================================================================
-// operator* ()
+// ThreadPool ()
 //==============================================================================
-constexpr Matrix Matrix::operator*(const Matrix& other) const
+ThreadPool::ThreadPool(unsigned nworkers, const NumaTopology& topology)
+    : m_topology(topology),
+      m_pinned(true),
+      m_queued(0),
+      m_stop(false)
 {
-    // static_assert
-    if (this->m_ncol != other.m_nrow) {
-        throw std::logic_error(("mult: dimensions do not match: " + diff_dims_error(*this, other)).c_str());
+    start(nworkers);
+}
+
+//==============================================================================
+// start ()
+//==============================================================================
+void ThreadPool::start(unsigned nworkers)
+{
+    const int nnodes = m_topology.get_num_nodes();
+    for (unsigned i = 0; i < nworkers; i++) {
+        m_worker_nodes.push_back(int(std::uint64_t(i) * nnodes / nworkers));
+    }
+    const std::size_t nqueues = nworkers + 1 + nnodes;
+    for (std::size_t q = 0; q < nqueues; q++) {
+        m_queues.push_back(std::make_unique<Queue>());
     }
 
-    return {
-        this->m_nrow,
-        other.m_ncol,
-        this->m_flops + other.m_flops + calc_mat_mult_flops(*this, other)
+    // own queue first, then those of the same node, then the others, each time
+    // rotating from the owner so that thieves spread
+    const auto queue_node = [&](std::size_t q) {
+        return (q < nworkers ? m_worker_nodes[q] : q == nworkers ? -1 : int(q - nworkers - 1));
     };
+    m_steal_orders.resize(nworkers + 1);
+    for (std::size_t self = 0; self < nworkers + 1; self++) {
+        const int self_node = queue_node(self);
+        for (const bool near : {true, false}) {
+            for (std::size_t i = 0; i < nqueues; i++) {
+                const std::size_t q = (self + i) % nqueues;
+                if ((i == 0 || (self_node >= 0 && queue_node(q) == self_node)) == near) {
+                    m_steal_orders[self].push_back(q);
+                }
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < nworkers; i++) {
+        m_threads.emplace_back([this, i]() {
+            if (m_pinned) {
+                pin_current_thread(m_topology.get_cpus(m_worker_nodes[i]));
+            }
+            worker_loop(i);
+        });
+    }
 }
 
 //==============================================================================
-// operator+= ()
+// ~ThreadPool ()
 //==============================================================================
-constexpr Matrix& Matrix::operator+=(const Matrix& other)
+ThreadPool::~ThreadPool()
 {
-    *this = this->operator+(other);
+    stop();
+}
 
-    return *this;
+//==============================================================================
+// stop ()
+//==============================================================================
+void ThreadPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sleep_mutex);
+        m_stop = true;
+    }
+    m_sleep_cv.notify_all();
+    for (std::thread& thread : m_threads) {
+        thread.join();
+    }
 }
 
 //==============================================================================
-// operator*= ()
+// resize ()
 //==============================================================================
-constexpr Matrix& Matrix::operator*=(const Matrix& other)
+// Restarts the pool with nworkers workers. No other thread may use the pool
+// meanwhile, and none of its tasks may be pending: meant for startup, see
+// MachineProfile::apply().
+void ThreadPool::resize(unsigned nworkers)
 {
-    *this = this->operator*(other);
+    if (t_pool == this || m_queued != 0) {
+        throw std::logic_error("thread pool: resized while in use");
+    }
 
-    return *this;
+    stop();
+    m_threads.clear();
+    m_worker_nodes.clear();
+    m_queues.clear();
+    m_steal_orders.clear();
+    m_stop = false;
+    start(nworkers);
 }
 
 //==============================================================================
-// operator== ()
+// get_concurrency ()
 //==============================================================================
-constexpr bool Matrix::operator==(const Matrix& other) const
+unsigned ThreadPool::get_concurrency() const
 {
-    return (this->m_nrow == other.m_nrow &&
-            this->m_ncol == other.m_ncol &&
-            this->m_flops == other.m_flops);
+    // the thread waiting on a TaskGroup runs tasks too
+    return m_threads.size() + 1;
 }
 
 //==============================================================================
-// operator<< ()
+// get_topology ()
 //==============================================================================
-std::ostream& operator<<(std::ostream& os, const Matrix& mat)
+const NumaTopology& ThreadPool::get_topology() const
 {
-    os << "<dims: " << mat.get_nrow() << " x " << mat.get_ncol() << ", flops: " << mat.get_flops() << ">";
+    return m_topology;
+}
 
-    return os;
+//==============================================================================
+// get_current_node ()
+//==============================================================================
+// Node of the calling worker, -1 for threads outside the pool
+int ThreadPool::get_current_node() const
+{
+    return (t_pool == this ? m_worker_nodes[t_pool_index] : -1);
 }
 
 //==============================================================================
-// sum_using_initializer_list ()
+// self_index ()
 //==============================================================================
-constexpr Matrix sum_using_initializer_list(std::initializer_list<const Matrix> mats)
+std::size_t ThreadPool::self_index() const
 {
-    // static_assert
-    if (mats.size() == 0) {
-        throw std::logic_error("no input mat");
+    return (t_pool == this ? t_pool_index : m_threads.size());
+}
+
+//==============================================================================
+// submit ()
+//==============================================================================
+// To the deque of node, or of the calling thread when node < 0. Any worker
+// may end up running the task, those of node first.
+void ThreadPool::submit(Task task, int node)
+{
+    const bool to_node = (node >= 0 && node < m_topology.get_num_nodes());
+    Queue& queue = *m_queues[to_node ? m_threads.size() + 1 + node : self_index()];
+    {
+        // counted before it can be popped, so that the count never wraps
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        m_queued++;
+        queue.tasks.push_back(std::move(task));
+    }
+    {
+        // taken so that a worker cannot miss the wakeup between its check and its wait
+        std::lock_guard<std::mutex> lock(m_sleep_mutex);
     }
+    m_sleep_cv.notify_one();
+}
 
-    Matrix res = *(mats.begin());
-    for (auto it = mats.begin() + 1; it != mats.end(); it++) {
-        res += *it;
+//==============================================================================
+// try_run_one ()
+//==============================================================================
+bool ThreadPool::try_run_one()
+{
+    const std::vector<std::size_t>& order = m_steal_orders[self_index()];
+
+    Task task;
+    for (std::size_t i = 0; i < order.size() && !task; i++) {
+        Queue& queue = *m_queues[order[i]];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        // own tasks LIFO (hot in cache), stolen ones FIFO (the largest pieces of work)
+        if (i == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+
+    if (!task) {
+        return false;
+    }
+
+    // a task is traced on its own, not within whatever the thread was doing
+    // when it picked it up, such as waiting in the middle of a product
+    struct TraceScopeGuard {
+        TraceScope *const saved = std::exchange(t_trace_scope, nullptr);
+        ~TraceScopeGuard() { t_trace_scope = saved; }
+    } guard;
+    m_queued--;
+    task();
+
+    return true;
+}
+
+//==============================================================================
+// worker_loop ()
+//==============================================================================
+void ThreadPool::worker_loop(std::size_t self)
+{
+    t_pool = this;
+    t_pool_index = self;
+
+    while (true) {
+        if (try_run_one()) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_sleep_mutex);
+        m_sleep_cv.wait(lock, [this]() { return m_stop || m_queued > 0; });
+        if (m_stop) {
+            return;
+        }
+    }
+}
+
+//==============================================================================
+// global ()
+//==============================================================================
+ThreadPool& ThreadPool::global()
+{
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+
+    return pool;
+}
+
+//==============================================================================
+// TaskGroup ()
+//==============================================================================
+TaskGroup::TaskGroup(ThreadPool& pool)
+    : m_pool(pool),
+      m_pending(0)
+{
+}
+
+//==============================================================================
+// ~TaskGroup ()
+//==============================================================================
+TaskGroup::~TaskGroup()
+{
+    // tasks reference the group, never leave them running
+    while (m_pending.load(std::memory_order_acquire) != 0) {
+        if (!m_pool.try_run_one()) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+//==============================================================================
+// run ()
+//==============================================================================
+// See ThreadPool::submit() for node
+template <typename Func>
+void TaskGroup::run(Func&& func, int node)
+{
+    m_pending.fetch_add(1, std::memory_order_relaxed);
+    m_pool.submit([this, func = std::forward<Func>(func)]() {
+        try {
+            func();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m_error_mutex);
+            if (!m_error) {
+                m_error = std::current_exception();
+            }
+        }
+        m_pending.fetch_sub(1, std::memory_order_acq_rel);
+    }, node);
+}
+
+//==============================================================================
+// wait ()
+//==============================================================================
+void TaskGroup::wait()
+{
+    while (m_pending.load(std::memory_order_acquire) != 0) {
+        if (!m_pool.try_run_one()) {
+            std::this_thread::yield();
+        }
     }
 
-    return res;
+    if (m_error) {
+        std::exception_ptr error = std::move(m_error);
+        m_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+//==============================================================================
+// parallel_for ()
+//==============================================================================
+// Calls func(first, last) over subranges of [begin, end) of at most 'grain'
+// elements. The range is split in halves recursively, the right half being
+// left for other threads to steal, so uneven subranges balance themselves.
+template <typename Func>
+void parallel_for(ThreadPool& pool, std::size_t begin, std::size_t end, std::size_t grain, const Func& func)
+{
+    grain = std::max<std::size_t>(grain, 1);
+    if (end - begin <= grain || pool.get_concurrency() == 1) {
+        if (begin < end) {
+            func(begin, end);
+        }
+        return;
+    }
+
+    TaskGroup group(pool);
+    const std::function<void(std::size_t, std::size_t)> split = [&](std::size_t first, std::size_t last) {
+        while (last - first > grain) {
+            const std::size_t mid = first + (last - first) / 2;
+            group.run([&split, mid, last]() { split(mid, last); });
+            last = mid;
+        }
+        func(first, last);
+    };
+    split(begin, end);
+    group.wait();
+}
+
+//==============================================================================
+// PoolFuture
+//==============================================================================
+// Value computed asynchronously by a task of run_async() or, from C++20, by a
+// coroutine returning PoolFuture<V>, which may co_await other futures. Like
+// std::future, get() waits and returns the value once, or rethrows what the
+// computation threw; the waiting thread runs tasks of the pool meanwhile, so
+// pools without workers progress. The pool of a coroutine is its first
+// ThreadPool parameter, or ThreadPool::global() if it has none.
+// A coroutine co_awaiting a future suspends without blocking its thread, and
+// whichever thread completes the future resumes it. At most one coroutine
+// can await a future.
+template <typename V>
+class PoolFuture {
+public:
+    PoolFuture() = default;
+
+    bool valid() const;
+    bool is_ready() const;
+    void wait() const;
+    V get();
+
+    template <typename Func>
+    static PoolFuture run(ThreadPool& pool, Func&& func);
+
+#if defined(__cpp_impl_coroutine)
+    struct promise_type;
+
+    bool await_ready() const;
+    bool await_suspend(std::coroutine_handle<> handle);
+    V await_resume();
+#endif
+
+private:
+    struct State {
+        explicit State(ThreadPool *pool);
+        void set(std::optional<V> value, std::exception_ptr error);
+
+        ThreadPool *const pool;  // whose tasks wait() runs, null for ThreadPool::global()
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool ready = false;
+        std::optional<V> value;
+        std::exception_ptr error;
+#if defined(__cpp_impl_coroutine)
+        std::coroutine_handle<> continuation;
+#endif
+    };
+
+    explicit PoolFuture(std::shared_ptr<State> state);
+
+    std::shared_ptr<State> m_state;
+};
+
+#if defined(__cpp_impl_coroutine)
+//==============================================================================
+// promise_type
+//==============================================================================
+// Coroutines returning a PoolFuture start right away, on the calling thread,
+// and complete the future when they co_return. The promise sees the
+// parameters of the coroutine, and keeps the first ThreadPool among them.
+template <typename V>
+struct PoolFuture<V>::promise_type {
+    std::shared_ptr<State> state;
+
+    template <typename... Args>
+    promise_type(Args&... args)
+        : state(std::make_shared<State>(find_pool(args...)))
+    {
+    }
+
+    template <typename... Args>
+    static ThreadPool *find_pool(Args&... args)
+    {
+        ThreadPool *pool = nullptr;
+        const auto visit = [&pool](auto& arg) {
+            if constexpr (std::is_same_v<std::remove_reference_t<decltype(arg)>, ThreadPool>) {
+                pool = (pool ? pool : &arg);
+            }
+        };
+        (visit(args), ...);
+
+        return pool;
+    }
+
+    PoolFuture get_return_object() { return PoolFuture(state); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_value(V value) { state->set(std::move(value), nullptr); }
+    void unhandled_exception() { state->set(std::nullopt, std::current_exception()); }
+};
+#endif
+
+//==============================================================================
+// State ()
+//==============================================================================
+template <typename V>
+PoolFuture<V>::State::State(ThreadPool *pool)
+    : pool(pool)
+{
+}
+
+//==============================================================================
+// set ()
+//==============================================================================
+// Completes the future, resuming the coroutine awaiting it if any
+template <typename V>
+void PoolFuture<V>::State::set(std::optional<V> new_value, std::exception_ptr new_error)
+{
+#if defined(__cpp_impl_coroutine)
+    std::coroutine_handle<> awaiting;
+#endif
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        value = std::move(new_value);
+        error = new_error;
+        ready = true;
+#if defined(__cpp_impl_coroutine)
+        awaiting = std::exchange(continuation, nullptr);
+#endif
+    }
+    cv.notify_all();
+#if defined(__cpp_impl_coroutine)
+    if (awaiting) {
+        awaiting.resume();
+    }
+#endif
+}
+
+//==============================================================================
+// PoolFuture ()
+//==============================================================================
+template <typename V>
+PoolFuture<V>::PoolFuture(std::shared_ptr<State> state)
+    : m_state(std::move(state))
+{
+}
+
+//==============================================================================
+// valid ()
+//==============================================================================
+// Whether there is a value to get(), false once it has been
+template <typename V>
+bool PoolFuture<V>::valid() const
+{
+    return m_state != nullptr;
+}
+
+//==============================================================================
+// is_ready ()
+//==============================================================================
+template <typename V>
+bool PoolFuture<V>::is_ready() const
+{
+    if (!m_state) {
+        throw std::logic_error("future: no state");
+    }
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+
+    return m_state->ready;
+}
+
+//==============================================================================
+// wait ()
+//==============================================================================
+template <typename V>
+void PoolFuture<V>::wait() const
+{
+    ThreadPool& pool = (valid() && m_state->pool ? *m_state->pool : ThreadPool::global());
+    while (!is_ready()) {
+        if (!pool.try_run_one()) {
+            // the future may be completed by another pool, or by a coroutine on one
+            std::unique_lock<std::mutex> lock(m_state->mutex);
+            m_state->cv.wait_for(lock, std::chrono::milliseconds(1), [this]() { return m_state->ready; });
+        }
+    }
+}
+
+//==============================================================================
+// get ()
+//==============================================================================
+template <typename V>
+V PoolFuture<V>::get()
+{
+    wait();
+    const std::shared_ptr<State> state = std::move(m_state);
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+
+    return std::move(*state->value);
+}
+
+//==============================================================================
+// run ()
+//==============================================================================
+// Future of func() run as a task of pool; func must be copyable, as tasks are
+template <typename V>
+template <typename Func>
+PoolFuture<V> PoolFuture<V>::run(ThreadPool& pool, Func&& func)
+{
+    auto state = std::make_shared<State>(&pool);
+    pool.submit([state, func = std::forward<Func>(func)]() mutable {
+        std::optional<V> value;
+        std::exception_ptr error;
+        try {
+            value.emplace(func());
+        } catch (...) {
+            error = std::current_exception();
+        }
+        state->set(std::move(value), error);
+    });
+
+    return PoolFuture(std::move(state));
+}
+
+#if defined(__cpp_impl_coroutine)
+//==============================================================================
+// await_ready ()
+//==============================================================================
+template <typename V>
+bool PoolFuture<V>::await_ready() const
+{
+    return is_ready();
+}
+
+//==============================================================================
+// await_suspend ()
+//==============================================================================
+// Suspends the awaiting coroutine unless the future completed meanwhile
+template <typename V>
+bool PoolFuture<V>::await_suspend(std::coroutine_handle<> handle)
+{
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    if (m_state->ready) {
+        return false;
+    }
+    if (m_state->continuation) {
+        throw std::logic_error("future: already awaited");
+    }
+    m_state->continuation = handle;
+
+    return true;
+}
+
+//==============================================================================
+// await_resume ()
+//==============================================================================
+template <typename V>
+V PoolFuture<V>::await_resume()
+{
+    return get();
+}
+#endif
+
+//==============================================================================
+// run_async ()
+//==============================================================================
+template <typename Func>
+auto run_async(ThreadPool& pool, Func&& func)
+{
+    return PoolFuture<std::decay_t<std::invoke_result_t<Func&>>>::run(pool, std::forward<Func>(func));
+}
+
+//==============================================================================
+// TraceEvent
+//==============================================================================
+// One traced operation: an m x k by k x n product, or an m x n sum (k = 0),
+// with the flops it was predicted to cost, the bytes it allocated for its
+// result and the kernel that ran it. op and kernel are string literals.
+struct TraceEvent {
+    const char *op;
+    const char *kernel;
+    int m;
+    int k;
+    int n;
+    std::int64_t flops;
+    std::int64_t bytes;
+    std::int64_t start_ns;  // since the epoch of the recorder
+    std::int64_t duration_ns;
+    unsigned thread;  // threads are numbered in the order they first record
+};
+
+//==============================================================================
+// TraceHistogram
+//==============================================================================
+// Events of one op and kernel, totalled, with their durations in powers of 2:
+// bucket b counts the events of [2^b, 2^(b + 1)) ns, bucket 0 those under 2 ns
+struct TraceHistogram {
+    static constexpr int num_buckets = 48;
+
+    std::int64_t count = 0;
+    std::int64_t flops = 0;
+    std::int64_t bytes = 0;
+    std::int64_t total_ns = 0;
+    std::array<std::int64_t, num_buckets> buckets{};
+
+    void add(const TraceEvent& event);
+};
+
+//==============================================================================
+// TraceRecorder
+//==============================================================================
+// Collects the events of the trace hooks, see TraceScope. Every thread
+// appends to a buffer of its own, under a lock only readers contend for, and
+// keeps at most max_events events in it, counting the others as dropped.
+// Hooks record only while the recorder is enabled, which it is not at first.
+class TraceRecorder {
+public:
+    static constexpr std::size_t max_events = 1 << 20;
+
+    TraceRecorder();
+
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    bool is_enabled() const;
+    void set_enabled(bool enabled);
+    std::int64_t now_ns() const;
+
+    void record(const TraceEvent& event);
+    void clear();
+
+    std::vector<TraceEvent> get_events() const;
+    std::int64_t get_num_dropped() const;
+    std::map<std::string, TraceHistogram> get_histograms() const;
+
+    void write_chrome_trace(std::ostream& os) const;
+    void write_histograms(std::ostream& os) const;
+
+    static TraceRecorder& global();
+
+private:
+    struct Buffer {
+        std::mutex mutex;
+        std::thread::id owner;
+        unsigned thread = 0;
+        std::vector<TraceEvent> events;
+        std::int64_t num_dropped = 0;
+    };
+
+    Buffer& get_buffer();
+
+    const std::uint64_t m_id;  // tells recorders apart in the buffer cache of each thread
+    const std::chrono::steady_clock::time_point m_epoch;
+    std::atomic<bool> m_enabled;
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<Buffer>> m_buffers;
+};
+
+//==============================================================================
+// TraceScope
+//==============================================================================
+// Times the operation it lives through and records it to
+// TraceRecorder::global(), unless the recorder is disabled or the operation
+// throws. A scope within one of the same op on the same thread, such as the
+// += under a +, is folded into that one. The kernel and the bytes allocated
+// go to the innermost scope of the calling thread. A pool task starts
+// outside the scopes of the thread that runs it. Only used through the
+// MATRIX_TRACE_* hooks below.
+class TraceScope {
+public:
+    TraceScope(const char *op, int m, int k, int n, std::int64_t flops);
+    ~TraceScope();
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    static void set_kernel(const char *kernel);
+    static void add_bytes(std::int64_t bytes);
+
+private:
+    TraceEvent m_event;
+    TraceScope *m_parent;
+    int m_num_exceptions;
+    bool m_active;
+};
+
+// The hooks of the hot paths: built with -DMATRIX_TRACE they record to
+// TraceRecorder::global(), otherwise they compile to nothing and their
+// arguments are not evaluated
+#if defined(MATRIX_TRACE)
+#define MATRIX_TRACE_SCOPE(op, m, k, n, flops) const TraceScope trace_scope(op, m, k, n, flops)
+#define MATRIX_TRACE_KERNEL(kernel) TraceScope::set_kernel(kernel)
+#define MATRIX_TRACE_BYTES(bytes) TraceScope::add_bytes(bytes)
+#else
+#define MATRIX_TRACE_SCOPE(op, m, k, n, flops) ((void)0)
+#define MATRIX_TRACE_KERNEL(kernel) ((void)0)
+#define MATRIX_TRACE_BYTES(bytes) ((void)0)
+#endif
+
+//==============================================================================
+// add ()
+//==============================================================================
+void TraceHistogram::add(const TraceEvent& event)
+{
+    int bucket = 0;
+    while (bucket + 1 < num_buckets && (std::int64_t(2) << bucket) <= event.duration_ns) {
+        bucket++;
+    }
+
+    count++;
+    flops += event.flops;
+    bytes += event.bytes;
+    total_ns += event.duration_ns;
+    buckets[bucket]++;
+}
+
+//==============================================================================
+// TraceRecorder ()
+//==============================================================================
+TraceRecorder::TraceRecorder()
+    : m_id([]() {
+          static std::atomic<std::uint64_t> next_id(1);
+          return next_id.fetch_add(1, std::memory_order_relaxed);
+      }()),
+      m_epoch(std::chrono::steady_clock::now()),
+      m_enabled(false)
+{
+}
+
+//==============================================================================
+// is_enabled ()
+//==============================================================================
+bool TraceRecorder::is_enabled() const
+{
+    return m_enabled.load(std::memory_order_relaxed);
+}
+
+//==============================================================================
+// set_enabled ()
+//==============================================================================
+void TraceRecorder::set_enabled(bool enabled)
+{
+    m_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+//==============================================================================
+// now_ns ()
+//==============================================================================
+std::int64_t TraceRecorder::now_ns() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_epoch).count();
+}
+
+//==============================================================================
+// get_buffer ()
+//==============================================================================
+// The buffer of the calling thread, looked up under the recorder lock only
+// when the thread last recorded to another recorder
+TraceRecorder::Buffer& TraceRecorder::get_buffer()
+{
+    thread_local std::uint64_t cached_id = 0;
+    thread_local Buffer *cached = nullptr;
+
+    if (cached_id != m_id) {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        const std::thread::id self = std::this_thread::get_id();
+        auto it = std::find_if(m_buffers.begin(), m_buffers.end(),
+                               [&](const std::unique_ptr<Buffer>& buffer) { return buffer->owner == self; });
+        if (it == m_buffers.end()) {
+            m_buffers.push_back(std::make_unique<Buffer>());
+            m_buffers.back()->owner = self;
+            m_buffers.back()->thread = unsigned(m_buffers.size() - 1);
+            it = m_buffers.end() - 1;
+        }
+        cached = it->get();
+        cached_id = m_id;
+    }
+
+    return *cached;
+}
+
+//==============================================================================
+// record ()
+//==============================================================================
+void TraceRecorder::record(const TraceEvent& event)
+{
+    Buffer& buffer = get_buffer();
+    const std::lock_guard<std::mutex> lock(buffer.mutex);
+
+    if (buffer.events.size() == max_events) {
+        buffer.num_dropped++;
+        return;
+    }
+    buffer.events.push_back(event);
+    buffer.events.back().thread = buffer.thread;
+}
+
+//==============================================================================
+// clear ()
+//==============================================================================
+void TraceRecorder::clear()
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (const std::unique_ptr<Buffer>& buffer : m_buffers) {
+        const std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        buffer->events.clear();
+        buffer->num_dropped = 0;
+    }
+}
+
+//==============================================================================
+// get_events ()
+//==============================================================================
+// The events of all threads, by start time
+std::vector<TraceEvent> TraceRecorder::get_events() const
+{
+    std::vector<TraceEvent> events;
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        for (const std::unique_ptr<Buffer>& buffer : m_buffers) {
+            const std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+            events.insert(events.end(), buffer->events.begin(), buffer->events.end());
+        }
+    }
+
+    std::stable_sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+        return std::tie(a.start_ns, a.thread) < std::tie(b.start_ns, b.thread);
+    });
+
+    return events;
+}
+
+//==============================================================================
+// get_num_dropped ()
+//==============================================================================
+std::int64_t TraceRecorder::get_num_dropped() const
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::int64_t num_dropped = 0;
+    for (const std::unique_ptr<Buffer>& buffer : m_buffers) {
+        const std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        num_dropped += buffer->num_dropped;
+    }
+
+    return num_dropped;
+}
+
+//==============================================================================
+// get_histograms ()
+//==============================================================================
+// By "op/kernel"
+std::map<std::string, TraceHistogram> TraceRecorder::get_histograms() const
+{
+    std::map<std::string, TraceHistogram> histograms;
+    for (const TraceEvent& event : get_events()) {
+        histograms[std::string(event.op) + "/" + event.kernel].add(event);
+    }
+
+    return histograms;
+}
+
+//==============================================================================
+// write_chrome_trace ()
+//==============================================================================
+// The events in the JSON format of chrome://tracing and Perfetto: one
+// complete event per operation, its kernel as category, times in us
+void TraceRecorder::write_chrome_trace(std::ostream& os) const
+{
+    const auto to_us = [](std::int64_t ns) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%lld.%03lld", (long long)(ns / 1000), (long long)(ns % 1000));
+        return std::string(buf);
+    };
+
+    os << "{\"traceEvents\":[";
+    const char *separator = "\n";
+    for (const TraceEvent& event : get_events()) {
+        const std::string shape = (event.k == 0 ? std::to_string(event.m) + "x" + std::to_string(event.n)
+                                                : std::to_string(event.m) + "x" + std::to_string(event.k) + " * " +
+                                                  std::to_string(event.k) + "x" + std::to_string(event.n));
+        os << separator << "{\"name\":\"" << event.op << "\",\"cat\":\"" << event.kernel
+           << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread << ",\"ts\":" << to_us(event.start_ns)
+           << ",\"dur\":" << to_us(event.duration_ns) << ",\"args\":{\"shape\":\"" << shape
+           << "\",\"kernel\":\"" << event.kernel << "\",\"flops\":" << event.flops
+           << ",\"bytes\":" << event.bytes << "}}";
+        separator = ",\n";
+    }
+    os << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+//==============================================================================
+// write_histograms ()
+//==============================================================================
+// A summary per op and kernel, then its non-empty range of buckets
+void TraceRecorder::write_histograms(std::ostream& os) const
+{
+    const auto to_string = [](std::int64_t ns) {
+        const char *units[] = {"ns", "us", "ms", "s"};
+        int unit = 0;
+        while (unit < 3 && ns >= 1000) {
+            ns /= 1000;
+            unit++;
+        }
+        return std::to_string(ns) + " " + units[unit];
+    };
+
+    char line[128];
+    for (const auto& [key, histogram] : get_histograms()) {
+        snprintf(line, sizeof(line), "%s: %lld calls, %.3f ms, %.2f GFLOP/s, %.3f MB allocated\n", key.c_str(),
+                 (long long)histogram.count, histogram.total_ns / 1e6,
+                 histogram.flops / std::max<double>(histogram.total_ns, 1), histogram.bytes / 1e6);
+        os << line;
+
+        const auto& buckets = histogram.buckets;
+        const auto is_used = [](std::int64_t count) { return count != 0; };
+        const int first = int(std::find_if(buckets.begin(), buckets.end(), is_used) - buckets.begin());
+        const int last = int(buckets.rend() - std::find_if(buckets.rbegin(), buckets.rend(), is_used));
+        const std::int64_t max_count = *std::max_element(buckets.begin(), buckets.end());
+        for (int b = first; b < last; b++) {
+            snprintf(line, sizeof(line), "  [%8s, %8s): %10lld ", to_string(std::int64_t(1) << b).c_str(),
+                     to_string(std::int64_t(2) << b).c_str(), (long long)buckets[b]);
+            os << line << std::string(std::size_t(40 * buckets[b] / max_count), '#') << '\n';
+        }
+    }
+}
+
+//==============================================================================
+// global ()
+//==============================================================================
+TraceRecorder& TraceRecorder::global()
+{
+    static TraceRecorder recorder;
+
+    return recorder;
+}
+
+//==============================================================================
+// TraceScope ()
+//==============================================================================
+TraceScope::TraceScope(const char *op, int m, int k, int n, std::int64_t flops)
+    : m_event{op, "unknown", m, k, n, flops, 0, 0, 0, 0},
+      m_parent(t_trace_scope),
+      m_num_exceptions(std::uncaught_exceptions()),
+      m_active(TraceRecorder::global().is_enabled() &&
+               (m_parent == nullptr || std::strcmp(m_parent->m_event.op, op) != 0))
+{
+    if (m_active) {
+        t_trace_scope = this;
+        m_event.start_ns = TraceRecorder::global().now_ns();
+    }
+}
+
+//==============================================================================
+// ~TraceScope ()
+//==============================================================================
+TraceScope::~TraceScope()
+{
+    if (!m_active) {
+        return;
+    }
+
+    TraceRecorder& recorder = TraceRecorder::global();
+    m_event.duration_ns = recorder.now_ns() - m_event.start_ns;
+    t_trace_scope = m_parent;
+    if (std::uncaught_exceptions() == m_num_exceptions) {
+        recorder.record(m_event);
+    }
+}
+
+//==============================================================================
+// set_kernel ()
+//==============================================================================
+void TraceScope::set_kernel(const char *kernel)
+{
+    if (t_trace_scope != nullptr) {
+        t_trace_scope->m_event.kernel = kernel;
+    }
+}
+
+//==============================================================================
+// add_bytes ()
+//==============================================================================
+void TraceScope::add_bytes(std::int64_t bytes)
+{
+    if (t_trace_scope != nullptr) {
+        t_trace_scope->m_event.bytes += bytes;
+    }
+}
+
+#if defined(__SIZEOF_INT128__)
+__extension__ typedef __int128 int128_t;
+#endif
+
+//==============================================================================
+// Saturating
+//==============================================================================
+// Integer that sticks at its maximum instead of overflowing, for flops
+// counts that only need to compare correctly whatever their magnitude.
+template <typename T>
+class Saturating {
+public:
+    constexpr Saturating(T value = 0);
+
+    constexpr T get_value() const;
+    constexpr bool is_saturated() const;
+    static constexpr Saturating max();
+
+    constexpr Saturating operator+(const Saturating& other) const;
+    constexpr Saturating operator*(const Saturating& other) const;
+    constexpr bool operator==(const Saturating& other) const;
+    constexpr bool operator!=(const Saturating& other) const;
+    constexpr bool operator<(const Saturating& other) const;
+    constexpr bool operator<=(const Saturating& other) const;
+
+private:
+    T m_value;
+};
+
+//==============================================================================
+// Saturating ()
+//==============================================================================
+template <typename T>
+constexpr Saturating<T>::Saturating(T value)
+    : m_value(value)
+{
+}
+
+//==============================================================================
+// get_value ()
+//==============================================================================
+template <typename T>
+constexpr T Saturating<T>::get_value() const
+{
+    return m_value;
+}
+
+//==============================================================================
+// is_saturated ()
+//==============================================================================
+template <typename T>
+constexpr bool Saturating<T>::is_saturated() const
+{
+    return m_value == std::numeric_limits<T>::max();
+}
+
+//==============================================================================
+// max ()
+//==============================================================================
+template <typename T>
+constexpr Saturating<T> Saturating<T>::max()
+{
+    return std::numeric_limits<T>::max();
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+template <typename T>
+constexpr Saturating<T> Saturating<T>::operator+(const Saturating& other) const
+{
+    // flops are never negative, only the upper bound needs care
+    T res = 0;
+    return (__builtin_add_overflow(m_value, other.m_value, &res) ? max() : Saturating(res));
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+template <typename T>
+constexpr Saturating<T> Saturating<T>::operator*(const Saturating& other) const
+{
+    T res = 0;
+    return (__builtin_mul_overflow(m_value, other.m_value, &res) ? max() : Saturating(res));
+}
+
+//==============================================================================
+// operator== ()
+//==============================================================================
+template <typename T>
+constexpr bool Saturating<T>::operator==(const Saturating& other) const
+{
+    return m_value == other.m_value;
+}
+
+//==============================================================================
+// operator!= ()
+//==============================================================================
+template <typename T>
+constexpr bool Saturating<T>::operator!=(const Saturating& other) const
+{
+    return m_value != other.m_value;
+}
+
+//==============================================================================
+// operator< ()
+//==============================================================================
+template <typename T>
+constexpr bool Saturating<T>::operator<(const Saturating& other) const
+{
+    return m_value < other.m_value;
+}
+
+//==============================================================================
+// operator<= ()
+//==============================================================================
+template <typename T>
+constexpr bool Saturating<T>::operator<=(const Saturating& other) const
+{
+    return m_value <= other.m_value;
+}
+
+//==============================================================================
+// flops_traits
+//==============================================================================
+// Arithmetic on flops counts: add() / mul() return false instead of wrapping
+// when the result does not fit. Saturating types always succeed.
+template <typename Flops>
+struct flops_traits {
+    static constexpr bool saturates = false;
+    static constexpr Flops max() { return std::numeric_limits<Flops>::max(); }
+    static constexpr bool add(Flops a, Flops b, Flops& res) { return !__builtin_add_overflow(a, b, &res); }
+    static constexpr bool mul(Flops a, Flops b, Flops& res) { return !__builtin_mul_overflow(a, b, &res); }
+};
+
+#if defined(__SIZEOF_INT128__)
+template <>
+struct flops_traits<int128_t> {
+    static constexpr bool saturates = false;
+    // std::numeric_limits knows __int128 only in GNU mode
+    static constexpr int128_t max() { return int128_t(~(unsigned __int128)0 >> 1); }
+    static constexpr bool add(int128_t a, int128_t b, int128_t& res) { return !__builtin_add_overflow(a, b, &res); }
+    static constexpr bool mul(int128_t a, int128_t b, int128_t& res) { return !__builtin_mul_overflow(a, b, &res); }
+};
+#endif
+
+template <typename T>
+struct flops_traits<Saturating<T>> {
+    static constexpr bool saturates = true;
+    static constexpr Saturating<T> max() { return Saturating<T>::max(); }
+    static constexpr bool add(Saturating<T> a, Saturating<T> b, Saturating<T>& res) { res = a + b; return true; }
+    static constexpr bool mul(Saturating<T> a, Saturating<T> b, Saturating<T>& res) { res = a * b; return true; }
+};
+
+// seconds predicted by the cost models, +inf standing for overflow
+template <>
+struct flops_traits<double> {
+    static constexpr bool saturates = true;
+    static constexpr double max() { return std::numeric_limits<double>::infinity(); }
+    static constexpr bool add(double a, double b, double& res) { res = a + b; return true; }
+    static constexpr bool mul(double a, double b, double& res) { res = a * b; return true; }
+};
+
+//==============================================================================
+// checked_add ()
+//==============================================================================
+// Throws on overflow, which also makes an overflowing constexpr evaluation a
+// compile error
+template <typename Flops>
+constexpr Flops checked_add(Flops a, Flops b)
+{
+    Flops res = 0;
+    if (!flops_traits<Flops>::add(a, b, res)) {
+        throw std::overflow_error("flops overflow");
+    }
+
+    return res;
+}
+
+//==============================================================================
+// checked_mul ()
+//==============================================================================
+template <typename Flops>
+constexpr Flops checked_mul(Flops a, Flops b)
+{
+    Flops res = 0;
+    if (!flops_traits<Flops>::mul(a, b, res)) {
+        throw std::overflow_error("flops overflow");
+    }
+
+    return res;
+}
+
+//==============================================================================
+// flops_to_string ()
+//==============================================================================
+template <typename Flops>
+std::string flops_to_string(Flops flops)
+{
+    return std::to_string(flops);
+}
+
+#if defined(__SIZEOF_INT128__)
+template <>
+std::string flops_to_string(int128_t flops)
+{
+    // non-negative, as all flops counts
+    std::string res;
+    do {
+        res.insert(res.begin(), char('0' + int(flops % 10)));
+        flops /= 10;
+    } while (flops != 0);
+
+    return res;
+}
+#endif
+
+template <typename T>
+std::string flops_to_string(Saturating<T> flops)
+{
+    return (flops.is_saturated() ? ">=" : "") + flops_to_string(flops.get_value());
+}
+
+template <typename Flops>
+struct BasicExprPlan;
+
+//==============================================================================
+// BasicMatrix
+//==============================================================================
+// Shape of a matrix plus the flops spent to compute it. Flops is int for
+// Matrix; int64_t, int128_t or Saturating<> fit real-world dimensions.
+// Arithmetic on flops is checked: overflow throws std::overflow_error, and
+// in a constexpr evaluation does not compile.
+template <typename Flops>
+class BasicMatrix {
+public:
+    using flops_type = Flops;
+
+    constexpr BasicMatrix(int nrow, int ncol);
+
+    constexpr int get_nrow() const;
+    constexpr int get_ncol() const;
+    constexpr Flops get_flops() const;
+
+    constexpr BasicMatrix operator+(const BasicMatrix& other) const;
+    constexpr BasicMatrix operator*(const BasicMatrix& other) const;
+    constexpr BasicMatrix& operator+=(const BasicMatrix& other);
+    constexpr BasicMatrix& operator*=(const BasicMatrix& other);
+    constexpr bool operator==(const BasicMatrix& other) const;
+
+    template <typename F>
+    friend std::ostream& operator<<(std::ostream& os, const BasicMatrix<F>& mat);
+
+    template <typename M>
+    friend M execute_expr_plan(const BasicExprPlan<typename M::flops_type>& plan, const M *const *inputs);
+
+private:
+    constexpr BasicMatrix(int nrow, int ncol, Flops flops);
+
+    int m_nrow;
+    int m_ncol;
+    Flops m_flops;
+};
+
+using Matrix = BasicMatrix<int>;
+
+//==============================================================================
+// calc_mat_add_flops ()
+//==============================================================================
+template <typename Flops, typename Mat>
+static constexpr Flops calc_mat_add_flops(const Mat& A, const Mat& B)
+{
+    return checked_mul<Flops>(A.get_nrow(), B.get_ncol());
+}
+
+//==============================================================================
+// calc_mult_flops ()
+//==============================================================================
+// Flops of a dim1 x dim2 by dim2 x dim3 product, the one formula the counts of
+// this file derive from: flops(dim1, dim2, dim3) = dim1 * dim2 * (2 * dim3 - 1).
+// The DP kernels hoist it out of their inner loops.
+template <typename Flops>
+constexpr Flops calc_mult_flops(int dim1, int dim2, int dim3)
+{
+    // 2 * dim3 - 1 as dim3 + (dim3 - 1), which cannot overflow int
+    const Flops twice_dim3_minus_1 = checked_add(Flops(dim3), Flops(dim3 - 1));
+    return checked_mul(checked_mul(Flops(dim1), Flops(dim2)), twice_dim3_minus_1);
+}
+
+//==============================================================================
+// calc_mat_mult_flops ()
+//==============================================================================
+template <typename Flops, typename Mat>
+static constexpr Flops calc_mat_mult_flops(const Mat& A, const Mat& B)
+{
+    return calc_mult_flops<Flops>(A.get_nrow(), A.get_ncol(), B.get_ncol());
+}
+
+//==============================================================================
+// BasicMatrix ()
+//==============================================================================
+template <typename Flops>
+constexpr BasicMatrix<Flops>::BasicMatrix(int nrow, int ncol, Flops flops)
+    : m_nrow(nrow),
+      m_ncol(ncol),
+      m_flops(flops)
+{
+}
+
+//==============================================================================
+// BasicMatrix ()
+//==============================================================================
+template <typename Flops>
+constexpr BasicMatrix<Flops>::BasicMatrix(int nrow, int ncol)
+    : BasicMatrix(nrow, ncol, 0)
+{
+}
+
+//==============================================================================
+// get_nrow ()
+//==============================================================================
+template <typename Flops>
+constexpr int BasicMatrix<Flops>::get_nrow() const
+{
+    return m_nrow;
+}
+
+//==============================================================================
+// get_ncol ()
+//==============================================================================
+template <typename Flops>
+constexpr int BasicMatrix<Flops>::get_ncol() const
+{
+    return m_ncol;
+}
+
+//==============================================================================
+// get_flops ()
+//==============================================================================
+template <typename Flops>
+constexpr Flops BasicMatrix<Flops>::get_flops() const
+{
+    return m_flops;
+}
+
+//==============================================================================
+// diff_dims_error ()
+//==============================================================================
+template <typename MatA, typename MatB>
+std::string diff_dims_error(const MatA& A, const MatB& B)
+{
+    return std::string("A: ") + std::to_string(A.get_nrow()) + "x" + std::to_string(A.get_ncol()) +
+          ", B: " + std::to_string(B.get_nrow()) + "x" + std::to_string(B.get_ncol());
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+template <typename Flops>
+constexpr BasicMatrix<Flops> BasicMatrix<Flops>::operator+(const BasicMatrix& other) const
+{
+    // static_assert
+    if (m_nrow != other.m_nrow || this->m_ncol != other.m_ncol) {
+        throw std::logic_error(("add: dimensions do not match: " + diff_dims_error(*this, other)).c_str());
+    }
+
+    return {
+        this->m_nrow,
+        this->m_ncol,
+        checked_add(checked_add(this->m_flops, other.m_flops), calc_mat_add_flops<Flops>(*this, other))
+    };
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+template <typename Flops>
+constexpr BasicMatrix<Flops> BasicMatrix<Flops>::operator*(const BasicMatrix& other) const
+{
+    // static_assert
+    if (this->m_ncol != other.m_nrow) {
+        throw std::logic_error(("mult: dimensions do not match: " + diff_dims_error(*this, other)).c_str());
+    }
+
+    return {
+        this->m_nrow,
+        other.m_ncol,
+        checked_add(checked_add(this->m_flops, other.m_flops), calc_mat_mult_flops<Flops>(*this, other))
+    };
+}
+
+//==============================================================================
+// operator+= ()
+//==============================================================================
+template <typename Flops>
+constexpr BasicMatrix<Flops>& BasicMatrix<Flops>::operator+=(const BasicMatrix& other)
+{
+    // static_assert
+    if (m_nrow != other.m_nrow || this->m_ncol != other.m_ncol) {
+        throw std::logic_error(("add: dimensions do not match: " + diff_dims_error(*this, other)).c_str());
+    }
+
+    m_flops = checked_add(checked_add(m_flops, other.m_flops), calc_mat_add_flops<Flops>(*this, other));
+
+    return *this;
+}
+
+//==============================================================================
+// operator*= ()
+//==============================================================================
+template <typename Flops>
+constexpr BasicMatrix<Flops>& BasicMatrix<Flops>::operator*=(const BasicMatrix& other)
+{
+    // static_assert
+    if (this->m_ncol != other.m_nrow) {
+        throw std::logic_error(("mult: dimensions do not match: " + diff_dims_error(*this, other)).c_str());
+    }
+
+    m_flops = checked_add(checked_add(m_flops, other.m_flops), calc_mat_mult_flops<Flops>(*this, other));
+    m_ncol = other.m_ncol;
+
+    return *this;
+}
+
+//==============================================================================
+// operator== ()
+//==============================================================================
+template <typename Flops>
+constexpr bool BasicMatrix<Flops>::operator==(const BasicMatrix& other) const
+{
+    return (this->m_nrow == other.m_nrow &&
+            this->m_ncol == other.m_ncol &&
+            this->m_flops == other.m_flops);
+}
+
+//==============================================================================
+// operator<< ()
+//==============================================================================
+template <typename Flops>
+std::ostream& operator<<(std::ostream& os, const BasicMatrix<Flops>& mat)
+{
+    os << "<dims: " << mat.get_nrow() << " x " << mat.get_ncol() << ", flops: " << flops_to_string(mat.get_flops())
+       << ">";
+
+    return os;
+}
+
+//==============================================================================
+// AlignedAllocator
+//==============================================================================
+template <typename T, std::size_t Align = 64>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind { using other = AlignedAllocator<U, Align>; };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    constexpr AlignedAllocator(const AlignedAllocator<U, Align>&) noexcept {}
+
+    T* allocate(std::size_t n)
+    {
+        // std::aligned_alloc() wants the size to be a multiple of the alignment
+        const std::size_t bytes = ((n * sizeof(T) + Align - 1) / Align) * Align;
+        if (void *p = std::aligned_alloc(Align, bytes ? bytes : Align)) {
+            return static_cast<T*>(p);
+        }
+        throw std::bad_alloc();
+    }
+
+    void deallocate(T* p, std::size_t) noexcept
+    {
+        std::free(p);
+    }
+
+    template <typename U>
+    constexpr bool operator==(const AlignedAllocator<U, Align>&) const noexcept { return true; }
+    template <typename U>
+    constexpr bool operator!=(const AlignedAllocator<U, Align>&) const noexcept { return false; }
+};
+
+template <typename T>
+using aligned_vector = std::vector<T, AlignedAllocator<T>>;
+
+//==============================================================================
+// NumaPolicy
+//==============================================================================
+// Where the pages of a buffer go on a NUMA machine
+enum class NumaPolicy {
+    first_touch,  // the kernel's default: on the node of the thread touching them first
+    local,        // on a given node whichever thread touches them, others once it is full
+    interleave,   // round robin over all nodes, for data the threads of every node read
+};
+
+//==============================================================================
+// place_numa_pages ()
+//==============================================================================
+// Applies policy, node being the one of NumaPolicy::local, to the pages of
+// [p, p + bytes), p page aligned, which must not have been touched yet. Returns
+// false, the pages then following first touch, where the kernel refuses or has
+// no mbind() (not Linux, containers filtering the syscall).
+bool place_numa_pages(void *p, std::size_t bytes, NumaPolicy policy, int node, const NumaTopology& topology)
+{
+    if (policy == NumaPolicy::first_touch || bytes == 0) {
+        return true;
+    }
+
+#if defined(__linux__) && defined(SYS_mbind)
+    // the kernel ABI, <numaif.h> coming with libnuma
+    constexpr int mpol_preferred = 1;
+    constexpr int mpol_interleave = 3;
+    constexpr std::size_t word_bits = 8 * sizeof(unsigned long);
+
+    std::vector<unsigned long> mask;
+    const auto add_node = [&](int index) {
+        const std::size_t os_node = topology.get_os_node(index);
+        mask.resize(std::max(mask.size(), os_node / word_bits + 1), 0);
+        mask[os_node / word_bits] |= 1ul << (os_node % word_bits);
+    };
+    if (policy == NumaPolicy::local) {
+        add_node(node);
+    } else {
+        for (int index = 0; index < topology.get_num_nodes(); index++) {
+            add_node(index);
+        }
+    }
+
+    // the kernel reads maxnode - 1 bits of the mask
+    const int mode = (policy == NumaPolicy::local ? mpol_preferred : mpol_interleave);
+    return syscall(SYS_mbind, p, bytes, mode, mask.data(), mask.size() * word_bits + 1, 0u) == 0;
+#else
+    (void)p;
+    (void)node;
+    (void)topology;
+    return false;
+#endif
+}
+
+//==============================================================================
+// NumaAllocator
+//==============================================================================
+// Allocator placing its storage by a NumaPolicy: buffers of a page and more
+// are mapped anonymously and placed before anything touches them. Smaller
+// ones, and all under first_touch, come from AlignedAllocator. Allocators of
+// different placements are not interchangeable, and containers carry theirs
+// along when moved or swapped.
+template <typename T>
+struct NumaAllocator {
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    template <typename U>
+    struct rebind { using other = NumaAllocator<U>; };
+
+    NumaPolicy policy = NumaPolicy::first_touch;
+    int node = 0;
+    const NumaTopology *topology = nullptr;  // NumaTopology::system() when null
+
+    NumaAllocator() = default;
+    NumaAllocator(NumaPolicy policy, int node, const NumaTopology *topology = nullptr) noexcept
+        : policy(policy),
+          node(node),
+          topology(topology)
+    {
+    }
+    template <typename U>
+    constexpr NumaAllocator(const NumaAllocator<U>& other) noexcept
+        : policy(other.policy),
+          node(other.node),
+          topology(other.topology)
+    {
+    }
+
+    bool is_mapped(std::size_t n) const
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        return policy != NumaPolicy::first_touch && n * sizeof(T) >= std::size_t(sysconf(_SC_PAGESIZE));
+#else
+        (void)n;
+        return false;
+#endif
+    }
+
+    T* allocate(std::size_t n)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if (is_mapped(n)) {
+            void *p = mmap(nullptr, n * sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            place_numa_pages(p, n * sizeof(T), policy, node, topology ? *topology : NumaTopology::system());
+            return static_cast<T*>(p);
+        }
+#endif
+        return AlignedAllocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if (is_mapped(n)) {
+            munmap(p, n * sizeof(T));
+            return;
+        }
+#endif
+        AlignedAllocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    constexpr bool operator==(const NumaAllocator<U>& other) const noexcept
+    {
+        return policy == other.policy && node == other.node && topology == other.topology;
+    }
+    template <typename U>
+    constexpr bool operator!=(const NumaAllocator<U>& other) const noexcept { return !(*this == other); }
+};
+
+template <typename T>
+using numa_vector = std::vector<T, NumaAllocator<T>>;
+
+//==============================================================================
+// GemmBlocking
+//==============================================================================
+// Register tile is MR x NR (the micro-kernel keeps it in local accumulators),
+// A is packed in MC x KC blocks, B in KC x NC panels.
+template <typename T>
+struct GemmBlocking {
+    static constexpr int MR = 4;
+    static constexpr int NR = 64 / sizeof(T) > 4 ? 64 / sizeof(T) : 4;
+    static constexpr int MC = 128;
+    static constexpr int KC = 256;
+    static constexpr int NC = 2048;
+};
+
+//==============================================================================
+// GemmTuning
+//==============================================================================
+// Cache blocking gemm() runs with: GemmBlocking's MC / KC / NC until tuned,
+// see bench_autotune() and MachineProfile. The register tile stays fixed.
+template <typename T>
+class GemmTuning {
+public:
+    struct Blocks {
+        int mc;
+        int kc;
+        int nc;
+    };
+
+    Blocks get_blocks() const;
+    void set_blocks(const Blocks& blocks);
+
+    static GemmTuning& global();
+
+private:
+    std::atomic<int> m_mc{GemmBlocking<T>::MC};
+    std::atomic<int> m_kc{GemmBlocking<T>::KC};
+    std::atomic<int> m_nc{GemmBlocking<T>::NC};
+};
+
+//==============================================================================
+// get_blocks ()
+//==============================================================================
+template <typename T>
+typename GemmTuning<T>::Blocks GemmTuning<T>::get_blocks() const
+{
+    return {m_mc.load(std::memory_order_relaxed), m_kc.load(std::memory_order_relaxed),
+            m_nc.load(std::memory_order_relaxed)};
+}
+
+//==============================================================================
+// set_blocks ()
+//==============================================================================
+template <typename T>
+void GemmTuning<T>::set_blocks(const Blocks& blocks)
+{
+    if (blocks.mc < 1 || blocks.kc < 1 || blocks.nc < 1) {
+        throw std::logic_error("gemm: bad blocking");
+    }
+
+    m_mc.store(blocks.mc, std::memory_order_relaxed);
+    m_kc.store(blocks.kc, std::memory_order_relaxed);
+    m_nc.store(blocks.nc, std::memory_order_relaxed);
+}
+
+//==============================================================================
+// global ()
+//==============================================================================
+template <typename T>
+GemmTuning<T>& GemmTuning<T>::global()
+{
+    static GemmTuning tuning;
+
+    return tuning;
+}
+
+//==============================================================================
+// gemm_pack_a ()
+//==============================================================================
+// Packs the mc x kc block of A into row panels of MR rows, k-major inside a
+// panel. Rows beyond mc are zero padded so the micro-kernel needs no edge case.
+template <typename T>
+static void gemm_pack_a(int mc, int kc, const T* A, int lda, T* packed)
+{
+    constexpr int MR = GemmBlocking<T>::MR;
+
+    for (int i = 0; i < mc; i += MR) {
+        const int mr = std::min(MR, mc - i);
+        for (int p = 0; p < kc; p++) {
+            for (int r = 0; r < mr; r++) {
+                *packed++ = A[(i + r) * lda + p];
+            }
+            for (int r = mr; r < MR; r++) {
+                *packed++ = T(0);
+            }
+        }
+    }
+}
+
+//==============================================================================
+// gemm_pack_b ()
+//==============================================================================
+// Packs the kc x nc panel of B into column panels of NR columns, k-major
+// inside a panel. Columns beyond nc are zero padded.
+template <typename T>
+static void gemm_pack_b(int kc, int nc, const T* B, int ldb, T* packed)
+{
+    constexpr int NR = GemmBlocking<T>::NR;
+
+    for (int j = 0; j < nc; j += NR) {
+        const int nr = std::min(NR, nc - j);
+        for (int p = 0; p < kc; p++) {
+            const T* b = B + p * ldb + j;
+            for (int c = 0; c < nr; c++) {
+                *packed++ = b[c];
+            }
+            for (int c = nr; c < NR; c++) {
+                *packed++ = T(0);
+            }
+        }
+    }
+}
+
+//==============================================================================
+// gemm_micro_kernel ()
+//==============================================================================
+// C[0:mr, 0:nr] = alpha * Apanel * Bpanel + beta * C[0:mr, 0:nr]
+template <typename T>
+static void gemm_micro_kernel(int kc, T alpha, const T* a, const T* b, T beta, T* C, int ldc, int mr, int nr)
+{
+    constexpr int MR = GemmBlocking<T>::MR;
+    constexpr int NR = GemmBlocking<T>::NR;
+
+    T acc[MR][NR] = {};
+    for (int p = 0; p < kc; p++) {
+        for (int r = 0; r < MR; r++) {
+            const T a_rp = a[p * MR + r];
+            for (int c = 0; c < NR; c++) {
+                acc[r][c] += a_rp * b[p * NR + c];
+            }
+        }
+    }
+
+    for (int r = 0; r < mr; r++) {
+        T* c_row = C + r * ldc;
+        if (beta == T(0)) {
+            for (int c = 0; c < nr; c++) {
+                c_row[c] = alpha * acc[r][c];
+            }
+        } else {
+            for (int c = 0; c < nr; c++) {
+                c_row[c] = alpha * acc[r][c] + beta * c_row[c];
+            }
+        }
+    }
+}
+
+//==============================================================================
+// gemm ()
+//==============================================================================
+// Row-major C = alpha * A * B + beta * C, where A is m x k, B is k x n, C is
+// m x n. Cache-blocked (NC / KC / MC loops around packed panels of A and B,
+// sizes from GemmTuning), register-tiled (MR x NR micro-kernel). Packing
+// buffers are kept per thread, so repeated calls do not allocate.
+template <typename T>
+void gemm(int m, int n, int k, T alpha, const T* A, int lda, const T* B, int ldb, T beta, T* C, int ldc)
+{
+    using Blk = GemmBlocking<T>;
+
+    if (m == 0 || n == 0) {
+        return;
+    }
+
+    if (k == 0) {
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) {
+                C[i * ldc + j] = (beta == T(0) ? T(0) : beta * C[i * ldc + j]);
+            }
+        }
+        return;
+    }
+
+    const auto blocks = GemmTuning<T>::global().get_blocks();
+    thread_local aligned_vector<T> packed_a;
+    thread_local aligned_vector<T> packed_b;
+    packed_a.resize(std::size_t(blocks.mc + Blk::MR) * blocks.kc);
+    packed_b.resize(std::size_t(blocks.nc + Blk::NR) * blocks.kc);
+
+    for (int jc = 0; jc < n; jc += blocks.nc) {
+        const int nc = std::min(blocks.nc, n - jc);
+        for (int pc = 0; pc < k; pc += blocks.kc) {
+            const int kc = std::min(blocks.kc, k - pc);
+            // only the first k-block applies the caller's beta, the rest accumulate
+            const T beta_pc = (pc == 0 ? beta : T(1));
+
+            gemm_pack_b(kc, nc, B + pc * ldb + jc, ldb, packed_b.data());
+
+            for (int ic = 0; ic < m; ic += blocks.mc) {
+                const int mc = std::min(blocks.mc, m - ic);
+
+                gemm_pack_a(mc, kc, A + ic * lda + pc, lda, packed_a.data());
+
+                for (int jr = 0; jr < nc; jr += Blk::NR) {
+                    const int nr = std::min(Blk::NR, nc - jr);
+                    for (int ir = 0; ir < mc; ir += Blk::MR) {
+                        const int mr = std::min(Blk::MR, mc - ir);
+                        gemm_micro_kernel(kc, alpha,
+                                          packed_a.data() + ir * kc,
+                                          packed_b.data() + jr * kc,
+                                          beta_pc,
+                                          C + (ic + ir) * ldc + jc + jr, ldc, mr, nr);
+                    }
+                }
+            }
+        }
+    }
+}
+
+//==============================================================================
+// parallel_gemm ()
+//==============================================================================
+// gemm() split into tiles of C run on pool: about two tiles per thread, cut
+// along the rows while there are enough of them and along the columns
+// otherwise, so skinny products spread too. Each tile packs its own panels
+// of A and B, small products stay on the calling thread.
+template <typename T>
+void parallel_gemm(ThreadPool& pool, int m, int n, int k, T alpha, const T* A, int lda, const T* B, int ldb, T beta,
+                   T* C, int ldc)
+{
+    using Blk = GemmBlocking<T>;
+    constexpr std::int64_t min_tile_work = 64 * 64 * 64;
+
+    const std::int64_t ntasks = 2 * std::int64_t(pool.get_concurrency());
+    const std::int64_t work = std::int64_t(m) * n * std::max(k, 1);
+    if (pool.get_concurrency() == 1 || work < 2 * min_tile_work) {
+        gemm(m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+        return;
+    }
+
+    const auto round_up = [](std::int64_t value, std::int64_t multiple) {
+        return (value + multiple - 1) / multiple * multiple;
+    };
+    const std::int64_t max_tiles = std::max<std::int64_t>(1, work / min_tile_work);
+    const std::int64_t tiles = std::min(ntasks, max_tiles);
+    const int tile_m = int(std::min<std::int64_t>(m, round_up((m + tiles - 1) / tiles, Blk::MR)));
+    const std::int64_t tiles_m = (m + tile_m - 1) / tile_m;
+    const std::int64_t tiles_n = std::max<std::int64_t>(1, tiles / tiles_m);
+    const int tile_n = int(std::min<std::int64_t>(n, round_up((n + tiles_n - 1) / tiles_n, Blk::NR)));
+    const std::size_t ncols = (n + tile_n - 1) / tile_n;
+
+    parallel_for(pool, 0, tiles_m * ncols, 1, [&](std::size_t first, std::size_t last) {
+        for (std::size_t tile = first; tile < last; tile++) {
+            const int i = int(tile / ncols) * tile_m;
+            const int j = int(tile % ncols) * tile_n;
+            gemm(std::min(tile_m, m - i), std::min(tile_n, n - j), k, alpha, A + std::size_t(i) * lda, lda,
+                 B + j, ldb, beta, C + std::size_t(i) * ldc + j, ldc);
+        }
+    });
+}
+
+//==============================================================================
+// StrassenPolicy
+//==============================================================================
+// When dense products switch from gemm() to strassen_winograd(): products of
+// m x k by k x n with m, k and n all at least the crossover. 0, the default,
+// never switches. calc_flops() is the cost of whichever kernel applies, for
+// planners to see the same costs the executor pays.
+class StrassenPolicy {
+public:
+    explicit StrassenPolicy(int crossover = 0);
+
+    int get_crossover() const;
+    void set_crossover(int crossover);
+    bool applies(int m, int k, int n) const;
+
+    template <typename Flops>
+    Flops calc_flops(int m, int k, int n) const;
+    std::size_t calc_scratch_size(int m, int k, int n) const;
+
+    static StrassenPolicy& global();
+
+private:
+    std::atomic<int> m_crossover;
+};
+
+//==============================================================================
+// StrassenPolicy ()
+//==============================================================================
+StrassenPolicy::StrassenPolicy(int crossover)
+    : m_crossover(crossover)
+{
+}
+
+//==============================================================================
+// get_crossover ()
+//==============================================================================
+int StrassenPolicy::get_crossover() const
+{
+    return m_crossover.load(std::memory_order_relaxed);
+}
+
+//==============================================================================
+// set_crossover ()
+//==============================================================================
+void StrassenPolicy::set_crossover(int crossover)
+{
+    m_crossover.store(crossover, std::memory_order_relaxed);
+}
+
+//==============================================================================
+// applies ()
+//==============================================================================
+bool StrassenPolicy::applies(int m, int k, int n) const
+{
+    const int crossover = get_crossover();
+
+    return (crossover > 0 && std::min({m, k, n}) >= crossover);
+}
+
+//==============================================================================
+// calc_flops ()
+//==============================================================================
+// calc_mult_flops() for the products left to gemm(). A Strassen-Winograd
+// step costs 7 half-size products and 15 half-size additions (4 on A, 4 on B,
+// 7 on C), plus gemm() on the odd row, column and inner index it peels off.
+template <typename Flops>
+Flops StrassenPolicy::calc_flops(int m, int k, int n) const
+{
+    if (!applies(m, k, n)) {
+        return calc_mult_flops<Flops>(m, k, n);
+    }
+
+    const int m2 = m / 2;
+    const int k2 = k / 2;
+    const int n2 = n / 2;
+    Flops flops = checked_mul(Flops(7), calc_flops<Flops>(m2, k2, n2));
+    flops = checked_add(flops, checked_mul(Flops(4), checked_mul(Flops(m2), Flops(k2))));
+    flops = checked_add(flops, checked_mul(Flops(4), checked_mul(Flops(k2), Flops(n2))));
+    flops = checked_add(flops, checked_mul(Flops(7), checked_mul(Flops(m2), Flops(n2))));
+    if (k % 2) {
+        flops = checked_add(flops, calc_mult_flops<Flops>(2 * m2, 1, 2 * n2));
+    }
+    if (n % 2) {
+        flops = checked_add(flops, calc_mult_flops<Flops>(2 * m2, k, 1));
+    }
+    if (m % 2) {
+        flops = checked_add(flops, calc_mult_flops<Flops>(1, k, n));
+    }
+
+    return flops;
+}
+
+//==============================================================================
+// calc_scratch_size ()
+//==============================================================================
+// Elements of scratch strassen_winograd() needs for the whole recursion: six
+// half-size blocks per step, the steps below reusing the space after them
+std::size_t StrassenPolicy::calc_scratch_size(int m, int k, int n) const
+{
+    std::size_t size = 0;
+    while (applies(m, k, n)) {
+        m /= 2;
+        k /= 2;
+        n /= 2;
+        size += 2 * (std::size_t(m) * k + std::size_t(k) * n + std::size_t(m) * n);
+    }
+
+    return size;
+}
+
+//==============================================================================
+// global ()
+//==============================================================================
+StrassenPolicy& StrassenPolicy::global()
+{
+    static StrassenPolicy policy;
+
+    return policy;
+}
+
+//==============================================================================
+// strassen_add ()
+//==============================================================================
+// C = A + sign * B, all m x n
+template <typename T>
+static void strassen_add(int m, int n, const T* A, int lda, T sign, const T* B, int ldb, T* C, int ldc)
+{
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < n; j++) {
+            C[i * ldc + j] = A[i * lda + j] + sign * B[i * ldb + j];
+        }
+    }
+}
+
+//==============================================================================
+// strassen_winograd ()
+//==============================================================================
+// Row-major C = A * B, where A is m x k, B is k x n, C is m x n, by the
+// Winograd form of Strassen's algorithm (7 products, 15 additions per step)
+// while policy applies, gemm() below. Odd dimensions are peeled off: the
+// last row, column and inner index are fixed up by gemm().
+// The temporaries go to scratch, of policy.calc_scratch_size(m, k, n)
+// elements; without one it is allocated once for the whole recursion.
+template <typename T>
+void strassen_winograd(int m, int n, int k, const T* A, int lda, const T* B, int ldb, T* C, int ldc,
+                       const StrassenPolicy& policy = StrassenPolicy::global(), T* scratch = nullptr)
+{
+    if (!policy.applies(m, k, n)) {
+        gemm(m, n, k, T(1), A, lda, B, ldb, T(0), C, ldc);
+        return;
+    }
+    if (scratch == nullptr) {
+        aligned_vector<T> buffer(policy.calc_scratch_size(m, k, n));
+        strassen_winograd(m, n, k, A, lda, B, ldb, C, ldc, policy, buffer.data());
+        return;
+    }
+
+    const int m2 = m / 2;
+    const int k2 = k / 2;
+    const int n2 = n / 2;
+    const T* A11 = A;
+    const T* A12 = A + k2;
+    const T* A21 = A + std::size_t(m2) * lda;
+    const T* A22 = A21 + k2;
+    const T* B11 = B;
+    const T* B12 = B + n2;
+    const T* B21 = B + std::size_t(k2) * ldb;
+    const T* B22 = B21 + n2;
+    T* C11 = C;
+    T* C12 = C + n2;
+    T* C21 = C + std::size_t(m2) * ldc;
+    T* C22 = C21 + n2;
+
+    const std::size_t size_a = std::size_t(m2) * k2;
+    const std::size_t size_b = std::size_t(k2) * n2;
+    const std::size_t size_c = std::size_t(m2) * n2;
+    T* S = scratch;
+    T* S2 = S + size_a;
+    T* U = S2 + size_a;
+    T* T2 = U + size_b;
+    T* P = T2 + size_b;
+    T* Q = P + size_c;
+    T* next = Q + size_c;
+
+    // S1 = A21 + A22, T1 = B12 - B11, P5 = S1 * T1 -> C22 and C12
+    strassen_add(m2, k2, A21, lda, T(1), A22, lda, S, k2);
+    strassen_add(k2, n2, B12, ldb, T(-1), B11, ldb, U, n2);
+    strassen_winograd(m2, n2, k2, S, k2, U, n2, C22, ldc, policy, next);
+    for (int i = 0; i < m2; i++) {
+        std::copy(C22 + std::size_t(i) * ldc, C22 + std::size_t(i) * ldc + n2, C12 + std::size_t(i) * ldc);
+    }
+
+    // S2 = S1 - A11, T2 = B22 - T1, P6 = S2 * T2 -> Q
+    strassen_add(m2, k2, S, k2, T(-1), A11, lda, S2, k2);
+    strassen_add(k2, n2, B22, ldb, T(-1), U, n2, T2, n2);
+    strassen_winograd(m2, n2, k2, S2, k2, T2, n2, Q, n2, policy, next);
+
+    // P1 = A11 * B11 -> P, U2 = P1 + P6 -> Q, C11 = P1 + P2
+    strassen_winograd(m2, n2, k2, A11, lda, B11, ldb, P, n2, policy, next);
+    strassen_add(m2, n2, P, n2, T(1), Q, n2, Q, n2);
+    strassen_winograd(m2, n2, k2, A12, lda, B21, ldb, C11, ldc, policy, next);
+    strassen_add(m2, n2, C11, ldc, T(1), P, n2, C11, ldc);
+
+    // S4 = A12 - S2, P3 = S4 * B22; C12 = U2 + P5 + P3
+    strassen_add(m2, k2, A12, lda, T(-1), S2, k2, S, k2);
+    strassen_winograd(m2, n2, k2, S, k2, B22, ldb, P, n2, policy, next);
+    strassen_add(m2, n2, C12, ldc, T(1), Q, n2, C12, ldc);
+    strassen_add(m2, n2, C12, ldc, T(1), P, n2, C12, ldc);
+
+    // S3 = A11 - A21, T3 = B22 - B12, P7 = S3 * T3, U3 = U2 + P7 -> Q
+    strassen_add(m2, k2, A11, lda, T(-1), A21, lda, S, k2);
+    strassen_add(k2, n2, B22, ldb, T(-1), B12, ldb, U, n2);
+    strassen_winograd(m2, n2, k2, S, k2, U, n2, P, n2, policy, next);
+    strassen_add(m2, n2, Q, n2, T(1), P, n2, Q, n2);
+
+    // C22 = U3 + P5
+    strassen_add(m2, n2, Q, n2, T(1), C22, ldc, C22, ldc);
+
+    // T4 = T2 - B21, P4 = A22 * T4, C21 = U3 - P4
+    strassen_add(k2, n2, T2, n2, T(-1), B21, ldb, U, n2);
+    strassen_winograd(m2, n2, k2, A22, lda, U, n2, P, n2, policy, next);
+    strassen_add(m2, n2, Q, n2, T(-1), P, n2, C21, ldc);
+
+    // peeling: the last inner index, then the last column and row of C
+    if (k % 2) {
+        gemm(2 * m2, 2 * n2, 1, T(1), A + (k - 1), lda, B + std::size_t(k - 1) * ldb, ldb, T(1), C, ldc);
+    }
+    if (n % 2) {
+        gemm(2 * m2, 1, k, T(1), A, lda, B + (n - 1), ldb, T(0), C + (n - 1), ldc);
+    }
+    if (m % 2) {
+        gemm(1, n, k, T(1), A + std::size_t(m - 1) * lda, lda, B, ldb, T(0), C + std::size_t(m - 1) * ldc, ldc);
+    }
+}
+
+//==============================================================================
+// dense_mult ()
+//==============================================================================
+// Row-major C = A * B + beta * C by the kernel policy picks, returns its flops.
+// strassen_winograd() only overwrites C, so accumulating products stay on
+// gemm(). With a pool, gemm() is parallel_gemm(); strassen_winograd() stays
+// on the calling thread, with scratch if given (see strassen_winograd()).
+template <typename Flops, typename T>
+Flops dense_mult(int m, int n, int k, const T* A, int lda, const T* B, int ldb, T beta, T* C, int ldc,
+                 const StrassenPolicy& policy = StrassenPolicy::global(), ThreadPool *pool = nullptr,
+                 T* scratch = nullptr)
+{
+    if (beta == T(0) && policy.applies(m, k, n)) {
+        MATRIX_TRACE_KERNEL("strassen_winograd");
+        strassen_winograd(m, n, k, A, lda, B, ldb, C, ldc, policy, scratch);
+        return policy.calc_flops<Flops>(m, k, n);
+    }
+
+    if (pool != nullptr) {
+        MATRIX_TRACE_KERNEL("parallel_gemm");
+        parallel_gemm(*pool, m, n, k, T(1), A, lda, B, ldb, beta, C, ldc);
+    } else {
+        MATRIX_TRACE_KERNEL("gemm");
+        gemm(m, n, k, T(1), A, lda, B, ldb, beta, C, ldc);
+    }
+    return calc_mult_flops<Flops>(m, k, n);
+}
+
+class MatrixArena;
+
+template <typename Mat, std::size_t N>
+class ProductExpr;
+
+template <typename T>
+class DenseMatrix;
+
+template <typename T>
+DenseMatrix<T> fused_sum(const DenseMatrix<T> *const *mats, std::size_t n, ThreadPool *pool = nullptr);
+
+//==============================================================================
+// is_dense_matrix
+//==============================================================================
+template <typename Mat>
+struct is_dense_matrix : std::false_type {};
+
+template <typename T>
+struct is_dense_matrix<DenseMatrix<T>> : std::true_type {};
+
+template <typename Mat>
+inline constexpr bool is_dense_matrix_v = is_dense_matrix<Mat>::value;
+
+enum class SparseFormat {
+    csr,  // compressed sparse rows
+    csc,  // compressed sparse columns
+};
+
+template <typename T, SparseFormat Format>
+class SparseMatrix;
+
+template <typename T>
+class MappedMatrix;
+
+template <typename T>
+class CompactBatch;
+
+template <typename T>
+struct precision_traits;
+
+//==============================================================================
+// DenseMatrix
+//==============================================================================
+// Row-major matrix that owns aligned, contiguous storage and really computes
+// the products that Matrix only accounts for. Flops are tracked with the same
+// formulas as Matrix, so both can be compared on the same expression, but in
+// 64 bits: real products overflow int.
+template <typename T>
+class DenseMatrix {
+public:
+    using flops_type = std::int64_t;
+
+    DenseMatrix(int nrow, int ncol);
+
+    int get_nrow() const;
+    int get_ncol() const;
+    flops_type get_flops() const;
+
+    T* data();
+    const T* data() const;
+    T& operator()(int i, int j);
+    const T& operator()(int i, int j) const;
+
+    DenseMatrix operator+(const DenseMatrix& other) const&;
+    DenseMatrix operator+(const DenseMatrix& other) &&;
+    DenseMatrix operator+(DenseMatrix&& other) const&;
+    DenseMatrix operator+(DenseMatrix&& other) &&;
+    DenseMatrix operator*(const DenseMatrix& other) const&;
+    DenseMatrix operator*(const DenseMatrix& other) &&;
+    DenseMatrix& operator+=(const DenseMatrix& other);
+    template <std::size_t N>
+    DenseMatrix& operator+=(const ProductExpr<DenseMatrix, N>& product);
+    DenseMatrix& operator*=(const DenseMatrix& other);
+    bool operator==(const DenseMatrix& other) const;
+
+    template <typename U>
+    friend std::ostream& operator<<(std::ostream& os, const DenseMatrix<U>& mat);
+
+    template <typename U, int R, int C>
+    friend class FixedMatrix;
+
+    template <typename U, SparseFormat F>
+    friend class SparseMatrix;
+
+    template <typename U>
+    friend class MappedMatrix;
+
+    template <typename U>
+    friend class CompactBatch;
+
+    template <typename In>
+    friend DenseMatrix<typename precision_traits<In>::accumulator> mixed_mult(const DenseMatrix<In>& A,
+                                                                             const DenseMatrix<In>& B);
+
+    template <typename To, typename From>
+    friend DenseMatrix<To> convert_matrix(const DenseMatrix<From>& mat);
+
+    template <typename U>
+    friend DenseMatrix<U> fused_sum(const DenseMatrix<U> *const *mats, std::size_t n, ThreadPool *pool);
+
+    template <typename U, typename Plan>
+    friend void execute_mult_plan_in_arena(const Plan& plan, const DenseMatrix<U> *const *inputs, MatrixArena& arena,
+                                           bool accumulate, DenseMatrix<U>& res);
+
+    template <typename U, typename Plan>
+    friend DenseMatrix<U> execute_mult_plan_in_pool(const Plan& plan, const DenseMatrix<U> *const *inputs,
+                                                    ThreadPool& pool, NumaPolicy numa);
+
+    template <typename M>
+    friend M execute_expr_plan(const BasicExprPlan<typename M::flops_type>& plan, const M *const *inputs);
+
+private:
+    int m_nrow;
+    int m_ncol;
+    flops_type m_flops;
+    aligned_vector<T> m_data;
+};
+
+//==============================================================================
+// DenseMatrix ()
+//==============================================================================
+template <typename T>
+DenseMatrix<T>::DenseMatrix(int nrow, int ncol)
+    : m_nrow(nrow),
+      m_ncol(ncol),
+      m_flops(0),
+      m_data(std::size_t(nrow) * ncol)
+{
+}
+
+//==============================================================================
+// get_nrow ()
+//==============================================================================
+template <typename T>
+int DenseMatrix<T>::get_nrow() const
+{
+    return m_nrow;
+}
+
+//==============================================================================
+// get_ncol ()
+//==============================================================================
+template <typename T>
+int DenseMatrix<T>::get_ncol() const
+{
+    return m_ncol;
+}
+
+//==============================================================================
+// get_flops ()
+//==============================================================================
+template <typename T>
+typename DenseMatrix<T>::flops_type DenseMatrix<T>::get_flops() const
+{
+    return m_flops;
+}
+
+//==============================================================================
+// data ()
+//==============================================================================
+template <typename T>
+T* DenseMatrix<T>::data()
+{
+    return m_data.data();
+}
+
+//==============================================================================
+// data ()
+//==============================================================================
+template <typename T>
+const T* DenseMatrix<T>::data() const
+{
+    return m_data.data();
+}
+
+//==============================================================================
+// operator() ()
+//==============================================================================
+template <typename T>
+T& DenseMatrix<T>::operator()(int i, int j)
+{
+    return m_data[std::size_t(i) * m_ncol + j];
+}
+
+//==============================================================================
+// operator() ()
+//==============================================================================
+template <typename T>
+const T& DenseMatrix<T>::operator()(int i, int j) const
+{
+    return m_data[std::size_t(i) * m_ncol + j];
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+template <typename T>
+DenseMatrix<T> DenseMatrix<T>::operator+(const DenseMatrix& other) const&
+{
+    MATRIX_TRACE_SCOPE("add", m_nrow, 0, m_ncol, calc_mat_add_flops<flops_type>(*this, other));
+    MATRIX_TRACE_BYTES(std::int64_t(sizeof(T)) * m_nrow * m_ncol);
+    DenseMatrix res = *this;
+    res += other;
+
+    return res;
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+// A dying left operand is the result, no allocation
+template <typename T>
+DenseMatrix<T> DenseMatrix<T>::operator+(const DenseMatrix& other) &&
+{
+    *this += other;
+
+    return std::move(*this);
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+// A dying right operand is the result, no allocation
+template <typename T>
+DenseMatrix<T> DenseMatrix<T>::operator+(DenseMatrix&& other) const&
+{
+    other += *this;
+
+    return std::move(other);
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+template <typename T>
+DenseMatrix<T> DenseMatrix<T>::operator+(DenseMatrix&& other) &&
+{
+    *this += other;
+
+    return std::move(*this);
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+template <typename T>
+DenseMatrix<T> DenseMatrix<T>::operator*(const DenseMatrix& other) const&
+{
+    if (m_ncol != other.m_nrow) {
+        throw std::logic_error(("mult: dimensions do not match: " + diff_dims_error(*this, other)).c_str());
+    }
+
+    MATRIX_TRACE_SCOPE("mult", m_nrow, m_ncol, other.m_ncol,
+                       StrassenPolicy::global().calc_flops<flops_type>(m_nrow, m_ncol, other.m_ncol));
+    MATRIX_TRACE_BYTES(std::int64_t(sizeof(T)) * m_nrow * other.m_ncol);
+    DenseMatrix res(m_nrow, other.m_ncol);
+    const flops_type flops = dense_mult<flops_type>(m_nrow, other.m_ncol, m_ncol, data(), m_ncol, other.data(),
+                                                    other.m_ncol, T(0), res.data(), res.m_ncol);
+    res.m_flops = checked_add(checked_add(m_flops, other.m_flops), flops);
+
+    return res;
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+// A dying left operand is the result where *= can work in place
+template <typename T>
+DenseMatrix<T> DenseMatrix<T>::operator*(const DenseMatrix& other) &&
+{
+    *this *= other;
+
+    return std::move(*this);
+}
+
+//==============================================================================
+// operator+= ()
+//==============================================================================
+template <typename T>
+DenseMatrix<T>& DenseMatrix<T>::operator+=(const DenseMatrix& other)
+{
+    if (m_nrow != other.m_nrow || m_ncol != other.m_ncol) {
+        throw std::logic_error(("add: dimensions do not match: " + diff_dims_error(*this, other)).c_str());
+    }
+
+    MATRIX_TRACE_SCOPE("add", m_nrow, 0, m_ncol, calc_mat_add_flops<flops_type>(*this, other));
+    MATRIX_TRACE_KERNEL("add");
+    for (std::size_t i = 0; i < m_data.size(); i++) {
+        m_data[i] += other.m_data[i];
+    }
+    m_flops = checked_add(checked_add(m_flops, other.m_flops), calc_mat_add_flops<flops_type>(*this, other));
+
+    return *this;
+}
+
+//==============================================================================
+// operator*= ()
+//==============================================================================
+// Row i of the product only depends on row i of *this, so when the product is
+// no wider than *this it is computed in place, a block of rows at a time: each
+// block is copied aside, then overwritten by its product. Otherwise, when
+// other is *this, or for Strassen-Winograd, the product goes to a new buffer.
+template <typename T>
+DenseMatrix<T>& DenseMatrix<T>::operator*=(const DenseMatrix& other)
+{
+    if (m_ncol != other.m_nrow) {
+        throw std::logic_error(("mult: dimensions do not match: " + diff_dims_error(*this, other)).c_str());
+    }
+    MATRIX_TRACE_SCOPE("mult", m_nrow, m_ncol, other.m_ncol,
+                       StrassenPolicy::global().calc_flops<flops_type>(m_nrow, m_ncol, other.m_ncol));
+    if (other.m_ncol > m_ncol || &other == this || StrassenPolicy::global().applies(m_nrow, m_ncol, other.m_ncol)) {
+        *this = *this * other;
+        return *this;
+    }
+
+    MATRIX_TRACE_KERNEL("gemm_in_place");
+
+    constexpr int block = GemmBlocking<T>::MC;
+    thread_local aligned_vector<T> rows;
+    rows.resize(std::max(rows.size(), std::size_t(block) * m_ncol));
+
+    const flops_type flops = checked_add(checked_add(m_flops, other.m_flops),
+                                         calc_mat_mult_flops<flops_type>(*this, other));
+    for (int i = 0; i < m_nrow; i += block) {
+        const int nrows = std::min(block, m_nrow - i);
+        const T* src = m_data.data() + std::size_t(i) * m_ncol;
+        std::copy(src, src + std::size_t(nrows) * m_ncol, rows.data());
+        gemm(nrows, other.m_ncol, m_ncol, T(1), rows.data(), m_ncol, other.data(), other.m_ncol, T(0),
+             m_data.data() + std::size_t(i) * other.m_ncol, other.m_ncol);
+    }
+    m_data.resize(std::size_t(m_nrow) * other.m_ncol);
+    m_ncol = other.m_ncol;
+    m_flops = flops;
+
+    return *this;
+}
+
+//==============================================================================
+// operator== ()
+//==============================================================================
+template <typename T>
+bool DenseMatrix<T>::operator==(const DenseMatrix& other) const
+{
+    return (m_nrow == other.m_nrow &&
+            m_ncol == other.m_ncol &&
+            m_flops == other.m_flops &&
+            m_data == other.m_data);
+}
+
+//==============================================================================
+// operator<< ()
+//==============================================================================
+template <typename T>
+std::ostream& operator<<(std::ostream& os, const DenseMatrix<T>& mat)
+{
+    os << "<dims: " << mat.get_nrow() << " x " << mat.get_ncol() << ", flops: " << mat.get_flops() << ">";
+
+    return os;
+}
+
+//==============================================================================
+// fused_sum ()
+//==============================================================================
+// mats[0] + ... + mats[n - 1] in one pass: the result is computed a tile at a
+// time, each tile staying in cache while every input streams through it once,
+// instead of one pass over the result per operand as with a left fold. The
+// additions run in the same order as the fold, so the result is the same.
+// With a pool the tiles are spread over its threads.
+template <typename T>
+DenseMatrix<T> fused_sum(const DenseMatrix<T> *const *mats, std::size_t n, ThreadPool *pool)
+{
+    using flops_type = typename DenseMatrix<T>::flops_type;
+
+    if (n == 0) {
+        throw std::logic_error("no input mat");
+    }
+
+    const DenseMatrix<T>& first = *mats[0];
+    flops_type flops = first.get_flops();
+    for (std::size_t m = 1; m < n; m++) {
+        if (mats[m]->get_nrow() != first.get_nrow() || mats[m]->get_ncol() != first.get_ncol()) {
+            throw std::logic_error(("add: dimensions do not match: " + diff_dims_error(first, *mats[m])).c_str());
+        }
+        flops = checked_add(checked_add(flops, mats[m]->get_flops()), calc_mat_add_flops<flops_type>(first, *mats[m]));
+    }
+
+    MATRIX_TRACE_SCOPE("sum", first.get_nrow(), 0, first.get_ncol(),
+                       checked_mul(flops_type(n - 1), calc_mat_add_flops<flops_type>(first, first)));
+    MATRIX_TRACE_KERNEL(pool != nullptr ? "parallel_fused_sum" : "fused_sum");
+    MATRIX_TRACE_BYTES(std::int64_t(sizeof(T)) * first.get_nrow() * first.get_ncol());
+    if (n == 1) {
+        return first;
+    }
+
+    DenseMatrix<T> res(first.get_nrow(), first.get_ncol());
+    res.m_flops = flops;
+    T* out = res.data();
+
+    constexpr std::size_t tile = 16384 / sizeof(T);
+    const std::size_t size = std::size_t(first.get_nrow()) * first.get_ncol();
+    const auto sum_tiles = [&](std::size_t first_tile, std::size_t last_tile) {
+        const std::size_t begin = first_tile * tile;
+        const std::size_t end = std::min(last_tile * tile, size);
+        for (std::size_t b = begin; b < end; b += tile) {
+            const std::size_t e = std::min(b + tile, end);
+            const T* in0 = mats[0]->data();
+            const T* in1 = mats[1]->data();
+            for (std::size_t i = b; i < e; i++) {
+                out[i] = in0[i] + in1[i];
+            }
+            for (std::size_t m = 2; m < n; m++) {
+                const T* in = mats[m]->data();
+                for (std::size_t i = b; i < e; i++) {
+                    out[i] += in[i];
+                }
+            }
+        }
+    };
+
+    const std::size_t ntiles = (size + tile - 1) / tile;
+    if (pool) {
+        parallel_for(*pool, 0, ntiles, 4, sum_tiles);
+    } else {
+        sum_tiles(0, ntiles);
+    }
+
+    return res;
+}
+
+//==============================================================================
+// fused_sum ()
+//==============================================================================
+template <typename T>
+DenseMatrix<T> fused_sum(std::initializer_list<const DenseMatrix<T>*> mats, ThreadPool *pool = nullptr)
+{
+    return fused_sum(mats.begin(), mats.size(), pool);
+}
+
+//==============================================================================
+// static_for ()
+//==============================================================================
+template <typename Func, int... I>
+constexpr void static_for(const Func& func, std::integer_sequence<int, I...>)
+{
+    (func(std::integral_constant<int, I>()), ...);
+}
+
+//==============================================================================
+// static_for ()
+//==============================================================================
+// Calls func(i) for i in [0, N). Up to max_unroll iterations are unrolled at
+// compile time, with i an std::integral_constant; larger N fall back to a loop.
+template <int N, typename Func>
+constexpr void static_for(const Func& func)
+{
+    constexpr int max_unroll = 16;
+
+    if constexpr (N <= max_unroll) {
+        static_for(func, std::make_integer_sequence<int, N>());
+    } else {
+        for (int i = 0; i < N; i++) {
+            func(i);
+        }
+    }
+}
+
+//==============================================================================
+// FixedMatrix
+//==============================================================================
+// DenseMatrix with dimensions R x C fixed at compile time. Multiplying or adding
+// matrices whose dimensions do not match does not compile, so no checks are
+// left at run time; storage is inline and the kernels for up to 16 x 16 are
+// fully unrolled. Converts to and from DenseMatrix<T> for mixed workloads.
+template <typename T, int R, int C>
+class FixedMatrix {
+    static_assert(R > 0 && C > 0, "dimensions must be positive");
+
+public:
+    using flops_type = std::int64_t;
+
+    constexpr FixedMatrix();
+    explicit FixedMatrix(const DenseMatrix<T>& mat);
+
+    static constexpr int get_nrow() { return R; }
+    static constexpr int get_ncol() { return C; }
+    constexpr flops_type get_flops() const;
+
+    constexpr T& operator()(int i, int j);
+    constexpr const T& operator()(int i, int j) const;
+
+    template <int R2, int C2>
+    constexpr FixedMatrix operator+(const FixedMatrix<T, R2, C2>& other) const;
+    template <int R2, int C2>
+    constexpr FixedMatrix<T, R, C2> operator*(const FixedMatrix<T, R2, C2>& other) const;
+    template <int R2, int C2>
+    constexpr FixedMatrix& operator+=(const FixedMatrix<T, R2, C2>& other);
+    template <int R2, int C2>
+    constexpr FixedMatrix& operator*=(const FixedMatrix<T, R2, C2>& other);
+    constexpr bool operator==(const FixedMatrix& other) const;
+
+    DenseMatrix<T> to_dense() const;
+
+    template <typename U, int R2, int C2>
+    friend class FixedMatrix;
+
+private:
+    flops_type m_flops;
+    std::array<T, std::size_t(R) * C> m_data;
+};
+
+//==============================================================================
+// FixedMatrix ()
+//==============================================================================
+template <typename T, int R, int C>
+constexpr FixedMatrix<T, R, C>::FixedMatrix()
+    : m_flops(0),
+      m_data()
+{
+}
+
+//==============================================================================
+// FixedMatrix ()
+//==============================================================================
+template <typename T, int R, int C>
+FixedMatrix<T, R, C>::FixedMatrix(const DenseMatrix<T>& mat)
+    : m_flops(mat.get_flops()),
+      m_data()
+{
+    if (mat.get_nrow() != R || mat.get_ncol() != C) {
+        throw std::logic_error(("convert: dimensions do not match: " + diff_dims_error(mat, *this)).c_str());
+    }
+
+    std::copy(mat.data(), mat.data() + m_data.size(), m_data.begin());
+}
+
+//==============================================================================
+// get_flops ()
+//==============================================================================
+template <typename T, int R, int C>
+constexpr typename FixedMatrix<T, R, C>::flops_type FixedMatrix<T, R, C>::get_flops() const
+{
+    return m_flops;
+}
+
+//==============================================================================
+// operator() ()
+//==============================================================================
+template <typename T, int R, int C>
+constexpr T& FixedMatrix<T, R, C>::operator()(int i, int j)
+{
+    return m_data[std::size_t(i) * C + j];
+}
+
+//==============================================================================
+// operator() ()
+//==============================================================================
+template <typename T, int R, int C>
+constexpr const T& FixedMatrix<T, R, C>::operator()(int i, int j) const
+{
+    return m_data[std::size_t(i) * C + j];
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+template <typename T, int R, int C>
+template <int R2, int C2>
+constexpr FixedMatrix<T, R, C> FixedMatrix<T, R, C>::operator+(const FixedMatrix<T, R2, C2>& other) const
+{
+    static_assert(R == R2 && C == C2, "add: dimensions do not match");
+
+    FixedMatrix res;
+    static_for<R>([&](auto i) {
+        static_for<C>([&](auto j) {
+            res.m_data[i * C + j] = m_data[i * C + j] + other.m_data[i * C + j];
+        });
+    });
+    res.m_flops = checked_add(checked_add(m_flops, other.m_flops), flops_type(R) * C);
+
+    return res;
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+template <typename T, int R, int C>
+template <int R2, int C2>
+constexpr FixedMatrix<T, R, C2> FixedMatrix<T, R, C>::operator*(const FixedMatrix<T, R2, C2>& other) const
+{
+    static_assert(C == R2, "mult: dimensions do not match");
+
+    // i-k-j order: the unrolled inner loop runs along rows of other and res
+    FixedMatrix<T, R, C2> res;
+    for (int i = 0; i < R; i++) {
+        static_for<C>([&](auto k) {
+            const T a = m_data[i * C + k];
+            static_for<C2>([&](auto j) {
+                res.m_data[i * C2 + j] += a * other.m_data[k * C2 + j];
+            });
+        });
+    }
+    res.m_flops = checked_add(checked_add(m_flops, other.m_flops), calc_mult_flops<flops_type>(R, C, C2));
+
+    return res;
+}
+
+//==============================================================================
+// operator+= ()
+//==============================================================================
+template <typename T, int R, int C>
+template <int R2, int C2>
+constexpr FixedMatrix<T, R, C>& FixedMatrix<T, R, C>::operator+=(const FixedMatrix<T, R2, C2>& other)
+{
+    *this = *this + other;
+
+    return *this;
+}
+
+//==============================================================================
+// operator*= ()
+//==============================================================================
+template <typename T, int R, int C>
+template <int R2, int C2>
+constexpr FixedMatrix<T, R, C>& FixedMatrix<T, R, C>::operator*=(const FixedMatrix<T, R2, C2>& other)
+{
+    static_assert(R2 == C && C2 == C, "mult: result dimensions do not match");
+
+    *this = *this * other;
+
+    return *this;
+}
+
+//==============================================================================
+// operator== ()
+//==============================================================================
+template <typename T, int R, int C>
+constexpr bool FixedMatrix<T, R, C>::operator==(const FixedMatrix& other) const
+{
+    for (std::size_t i = 0; i < m_data.size(); i++) {
+        if (!(m_data[i] == other.m_data[i])) {
+            return false;
+        }
+    }
+
+    return (m_flops == other.m_flops);
+}
+
+//==============================================================================
+// to_dense ()
+//==============================================================================
+template <typename T, int R, int C>
+DenseMatrix<T> FixedMatrix<T, R, C>::to_dense() const
+{
+    DenseMatrix<T> res(R, C);
+    std::copy(m_data.begin(), m_data.end(), res.data());
+    res.m_flops = m_flops;
+
+    return res;
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+template <typename T, int R, int C>
+DenseMatrix<T> operator*(const FixedMatrix<T, R, C>& A, const DenseMatrix<T>& B)
+{
+    return A.to_dense() * B;
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+template <typename T, int R, int C>
+DenseMatrix<T> operator*(const DenseMatrix<T>& A, const FixedMatrix<T, R, C>& B)
+{
+    return A * B.to_dense();
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+template <typename T, int R, int C>
+DenseMatrix<T> operator+(const FixedMatrix<T, R, C>& A, const DenseMatrix<T>& B)
+{
+    return A.to_dense() + B;
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+template <typename T, int R, int C>
+DenseMatrix<T> operator+(const DenseMatrix<T>& A, const FixedMatrix<T, R, C>& B)
+{
+    return A + B.to_dense();
+}
+
+//==============================================================================
+// operator<< ()
+//==============================================================================
+template <typename T, int R, int C>
+std::ostream& operator<<(std::ostream& os, const FixedMatrix<T, R, C>& mat)
+{
+    os << "<dims: " << R << " x " << C << ", flops: " << mat.get_flops() << ">";
+
+    return os;
+}
+
+//==============================================================================
+// bfloat16
+//==============================================================================
+// Storage-only brain float: the upper half of a float, same range, 8 bits of
+// precision. Converting from float rounds to nearest even. Products of
+// bfloat16 matrices accumulate in float, see mixed_mult().
+struct bfloat16 {
+    std::uint16_t bits = 0;
+
+    bfloat16() = default;
+    bfloat16(float value);
+
+    operator float() const;
+    bool operator==(const bfloat16& other) const;
+};
+
+//==============================================================================
+// bfloat16 ()
+//==============================================================================
+bfloat16::bfloat16(float value)
+{
+    std::uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    if ((f & 0x7fffffff) > 0x7f800000) {
+        bits = (f >> 16) | 0x40;  // keep NaN a quiet NaN
+    } else {
+        bits = (f + 0x7fff + ((f >> 16) & 1)) >> 16;
+    }
+}
+
+//==============================================================================
+// operator float ()
+//==============================================================================
+bfloat16::operator float() const
+{
+    const std::uint32_t f = std::uint32_t(bits) << 16;
+    float value;
+    std::memcpy(&value, &f, sizeof(value));
+
+    return value;
+}
+
+//==============================================================================
+// operator== ()
+//==============================================================================
+bool bfloat16::operator==(const bfloat16& other) const
+{
+    return bits == other.bits;
+}
+
+//==============================================================================
+// float16
+//==============================================================================
+// Storage-only IEEE half: 5 bits of exponent, 11 of precision, subnormals
+// kept. Converting from float rounds to nearest even, and overflows to
+// infinity past 65504. Products accumulate in float, see mixed_mult().
+struct float16 {
+    std::uint16_t bits = 0;
+
+    float16() = default;
+    float16(float value);
+
+    operator float() const;
+    bool operator==(const float16& other) const;
+};
+
+//==============================================================================
+// float16 ()
+//==============================================================================
+float16::float16(float value)
+{
+    std::uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    const std::uint32_t sign = (f >> 16) & 0x8000;
+    const std::uint32_t abs = f & 0x7fffffff;
+    if (abs > 0x7f800000) {
+        bits = sign | 0x7e00;
+    } else if (abs >= 0x477ff000) {
+        // 65520 and up round to infinity
+        bits = sign | 0x7c00;
+    } else if (abs < 0x38800000) {
+        // below 2^-14: a subnormal in units of 2^-24, exact before rounding
+        float magnitude;
+        std::memcpy(&magnitude, &abs, sizeof(magnitude));
+        bits = sign | std::uint32_t(std::nearbyint(magnitude * 16777216.0f));
+    } else {
+        // rebias the exponent from 127 to 15, then round away 13 bits
+        const std::uint32_t rebiased = abs - 0x38000000;
+        bits = sign | ((rebiased + 0xfff + ((rebiased >> 13) & 1)) >> 13);
+    }
+}
+
+//==============================================================================
+// operator float ()
+//==============================================================================
+float16::operator float() const
+{
+    const std::uint32_t sign = std::uint32_t(bits & 0x8000) << 16;
+    const std::uint32_t exponent = (bits >> 10) & 0x1f;
+    const std::uint32_t mantissa = bits & 0x3ff;
+    if (exponent == 0) {
+        const float magnitude = mantissa / 16777216.0f;
+        return (sign ? -magnitude : magnitude);
+    }
+
+    const std::uint32_t f = sign | (exponent == 0x1f ? 0x7f800000 : (exponent + 112) << 23) | (mantissa << 13);
+    float value;
+    std::memcpy(&value, &f, sizeof(value));
+
+    return value;
+}
+
+//==============================================================================
+// operator== ()
+//==============================================================================
+bool float16::operator==(const float16& other) const
+{
+    return bits == other.bits;
+}
+
+//==============================================================================
+// operator<< ()
+//==============================================================================
+std::ostream& operator<<(std::ostream& os, bfloat16 value)
+{
+    return os << float(value);
+}
+
+//==============================================================================
+// operator<< ()
+//==============================================================================
+std::ostream& operator<<(std::ostream& os, float16 value)
+{
+    return os << float(value);
+}
+
+//==============================================================================
+// Precision
+//==============================================================================
+// Element types products can run in, the narrow ones accumulating wider
+enum class Precision {
+    fp64,
+    fp32,
+    bf16,  // float accumulation
+    fp16,  // float accumulation
+    int8,  // std::int32_t accumulation
+};
+
+constexpr std::size_t num_precisions = 5;
+
+//==============================================================================
+// precision_traits
+//==============================================================================
+// Precision of element type T, and the type its products accumulate in and
+// come out as
+template <typename T>
+struct precision_traits;
+
+template <>
+struct precision_traits<double> {
+    using accumulator = double;
+    static constexpr Precision precision = Precision::fp64;
+};
+
+template <>
+struct precision_traits<float> {
+    using accumulator = float;
+    static constexpr Precision precision = Precision::fp32;
+};
+
+template <>
+struct precision_traits<bfloat16> {
+    using accumulator = float;
+    static constexpr Precision precision = Precision::bf16;
+};
+
+template <>
+struct precision_traits<float16> {
+    using accumulator = float;
+    static constexpr Precision precision = Precision::fp16;
+};
+
+template <>
+struct precision_traits<std::int8_t> {
+    using accumulator = std::int32_t;
+    static constexpr Precision precision = Precision::int8;
+};
+
+template <typename T>
+using accumulator_t = typename precision_traits<T>::accumulator;
+
+//==============================================================================
+// get_precision_name ()
+//==============================================================================
+const char *get_precision_name(Precision precision)
+{
+    static const char *const names[num_precisions] = {"fp64", "fp32", "bf16", "fp16", "int8"};
+
+    return names[std::size_t(precision)];
+}
+
+//==============================================================================
+// get_precision_sizes ()
+//==============================================================================
+// Bytes of an element and of an accumulator
+std::pair<std::size_t, std::size_t> get_precision_sizes(Precision precision)
+{
+    static const std::pair<std::size_t, std::size_t> sizes[num_precisions] = {{8, 8}, {4, 4}, {2, 4}, {2, 4}, {1, 4}};
+
+    return sizes[std::size_t(precision)];
+}
+
+//==============================================================================
+// MixedGemmKernel
+//==============================================================================
+// Row-major C = A * B, A m x k and B k x n of In, C of accumulator_t<In>
+template <typename In>
+struct MixedGemmKernel {
+    using Func = void (*)(int m, int n, int k, const In *A, int lda, const In *B, int ldb, accumulator_t<In> *C,
+                          int ldc);
+
+    const char *name;
+    Func func;
+};
+
+//==============================================================================
+// mixed_gemm_scalar ()
+//==============================================================================
+template <typename In>
+static void mixed_gemm_scalar(int m, int n, int k, const In *A, int lda, const In *B, int ldb, accumulator_t<In> *C,
+                              int ldc)
+{
+    using Acc = accumulator_t<In>;
+    for (int i = 0; i < m; i++) {
+        std::fill(C + i * ldc, C + i * ldc + n, Acc(0));
+        for (int p = 0; p < k; p++) {
+            const Acc a = Acc(A[i * lda + p]);
+            for (int j = 0; j < n; j++) {
+                C[i * ldc + j] += a * Acc(B[p * ldb + j]);
+            }
+        }
+    }
+}
+
+//==============================================================================
+// mixed_gemm_native ()
+//==============================================================================
+// float and double accumulate in themselves: gemm()
+template <typename In>
+static void mixed_gemm_native(int m, int n, int k, const In *A, int lda, const In *B, int ldb, accumulator_t<In> *C,
+                              int ldc)
+{
+    gemm(m, n, k, In(1), A, lda, B, ldb, In(0), C, ldc);
+}
+
+//==============================================================================
+// pack_dot_panel ()
+//==============================================================================
+// B (k x n) for the dot-product instructions, which sum Group consecutive
+// products along k per 32-bit lane: element (p, j) goes to
+// res[((p / Group) * n_pad + j) * Group + p % Group]. Padding is zero, so it
+// adds nothing to any dot product.
+template <int Group, typename In>
+const In *pack_dot_panel(int k, int n, int n_pad, const In *B, int ldb)
+{
+    thread_local std::vector<In> packed;
+    const int k_groups = (k + Group - 1) / Group;
+    packed.assign(std::size_t(k_groups) * n_pad * Group, In());
+    for (int p = 0; p < k; p++) {
+        for (int j = 0; j < n; j++) {
+            packed[(std::size_t(p / Group) * n_pad + j) * Group + p % Group] = B[p * ldb + j];
+        }
+    }
+
+    return packed.data();
+}
+
+//==============================================================================
+// load_dot_group ()
+//==============================================================================
+// Group consecutive elements of a row of A at p as one 32-bit lane, zero past
+// k; flip adds 128 to int8 ones (for the unsigned operand of VNNI)
+template <int Group, typename In>
+static std::uint32_t load_dot_group(const In *a_row, int p, int k, bool flip = false)
+{
+    std::uint32_t res = 0;
+    for (int g = 0; g < Group; g++) {
+        std::uint32_t value = 0;
+        if (p + g < k) {
+            if constexpr (std::is_same_v<In, std::int8_t>) {
+                value = std::uint8_t(a_row[p + g]) ^ (flip ? 0x80 : 0);
+            } else {
+                value = a_row[p + g].bits;
+            }
+        } else if (flip) {
+            value = 0x80;  // 0 once flipped back
+        }
+        res |= value << (g * 32 / Group);
+    }
+
+    return res;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+//==============================================================================
+// mixed_gemm_avx512_bf16 ()
+//==============================================================================
+// vdpbf16ps: every float lane adds the products of a pair of bfloat16 along
+// k. Rows of A are broadcast a pair at a time against 16 columns of the
+// packed B; 4 rows by 32 columns stay in registers.
+__attribute__((target("avx512f,avx512bf16")))
+static void mixed_gemm_avx512_bf16(int m, int n, int k, const bfloat16 *A, int lda, const bfloat16 *B, int ldb,
+                                   float *C, int ldc)
+{
+    constexpr int MR = 4;
+    const int n_pad = (n + 31) / 32 * 32;
+    const int k_pairs = (k + 1) / 2;
+    const bfloat16 *packed = pack_dot_panel<2>(k, n, n_pad, B, ldb);
+
+    thread_local std::vector<std::uint32_t> a_pairs;
+    a_pairs.resize(std::size_t(k_pairs) * MR);
+    for (int i = 0; i < m; i += MR) {
+        const int mr = std::min(MR, m - i);
+        // rows past m repeat the last one, their sums are dropped
+        for (int q = 0; q < k_pairs; q++) {
+            for (int r = 0; r < MR; r++) {
+                a_pairs[q * MR + r] = load_dot_group<2>(A + (i + std::min(r, mr - 1)) * lda, 2 * q, k);
+            }
+        }
+        for (int j = 0; j < n; j += 32) {
+            __m512 acc[MR][2];
+#pragma GCC unroll 4
+            for (int r = 0; r < MR; r++) {
+                acc[r][0] = _mm512_setzero_ps();
+                acc[r][1] = _mm512_setzero_ps();
+            }
+            for (int q = 0; q < k_pairs; q++) {
+                const bfloat16 *b = packed + (std::size_t(q) * n_pad + j) * 2;
+                const __m512bh b0 = (__m512bh)_mm512_loadu_si512(b);
+                const __m512bh b1 = (__m512bh)_mm512_loadu_si512(b + 32);
+#pragma GCC unroll 4
+                for (int r = 0; r < MR; r++) {
+                    const __m512bh a = (__m512bh)_mm512_set1_epi32(a_pairs[q * MR + r]);
+                    acc[r][0] = _mm512_dpbf16_ps(acc[r][0], a, b0);
+                    acc[r][1] = _mm512_dpbf16_ps(acc[r][1], a, b1);
+                }
+            }
+            const int nr = std::min(32, n - j);
+            const __mmask16 mask0 = (nr >= 16 ? 0xffff : (1u << nr) - 1);
+            const __mmask16 mask1 = (nr >= 32 ? 0xffff : nr > 16 ? (1u << (nr - 16)) - 1 : 0);
+            for (int r = 0; r < mr; r++) {
+                _mm512_mask_storeu_ps(C + (i + r) * ldc + j, mask0, acc[r][0]);
+                _mm512_mask_storeu_ps(C + (i + r) * ldc + j + 16, mask1, acc[r][1]);
+            }
+        }
+    }
+}
+
+//==============================================================================
+// mixed_gemm_avx512_fp16 ()
+//==============================================================================
+// vcvtph2ps widens 16 halves of a row of B to floats, multiplied in float
+// with a broadcast element of A, converted once per block of 4 rows; 4 rows
+// by 32 columns stay in registers
+__attribute__((target("avx512f")))
+static void mixed_gemm_avx512_fp16(int m, int n, int k, const float16 *A, int lda, const float16 *B, int ldb,
+                                   float *C, int ldc)
+{
+    constexpr int MR = 4;
+    const int n_pad = (n + 31) / 32 * 32;
+    const float16 *packed = pack_dot_panel<1>(k, n, n_pad, B, ldb);
+
+    // rows of A as floats, widened 16 at a time: float16's own conversion is
+    // scalar code, slow to call with the upper halves of registers in use
+    const int k_pad = (k + 15) / 16 * 16;
+    thread_local std::vector<float> a_floats;
+    a_floats.resize(std::size_t(k_pad) * MR);
+    for (int i = 0; i < m; i += MR) {
+        const int mr = std::min(MR, m - i);
+        for (int r = 0; r < MR; r++) {
+            const float16 *a_row = A + (i + std::min(r, mr - 1)) * lda;
+            for (int p = 0; p < k_pad; p += 16) {
+                alignas(32) float16 halves[16] = {};
+                std::copy(a_row + p, a_row + std::min(p + 16, k), halves);
+                const __m256i h = _mm256_load_si256(reinterpret_cast<const __m256i*>(halves));
+                _mm512_storeu_ps(a_floats.data() + r * k_pad + p, _mm512_maskz_cvtph_ps(0xffff, h));
+            }
+        }
+        for (int j = 0; j < n; j += 32) {
+            __m512 acc[MR][2];
+#pragma GCC unroll 4
+            for (int r = 0; r < MR; r++) {
+                acc[r][0] = _mm512_setzero_ps();
+                acc[r][1] = _mm512_setzero_ps();
+            }
+            for (int p = 0; p < k; p++) {
+                const float16 *b = packed + std::size_t(p) * n_pad + j;
+                // the zero-masking forms: the plain ones trip -Wmaybe-uninitialized in GCC 12
+                const __m256i h0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+                const __m256i h1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + 16));
+                const __m512 b0 = _mm512_maskz_cvtph_ps(0xffff, h0);
+                const __m512 b1 = _mm512_maskz_cvtph_ps(0xffff, h1);
+#pragma GCC unroll 4
+                for (int r = 0; r < MR; r++) {
+                    const __m512 a = _mm512_set1_ps(a_floats[r * k_pad + p]);
+                    acc[r][0] = _mm512_fmadd_ps(a, b0, acc[r][0]);
+                    acc[r][1] = _mm512_fmadd_ps(a, b1, acc[r][1]);
+                }
+            }
+            const int nr = std::min(32, n - j);
+            const __mmask16 mask0 = (nr >= 16 ? 0xffff : (1u << nr) - 1);
+            const __mmask16 mask1 = (nr >= 32 ? 0xffff : nr > 16 ? (1u << (nr - 16)) - 1 : 0);
+            for (int r = 0; r < mr; r++) {
+                _mm512_mask_storeu_ps(C + (i + r) * ldc + j, mask0, acc[r][0]);
+                _mm512_mask_storeu_ps(C + (i + r) * ldc + j + 16, mask1, acc[r][1]);
+            }
+        }
+    }
+}
+
+//==============================================================================
+// mixed_gemm_avx512_vnni ()
+//==============================================================================
+// vpdpbusd: every int32 lane adds the products of 4 unsigned by 4 signed
+// bytes along k. A is made unsigned by adding 128, which adds 128 times the
+// column sums of B, taken off at the end. 4 rows by 32 columns stay in
+// registers.
+__attribute__((target("avx512f,avx512vnni")))
+static void mixed_gemm_avx512_vnni(int m, int n, int k, const std::int8_t *A, int lda, const std::int8_t *B, int ldb,
+                                   std::int32_t *C, int ldc)
+{
+    constexpr int MR = 4;
+    const int n_pad = (n + 31) / 32 * 32;
+    const int k_quads = (k + 3) / 4;
+    const std::int8_t *packed = pack_dot_panel<4>(k, n, n_pad, B, ldb);
+
+    // 128 times the column sums of B
+    thread_local std::vector<std::int32_t> biases;
+    biases.assign(n_pad, 0);
+    for (int p = 0; p < k; p++) {
+        for (int j = 0; j < n; j++) {
+            biases[j] += 128 * B[p * ldb + j];
+        }
+    }
+
+    thread_local std::vector<std::uint32_t> a_quads;
+    a_quads.resize(std::size_t(k_quads) * MR);
+    for (int i = 0; i < m; i += MR) {
+        const int mr = std::min(MR, m - i);
+        for (int q = 0; q < k_quads; q++) {
+            for (int r = 0; r < MR; r++) {
+                a_quads[q * MR + r] = load_dot_group<4>(A + (i + std::min(r, mr - 1)) * lda, 4 * q, k, true);
+            }
+        }
+        for (int j = 0; j < n; j += 32) {
+            __m512i acc[MR][2];
+#pragma GCC unroll 4
+            for (int r = 0; r < MR; r++) {
+                acc[r][0] = _mm512_setzero_si512();
+                acc[r][1] = _mm512_setzero_si512();
+            }
+            for (int q = 0; q < k_quads; q++) {
+                const std::int8_t *b = packed + (std::size_t(q) * n_pad + j) * 4;
+                const __m512i b0 = _mm512_loadu_si512(b);
+                const __m512i b1 = _mm512_loadu_si512(b + 64);
+#pragma GCC unroll 4
+                for (int r = 0; r < MR; r++) {
+                    const __m512i a = _mm512_set1_epi32(a_quads[q * MR + r]);
+                    acc[r][0] = _mm512_dpbusd_epi32(acc[r][0], a, b0);
+                    acc[r][1] = _mm512_dpbusd_epi32(acc[r][1], a, b1);
+                }
+            }
+            const __m512i bias0 = _mm512_loadu_si512(biases.data() + j);
+            const __m512i bias1 = _mm512_loadu_si512(biases.data() + j + 16);
+            const int nr = std::min(32, n - j);
+            const __mmask16 mask0 = (nr >= 16 ? 0xffff : (1u << nr) - 1);
+            const __mmask16 mask1 = (nr >= 32 ? 0xffff : nr > 16 ? (1u << (nr - 16)) - 1 : 0);
+            for (int r = 0; r < mr; r++) {
+                _mm512_mask_storeu_epi32(C + (i + r) * ldc + j, mask0, _mm512_sub_epi32(acc[r][0], bias0));
+                _mm512_mask_storeu_epi32(C + (i + r) * ldc + j + 16, mask1, _mm512_sub_epi32(acc[r][1], bias1));
+            }
+        }
+    }
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_DOTPROD)
+//==============================================================================
+// mixed_gemm_neon_sdot ()
+//==============================================================================
+// sdot: every int32 lane adds the products of 4 signed bytes along k. Rows of
+// A are broadcast 4 bytes at a time against 16 columns of the packed B.
+static void mixed_gemm_neon_sdot(int m, int n, int k, const std::int8_t *A, int lda, const std::int8_t *B, int ldb,
+                                 std::int32_t *C, int ldc)
+{
+    const int n_pad = (n + 15) / 16 * 16;
+    const int k_quads = (k + 3) / 4;
+    const std::int8_t *packed = pack_dot_panel<4>(k, n, n_pad, B, ldb);
+
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < n; j += 16) {
+            int32x4_t acc[4] = {vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0)};
+            for (int q = 0; q < k_quads; q++) {
+                const int8x16_t a = vreinterpretq_s8_u32(vdupq_n_u32(load_dot_group<4>(A + i * lda, 4 * q, k)));
+                const std::int8_t *b = packed + (std::size_t(q) * n_pad + j) * 4;
+                for (int v = 0; v < 4; v++) {
+                    acc[v] = vdotq_s32(acc[v], a, vld1q_s8(b + 16 * v));
+                }
+            }
+            std::int32_t res[16];
+            for (int v = 0; v < 4; v++) {
+                vst1q_s32(res + 4 * v, acc[v]);
+            }
+            std::copy(res, res + std::min(16, n - j), C + i * ldc + j);
+        }
+    }
+}
+#endif
+
+//==============================================================================
+// get_mixed_gemm_kernels ()
+//==============================================================================
+// All kernels this CPU can run for In, best first; the scalar loop is last
+template <typename In>
+const std::vector<MixedGemmKernel<In>>& get_mixed_gemm_kernels()
+{
+    static const std::vector<MixedGemmKernel<In>> kernels = []() {
+        std::vector<MixedGemmKernel<In>> res;
+        if constexpr (std::is_same_v<In, float> || std::is_same_v<In, double>) {
+            res.push_back({"gemm", mixed_gemm_native<In>});
+        }
+#if defined(__x86_64__) && defined(__GNUC__)
+        __builtin_cpu_init();
+        if constexpr (std::is_same_v<In, bfloat16>) {
+            if (__builtin_cpu_supports("avx512bf16")) {
+                res.push_back({"avx512_bf16", mixed_gemm_avx512_bf16});
+            }
+        }
+        if constexpr (std::is_same_v<In, float16>) {
+            if (__builtin_cpu_supports("avx512f")) {
+                res.push_back({"avx512_fp16", mixed_gemm_avx512_fp16});
+            }
+        }
+        if constexpr (std::is_same_v<In, std::int8_t>) {
+            if (__builtin_cpu_supports("avx512vnni")) {
+                res.push_back({"avx512_vnni", mixed_gemm_avx512_vnni});
+            }
+        }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_DOTPROD)
+        if constexpr (std::is_same_v<In, std::int8_t>) {
+            res.push_back({"neon_sdot", mixed_gemm_neon_sdot});
+        }
+#endif
+        res.push_back({"scalar", mixed_gemm_scalar<In>});
+        return res;
+    }();
+
+    return kernels;
+}
+
+//==============================================================================
+// mixed_mult ()
+//==============================================================================
+// A * B in the accumulator type of In (float for bfloat16 and float16,
+// std::int32_t for std::int8_t), on the best kernel of the CPU. Flops count
+// as for DenseMatrix products; how much each one costs is up to the
+// precision, see PrecisionCostModel.
+template <typename In>
+DenseMatrix<accumulator_t<In>> mixed_mult(const DenseMatrix<In>& A, const DenseMatrix<In>& B)
+{
+    if (A.get_ncol() != B.get_nrow()) {
+        throw std::logic_error("mixed mult: dimensions do not match: " + diff_dims_error(A, B));
+    }
+
+    const MixedGemmKernel<In>& kernel = get_mixed_gemm_kernels<In>().front();
+    MATRIX_TRACE_SCOPE("mixed_mult", A.get_nrow(), A.get_ncol(), B.get_ncol(),
+                       calc_mult_flops<std::int64_t>(A.get_nrow(), A.get_ncol(), B.get_ncol()));
+    MATRIX_TRACE_KERNEL(kernel.name);
+    MATRIX_TRACE_BYTES(std::int64_t(sizeof(accumulator_t<In>)) * A.get_nrow() * B.get_ncol());
+    DenseMatrix<accumulator_t<In>> res(A.get_nrow(), B.get_ncol());
+    kernel.func(A.get_nrow(), B.get_ncol(), A.get_ncol(), A.data(), A.get_ncol(), B.data(), B.get_ncol(), res.data(),
+                res.get_ncol());
+    res.m_flops = checked_add(checked_add(A.get_flops(), B.get_flops()),
+                              calc_mult_flops<std::int64_t>(A.get_nrow(), A.get_ncol(), B.get_ncol()));
+
+    return res;
+}
+
+//==============================================================================
+// convert_element ()
+//==============================================================================
+// From one element type to another, through float or double; integers are
+// rounded and saturated
+template <typename To, typename From>
+To convert_element(From value)
+{
+    if constexpr (std::is_integral_v<To>) {
+        const double rounded = std::nearbyint(double(value));
+        return To(std::clamp<double>(rounded, std::numeric_limits<To>::min(), std::numeric_limits<To>::max()));
+    } else if constexpr (std::is_same_v<To, bfloat16> || std::is_same_v<To, float16>) {
+        return To(float(value));
+    } else {
+        return To(double(value));
+    }
+}
+
+//==============================================================================
+// convert_matrix ()
+//==============================================================================
+// A copy of mat in another element type, flops kept
+template <typename To, typename From>
+DenseMatrix<To> convert_matrix(const DenseMatrix<From>& mat)
+{
+    DenseMatrix<To> res(mat.get_nrow(), mat.get_ncol());
+    std::transform(mat.data(), mat.data() + std::size_t(mat.get_nrow()) * mat.get_ncol(), res.data(),
+                   convert_element<To, From>);
+    res.m_flops = mat.get_flops();
+
+    return res;
+}
+
+//==============================================================================
+// CompactBatch
+//==============================================================================
+// Batch of size() matrices of the same nrow x ncol shape in the compact
+// (interleaved) layout: matrices go in groups of `lanes`, and a group stores
+// element (i, j) of its matrices side by side, so that element of the whole
+// group is one SIMD vector. A batched product then multiplies `lanes` small
+// matrices at once with plain vector arithmetic, with no packing and no
+// per-matrix dispatch. The unused lanes of the last group are kept at zero.
+template <typename T>
+class CompactBatch {
+public:
+    using flops_type = std::int64_t;
+
+    static constexpr std::size_t lanes = 64 / sizeof(T);
+
+    CompactBatch(int nrow, int ncol, std::size_t count);
+
+    static CompactBatch pack(const DenseMatrix<T> *const *mats, std::size_t count);
+    DenseMatrix<T> unpack(std::size_t p) const;
+
+    int get_nrow() const;
+    int get_ncol() const;
+    std::size_t size() const;
+    std::size_t get_num_groups() const;
+    flops_type get_flops(std::size_t p) const;
+
+    T* data();
+    const T* data() const;
+    T& operator()(std::size_t p, int i, int j);
+    const T& operator()(std::size_t p, int i, int j) const;
+
+    CompactBatch operator*(const CompactBatch& other) const;
+
+    template <typename U>
+    friend void batched_mult(const CompactBatch<U>& A, const CompactBatch<U>& B, CompactBatch<U>& res,
+                             ThreadPool *pool);
+
+private:
+    std::size_t index(std::size_t p, int i, int j) const;
+
+    int m_nrow;
+    int m_ncol;
+    std::size_t m_count;
+    std::vector<flops_type> m_flops;  // per matrix
+    aligned_vector<T> m_data;
+};
+
+//==============================================================================
+// CompactBatch ()
+//==============================================================================
+template <typename T>
+CompactBatch<T>::CompactBatch(int nrow, int ncol, std::size_t count)
+    : m_nrow(nrow),
+      m_ncol(ncol),
+      m_count(count),
+      m_flops(count),
+      m_data((count + lanes - 1) / lanes * lanes * nrow * ncol)
+{
+}
+
+//==============================================================================
+// pack ()
+//==============================================================================
+// Batch of the count matrices mats[0..count), which must all have the same
+// shape
+template <typename T>
+CompactBatch<T> CompactBatch<T>::pack(const DenseMatrix<T> *const *mats, std::size_t count)
+{
+    CompactBatch res(count ? mats[0]->get_nrow() : 0, count ? mats[0]->get_ncol() : 0, count);
+    for (std::size_t p = 0; p < count; p++) {
+        const DenseMatrix<T>& mat = *mats[p];
+        if (mat.get_nrow() != res.m_nrow || mat.get_ncol() != res.m_ncol) {
+            throw std::logic_error("batch: dimensions do not match: " + diff_dims_error(*mats[0], mat));
+        }
+        for (int i = 0; i < res.m_nrow; i++) {
+            for (int j = 0; j < res.m_ncol; j++) {
+                res(p, i, j) = mat(i, j);
+            }
+        }
+        res.m_flops[p] = mat.get_flops();
+    }
+
+    return res;
+}
+
+//==============================================================================
+// unpack ()
+//==============================================================================
+// Matrix p of the batch
+template <typename T>
+DenseMatrix<T> CompactBatch<T>::unpack(std::size_t p) const
+{
+    DenseMatrix<T> res(m_nrow, m_ncol);
+    for (int i = 0; i < m_nrow; i++) {
+        for (int j = 0; j < m_ncol; j++) {
+            res(i, j) = (*this)(p, i, j);
+        }
+    }
+    res.m_flops = m_flops[p];
+
+    return res;
+}
+
+//==============================================================================
+// get_nrow ()
+//==============================================================================
+template <typename T>
+int CompactBatch<T>::get_nrow() const
+{
+    return m_nrow;
+}
+
+//==============================================================================
+// get_ncol ()
+//==============================================================================
+template <typename T>
+int CompactBatch<T>::get_ncol() const
+{
+    return m_ncol;
+}
+
+//==============================================================================
+// size ()
+//==============================================================================
+template <typename T>
+std::size_t CompactBatch<T>::size() const
+{
+    return m_count;
+}
+
+//==============================================================================
+// get_num_groups ()
+//==============================================================================
+template <typename T>
+std::size_t CompactBatch<T>::get_num_groups() const
+{
+    return (m_count + lanes - 1) / lanes;
+}
+
+//==============================================================================
+// get_flops ()
+//==============================================================================
+template <typename T>
+typename CompactBatch<T>::flops_type CompactBatch<T>::get_flops(std::size_t p) const
+{
+    return m_flops[p];
+}
+
+//==============================================================================
+// data ()
+//==============================================================================
+template <typename T>
+T* CompactBatch<T>::data()
+{
+    return m_data.data();
+}
+
+//==============================================================================
+// data ()
+//==============================================================================
+template <typename T>
+const T* CompactBatch<T>::data() const
+{
+    return m_data.data();
+}
+
+//==============================================================================
+// operator() ()
+//==============================================================================
+template <typename T>
+T& CompactBatch<T>::operator()(std::size_t p, int i, int j)
+{
+    return m_data[index(p, i, j)];
+}
+
+//==============================================================================
+// operator() ()
+//==============================================================================
+template <typename T>
+const T& CompactBatch<T>::operator()(std::size_t p, int i, int j) const
+{
+    return m_data[index(p, i, j)];
+}
+
+//==============================================================================
+// index ()
+//==============================================================================
+template <typename T>
+std::size_t CompactBatch<T>::index(std::size_t p, int i, int j) const
+{
+    return ((p / lanes) * m_nrow * m_ncol + std::size_t(i) * m_ncol + j) * lanes + p % lanes;
+}
+
+//==============================================================================
+// CompactGemmKernel
+//==============================================================================
+// C = A * B for groups [first, last) of compact batches of m x k by k x n
+// matrices. The kernels for a few common shapes have them fixed at compile
+// time, so every loop bound is a constant; the generic one (m == 0) takes
+// any shape.
+template <typename T>
+struct CompactGemmKernel {
+    using Func = void (*)(const T *A, const T *B, T *C, std::size_t first, std::size_t last, int m, int k, int n);
+
+    const char *name;
+    int m;
+    int k;
+    int n;
+    Func func;
+};
+
+#if defined(__GNUC__)
+template <typename T, std::size_t Bytes>
+struct compact_vector {
+    typedef T type __attribute__((vector_size(Bytes), may_alias));
+};
+
+//==============================================================================
+// compact_gemm_tile ()
+//==============================================================================
+// c[0:RJ] = a_row * b[:, 0:RJ] for one group, each element being S native
+// vectors of Vec (S * sizeof(Vec) = 64 bytes, a group's lanes); the RJ * S
+// accumulators stay in registers across k
+template <int RJ, int S, typename Vec>
+__attribute__((always_inline))
+inline void compact_gemm_tile(const Vec *a_row, const Vec *b, Vec *c, int k, int ldb)
+{
+    // -O2 does not unroll these by itself, and rolled loops keep acc in memory
+    Vec acc[RJ][S] = {};
+    for (int p = 0; p < k; p++) {
+#pragma GCC unroll 8
+        for (int s = 0; s < S; s++) {
+            const Vec a = a_row[p * S + s];
+#pragma GCC unroll 8
+            for (int r = 0; r < RJ; r++) {
+                acc[r][s] += a * b[(p * ldb + r) * S + s];
+            }
+        }
+    }
+
+#pragma GCC unroll 8
+    for (int r = 0; r < RJ; r++) {
+#pragma GCC unroll 8
+        for (int s = 0; s < S; s++) {
+            c[r * S + s] = acc[r][s];
+        }
+    }
+}
+
+//==============================================================================
+// compact_gemm_groups ()
+//==============================================================================
+// Shared body of the kernels, compiled once per target (VecBytes being its
+// vector width) and shape they are built for. Tiles are as wide as 8
+// accumulators allow.
+template <typename T, std::size_t VecBytes>
+__attribute__((always_inline))
+inline void compact_gemm_groups(const T *A, const T *B, T *C, std::size_t first, std::size_t last, int m, int k,
+                                int n)
+{
+    using Vec = typename compact_vector<T, VecBytes>::type;
+    constexpr int S = 64 / VecBytes;
+    constexpr int RJ = 8 / S;
+
+    for (std::size_t g = first; g < last; g++) {
+        const Vec *a = reinterpret_cast<const Vec*>(A) + g * m * k * S;
+        const Vec *b = reinterpret_cast<const Vec*>(B) + g * k * n * S;
+        Vec *c = reinterpret_cast<Vec*>(C) + g * m * n * S;
+        for (int i = 0; i < m; i++) {
+            int j = 0;
+            for (; j + RJ <= n; j += RJ) {
+                compact_gemm_tile<RJ, S>(a + i * k * S, b + j * S, c + (i * n + j) * S, k, n);
+            }
+            for (; j < n; j++) {
+                compact_gemm_tile<1, S>(a + i * k * S, b + j * S, c + (i * n + j) * S, k, n);
+            }
+        }
+    }
+}
+
+//==============================================================================
+// compact_gemm_generic ()
+//==============================================================================
+template <typename T, int M, int K, int N>
+static void compact_gemm_generic(const T *A, const T *B, T *C, std::size_t first, std::size_t last, int m, int k,
+                                 int n)
+{
+    if constexpr (M > 0) {
+        compact_gemm_groups<T, 16>(A, B, C, first, last, M, K, N);
+    } else {
+        compact_gemm_groups<T, 16>(A, B, C, first, last, m, k, n);
+    }
+}
+
+#if defined(__x86_64__)
+//==============================================================================
+// compact_gemm_avx2 ()
+//==============================================================================
+template <typename T, int M, int K, int N>
+__attribute__((target("avx2")))
+static void compact_gemm_avx2(const T *A, const T *B, T *C, std::size_t first, std::size_t last, int m, int k,
+                              int n)
+{
+    if constexpr (M > 0) {
+        compact_gemm_groups<T, 32>(A, B, C, first, last, M, K, N);
+    } else {
+        compact_gemm_groups<T, 32>(A, B, C, first, last, m, k, n);
+    }
+}
+
+//==============================================================================
+// compact_gemm_avx512 ()
+//==============================================================================
+template <typename T, int M, int K, int N>
+__attribute__((target("avx512f")))
+static void compact_gemm_avx512(const T *A, const T *B, T *C, std::size_t first, std::size_t last, int m, int k,
+                                int n)
+{
+    if constexpr (M > 0) {
+        compact_gemm_groups<T, 64>(A, B, C, first, last, M, K, N);
+    } else {
+        compact_gemm_groups<T, 64>(A, B, C, first, last, m, k, n);
+    }
+}
+#endif
+
+//==============================================================================
+// add_compact_gemm_kernels ()
+//==============================================================================
+// The fixed-shape kernels of one target, then its generic one: small squares
+// and the products of the chains in run_time_checks()
+template <typename T, template <typename, int, int, int> class Target>
+void add_compact_gemm_kernels(const char *name, std::vector<CompactGemmKernel<T>>& res)
+{
+    res.insert(res.end(), {{name, 2, 2, 2, Target<T, 2, 2, 2>::func},
+                           {name, 3, 3, 3, Target<T, 3, 3, 3>::func},
+                           {name, 4, 4, 4, Target<T, 4, 4, 4>::func},
+                           {name, 8, 8, 8, Target<T, 8, 8, 8>::func},
+                           {name, 16, 16, 16, Target<T, 16, 16, 16>::func},
+                           {name, 2, 5, 3, Target<T, 2, 5, 3>::func},
+                           {name, 5, 3, 10, Target<T, 5, 3, 10>::func},
+                           {name, 40, 20, 30, Target<T, 40, 20, 30>::func},
+                           {name, 20, 30, 10, Target<T, 20, 30, 10>::func},
+                           {name, 30, 10, 30, Target<T, 30, 10, 30>::func},
+                           {name, 0, 0, 0, Target<T, 0, 0, 0>::func}});
+}
+
+template <typename T, int M, int K, int N>
+struct CompactGemmGeneric {
+    static constexpr auto func = compact_gemm_generic<T, M, K, N>;
+};
+
+#if defined(__x86_64__)
+template <typename T, int M, int K, int N>
+struct CompactGemmAvx2 {
+    static constexpr auto func = compact_gemm_avx2<T, M, K, N>;
+};
+
+template <typename T, int M, int K, int N>
+struct CompactGemmAvx512 {
+    static constexpr auto func = compact_gemm_avx512<T, M, K, N>;
+};
+#endif
+#endif
+
+//==============================================================================
+// compact_gemm_scalar ()
+//==============================================================================
+template <typename T>
+static void compact_gemm_scalar(const T *A, const T *B, T *C, std::size_t first, std::size_t last, int m, int k,
+                                int n)
+{
+    constexpr std::size_t lanes = CompactBatch<T>::lanes;
+    for (std::size_t g = first; g < last; g++) {
+        const T *a = A + g * m * k * lanes;
+        const T *b = B + g * k * n * lanes;
+        T *c = C + g * m * n * lanes;
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) {
+                T acc[lanes] = {};
+                for (int p = 0; p < k; p++) {
+                    for (std::size_t l = 0; l < lanes; l++) {
+                        acc[l] += a[(i * k + p) * lanes + l] * b[(p * n + j) * lanes + l];
+                    }
+                }
+                std::copy(acc, acc + lanes, c + (i * n + j) * lanes);
+            }
+        }
+    }
+}
+
+//==============================================================================
+// get_compact_gemm_kernels ()
+//==============================================================================
+// All kernels this CPU can run, best target first, and within a target the
+// fixed shapes before the generic kernel; the scalar loop comes last
+template <typename T>
+const std::vector<CompactGemmKernel<T>>& get_compact_gemm_kernels()
+{
+    static const std::vector<CompactGemmKernel<T>> kernels = []() {
+        std::vector<CompactGemmKernel<T>> res;
+#if defined(__GNUC__)
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            add_compact_gemm_kernels<T, CompactGemmAvx512>("avx512", res);
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            add_compact_gemm_kernels<T, CompactGemmAvx2>("avx2", res);
+        }
+#endif
+        // SSE2 on x86-64, NEON on aarch64
+        add_compact_gemm_kernels<T, CompactGemmGeneric>("generic", res);
+#endif
+        res.push_back({"scalar", 0, 0, 0, compact_gemm_scalar<T>});
+        return res;
+    }();
+
+    return kernels;
+}
+
+//==============================================================================
+// get_compact_gemm_kernel ()
+//==============================================================================
+// Best kernel for m x k by k x n products
+template <typename T>
+const CompactGemmKernel<T>& get_compact_gemm_kernel(int m, int k, int n)
+{
+    for (const CompactGemmKernel<T>& kernel : get_compact_gemm_kernels<T>()) {
+        if (kernel.m == 0 || (kernel.m == m && kernel.k == k && kernel.n == n)) {
+            return kernel;
+        }
+    }
+
+    return get_compact_gemm_kernels<T>().back();
+}
+
+//==============================================================================
+// batched_mult ()
+//==============================================================================
+// res[p] = A[p] * B[p] for two batches of the same size, on the kernel
+// get_compact_gemm_kernel() picks for their shapes, into res of the shape
+// and size of the products: reusing res saves an allocation per batch. res
+// must not be A or B, the kernels write it while reading them. With a pool,
+// groups are split across it.
+template <typename T>
+void batched_mult(const CompactBatch<T>& A, const CompactBatch<T>& B, CompactBatch<T>& res,
+                  ThreadPool *pool = nullptr)
+{
+    // minimum number of multiply-adds per task
+    constexpr std::size_t min_task_work = 1 << 18;
+
+    if (A.get_ncol() != B.get_nrow()) {
+        throw std::logic_error("batched mult: dimensions do not match: " + diff_dims_error(A, B));
+    }
+    if (A.size() != B.size() || res.size() != A.size()) {
+        throw std::logic_error("batched mult: batch sizes do not match: " + std::to_string(A.size()) + ", " +
+                               std::to_string(B.size()) + ", " + std::to_string(res.size()));
+    }
+    if (res.get_nrow() != A.get_nrow() || res.get_ncol() != B.get_ncol()) {
+        throw std::logic_error("batched mult: result dimensions do not match: " + diff_dims_error(res, B));
+    }
+    if (&res == &A || &res == &B) {
+        throw std::logic_error("batched mult: result is an operand");
+    }
+
+    const int m = A.get_nrow();
+    const int k = A.get_ncol();
+    const int n = B.get_ncol();
+    const CompactGemmKernel<T>& kernel = get_compact_gemm_kernel<T>(m, k, n);
+    MATRIX_TRACE_SCOPE("batched_mult", m, k, n,
+                       checked_mul(std::int64_t(A.size()), calc_mult_flops<std::int64_t>(m, k, n)));
+    MATRIX_TRACE_KERNEL(kernel.name);
+    const auto mult_groups = [&](std::size_t first, std::size_t last) {
+        kernel.func(A.data(), B.data(), res.data(), first, last, m, k, n);
+    };
+
+    const std::size_t group_work = std::max<std::size_t>(std::size_t(m) * k * n * CompactBatch<T>::lanes, 1);
+    if (pool) {
+        parallel_for(*pool, 0, res.get_num_groups(), min_task_work / group_work, mult_groups);
+    } else {
+        mult_groups(0, res.get_num_groups());
+    }
+
+    const typename CompactBatch<T>::flops_type flops = calc_mult_flops<typename CompactBatch<T>::flops_type>(m, k, n);
+    for (std::size_t p = 0; p < res.size(); p++) {
+        res.m_flops[p] = checked_add(checked_add(A.m_flops[p], B.m_flops[p]), flops);
+    }
+}
+
+//==============================================================================
+// batched_mult ()
+//==============================================================================
+template <typename T>
+CompactBatch<T> batched_mult(const CompactBatch<T>& A, const CompactBatch<T>& B, ThreadPool *pool = nullptr)
+{
+    MATRIX_TRACE_SCOPE("batched_mult", A.get_nrow(), A.get_ncol(), B.get_ncol(),
+                       checked_mul(std::int64_t(A.size()),
+                                   calc_mult_flops<std::int64_t>(A.get_nrow(), A.get_ncol(), B.get_ncol())));
+    CompactBatch<T> res(A.get_nrow(), B.get_ncol(), A.size());
+    MATRIX_TRACE_BYTES(std::int64_t(sizeof(T)) * res.get_num_groups() * CompactBatch<T>::lanes * res.get_nrow() *
+                       res.get_ncol());
+    batched_mult(A, B, res, pool);
+
+    return res;
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+template <typename T>
+CompactBatch<T> CompactBatch<T>::operator*(const CompactBatch& other) const
+{
+    return batched_mult(*this, other);
+}
+
+//==============================================================================
+// SparseShape
+//==============================================================================
+// Shape and number of non-zeros of a sparse operand, all the sparse cost
+// estimates look at. nnz is a double: estimates are fractional.
+struct SparseShape {
+    int nrow = 0;
+    int ncol = 0;
+    double nnz = 0;
+
+    double get_density() const;
+};
+
+//==============================================================================
+// get_density ()
+//==============================================================================
+double SparseShape::get_density() const
+{
+    const double size = double(nrow) * ncol;
+    return (size == 0 ? 0 : nnz / size);
+}
+
+//==============================================================================
+// estimate_mult_shape ()
+//==============================================================================
+// Expected shape of A * B if the non-zeros of both are spread uniformly and
+// independently: an entry of the product stays zero with probability
+// (1 - density(A) * density(B)) ^ k
+SparseShape estimate_mult_shape(const SparseShape& A, const SparseShape& B)
+{
+    const double p = std::min(1.0, A.get_density() * B.get_density());
+    const double density = (p == 1 ? 1 : -std::expm1(A.ncol * std::log1p(-p)));
+
+    return {A.nrow, B.ncol, density * A.nrow * B.ncol};
+}
+
+//==============================================================================
+// calc_sparse_mult_flops ()
+//==============================================================================
+// Flops of A * B when column k of A has left_nnz[k] non-zeros and row k of B
+// right_nnz[k]: every non-zero a_ik scales row k of B into row i of the
+// product, 2 * right_nnz[k] - 1 flops, which is how calc_mult_flops() counts
+// a dense product
+std::int64_t calc_sparse_mult_flops(const std::vector<std::int64_t>& left_nnz,
+                                    const std::vector<std::int64_t>& right_nnz)
+{
+    std::int64_t flops = 0;
+    for (std::size_t k = 0; k < left_nnz.size(); k++) {
+        if (right_nnz[k] != 0) {
+            flops = checked_add(flops, checked_mul(left_nnz[k], 2 * right_nnz[k] - 1));
+        }
+    }
+
+    return flops;
+}
+
+//==============================================================================
+// estimate_sparse_mult_flops ()
+//==============================================================================
+// Expected calc_sparse_mult_flops() of A * B under the same model: a row of
+// B holds nnz(B) / k non-zeros on average and is empty with probability
+// (1 - density(B)) ^ n. Dense operands cost exactly calc_mult_flops().
+double estimate_sparse_mult_flops(const SparseShape& A, const SparseShape& B)
+{
+    if (A.ncol == 0) {
+        return 0;
+    }
+
+    const double density = std::min(1.0, B.get_density());
+    const double nonempty = (density == 1 ? 1 : -std::expm1(B.ncol * std::log1p(-density)));
+    return std::max(0.0, A.nnz * (2 * B.nnz / A.ncol - nonempty));
+}
+
+//==============================================================================
+// SparseMatrix
+//==============================================================================
+// Compressed sparse rows (csr) or columns (csc): for csr, the column indices
+// and values of row i are at [outer[i], outer[i + 1]), sorted by column; csc
+// stores the transpose the same way. Products with another SparseMatrix run
+// Gustavson's row by row SpGEMM with a dense accumulator, products with a
+// DenseMatrix an SpMM over the compressed side (csr on the left, csc on the
+// right; the other format is converted first). Flops are counted from the
+// non-zeros, see calc_sparse_mult_flops(). Zeros produced by cancellation
+// are kept as structural non-zeros.
+template <typename T, SparseFormat Format = SparseFormat::csr>
+class SparseMatrix {
+public:
+    using flops_type = std::int64_t;
+
+    SparseMatrix(int nrow, int ncol);
+    explicit SparseMatrix(const DenseMatrix<T>& dense);
+
+    static SparseMatrix from_triplets(int nrow, int ncol, std::vector<std::tuple<int, int, T>> triplets);
+
+    int get_nrow() const;
+    int get_ncol() const;
+    std::int64_t get_nnz() const;
+    flops_type get_flops() const;
+    SparseShape get_shape() const;
+    T get(int i, int j) const;
+
+    DenseMatrix<T> to_dense() const;
+    template <SparseFormat To>
+    SparseMatrix<T, To> to_format() const;
+
+    template <SparseFormat Other>
+    SparseMatrix operator*(const SparseMatrix<T, Other>& other) const;
+    DenseMatrix<T> operator*(const DenseMatrix<T>& dense) const;
+    bool operator==(const SparseMatrix& other) const;
+
+    template <typename U, SparseFormat F>
+    friend DenseMatrix<U> operator*(const DenseMatrix<U>& dense, const SparseMatrix<U, F>& sparse);
+
+    template <typename U, SparseFormat F>
+    friend class SparseMatrix;
+
+private:
+    int get_outer_size() const;
+    int get_inner_size() const;
+    std::vector<std::int64_t> count_nnz(bool rows) const;
+    SparseMatrix transpose_storage(int nrow, int ncol) const;
+    DenseMatrix<T> premultiply(const DenseMatrix<T>& dense) const;
+    static SparseMatrix mult_storage(const SparseMatrix& left, const SparseMatrix& right, int nrow, int ncol);
+
+    int m_nrow;
+    int m_ncol;
+    flops_type m_flops;
+    std::vector<std::int64_t> m_outer;  // get_outer_size() + 1 offsets
+    std::vector<int> m_inner;
+    std::vector<T> m_values;
+};
+
+template <typename T>
+using CsrMatrix = SparseMatrix<T, SparseFormat::csr>;
+
+template <typename T>
+using CscMatrix = SparseMatrix<T, SparseFormat::csc>;
+
+//==============================================================================
+// SparseMatrix ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+SparseMatrix<T, Format>::SparseMatrix(int nrow, int ncol)
+    : m_nrow(nrow),
+      m_ncol(ncol),
+      m_flops(0),
+      m_outer((Format == SparseFormat::csr ? nrow : ncol) + std::size_t(1), 0)
+{
+}
+
+//==============================================================================
+// SparseMatrix ()
+//==============================================================================
+// The non-zeros of dense, its flops carried over
+template <typename T, SparseFormat Format>
+SparseMatrix<T, Format>::SparseMatrix(const DenseMatrix<T>& dense)
+    : SparseMatrix(dense.get_nrow(), dense.get_ncol())
+{
+    for (int o = 0; o < get_outer_size(); o++) {
+        for (int i = 0; i < get_inner_size(); i++) {
+            const T value = (Format == SparseFormat::csr ? dense(o, i) : dense(i, o));
+            if (value != T(0)) {
+                m_inner.push_back(i);
+                m_values.push_back(value);
+            }
+        }
+        m_outer[o + 1] = m_inner.size();
+    }
+    m_flops = dense.get_flops();
+}
+
+//==============================================================================
+// from_triplets ()
+//==============================================================================
+// Matrix of the (row, col, value) entries, in any order, duplicates summed
+template <typename T, SparseFormat Format>
+SparseMatrix<T, Format> SparseMatrix<T, Format>::from_triplets(int nrow, int ncol,
+                                                               std::vector<std::tuple<int, int, T>> triplets)
+{
+    SparseMatrix res(nrow, ncol);
+    for (auto& [i, j, value] : triplets) {
+        if (i < 0 || i >= nrow || j < 0 || j >= ncol) {
+            throw std::logic_error("sparse: entry out of range");
+        }
+        if (Format == SparseFormat::csc) {
+            std::swap(i, j);
+        }
+    }
+    std::sort(triplets.begin(), triplets.end(), [](const auto& a, const auto& b) {
+        return std::make_pair(std::get<0>(a), std::get<1>(a)) < std::make_pair(std::get<0>(b), std::get<1>(b));
+    });
+
+    int prev_o = -1;
+    int prev_i = -1;
+    for (const auto& [o, i, value] : triplets) {
+        if (o == prev_o && i == prev_i) {
+            res.m_values.back() += value;
+            continue;
+        }
+        res.m_inner.push_back(i);
+        res.m_values.push_back(value);
+        res.m_outer[o + 1]++;
+        prev_o = o;
+        prev_i = i;
+    }
+    for (std::size_t o = 1; o < res.m_outer.size(); o++) {
+        res.m_outer[o] += res.m_outer[o - 1];
+    }
+
+    return res;
+}
+
+//==============================================================================
+// get_nrow ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+int SparseMatrix<T, Format>::get_nrow() const
+{
+    return m_nrow;
+}
+
+//==============================================================================
+// get_ncol ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+int SparseMatrix<T, Format>::get_ncol() const
+{
+    return m_ncol;
+}
+
+//==============================================================================
+// get_nnz ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+std::int64_t SparseMatrix<T, Format>::get_nnz() const
+{
+    return m_inner.size();
+}
+
+//==============================================================================
+// get_flops ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+typename SparseMatrix<T, Format>::flops_type SparseMatrix<T, Format>::get_flops() const
+{
+    return m_flops;
+}
+
+//==============================================================================
+// get_shape ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+SparseShape SparseMatrix<T, Format>::get_shape() const
+{
+    return {m_nrow, m_ncol, double(get_nnz())};
+}
+
+//==============================================================================
+// get ()
+//==============================================================================
+// Entry (i, j), by binary search in its row (or column)
+template <typename T, SparseFormat Format>
+T SparseMatrix<T, Format>::get(int i, int j) const
+{
+    const int o = (Format == SparseFormat::csr ? i : j);
+    const int inner = (Format == SparseFormat::csr ? j : i);
+    const auto first = m_inner.begin() + m_outer[o];
+    const auto last = m_inner.begin() + m_outer[o + 1];
+    const auto it = std::lower_bound(first, last, inner);
+
+    return (it != last && *it == inner ? m_values[it - m_inner.begin()] : T(0));
+}
+
+//==============================================================================
+// get_outer_size ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+int SparseMatrix<T, Format>::get_outer_size() const
+{
+    return (Format == SparseFormat::csr ? m_nrow : m_ncol);
+}
+
+//==============================================================================
+// get_inner_size ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+int SparseMatrix<T, Format>::get_inner_size() const
+{
+    return (Format == SparseFormat::csr ? m_ncol : m_nrow);
+}
+
+//==============================================================================
+// count_nnz ()
+//==============================================================================
+// Non-zeros of each row, or of each column
+template <typename T, SparseFormat Format>
+std::vector<std::int64_t> SparseMatrix<T, Format>::count_nnz(bool rows) const
+{
+    if (rows == (Format == SparseFormat::csr)) {
+        std::vector<std::int64_t> res(get_outer_size());
+        for (int o = 0; o < get_outer_size(); o++) {
+            res[o] = m_outer[o + 1] - m_outer[o];
+        }
+        return res;
+    }
+
+    std::vector<std::int64_t> res(get_inner_size(), 0);
+    for (int inner : m_inner) {
+        res[inner]++;
+    }
+    return res;
+}
+
+//==============================================================================
+// to_dense ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+DenseMatrix<T> SparseMatrix<T, Format>::to_dense() const
+{
+    DenseMatrix<T> res(m_nrow, m_ncol);
+    for (int o = 0; o < get_outer_size(); o++) {
+        for (std::int64_t p = m_outer[o]; p < m_outer[o + 1]; p++) {
+            (Format == SparseFormat::csr ? res(o, m_inner[p]) : res(m_inner[p], o)) = m_values[p];
+        }
+    }
+    res.m_flops = m_flops;
+
+    return res;
+}
+
+//==============================================================================
+// transpose_storage ()
+//==============================================================================
+// The compressed arrays of the transpose (a counting sort by inner index),
+// which is the same matrix in the other format, as a nrow x ncol matrix of
+// this format
+template <typename T, SparseFormat Format>
+SparseMatrix<T, Format> SparseMatrix<T, Format>::transpose_storage(int nrow, int ncol) const
+{
+    SparseMatrix res(nrow, ncol);
+    res.m_outer.assign(get_inner_size() + std::size_t(1), 0);
+    res.m_inner.resize(m_inner.size());
+    res.m_values.resize(m_values.size());
+    for (int inner : m_inner) {
+        res.m_outer[inner + 1]++;
+    }
+    for (std::size_t i = 1; i < res.m_outer.size(); i++) {
+        res.m_outer[i] += res.m_outer[i - 1];
+    }
+
+    std::vector<std::int64_t> next(res.m_outer.begin(), res.m_outer.end() - 1);
+    for (int o = 0; o < get_outer_size(); o++) {
+        for (std::int64_t p = m_outer[o]; p < m_outer[o + 1]; p++) {
+            const std::int64_t q = next[m_inner[p]]++;
+            res.m_inner[q] = o;
+            res.m_values[q] = m_values[p];
+        }
+    }
+    res.m_flops = m_flops;
+
+    return res;
+}
+
+//==============================================================================
+// to_format ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+template <SparseFormat To>
+SparseMatrix<T, To> SparseMatrix<T, Format>::to_format() const
+{
+    if constexpr (To == Format) {
+        return *this;
+    } else {
+        // A in the other format has the arrays of the transpose of A in this one
+        SparseMatrix transposed = transpose_storage(m_ncol, m_nrow);
+        SparseMatrix<T, To> res(m_nrow, m_ncol);
+        res.m_outer = std::move(transposed.m_outer);
+        res.m_inner = std::move(transposed.m_inner);
+        res.m_values = std::move(transposed.m_values);
+        res.m_flops = m_flops;
+
+        return res;
+    }
+}
+
+//==============================================================================
+// mult_storage ()
+//==============================================================================
+// Gustavson's SpGEMM on the compressed arrays, read as csr: outer i of the
+// result gathers the outers of right selected by the inner indices of outer
+// i of left, in a dense accumulator over the inner dimension. The result is
+// a nrow x ncol matrix of this format, flops left to the caller.
+template <typename T, SparseFormat Format>
+SparseMatrix<T, Format> SparseMatrix<T, Format>::mult_storage(const SparseMatrix& left, const SparseMatrix& right,
+                                                              int nrow, int ncol)
+{
+    SparseMatrix res(nrow, ncol);
+    const int inner_size = res.get_inner_size();
+    std::vector<T> acc(inner_size);
+    std::vector<int> mark(inner_size, -1);
+    std::vector<int> inners;
+
+    for (int o = 0; o < res.get_outer_size(); o++) {
+        inners.clear();
+        for (std::int64_t p = left.m_outer[o]; p < left.m_outer[o + 1]; p++) {
+            const int k = left.m_inner[p];
+            const T value = left.m_values[p];
+            for (std::int64_t q = right.m_outer[k]; q < right.m_outer[k + 1]; q++) {
+                const int i = right.m_inner[q];
+                if (mark[i] != o) {
+                    mark[i] = o;
+                    acc[i] = T(0);
+                    inners.push_back(i);
+                }
+                acc[i] += value * right.m_values[q];
+            }
+        }
+
+        std::sort(inners.begin(), inners.end());
+        for (int i : inners) {
+            res.m_inner.push_back(i);
+            res.m_values.push_back(acc[i]);
+        }
+        res.m_outer[o + 1] = res.m_inner.size();
+    }
+
+    return res;
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+// SpGEMM, other converted to this format if need be
+template <typename T, SparseFormat Format>
+template <SparseFormat Other>
+SparseMatrix<T, Format> SparseMatrix<T, Format>::operator*(const SparseMatrix<T, Other>& other) const
+{
+    if (m_ncol != other.get_nrow()) {
+        throw std::logic_error(("mult: dimensions do not match: " + diff_dims_error(*this, other)).c_str());
+    }
+
+    if constexpr (Other != Format) {
+        return *this * other.template to_format<Format>();
+    } else {
+        MATRIX_TRACE_SCOPE("spgemm", m_nrow, m_ncol, other.m_ncol,
+                           calc_sparse_mult_flops(count_nnz(false), other.count_nnz(true)));
+        MATRIX_TRACE_KERNEL(Format == SparseFormat::csr ? "csr_spgemm" : "csc_spgemm");
+        // (A * B)^T = B^T * A^T, the csr arrays of B^T and A^T being those of B and A in csc
+        SparseMatrix res = (Format == SparseFormat::csr ? mult_storage(*this, other, m_nrow, other.m_ncol)
+                                                        : mult_storage(other, *this, m_nrow, other.m_ncol));
+        MATRIX_TRACE_BYTES(std::int64_t(sizeof(std::int64_t) * res.m_outer.size() + sizeof(int) * res.m_inner.size() +
+                                        sizeof(T) * res.m_values.size()));
+        res.m_flops = checked_add(checked_add(m_flops, other.m_flops),
+                                  calc_sparse_mult_flops(count_nnz(false), other.count_nnz(true)));
+
+        return res;
+    }
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+// SpMM: row i of the product is the sum over the non-zeros a_ik of row i of
+// a_ik times row k of dense, contiguous in both
+template <typename T, SparseFormat Format>
+DenseMatrix<T> SparseMatrix<T, Format>::operator*(const DenseMatrix<T>& dense) const
+{
+    if (m_ncol != dense.get_nrow()) {
+        throw std::logic_error(("mult: dimensions do not match: " + diff_dims_error(*this, dense)).c_str());
+    }
+    if constexpr (Format == SparseFormat::csc) {
+        return to_format<SparseFormat::csr>() * dense;
+    } else {
+        const int n = dense.get_ncol();
+        MATRIX_TRACE_SCOPE("spmm", m_nrow, m_ncol, n,
+                           calc_sparse_mult_flops(count_nnz(false), std::vector<std::int64_t>(m_ncol, n)));
+        MATRIX_TRACE_KERNEL("csr_spmm");
+        MATRIX_TRACE_BYTES(std::int64_t(sizeof(T)) * m_nrow * n);
+        DenseMatrix<T> res(m_nrow, n);
+        for (int i = 0; i < m_nrow; i++) {
+            T* out = res.data() + std::size_t(i) * n;
+            for (std::int64_t p = m_outer[i]; p < m_outer[i + 1]; p++) {
+                const T value = m_values[p];
+                const T* row = dense.data() + std::size_t(m_inner[p]) * n;
+                for (int j = 0; j < n; j++) {
+                    out[j] += value * row[j];
+                }
+            }
+        }
+        const std::vector<std::int64_t> dense_nnz(m_ncol, n);
+        res.m_flops = checked_add(checked_add(m_flops, dense.get_flops()),
+                                  calc_sparse_mult_flops(count_nnz(false), dense_nnz));
+
+        return res;
+    }
+}
+
+//==============================================================================
+// premultiply ()
+//==============================================================================
+// SpMM with the sparse side on the right: entry (i, j) of dense * this is the
+// dot product of row i of dense with the non-zeros of column j
+template <typename T, SparseFormat Format>
+DenseMatrix<T> SparseMatrix<T, Format>::premultiply(const DenseMatrix<T>& dense) const
+{
+    if (dense.get_ncol() != m_nrow) {
+        throw std::logic_error(("mult: dimensions do not match: " + diff_dims_error(dense, *this)).c_str());
+    }
+    if constexpr (Format == SparseFormat::csr) {
+        return to_format<SparseFormat::csc>().premultiply(dense);
+    } else {
+        const int m = dense.get_nrow();
+        const int k = dense.get_ncol();
+        MATRIX_TRACE_SCOPE("spmm", m, k, m_ncol,
+                           calc_sparse_mult_flops(std::vector<std::int64_t>(k, m), count_nnz(true)));
+        MATRIX_TRACE_KERNEL("csc_premultiply");
+        MATRIX_TRACE_BYTES(std::int64_t(sizeof(T)) * m * m_ncol);
+        DenseMatrix<T> res(m, m_ncol);
+        for (int i = 0; i < m; i++) {
+            const T* row = dense.data() + std::size_t(i) * k;
+            T* out = res.data() + std::size_t(i) * m_ncol;
+            for (int j = 0; j < m_ncol; j++) {
+                T sum = T(0);
+                for (std::int64_t p = m_outer[j]; p < m_outer[j + 1]; p++) {
+                    sum += row[m_inner[p]] * m_values[p];
+                }
+                out[j] = sum;
+            }
+        }
+
+        const std::vector<std::int64_t> dense_nnz(k, m);
+        res.m_flops = checked_add(checked_add(m_flops, dense.get_flops()),
+                                  calc_sparse_mult_flops(dense_nnz, count_nnz(true)));
+
+        return res;
+    }
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+DenseMatrix<T> operator*(const DenseMatrix<T>& dense, const SparseMatrix<T, Format>& sparse)
+{
+    return sparse.premultiply(dense);
+}
+
+//==============================================================================
+// operator== ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+bool SparseMatrix<T, Format>::operator==(const SparseMatrix& other) const
+{
+    return (m_nrow == other.m_nrow &&
+            m_ncol == other.m_ncol &&
+            m_flops == other.m_flops &&
+            m_outer == other.m_outer &&
+            m_inner == other.m_inner &&
+            m_values == other.m_values);
+}
+
+//==============================================================================
+// operator<< ()
+//==============================================================================
+template <typename T, SparseFormat Format>
+std::ostream& operator<<(std::ostream& os, const SparseMatrix<T, Format>& mat)
+{
+    os << "<dims: " << mat.get_nrow() << " x " << mat.get_ncol() << ", nnz: " << mat.get_nnz()
+       << ", flops: " << mat.get_flops() << ">";
+
+    return os;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+//==============================================================================
+// MatrixFileHeader
+//==============================================================================
+// First page of a matrix file. The elements follow in tiles of tile_rows x
+// tile_cols, tiles in row-major order and row-major inside, edge tiles zero
+// padded. Every tile starts on a page boundary, tile_bytes apart, so a tile
+// maps, reads ahead and drops from memory on its own.
+struct MatrixFileHeader {
+    static constexpr char MAGIC[8] = {'M', 'A', 'T', 'R', 'I', 'X', 'F', '1'};
+    static constexpr std::uint32_t VERSION = 1;
+    static constexpr std::uint32_t TILED_ROW_MAJOR = 1;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t dtype;      // matrix_file_dtype<T>
+    std::uint32_t elem_size;
+    std::uint32_t layout;     // TILED_ROW_MAJOR
+    std::int32_t nrow;
+    std::int32_t ncol;
+    std::int32_t tile_rows;
+    std::int32_t tile_cols;
+    std::int64_t flops;       // of the computation that produced the matrix
+    std::int64_t tile_bytes;  // tile size rounded up to pages
+    std::int64_t data_offset;
+};
+
+template <typename T>
+struct matrix_file_dtype;
+
+template <>
+struct matrix_file_dtype<float> : std::integral_constant<std::uint32_t, 1> {};
+
+template <>
+struct matrix_file_dtype<double> : std::integral_constant<std::uint32_t, 2> {};
+
+//==============================================================================
+// MappedMatrix
+//==============================================================================
+// Matrix stored in a matrix file (see MatrixFileHeader) and mapped with
+// mmap(): the elements are never copied, the kernel pages tiles in on access
+// and out under memory pressure. prefetch() starts reading a tile ahead,
+// release() drops it from the process once done with it. Move-only, the
+// mapping lives as long as the object.
+template <typename T>
+class MappedMatrix {
+public:
+    using flops_type = std::int64_t;
+
+    static MappedMatrix create(const std::string& path, int nrow, int ncol, int tile_rows = 256, int tile_cols = 256);
+    static MappedMatrix open(const std::string& path, bool writable = false);
+    static MappedMatrix from_dense(const std::string& path, const DenseMatrix<T>& dense, int tile_rows = 256,
+                                   int tile_cols = 256);
+
+    MappedMatrix(MappedMatrix&& other) noexcept;
+    MappedMatrix& operator=(MappedMatrix&& other) noexcept;
+    ~MappedMatrix();
+
+    int get_nrow() const;
+    int get_ncol() const;
+    flops_type get_flops() const;
+    void set_flops(flops_type flops);
+    int get_tile_rows() const;
+    int get_tile_cols() const;
+    int get_num_tile_rows() const;
+    int get_num_tile_cols() const;
+
+    const T* tile(int ti, int tj) const;
+    T* tile(int ti, int tj);
+    T get(int i, int j) const;
+    DenseMatrix<T> to_dense() const;
+
+    void prefetch(int ti, int tj) const;
+    void release(int ti, int tj) const;
+    void sync() const;
+
+private:
+    MappedMatrix(int fd, void *base, std::size_t size, bool writable);
+
+    void unmap();
+    const MatrixFileHeader& header() const;
+    std::size_t tile_offset(int ti, int tj) const;
+    void advise(int ti, int tj, int advice) const;
+
+    int m_fd;
+    void *m_base;
+    std::size_t m_size;
+    bool m_writable;
+};
+
+//==============================================================================
+// MappedMatrix ()
+//==============================================================================
+template <typename T>
+MappedMatrix<T>::MappedMatrix(int fd, void *base, std::size_t size, bool writable)
+    : m_fd(fd),
+      m_base(base),
+      m_size(size),
+      m_writable(writable)
+{
+}
+
+//==============================================================================
+// MappedMatrix ()
+//==============================================================================
+template <typename T>
+MappedMatrix<T>::MappedMatrix(MappedMatrix&& other) noexcept
+    : m_fd(std::exchange(other.m_fd, -1)),
+      m_base(std::exchange(other.m_base, nullptr)),
+      m_size(std::exchange(other.m_size, 0)),
+      m_writable(other.m_writable)
+{
+}
+
+//==============================================================================
+// operator= ()
+//==============================================================================
+template <typename T>
+MappedMatrix<T>& MappedMatrix<T>::operator=(MappedMatrix&& other) noexcept
+{
+    if (this != &other) {
+        unmap();
+        m_fd = std::exchange(other.m_fd, -1);
+        m_base = std::exchange(other.m_base, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+        m_writable = other.m_writable;
+    }
+
+    return *this;
+}
+
+//==============================================================================
+// ~MappedMatrix ()
+//==============================================================================
+template <typename T>
+MappedMatrix<T>::~MappedMatrix()
+{
+    unmap();
+}
+
+//==============================================================================
+// unmap ()
+//==============================================================================
+// Drops the mapping and closes the file, leaving the object empty
+template <typename T>
+void MappedMatrix<T>::unmap()
+{
+    if (m_base != nullptr) {
+        munmap(std::exchange(m_base, nullptr), std::exchange(m_size, 0));
+    }
+    if (m_fd != -1) {
+        close(std::exchange(m_fd, -1));
+    }
+}
+
+//==============================================================================
+// create ()
+//==============================================================================
+// New zero matrix file at path, opened writable
+template <typename T>
+MappedMatrix<T> MappedMatrix<T>::create(const std::string& path, int nrow, int ncol, int tile_rows, int tile_cols)
+{
+    if (nrow < 0 || ncol < 0 || tile_rows < 1 || tile_cols < 1) {
+        throw std::logic_error("matrix file: bad dims");
+    }
+
+    const std::int64_t page = sysconf(_SC_PAGESIZE);
+    const auto round_up = [page](std::int64_t bytes) { return (bytes + page - 1) / page * page; };
+
+    MatrixFileHeader header = {};
+    std::copy(std::begin(MatrixFileHeader::MAGIC), std::end(MatrixFileHeader::MAGIC), header.magic);
+    header.version = MatrixFileHeader::VERSION;
+    header.dtype = matrix_file_dtype<T>::value;
+    header.elem_size = sizeof(T);
+    header.layout = MatrixFileHeader::TILED_ROW_MAJOR;
+    header.nrow = nrow;
+    header.ncol = ncol;
+    header.tile_rows = tile_rows;
+    header.tile_cols = tile_cols;
+    header.flops = 0;
+    header.tile_bytes = round_up(std::int64_t(tile_rows) * tile_cols * sizeof(T));
+    header.data_offset = round_up(sizeof(MatrixFileHeader));
+
+    const std::int64_t ntiles = std::int64_t((nrow + tile_rows - 1) / tile_rows) * ((ncol + tile_cols - 1) / tile_cols);
+    const std::int64_t size = header.data_offset + ntiles * header.tile_bytes;
+
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        throw std::runtime_error("matrix file: cannot create " + path);
+    }
+    if (ftruncate(fd, size) != 0 || pwrite(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header))) {
+        close(fd);
+        throw std::runtime_error("matrix file: cannot write " + path);
+    }
+    close(fd);
+
+    return open(path, true);
+}
+
+//==============================================================================
+// open ()
+//==============================================================================
+// Maps the matrix file at path, after checking its header against T and the
+// file size: every tile must lie in the file, with all the arithmetic that
+// locates tiles checked for overflow
+template <typename T>
+MappedMatrix<T> MappedMatrix<T>::open(const std::string& path, bool writable)
+{
+    const int fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("matrix file: cannot open " + path);
+    }
+
+    struct stat st = {};
+    MatrixFileHeader header = {};
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header))) {
+        close(fd);
+        throw std::runtime_error("matrix file: cannot read " + path);
+    }
+    using traits = flops_traits<std::int64_t>;
+    constexpr std::int64_t max_dim = std::numeric_limits<int>::max();
+    // the tile counts are computed in int by get_num_tile_rows() and get_num_tile_cols()
+    const bool dims_ok = header.nrow >= 0 && header.ncol >= 0 && header.tile_rows >= 1 && header.tile_cols >= 1 &&
+                         std::int64_t(header.nrow) + header.tile_rows - 1 <= max_dim &&
+                         std::int64_t(header.ncol) + header.tile_cols - 1 <= max_dim;
+    const std::int64_t ntiles = (!dims_ok ? 0 :
+        std::int64_t((header.nrow + header.tile_rows - 1) / header.tile_rows) *
+        ((header.ncol + header.tile_cols - 1) / header.tile_cols));
+    std::int64_t elem_bytes = 0;
+    std::int64_t data_bytes = 0;
+    std::int64_t end = 0;
+    const bool layout_ok = dims_ok &&
+        traits::mul(std::int64_t(header.tile_rows) * header.tile_cols, std::int64_t(sizeof(T)), elem_bytes) &&
+        header.tile_bytes >= elem_bytes && header.tile_bytes % std::int64_t(alignof(T)) == 0 &&
+        header.data_offset >= std::int64_t(sizeof(MatrixFileHeader)) &&
+        header.data_offset % std::int64_t(alignof(T)) == 0 &&
+        traits::mul(ntiles, header.tile_bytes, data_bytes) && traits::add(header.data_offset, data_bytes, end) &&
+        end <= st.st_size;
+    if (!std::equal(std::begin(MatrixFileHeader::MAGIC), std::end(MatrixFileHeader::MAGIC), header.magic) ||
+        header.version != MatrixFileHeader::VERSION || header.layout != MatrixFileHeader::TILED_ROW_MAJOR ||
+        !layout_ok) {
+        close(fd);
+        throw std::runtime_error("matrix file: bad header in " + path);
+    }
+    if (header.dtype != matrix_file_dtype<T>::value || header.elem_size != sizeof(T)) {
+        close(fd);
+        throw std::runtime_error("matrix file: wrong element type in " + path);
+    }
+
+    void *base = mmap(nullptr, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("matrix file: cannot map " + path);
+    }
+
+    return MappedMatrix(fd, base, st.st_size, writable);
+}
+
+//==============================================================================
+// from_dense ()
+//==============================================================================
+template <typename T>
+MappedMatrix<T> MappedMatrix<T>::from_dense(const std::string& path, const DenseMatrix<T>& dense, int tile_rows,
+                                            int tile_cols)
+{
+    MappedMatrix res = create(path, dense.get_nrow(), dense.get_ncol(), tile_rows, tile_cols);
+    for (int i = 0; i < dense.get_nrow(); i++) {
+        for (int j = 0; j < dense.get_ncol(); j++) {
+            res.tile(i / tile_rows, j / tile_cols)[(i % tile_rows) * tile_cols + j % tile_cols] = dense(i, j);
+        }
+    }
+    res.set_flops(dense.get_flops());
+
+    return res;
+}
+
+//==============================================================================
+// header ()
+//==============================================================================
+template <typename T>
+const MatrixFileHeader& MappedMatrix<T>::header() const
+{
+    return *static_cast<const MatrixFileHeader *>(m_base);
+}
+
+//==============================================================================
+// get_nrow ()
+//==============================================================================
+template <typename T>
+int MappedMatrix<T>::get_nrow() const
+{
+    return header().nrow;
+}
+
+//==============================================================================
+// get_ncol ()
+//==============================================================================
+template <typename T>
+int MappedMatrix<T>::get_ncol() const
+{
+    return header().ncol;
+}
+
+//==============================================================================
+// get_flops ()
+//==============================================================================
+template <typename T>
+typename MappedMatrix<T>::flops_type MappedMatrix<T>::get_flops() const
+{
+    return header().flops;
+}
+
+//==============================================================================
+// set_flops ()
+//==============================================================================
+template <typename T>
+void MappedMatrix<T>::set_flops(flops_type flops)
+{
+    if (!m_writable) {
+        throw std::logic_error("matrix file: not opened writable");
+    }
+
+    static_cast<MatrixFileHeader *>(m_base)->flops = flops;
+}
+
+//==============================================================================
+// get_tile_rows ()
+//==============================================================================
+template <typename T>
+int MappedMatrix<T>::get_tile_rows() const
+{
+    return header().tile_rows;
+}
+
+//==============================================================================
+// get_tile_cols ()
+//==============================================================================
+template <typename T>
+int MappedMatrix<T>::get_tile_cols() const
+{
+    return header().tile_cols;
+}
+
+//==============================================================================
+// get_num_tile_rows ()
+//==============================================================================
+template <typename T>
+int MappedMatrix<T>::get_num_tile_rows() const
+{
+    return (get_nrow() + get_tile_rows() - 1) / get_tile_rows();
+}
+
+//==============================================================================
+// get_num_tile_cols ()
+//==============================================================================
+template <typename T>
+int MappedMatrix<T>::get_num_tile_cols() const
+{
+    return (get_ncol() + get_tile_cols() - 1) / get_tile_cols();
+}
+
+//==============================================================================
+// tile_offset ()
+//==============================================================================
+template <typename T>
+std::size_t MappedMatrix<T>::tile_offset(int ti, int tj) const
+{
+    const std::size_t index = std::size_t(ti) * get_num_tile_cols() + tj;
+    return header().data_offset + index * header().tile_bytes;
+}
+
+//==============================================================================
+// tile ()
+//==============================================================================
+// Tile (ti, tj), tile_rows x tile_cols row-major
+template <typename T>
+const T* MappedMatrix<T>::tile(int ti, int tj) const
+{
+    return reinterpret_cast<const T *>(static_cast<const char *>(m_base) + tile_offset(ti, tj));
+}
+
+//==============================================================================
+// tile ()
+//==============================================================================
+template <typename T>
+T* MappedMatrix<T>::tile(int ti, int tj)
+{
+    if (!m_writable) {
+        throw std::logic_error("matrix file: not opened writable");
+    }
+
+    return reinterpret_cast<T *>(static_cast<char *>(m_base) + tile_offset(ti, tj));
+}
+
+//==============================================================================
+// get ()
+//==============================================================================
+template <typename T>
+T MappedMatrix<T>::get(int i, int j) const
+{
+    const int tile_rows = get_tile_rows();
+    const int tile_cols = get_tile_cols();
+
+    return tile(i / tile_rows, j / tile_cols)[(i % tile_rows) * tile_cols + j % tile_cols];
+}
+
+//==============================================================================
+// to_dense ()
+//==============================================================================
+template <typename T>
+DenseMatrix<T> MappedMatrix<T>::to_dense() const
+{
+    DenseMatrix<T> res(get_nrow(), get_ncol());
+    for (int i = 0; i < get_nrow(); i++) {
+        for (int j = 0; j < get_ncol(); j++) {
+            res(i, j) = get(i, j);
+        }
+    }
+    res.m_flops = get_flops();
+
+    return res;
+}
+
+//==============================================================================
+// advise ()
+//==============================================================================
+template <typename T>
+void MappedMatrix<T>::advise(int ti, int tj, int advice) const
+{
+    // advice only: a failure costs speed, never correctness
+    madvise(static_cast<char *>(m_base) + tile_offset(ti, tj), header().tile_bytes, advice);
+}
+
+//==============================================================================
+// prefetch ()
+//==============================================================================
+template <typename T>
+void MappedMatrix<T>::prefetch(int ti, int tj) const
+{
+    advise(ti, tj, MADV_WILLNEED);
+}
+
+//==============================================================================
+// release ()
+//==============================================================================
+// The file is the backing store of a shared mapping: dropped pages, written
+// ones included, are read back from it on the next access
+template <typename T>
+void MappedMatrix<T>::release(int ti, int tj) const
+{
+    advise(ti, tj, MADV_DONTNEED);
+}
+
+//==============================================================================
+// sync ()
+//==============================================================================
+// Writes the dirty pages back to the file
+template <typename T>
+void MappedMatrix<T>::sync() const
+{
+    if (m_writable && msync(m_base, m_size, MS_SYNC) != 0) {
+        throw std::runtime_error("matrix file: cannot sync");
+    }
+}
+
+//==============================================================================
+// out_of_core_mult ()
+//==============================================================================
+// A * B into a new matrix file at path, holding about memory_bytes of tiles
+// at once: A is streamed in panels of tile rows filling half the budget, and
+// for each panel B one tile column at a time. So A is read once, B once per
+// panel and the product written once, see OutOfCoreCostModel. The next tiles
+// are prefetched while gemm() works on the current ones, and tiles are
+// released as soon as the loops are done with them.
+template <typename T>
+MappedMatrix<T> out_of_core_mult(const MappedMatrix<T>& A, const MappedMatrix<T>& B, const std::string& path,
+                                 std::int64_t memory_bytes)
+{
+    if (A.get_ncol() != B.get_nrow()) {
+        throw std::logic_error(("mult: dimensions do not match: " + diff_dims_error(A, B)).c_str());
+    }
+    if (A.get_tile_cols() != B.get_tile_rows()) {
+        throw std::logic_error("mult: tiles do not match");
+    }
+
+    const int tile_m = A.get_tile_rows();
+    const int tile_k = A.get_tile_cols();
+    const int tile_n = B.get_tile_cols();
+    MappedMatrix<T> C = MappedMatrix<T>::create(path, A.get_nrow(), B.get_ncol(), tile_m, tile_n);
+
+    const int ntile_m = A.get_num_tile_rows();
+    const int ntile_k = A.get_num_tile_cols();
+    const int ntile_n = B.get_num_tile_cols();
+    const std::int64_t row_bytes = std::int64_t(ntile_k) * tile_m * tile_k * sizeof(T);
+    const int panel = int(std::clamp<std::int64_t>(memory_bytes / 2 / std::max<std::int64_t>(row_bytes, 1), 1,
+                                                   std::max(ntile_m, 1)));
+
+    for (int ti0 = 0; ti0 < ntile_m; ti0 += panel) {
+        const int ti1 = std::min(ntile_m, ti0 + panel);
+        for (int tj = 0; tj < ntile_n; tj++) {
+            const int nc = std::min(tile_n, B.get_ncol() - tj * tile_n);
+            for (int ti = ti0; ti < ti1; ti++) {
+                const int mc = std::min(tile_m, A.get_nrow() - ti * tile_m);
+                T* c = C.tile(ti, tj);
+                for (int tp = 0; tp < ntile_k; tp++) {
+                    if (tp + 1 < ntile_k) {
+                        A.prefetch(ti, tp + 1);
+                        B.prefetch(tp + 1, tj);
+                    } else if (ti + 1 < ti1) {
+                        A.prefetch(ti + 1, 0);
+                        B.prefetch(0, tj);
+                    }
+                    const int kc = std::min(tile_k, A.get_ncol() - tp * tile_k);
+                    gemm(mc, nc, kc, T(1), A.tile(ti, tp), tile_k, B.tile(tp, tj), tile_n,
+                         T(tp == 0 ? 0 : 1), c, tile_n);
+                }
+                C.release(ti, tj);
+            }
+            for (int tp = 0; tp < ntile_k; tp++) {
+                B.release(tp, tj);
+            }
+        }
+        for (int ti = ti0; ti < ti1; ti++) {
+            for (int tp = 0; tp < ntile_k; tp++) {
+                A.release(ti, tp);
+            }
+        }
+    }
+
+    C.set_flops(checked_add(checked_add(A.get_flops(), B.get_flops()),
+                            calc_mult_flops<std::int64_t>(A.get_nrow(), A.get_ncol(), B.get_ncol())));
+
+    return C;
+}
+#endif
+
+//==============================================================================
+// sum_using_initializer_list ()
+//==============================================================================
+constexpr Matrix sum_using_initializer_list(std::initializer_list<const Matrix> mats)
+{
+    // static_assert
+    if (mats.size() == 0) {
+        throw std::logic_error("no input mat");
+    }
+
+    Matrix res = *(mats.begin());
+    for (auto it = mats.begin() + 1; it != mats.end(); it++) {
+        res += *it;
+    }
+
+    return res;
+}
+
+//==============================================================================
+// product_using_initializer_list ()
+//==============================================================================
+constexpr Matrix product_using_initializer_list(std::initializer_list<const Matrix> mats)
+{
+    if (mats.size() == 0) {
+        throw std::logic_error("no input mat");
+    }
+
+    Matrix res = *(mats.begin());
+    for (auto it = mats.begin() + 1; it != mats.end(); it++) {
+        res *= *it;
+    }
+
+    return res;
+}
+
+//==============================================================================
+// sum_using_fold_expression ()
+//==============================================================================
+// DenseMatrix operands are summed by fused_sum(), in one pass
+template <typename... Args>
+static constexpr auto sum_using_fold_expression(Args&&... args)
+{
+    if constexpr ((is_dense_matrix_v<std::decay_t<Args>> && ...)) {
+        const auto inputs = std::array{static_cast<const std::decay_t<Args>*>(&args)...};
+        return fused_sum(inputs.data(), inputs.size());
+    } else {
+        return Matrix((... + args));  // ((arg1 + arg2) + arg3) + ...
+//        return Matrix((args + ...));  // arg1 + (arg2 + (arg3 + ...))
+    }
+}
+
+//==============================================================================
+// product_using_fold_expression ()
+//==============================================================================
+template <typename... Args>
+static constexpr Matrix product_using_fold_expression(Args&&... args)
+{
+    return (... * args);  // ((arg1 * arg2) * arg3) * ...
+//    return (args * ...);  // arg1 * (arg2 * (arg3 * ...))
+}
+
+//==============================================================================
+// MultOrderSolver
+//==============================================================================
+enum class MultOrderSolver {
+    dp,           // exact, O(n^3) time, O(n^2) space
+    dp_parallel,  // same as dp, each diagonal of the table split across ThreadPool::global()
+    hu_shing,     // near-optimal, O(n) time and space
+    greedy,       // greedy refined by windowed DP, calc_approx_mult_plan() with default options
+};
+
+//==============================================================================
+// ArgminSplitKernel
+//==============================================================================
+// Inner loop of the chain DP: over t in [0, count) returns the minimum of
+// cost_ik[t] + cost_kj[t] + dims_k[t] * scale and the first t attaining it.
+// Callers pass the arrays already offset to the first split point.
+struct ArgminSplitKernel {
+    using Func = std::pair<int, std::size_t> (*)(const int *cost_ik, const int *cost_kj, const int *dims_k,
+                                                 int scale, std::size_t count);
+
+    const char *name;
+    Func func;
+};
+
+//==============================================================================
+// argmin_split_scalar ()
+//==============================================================================
+static std::pair<int, std::size_t> argmin_split_scalar(const int *cost_ik, const int *cost_kj, const int *dims_k,
+                                                       int scale, std::size_t count)
+{
+    int best_cost = std::numeric_limits<int>::max();
+    std::size_t best_t = 0;
+    for (std::size_t t = 0; t < count; t++) {
+        const int cost = cost_ik[t] + cost_kj[t] + dims_k[t] * scale;
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_t = t;
+        }
+    }
+
+    return {best_cost, best_t};
+}
+
+//==============================================================================
+// argmin_split_reduce ()
+//==============================================================================
+// Combines per-lane minima (lane l having seen t = l, l + nlanes, ...) and the
+// scalar tail [first_tail, count), keeping the first t on ties like the
+// scalar kernel does.
+static std::pair<int, std::size_t> argmin_split_reduce(const int *lane_min, const int *lane_t, int nlanes,
+                                                       const int *cost_ik, const int *cost_kj, const int *dims_k,
+                                                       int scale, std::size_t first_tail, std::size_t count)
+{
+    int best_cost = std::numeric_limits<int>::max();
+    std::size_t best_t = 0;
+    for (int l = 0; l < nlanes; l++) {
+        if (lane_min[l] < best_cost || (lane_min[l] == best_cost && std::size_t(lane_t[l]) < best_t)) {
+            best_cost = lane_min[l];
+            best_t = lane_t[l];
+        }
+    }
+
+    for (std::size_t t = first_tail; t < count; t++) {
+        const int cost = cost_ik[t] + cost_kj[t] + dims_k[t] * scale;
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_t = t;
+        }
+    }
+
+    return {best_cost, best_t};
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+//==============================================================================
+// argmin_split_avx2 ()
+//==============================================================================
+__attribute__((target("avx2")))
+static std::pair<int, std::size_t> argmin_split_avx2(const int *cost_ik, const int *cost_kj, const int *dims_k,
+                                                     int scale, std::size_t count)
+{
+    const __m256i vscale = _mm256_set1_epi32(scale);
+    const __m256i vstep = _mm256_set1_epi32(8);
+    __m256i vmin = _mm256_set1_epi32(std::numeric_limits<int>::max());
+    __m256i vmin_t = _mm256_setzero_si256();
+    __m256i vt = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    std::size_t t = 0;
+    for (; t + 8 <= count; t += 8) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cost_ik + t));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cost_kj + t));
+        const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dims_k + t));
+        const __m256i cost = _mm256_add_epi32(_mm256_add_epi32(a, b), _mm256_mullo_epi32(d, vscale));
+        // strictly smaller only, so every lane keeps its first minimum
+        const __m256i smaller = _mm256_cmpgt_epi32(vmin, cost);
+        vmin = _mm256_blendv_epi8(vmin, cost, smaller);
+        vmin_t = _mm256_blendv_epi8(vmin_t, vt, smaller);
+        vt = _mm256_add_epi32(vt, vstep);
+    }
+
+    alignas(32) int lane_min[8];
+    alignas(32) int lane_t[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lane_min), vmin);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lane_t), vmin_t);
+
+    return argmin_split_reduce(lane_min, lane_t, 8, cost_ik, cost_kj, dims_k, scale, t, count);
+}
+
+//==============================================================================
+// argmin_split_avx512 ()
+//==============================================================================
+__attribute__((target("avx512f")))
+static std::pair<int, std::size_t> argmin_split_avx512(const int *cost_ik, const int *cost_kj, const int *dims_k,
+                                                       int scale, std::size_t count)
+{
+    const __m512i vscale = _mm512_set1_epi32(scale);
+    const __m512i vstep = _mm512_set1_epi32(16);
+    __m512i vmin = _mm512_set1_epi32(std::numeric_limits<int>::max());
+    __m512i vmin_t = _mm512_setzero_si512();
+    __m512i vt = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    std::size_t t = 0;
+    for (; t + 16 <= count; t += 16) {
+        const __m512i a = _mm512_loadu_si512(cost_ik + t);
+        const __m512i b = _mm512_loadu_si512(cost_kj + t);
+        const __m512i d = _mm512_loadu_si512(dims_k + t);
+        const __m512i cost = _mm512_add_epi32(_mm512_add_epi32(a, b), _mm512_mullo_epi32(d, vscale));
+        const __mmask16 smaller = _mm512_cmpgt_epi32_mask(vmin, cost);
+        vmin = _mm512_mask_mov_epi32(vmin, smaller, cost);
+        vmin_t = _mm512_mask_mov_epi32(vmin_t, smaller, vt);
+        vt = _mm512_add_epi32(vt, vstep);
+    }
+
+    alignas(64) int lane_min[16];
+    alignas(64) int lane_t[16];
+    _mm512_store_si512(lane_min, vmin);
+    _mm512_store_si512(lane_t, vmin_t);
+
+    return argmin_split_reduce(lane_min, lane_t, 16, cost_ik, cost_kj, dims_k, scale, t, count);
+}
+#endif
+
+#if defined(__aarch64__)
+//==============================================================================
+// argmin_split_neon ()
+//==============================================================================
+static std::pair<int, std::size_t> argmin_split_neon(const int *cost_ik, const int *cost_kj, const int *dims_k,
+                                                     int scale, std::size_t count)
+{
+    const int32x4_t vscale = vdupq_n_s32(scale);
+    const int32x4_t vstep = vdupq_n_s32(4);
+    int32x4_t vmin = vdupq_n_s32(std::numeric_limits<int>::max());
+    int32x4_t vmin_t = vdupq_n_s32(0);
+    const int first_t[4] = {0, 1, 2, 3};
+    int32x4_t vt = vld1q_s32(first_t);
+
+    std::size_t t = 0;
+    for (; t + 4 <= count; t += 4) {
+        const int32x4_t ab = vaddq_s32(vld1q_s32(cost_ik + t), vld1q_s32(cost_kj + t));
+        const int32x4_t cost = vmlaq_s32(ab, vld1q_s32(dims_k + t), vscale);
+        const uint32x4_t smaller = vcgtq_s32(vmin, cost);
+        vmin = vbslq_s32(smaller, cost, vmin);
+        vmin_t = vbslq_s32(smaller, vt, vmin_t);
+        vt = vaddq_s32(vt, vstep);
+    }
+
+    int lane_min[4];
+    int lane_t[4];
+    vst1q_s32(lane_min, vmin);
+    vst1q_s32(lane_t, vmin_t);
+
+    return argmin_split_reduce(lane_min, lane_t, 4, cost_ik, cost_kj, dims_k, scale, t, count);
+}
+#endif
+
+//==============================================================================
+// get_argmin_split_kernels ()
+//==============================================================================
+// All kernels this CPU can run, best first
+static const std::vector<ArgminSplitKernel>& get_argmin_split_kernels()
+{
+    static const std::vector<ArgminSplitKernel> kernels = []() {
+        std::vector<ArgminSplitKernel> res;
+#if defined(__x86_64__) && defined(__GNUC__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            res.push_back({"avx512", argmin_split_avx512});
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            res.push_back({"avx2", argmin_split_avx2});
+        }
+#elif defined(__aarch64__)
+        res.push_back({"neon", argmin_split_neon});
+#endif
+        res.push_back({"scalar", argmin_split_scalar});
+        return res;
+    }();
+
+    return kernels;
+}
+
+//==============================================================================
+// get_argmin_split_kernel ()
+//==============================================================================
+static const ArgminSplitKernel& get_argmin_split_kernel()
+{
+    return get_argmin_split_kernels().front();
+}
+
+template <typename Flops>
+class BasicMultOrderWorkspace;
+template <typename Flops>
+void calc_mult_order_table(const int *dims, std::size_t n, BasicMultOrderWorkspace<Flops>& ws,
+                           ThreadPool *pool = nullptr);
+
+//==============================================================================
+// argmin_split_checked ()
+//==============================================================================
+// Checked split loop of the subchain i..j over any Flops, shared by the DP
+// tables and calc_static_mult_plan(): cost_ik(t) and cost_kj(t) are the costs
+// of the subchains i..i+t and i+t+1..j. Split points whose cost does not fit
+// in Flops are skipped; if all of them are, the cost returned is
+// flops_traits<Flops>::max().
+template <typename Flops, typename CostIK, typename CostKJ>
+constexpr std::pair<Flops, std::size_t> argmin_split_checked(const CostIK& cost_ik, const CostKJ& cost_kj,
+                                                             const int *dims, std::size_t i, std::size_t j)
+{
+    using traits = flops_traits<Flops>;
+    const Flops overflow = traits::max();
+
+    Flops twice_dim_j = 0;
+    Flops scale = 0;
+    const bool scale_fits = traits::add(Flops(dims[j + 1]), Flops(dims[j + 1] - 1), twice_dim_j) &&
+                            traits::mul(Flops(dims[i]), twice_dim_j, scale);
+
+    Flops best_cost = overflow;
+    std::size_t best_t = 0;
+    for (std::size_t t = 0; t < j - i && scale_fits; t++) {
+        const Flops ik = cost_ik(t);
+        const Flops kj = cost_kj(t);
+        Flops mult = 0;
+        Flops subchains = 0;
+        Flops cost = 0;
+        if (ik == overflow || kj == overflow ||
+            !traits::mul(scale, Flops(dims[i + 1 + t]), mult) ||
+            !traits::add(ik, kj, subchains) ||
+            !traits::add(subchains, mult, cost)) {
+            continue;
+        }
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_t = t;
+        }
+    }
+
+    return {best_cost, best_t};
+}
+
+//==============================================================================
+// BasicMultOrderWorkspace
+//==============================================================================
+// DP tables of calc_mult_order_table(), kept flat and upper-triangular. The
+// costs are stored twice: row-major, so that min_cost[i][k] over k is
+// contiguous, and column-major, so that min_cost[k + 1][j] over k is
+// contiguous too. Buffers only ever grow: a workspace kept across calls stops
+// allocating once it has seen the longest chain.
+// A cost of flops_traits<Flops>::max() means the subchain overflows Flops.
+template <typename Flops>
+class BasicMultOrderWorkspace {
+public:
+    std::size_t size() const;
+    Flops get_cost(std::size_t i, std::size_t j) const;
+    int get_split(std::size_t i, std::size_t j) const;
+
+    static BasicMultOrderWorkspace& thread_local_instance();
+
+private:
+    template <typename F>
+    friend void calc_mult_order_table(const int *dims, std::size_t n, BasicMultOrderWorkspace<F>& ws,
+                                      ThreadPool *pool);
+
+    void reset(std::size_t n);
+    void calc_cell(const int *dims, std::size_t i, std::size_t j, ArgminSplitKernel::Func argmin);
+    void calc_cell_checked(const int *dims, std::size_t i, std::size_t j);
+    std::size_t row_index(std::size_t i, std::size_t j) const;
+    std::size_t col_index(std::size_t i, std::size_t j) const;
+
+    std::size_t m_n = 0;
+    std::vector<Flops> m_cost_row;  // upper triangle, row-major
+    std::vector<Flops> m_cost_col;  // upper triangle, column-major
+    std::vector<int> m_split;       // upper triangle, row-major
+};
+
+using MultOrderWorkspace = BasicMultOrderWorkspace<int>;
+
+//==============================================================================
+// size ()
+//==============================================================================
+template <typename Flops>
+std::size_t BasicMultOrderWorkspace<Flops>::size() const
+{
+    return m_n;
+}
+
+//==============================================================================
+// get_cost ()
+//==============================================================================
+template <typename Flops>
+Flops BasicMultOrderWorkspace<Flops>::get_cost(std::size_t i, std::size_t j) const
+{
+    return m_cost_row[row_index(i, j)];
+}
+
+//==============================================================================
+// get_split ()
+//==============================================================================
+template <typename Flops>
+int BasicMultOrderWorkspace<Flops>::get_split(std::size_t i, std::size_t j) const
+{
+    return m_split[row_index(i, j)];
+}
+
+//==============================================================================
+// thread_local_instance ()
+//==============================================================================
+template <typename Flops>
+BasicMultOrderWorkspace<Flops>& BasicMultOrderWorkspace<Flops>::thread_local_instance()
+{
+    thread_local BasicMultOrderWorkspace ws;
+
+    return ws;
+}
+
+//==============================================================================
+// reset ()
+//==============================================================================
+template <typename Flops>
+void BasicMultOrderWorkspace<Flops>::reset(std::size_t n)
+{
+    // resize() within capacity does not allocate
+    const std::size_t cells = n * (n + 1) / 2;
+    m_n = n;
+    m_cost_row.resize(cells);
+    m_cost_col.resize(cells);
+    m_split.resize(cells);
+}
+
+//==============================================================================
+// row_index ()
+//==============================================================================
+template <typename Flops>
+std::size_t BasicMultOrderWorkspace<Flops>::row_index(std::size_t i, std::size_t j) const
+{
+    // row i holds (i, i..n-1) and starts after i rows of n, n-1, ... cells
+    return i * m_n - i * (i - 1) / 2 + (j - i);
+}
+
+//==============================================================================
+// col_index ()
+//==============================================================================
+template <typename Flops>
+std::size_t BasicMultOrderWorkspace<Flops>::col_index(std::size_t i, std::size_t j) const
+{
+    // column j holds (0..j, j) and starts after j columns of 1, 2, ... cells
+    return j * (j + 1) / 2 + i;
+}
+
+//==============================================================================
+// calc_cell ()
+//==============================================================================
+template <typename Flops>
+void BasicMultOrderWorkspace<Flops>::calc_cell(const int *dims, std::size_t i, std::size_t j,
+                                               ArgminSplitKernel::Func argmin)
+{
+    if constexpr (std::is_same_v<Flops, int>) {
+        if (argmin) {
+            // k runs over [i, j): min_cost[i][k] is contiguous in the row-major copy,
+            // min_cost[k + 1][j] in the column-major one, dims[k + 1] in dims
+            const int *cost_ik = m_cost_row.data() + row_index(i, i);
+            const int *cost_kj = m_cost_col.data() + col_index(i + 1, j);
+            // flops(dim1, dim2, dim3) = dim1 * dim2 * (2 * dim3 - 1)
+            const int scale = dims[i] * (2 * dims[j + 1] - 1);
+
+            const auto [best_cost, best_t] = argmin(cost_ik, cost_kj, dims + i + 1, scale, j - i);
+
+            m_cost_row[row_index(i, j)] = best_cost;
+            m_cost_col[col_index(i, j)] = best_cost;
+            m_split[row_index(i, j)] = i + best_t;
+            return;
+        }
+    }
+
+    calc_cell_checked(dims, i, j);
+}
+
+//==============================================================================
+// calc_cell_checked ()
+//==============================================================================
+// Same as the SIMD kernels, with every operation checked: split points whose
+// cost does not fit in Flops are skipped
+template <typename Flops>
+void BasicMultOrderWorkspace<Flops>::calc_cell_checked(const int *dims, std::size_t i, std::size_t j)
+{
+    const Flops *cost_ik = m_cost_row.data() + row_index(i, i);
+    const Flops *cost_kj = m_cost_col.data() + col_index(i + 1, j);
+    const auto [best_cost, best_t] = argmin_split_checked<Flops>([cost_ik](std::size_t t) { return cost_ik[t]; },
+                                                                 [cost_kj](std::size_t t) { return cost_kj[t]; },
+                                                                 dims, i, j);
+
+    m_cost_row[row_index(i, j)] = best_cost;
+    m_cost_col[col_index(i, j)] = best_cost;
+    m_split[row_index(i, j)] = i + best_t;
+}
+
+//==============================================================================
+// calc_mult_order_table ()
+//==============================================================================
+// Matrix Chain Multiplication DP over a chain of n matrices, the i-th one
+// being dims[i] x dims[i + 1]. On return ws.get_cost(i, j) holds the minimum
+// flops of the subchain i..j and ws.get_split(i, j) the split point of its
+// optimal order. Throws std::overflow_error if even the cheapest order does
+// not fit in Flops, unless Flops saturates.
+// The split loop runs on the best SIMD kernel of the CPU when Flops is int and
+// no order of the chain can overflow; otherwise on the checked scalar loop.
+// Cells of the same diagonal (same length) only depend on shorter diagonals.
+// When a pool is given each diagonal is split across it, as a wavefront; a
+// diagonal too small to pay for the synchronization is computed in place.
+template <typename Flops>
+void calc_mult_order_table(const int *dims, std::size_t n, BasicMultOrderWorkspace<Flops>& ws, ThreadPool *pool)
+{
+    // minimum number of k iterations per task
+    constexpr std::size_t min_task_work = 1 << 14;
+
+    // any order costs at most (n - 1) products of max_dim * max_dim * (2 * max_dim - 1)
+    const double max_dim = (n ? *std::max_element(dims, dims + n + 1) : 0);
+    const double max_order_cost = (n ? n - 1 : 0) * max_dim * max_dim * (2 * max_dim - 1);
+    const ArgminSplitKernel::Func argmin =
+        (max_order_cost <= std::numeric_limits<int>::max() ? get_argmin_split_kernel().func : nullptr);
+
+    ws.reset(n);
+    for (std::size_t i = 0; i < n; i++) {
+        ws.m_cost_row[ws.row_index(i, i)] = 0;
+        ws.m_cost_col[ws.col_index(i, i)] = 0;
+    }
+
+    for (std::size_t length = 2; length < n + 1; length++) {
+        // find minimum flops for all chains of size 'length'
+        const std::size_t ncells = n - length + 1;
+        const auto calc_cells = [&](std::size_t first, std::size_t last) {
+            for (std::size_t i = first; i < last; i++) {
+                ws.calc_cell(dims, i, i + length - 1, argmin);
+            }
+        };
+
+        const std::size_t grain = (min_task_work + length - 2) / (length - 1);
+        if (pool && ncells > grain) {
+            parallel_for(*pool, 0, ncells, grain, calc_cells);
+        } else {
+            calc_cells(0, ncells);
+        }
+    }
+
+    if (!flops_traits<Flops>::saturates && n && ws.get_cost(0, n - 1) == flops_traits<Flops>::max()) {
+        throw std::overflow_error("mult order: flops overflow");
+    }
+}
+
+//==============================================================================
+// calc_mult_order_hu_shing ()
+//==============================================================================
+// Hu-Shing near-optimal partition of the chain's polygon. The chain is seen as
+// a convex polygon with vertex weights dims[0..n], every parenthesization as a
+// triangulation of it, and a triangle (a, b, c), a < b < c, as the product of
+// subchains a..b-1 and b..c-1. Starting from the lightest vertex V1 the
+// vertices are scanned with a stack; V_c between V_a and V_b is cut off as
+// triangle (a, c, b) whenever that is cheaper than leaving it to the fan from
+// V1, i.e. cost(a, c, b) + cost(1, a, b) < cost(1, a, c) + cost(1, c, b). The
+// remaining polygon is fanned from V1. For costs w_a * w_b * w_c this is the
+// 1/w_a + 1/w_b > 1/w_c + 1/w_1 test, within 15.47% of optimal; our cost has
+// an extra -w_a * w_b term, which is why the test compares the actual costs
+// and why the exact O(n log n) algorithm does not carry over.
+// On return split_at[i * n + j] holds the split point of the subchain i..j for
+// every internal node of the tree. Returns the flops of the plan, checked.
+template <typename Flops = int>
+static Flops calc_mult_order_hu_shing(const std::vector<int>& dims,
+                                      std::unordered_map<std::int64_t, int>& split_at)
+{
+    const std::int64_t n = dims.size() - 1;
+    const std::size_t nvert = dims.size();
+    split_at.clear();
+    split_at.reserve(nvert);
+
+    const auto sort3 = [](std::size_t& a, std::size_t& b, std::size_t& c) {
+        // the lowest and highest vertex delimit the subchain
+        if (a > b) std::swap(a, b);
+        if (b > c) std::swap(b, c);
+        if (a > b) std::swap(a, b);
+    };
+
+    // only compared to pick the cuts, double is accurate enough whatever the dims
+    const auto tri_cost = [&](std::size_t a, std::size_t b, std::size_t c) {
+        sort3(a, b, c);
+        // flops(dim1, dim2, dim3) = dim1 * dim2 * (2 * dim3 - 1)
+        return double(dims[a]) * dims[b] * (2.0 * dims[c] - 1);
+    };
+
+    Flops cost = 0;
+    const auto emit = [&](std::size_t a, std::size_t b, std::size_t c) {
+        sort3(a, b, c);
+        split_at[a * n + (c - 1)] = b - 1;
+        cost = checked_add(cost, calc_mult_flops<Flops>(dims[a], dims[b], dims[c]));
+    };
+
+    const std::size_t v1 = std::min_element(dims.begin(), dims.end()) - dims.begin();
+    std::vector<std::size_t> stack;
+    stack.reserve(nvert);
+    stack.push_back(v1);
+    for (std::size_t t = 1; t < nvert; t++) {
+        const std::size_t b = (v1 + t) % nvert;
+        while (stack.size() >= 2) {
+            const std::size_t c = stack.back();
+            const std::size_t a = stack[stack.size() - 2];
+            if (tri_cost(a, c, b) + tri_cost(v1, a, b) >= tri_cost(v1, a, c) + tri_cost(v1, c, b)) {
+                break;
+            }
+            emit(a, c, b);
+            stack.pop_back();
+        }
+        stack.push_back(b);
+    }
+
+    for (std::size_t s = 1; s + 1 < stack.size(); s++) {
+        emit(v1, stack[s], stack[s + 1]);
+    }
+
+    return cost;
+}
+
+//==============================================================================
+// BasicMultPlan
+//==============================================================================
+// Execution plan of a chain product. Operands are numbered: 0..n-1 are the
+// chain's matrices, n + t is the result of nodes[t]. Nodes are in post-order,
+// so each one only uses inputs and earlier nodes, and the last one yields the
+// product of the whole chain; an executor just runs them in sequence.
+template <typename Flops = int>
+struct BasicMultPlan {
+    struct Node {
+        int left;   // operand multiplied on the left
+        int right;  // operand multiplied on the right
+        int nrow;   // shape of the product
+        int ncol;
+        Flops flops;  // flops of this product only
+    };
+
+    int num_inputs = 0;
+    std::vector<Node> nodes;
+    Flops flops = 0;  // flops of the whole plan
+
+    int get_result() const;
+    std::int64_t get_peak_bytes(std::size_t elem_size) const;
+    std::string to_string(std::initializer_list<const char *> mat_names = {}) const;
+};
+
+using MultPlan = BasicMultPlan<int>;
+
+//==============================================================================
+// get_result ()
+//==============================================================================
+// Operand holding the product of the whole chain
+template <typename Flops>
+int BasicMultPlan<Flops>::get_result() const
+{
+    return (nodes.empty() ? 0 : num_inputs + int(nodes.size()) - 1);
+}
+
+//==============================================================================
+// get_peak_bytes ()
+//==============================================================================
+// Most bytes held at once by intermediates (and the result) when the plan is
+// run by execute_mult_plan(), with elements of elem_size bytes. A product is
+// allocated while both its operands are still alive; inputs are not counted.
+template <typename Flops>
+std::int64_t BasicMultPlan<Flops>::get_peak_bytes(std::size_t elem_size) const
+{
+    const auto bytes = [&](int op) -> std::int64_t {
+        if (op < num_inputs) {
+            return 0;
+        }
+        const Node& node = nodes[op - num_inputs];
+        return checked_mul(checked_mul(std::int64_t(node.nrow), std::int64_t(node.ncol)), std::int64_t(elem_size));
+    };
+
+    std::int64_t live = 0;
+    std::int64_t peak = 0;
+    for (std::size_t t = 0; t < nodes.size(); t++) {
+        live = checked_add(live, bytes(num_inputs + int(t)));
+        peak = std::max(peak, live);
+        live -= bytes(nodes[t].left) + bytes(nodes[t].right);
+    }
+
+    return peak;
+}
+
+//==============================================================================
+// to_string ()
+//==============================================================================
+// Debug view, the parenthesized order. Appends to one string in a single
+// walk down the tree, so it stays linear in the length of the result.
+template <typename Flops>
+std::string BasicMultPlan<Flops>::to_string(std::initializer_list<const char *> mat_names) const
+{
+    if (num_inputs == 0) {
+        return "";
+    }
+
+    // static_assert
+    if (mat_names.size() && mat_names.size() != std::size_t(num_inputs)) {
+        throw std::logic_error("wrong input sizes");
+    }
+
+    // operands still to print, or a ')' / ' * ' to emit once their left side is done
+    constexpr int close_paren = -1;
+    constexpr int times = -2;
+    std::string res;
+    std::vector<int> stack = {get_result()};
+    while (!stack.empty()) {
+        const int op = stack.back();
+        stack.pop_back();
+        if (op == close_paren) {
+            res += ')';
+        } else if (op == times) {
+            res += " * ";
+        } else if (op < num_inputs) {
+            if (mat_names.size()) {
+                res += *(mat_names.begin() + op);
+            } else {
+                res += 'M';
+                res += std::to_string(op + 1);
+            }
+        } else {
+            const Node& node = nodes[op - num_inputs];
+            res += '(';
+            stack.insert(stack.end(), {close_paren, node.right, times, node.left});
+        }
+    }
+
+    return res;
+}
+
+//==============================================================================
+// build_mult_plan ()
+//==============================================================================
+// Plan of the chain of n matrices (the i-th one being dims[i] x dims[i + 1])
+// that evaluates subchain i..j as (i..k) * (k+1..j), k = split(i, j)
+template <typename Flops, typename SplitFn, typename CostFn>
+BasicMultPlan<Flops> build_mult_plan(const int *dims, std::size_t n, const SplitFn& split, const CostFn& mult_cost)
+{
+    BasicMultPlan<Flops> plan;
+    plan.num_inputs = n;
+    if (n < 2) {
+        return plan;
+    }
+    plan.nodes.reserve(n - 1);
+
+    // iterative post-order walk, chains can be far deeper than the call stack
+    struct Frame {
+        int i;
+        int j;
+        int k;
+        int stage;  // 0: not split yet, 1: left subchain done, 2: both done
+    };
+    std::vector<Frame> frames = {{0, int(n - 1), 0, 0}};
+    std::vector<int> operands;
+    while (!frames.empty()) {
+        const std::size_t top = frames.size() - 1;
+        const Frame frame = frames[top];
+        if (frame.i == frame.j) {
+            operands.push_back(frame.i);
+            frames.pop_back();
+        } else if (frame.stage == 0) {
+            const int k = split(frame.i, frame.j);
+            frames[top].k = k;
+            frames[top].stage = 1;
+            frames.push_back({frame.i, k, 0, 0});
+        } else if (frame.stage == 1) {
+            frames[top].stage = 2;
+            frames.push_back({frame.k + 1, frame.j, 0, 0});
+        } else {
+            const int right = operands.back();
+            operands.pop_back();
+            const int left = operands.back();
+            operands.pop_back();
+
+            const int dim_j = dims[frame.j + 1];
+            const Flops flops = mult_cost(dims[frame.i], dims[frame.k + 1], dim_j);
+            plan.nodes.push_back({left, right, dims[frame.i], dim_j, flops});
+            plan.flops = checked_add(plan.flops, flops);
+            operands.push_back(int(n) + int(plan.nodes.size()) - 1);
+            frames.pop_back();
+        }
+    }
+
+    return plan;
+}
+
+//==============================================================================
+// build_mult_plan ()
+//==============================================================================
+template <typename Flops, typename SplitFn>
+BasicMultPlan<Flops> build_mult_plan(const int *dims, std::size_t n, const SplitFn& split)
+{
+    return build_mult_plan<Flops>(dims, n, split, calc_mult_flops<Flops>);
+}
+
+//==============================================================================
+// calc_mult_plan_with_split_cost ()
+//==============================================================================
+// Optimal plan of the chain of n matrices when multiplying the product of the
+// subchain i..k by that of k+1..j costs split_cost(i, k, j), for costs that
+// depend on more than the dims (see calc_sparse_mult_plan()). The cost can be
+// of another type than Flops, e.g. seconds predicted by a cost model; the
+// nodes of the plan then get mult_flops(dim1, dim2, dim3).
+// Scalar O(n^3), same overflow handling as the DP: splits whose cost overflows
+// (or whose split_cost() throws std::overflow_error) are skipped.
+template <typename Flops, typename CostFn, typename FlopsFn>
+BasicMultPlan<Flops> calc_mult_plan_with_split_cost(const int *dims, std::size_t n, const CostFn& split_cost,
+                                                    const FlopsFn& mult_flops)
+{
+    using Cost = std::decay_t<decltype(split_cost(0, 0, 0))>;
+    using traits = flops_traits<Cost>;
+    const Cost overflow = traits::max();
+
+    if (n < 2) {
+        return build_mult_plan<Flops>(dims, n, [](int, int) { return 0; }, mult_flops);
+    }
+
+    std::vector<Cost> min_cost(n * n, Cost(0));
+    std::vector<int> min_index(n * n, 0);
+    for (std::size_t length = 2; length < n + 1; length++) {
+        for (std::size_t i = 0; i < n - length + 1; i++) {
+            const std::size_t j = i + length - 1;
+
+            min_cost[i * n + j] = overflow;
+            for (std::size_t k = i; k < j; k++) {
+                const Cost cost_ik = min_cost[i * n + k];
+                const Cost cost_kj = min_cost[(k + 1) * n + j];
+                if (cost_ik == overflow || cost_kj == overflow) {
+                    continue;
+                }
+
+                Cost mult = 0;
+                try {
+                    mult = split_cost(int(i), int(k), int(j));
+                } catch (const std::overflow_error&) {
+                    continue;
+                }
+                Cost subchains = 0;
+                Cost cost = 0;
+                if (!traits::add(cost_ik, cost_kj, subchains) || !traits::add(subchains, mult, cost)) {
+                    continue;
+                }
+                if (cost < min_cost[i * n + j]) {
+                    min_cost[i * n + j] = cost;
+                    min_index[i * n + j] = k;
+                }
+            }
+        }
+    }
+
+    if (!traits::saturates && min_cost[n - 1] == overflow) {
+        throw std::overflow_error("mult order: flops overflow");
+    }
+
+    const auto split = [&min_index, n](int i, int j) { return min_index[i * n + j]; };
+    return build_mult_plan<Flops>(dims, n, split, mult_flops);
+}
+
+//==============================================================================
+// calc_mult_plan_with_cost ()
+//==============================================================================
+// Optimal plan of the chain of n matrices when multiplying a dim1 x dim2 by a
+// dim2 x dim3 matrix costs mult_cost(dim1, dim2, dim3), for costs the SIMD DP
+// cannot assume, see calc_mult_plan_with_split_cost()
+template <typename Flops, typename CostFn, typename FlopsFn>
+BasicMultPlan<Flops> calc_mult_plan_with_cost(const int *dims, std::size_t n, const CostFn& mult_cost,
+                                              const FlopsFn& mult_flops)
+{
+    const auto split_cost = [dims, &mult_cost](int i, int k, int j) {
+        return mult_cost(dims[i], dims[k + 1], dims[j + 1]);
+    };
+
+    return calc_mult_plan_with_split_cost<Flops>(dims, n, split_cost, mult_flops);
+}
+
+//==============================================================================
+// calc_mult_plan_with_cost ()
+//==============================================================================
+template <typename Flops, typename CostFn>
+BasicMultPlan<Flops> calc_mult_plan_with_cost(const int *dims, std::size_t n, const CostFn& mult_cost)
+{
+    return calc_mult_plan_with_cost<Flops>(dims, n, mult_cost, mult_cost);
+}
+
+//==============================================================================
+// ApproxPlanOptions
+//==============================================================================
+// Knobs of calc_approx_mult_plan()
+struct ApproxPlanOptions {
+    double time_budget_s = 1e-2;  // for refining the greedy plan, the greedy pass itself always runs
+    double target_factor = 1.0;   // refining stops once within that factor of calc_mult_chain_lower_bound()
+    int window = 10;              // operands re-parenthesized at once by the exact DP, O(window^3) each
+};
+
+//==============================================================================
+// calc_mult_chain_lower_bound ()
+//==============================================================================
+// Lower bound on the flops of every plan of the chain of n matrices, the i-th
+// one being dims[i] x dims[i + 1], dims positive. Each inner dim dims[m],
+// 0 < m < n, is eliminated by exactly one product, between an outer dim on its
+// left and one on its right, so that product costs at least
+// flops(min(dims[0..m-1]), dims[m], min(dims[m+1..n])). O(n).
+template <typename Flops = int>
+Flops calc_mult_chain_lower_bound(const int *dims, std::size_t n)
+{
+    Flops bound = 0;
+    if (n < 2) {
+        return bound;
+    }
+
+    std::vector<int> suffix_min(n + 1);
+    suffix_min[n] = dims[n];
+    for (std::size_t m = n; m-- > 0;) {
+        suffix_min[m] = std::min(dims[m], suffix_min[m + 1]);
+    }
+
+    int prefix_min = dims[0];
+    for (std::size_t m = 1; m < n; m++) {
+        bound = checked_add(bound, calc_mult_flops<Flops>(prefix_min, dims[m], suffix_min[m + 1]));
+        prefix_min = std::min(prefix_min, dims[m]);
+    }
+
+    return bound;
+}
+
+//==============================================================================
+// ApproxChainTree
+//==============================================================================
+// Plan of the chain of n matrices, the i-th one being dims[i] x dims[i + 1], as
+// the binary tree calc_approx_mult_plan() edits in place, n > 0: nodes 0..n-1 are the
+// matrices, n..2n-2 the products, in no particular order once refined. Costs
+// are doubles, only compared; to_plan() counts the exact flops.
+class ApproxChainTree {
+public:
+    enum class Greedy {
+        largest_dim,  // eliminate the largest inner dim first
+        cheapest,     // do the cheapest product first
+    };
+
+    ApproxChainTree(const int *dims, std::size_t n, Greedy greedy);
+
+    double get_cost() const;
+    bool refine(int node, int window);
+
+    template <typename Flops>
+    BasicMultPlan<Flops> to_plan() const;
+
+private:
+    double calc_mult_cost(int left, int right) const;
+    int build_window(int i, int j, std::size_t& num_used);
+
+    const int *m_dims;
+    int m_n;
+    int m_root;
+    double m_cost = 0;
+    std::vector<int> m_left;   // operands of the products
+    std::vector<int> m_right;
+    std::vector<int> m_first;  // first and last matrix of every node
+    std::vector<int> m_last;
+
+    // scratch of refine()
+    std::vector<int> m_frontier;
+    std::vector<int> m_inner;
+    std::vector<double> m_window_cost;
+    std::vector<int> m_window_split;
+};
+
+//==============================================================================
+// ApproxChainTree ()
+//==============================================================================
+// Greedy plan, O(n log n): the operands left to right as a linked list, the
+// products of adjacent ones in a heap, best first. An entry is stale once either
+// of its operands has been consumed.
+ApproxChainTree::ApproxChainTree(const int *dims, std::size_t n, Greedy greedy)
+    : m_dims(dims),
+      m_n(int(n)),
+      m_root(int(2 * n) - 2),
+      m_left(2 * n - 1, -1),
+      m_right(2 * n - 1, -1),
+      m_first(2 * n - 1),
+      m_last(2 * n - 1)
+{
+    struct Candidate {
+        double priority;
+        double cost;
+        int first;  // of the left operand, ties going leftmost first for determinism
+        int left;
+        int right;
+    };
+    const auto worse = [](const Candidate& a, const Candidate& b) {
+        if (a.priority != b.priority) return a.priority < b.priority;
+        if (a.cost != b.cost) return a.cost > b.cost;
+        return a.first > b.first;
+    };
+
+    std::vector<Candidate> heap;
+    heap.reserve(3 * n);
+    const auto make_candidate = [this, greedy](int left, int right) {
+        const double cost = calc_mult_cost(left, right);
+        const double priority = (greedy == Greedy::largest_dim ? m_dims[m_first[right]] : -cost);
+        return Candidate{priority, cost, m_first[left], left, right};
+    };
+    const auto push = [&](int left, int right) {
+        heap.push_back(make_candidate(left, right));
+        std::push_heap(heap.begin(), heap.end(), worse);
+    };
+
+    std::vector<int> prev(2 * n - 1, -1);
+    std::vector<int> next(2 * n - 1, -1);
+    for (int i = 0; i < m_n; i++) {
+        m_first[i] = i;
+        m_last[i] = i;
+        prev[i] = i - 1;
+        next[i] = (i + 1 < m_n ? i + 1 : -1);
+    }
+    for (int i = 0; i + 1 < m_n; i++) {
+        heap.push_back(make_candidate(i, i + 1));
+    }
+    std::make_heap(heap.begin(), heap.end(), worse);
+
+    int node = m_n;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), worse);
+        const Candidate best = heap.back();
+        heap.pop_back();
+        if (next[best.left] != best.right) {
+            continue;
+        }
+
+        m_left[node] = best.left;
+        m_right[node] = best.right;
+        m_first[node] = m_first[best.left];
+        m_last[node] = m_last[best.right];
+        m_cost += best.cost;
+
+        prev[node] = prev[best.left];
+        next[node] = next[best.right];
+        next[best.left] = -1;
+        next[best.right] = -1;
+        if (prev[node] >= 0) {
+            next[prev[node]] = node;
+            push(prev[node], node);
+        }
+        if (next[node] >= 0) {
+            prev[next[node]] = node;
+            push(node, next[node]);
+        }
+        node++;
+    }
+}
+
+//==============================================================================
+// get_cost ()
+//==============================================================================
+double ApproxChainTree::get_cost() const
+{
+    return m_cost;
+}
+
+//==============================================================================
+// calc_mult_cost ()
+//==============================================================================
+double ApproxChainTree::calc_mult_cost(int left, int right) const
+{
+    // flops(dim1, dim2, dim3) = dim1 * dim2 * (2 * dim3 - 1)
+    return double(m_dims[m_first[left]]) * m_dims[m_first[right]] * (2.0 * m_dims[m_last[right] + 1] - 1);
+}
+
+//==============================================================================
+// refine ()
+//==============================================================================
+// Re-parenthesizes the top of the subtree of product node by the exact DP: its
+// products taken breadth first until the window has that many operands. Keeps
+// the new order only if strictly cheaper; returns whether it did.
+bool ApproxChainTree::refine(int node, int window)
+{
+    if (node < m_n || window < 3) {
+        return false;
+    }
+
+    // breadth first, which gave far better plans than expanding the most expensive products first
+    m_inner.assign(1, node);
+    m_frontier.clear();
+    double old_cost = 0;
+    std::size_t num_expanded = 0;
+    while (num_expanded < m_inner.size() && int(m_frontier.size() + m_inner.size() - num_expanded) < window) {
+        const int inner = m_inner[num_expanded++];
+        old_cost += calc_mult_cost(m_left[inner], m_right[inner]);
+        for (int child : {m_left[inner], m_right[inner]}) {
+            (child < m_n ? m_frontier : m_inner).push_back(child);
+        }
+    }
+    if (num_expanded < 2) {
+        return false;
+    }
+    m_frontier.insert(m_frontier.end(), m_inner.begin() + num_expanded, m_inner.end());
+    m_inner.resize(num_expanded);
+    std::sort(m_frontier.begin(), m_frontier.end(), [this](int a, int b) { return m_first[a] < m_first[b]; });
+
+    // the operands' dims, then the same DP as calc_mult_plan_with_cost()
+    const std::size_t k = m_frontier.size();
+    const auto dim = [this, k](std::size_t t) {
+        return double(t < k ? m_dims[m_first[m_frontier[t]]] : m_dims[m_last[m_frontier[k - 1]] + 1]);
+    };
+    m_window_cost.assign(k * k, 0.0);
+    m_window_split.assign(k * k, 0);
+    for (std::size_t length = 2; length < k + 1; length++) {
+        for (std::size_t i = 0; i < k - length + 1; i++) {
+            const std::size_t j = i + length - 1;
+            double& best = m_window_cost[i * k + j];
+            best = std::numeric_limits<double>::infinity();
+            for (std::size_t s = i; s < j; s++) {
+                const double cost = m_window_cost[i * k + s] + m_window_cost[(s + 1) * k + j] +
+                                    dim(i) * dim(s + 1) * (2.0 * dim(j + 1) - 1);
+                if (cost < best) {
+                    best = cost;
+                    m_window_split[i * k + j] = int(s);
+                }
+            }
+        }
+    }
+
+    // rounding apart, ties keep the current order
+    const double new_cost = m_window_cost[k - 1];
+    if (!(new_cost < old_cost * (1 - 1e-12))) {
+        return false;
+    }
+
+    std::size_t num_used = 0;
+    build_window(0, int(k) - 1, num_used);  // roots the window at m_inner[0], i.e. node
+    m_cost += new_cost - old_cost;
+
+    return true;
+}
+
+//==============================================================================
+// build_window ()
+//==============================================================================
+// Rebuilds operands i..j of the window from the DP's splits, reusing the
+// window's product nodes pre-order. Depth at most the window size.
+int ApproxChainTree::build_window(int i, int j, std::size_t& num_used)
+{
+    if (i == j) {
+        return m_frontier[i];
+    }
+
+    const int node = m_inner[num_used++];
+    const int split = m_window_split[i * m_frontier.size() + j];
+    const int left = build_window(i, split, num_used);
+    const int right = build_window(split + 1, j, num_used);
+    m_left[node] = left;
+    m_right[node] = right;
+    m_first[node] = m_first[left];
+    m_last[node] = m_last[right];
+
+    return node;
+}
+
+//==============================================================================
+// to_plan ()
+//==============================================================================
+template <typename Flops>
+BasicMultPlan<Flops> ApproxChainTree::to_plan() const
+{
+    BasicMultPlan<Flops> plan;
+    plan.num_inputs = m_n;
+    if (m_n < 2) {
+        return plan;
+    }
+    plan.nodes.reserve(m_n - 1);
+
+    // iterative post-order walk, the greedy trees can be as deep as the chain
+    std::vector<int> operand(m_left.size());
+    std::vector<std::pair<int, bool>> stack = {{m_root, false}};
+    while (!stack.empty()) {
+        const auto [node, children_done] = stack.back();
+        stack.pop_back();
+        if (node < m_n) {
+            operand[node] = node;
+        } else if (!children_done) {
+            stack.push_back({node, true});
+            stack.push_back({m_right[node], false});
+            stack.push_back({m_left[node], false});
+        } else {
+            const int nrow = m_dims[m_first[node]];
+            const int ncol = m_dims[m_last[node] + 1];
+            const Flops flops = calc_mult_flops<Flops>(nrow, m_dims[m_first[m_right[node]]], ncol);
+            plan.nodes.push_back({operand[m_left[node]], operand[m_right[node]], nrow, ncol, flops});
+            plan.flops = checked_add(plan.flops, flops);
+            operand[node] = m_n + int(plan.nodes.size()) - 1;
+        }
+    }
+
+    return plan;
+}
+
+//==============================================================================
+// calc_approx_mult_plan ()
+//==============================================================================
+// Plan of the chain of n matrices, the i-th one being dims[i] x dims[i + 1],
+// for chains too long for the exact DP. The cheaper of two greedy plans (cheapest
+// product first, largest inner dim eliminated first) is refined for up to
+// options.time_budget_s: around every product in turn, up to options.window
+// operands are re-parenthesized by the exact DP, sweeping until no window
+// improves, the budget runs out or the plan is proven within
+// options.target_factor of optimal by calc_mult_chain_lower_bound(). A window
+// as wide as the chain makes the plan optimal. Flops checked.
+template <typename Flops = int>
+BasicMultPlan<Flops> calc_approx_mult_plan(const int *dims, std::size_t n,
+                                           const ApproxPlanOptions& options = ApproxPlanOptions())
+{
+    using clock = std::chrono::steady_clock;
+
+    if (n < 2) {
+        return build_mult_plan<Flops>(dims, n, [](int, int) { return 0; });
+    }
+
+    // a budget beyond 30 years is no budget, and must not overflow the clock
+    const std::chrono::duration<double> budget(std::min(options.time_budget_s, 1e9));
+    const clock::time_point deadline = clock::now() + std::chrono::duration_cast<clock::duration>(budget);
+    const double target = options.target_factor * calc_mult_chain_lower_bound<double>(dims, n);
+
+    ApproxChainTree tree(dims, n, ApproxChainTree::Greedy::cheapest);
+    if (tree.get_cost() > target && clock::now() < deadline) {
+        ApproxChainTree largest_dim(dims, n, ApproxChainTree::Greedy::largest_dim);
+        if (largest_dim.get_cost() < tree.get_cost()) {
+            tree = std::move(largest_dim);
+        }
+    }
+
+    // the greedy's last products, the most expensive ones, first
+    for (bool improved = true; improved;) {
+        improved = false;
+        for (int node = int(2 * n) - 2; node >= int(n); node--) {
+            if (tree.get_cost() <= target || clock::now() >= deadline) {
+                return tree.to_plan<Flops>();
+            }
+            improved = tree.refine(node, options.window) || improved;
+        }
+    }
+
+    return tree.to_plan<Flops>();
+}
+
+//==============================================================================
+// calc_optimal_mult_plan ()
+//==============================================================================
+// Plan of the chain of n matrices, the i-th one being dims[i] x dims[i + 1]
+template <typename Flops = int>
+BasicMultPlan<Flops> calc_optimal_mult_plan(const int *dims, std::size_t n,
+                                            MultOrderSolver solver = MultOrderSolver::dp,
+                                            BasicMultOrderWorkspace<Flops>& workspace =
+                                                BasicMultOrderWorkspace<Flops>::thread_local_instance())
+{
+    if (solver == MultOrderSolver::greedy) {
+        return calc_approx_mult_plan<Flops>(dims, n);
+    }
+    if (solver == MultOrderSolver::hu_shing) {
+        const std::vector<int> dims_vec(dims, dims + n + 1);
+        std::unordered_map<std::int64_t, int> split_at;
+        calc_mult_order_hu_shing<Flops>(dims_vec, split_at);
+        const auto split = [&split_at, n](int i, int j) { return split_at.at(i * std::int64_t(n) + j); };
+
+        return build_mult_plan<Flops>(dims, n, split);
+    }
+
+    ThreadPool *pool = (solver == MultOrderSolver::dp_parallel ? &ThreadPool::global() : nullptr);
+    calc_mult_order_table(dims, n, workspace, pool);
+    const auto split = [&workspace](int i, int j) { return workspace.get_split(i, j); };
+
+    return build_mult_plan<Flops>(dims, n, split);
+}
+
+//==============================================================================
+// calc_optimal_mult_plan ()
+//==============================================================================
+// Plan costed as the executor will run it, Strassen-Winograd included where
+// policy applies
+template <typename Flops = int>
+BasicMultPlan<Flops> calc_optimal_mult_plan(const int *dims, std::size_t n, const StrassenPolicy& policy)
+{
+    const auto mult_cost = [&policy](int dim1, int dim2, int dim3) {
+        return policy.calc_flops<Flops>(dim1, dim2, dim3);
+    };
+
+    return calc_mult_plan_with_cost<Flops>(dims, n, mult_cost);
+}
+
+//==============================================================================
+// BasicIncrementalMultPlanner
+//==============================================================================
+// calc_optimal_mult_plan() that keeps its DP tables from one chain to the
+// next and only recomputes the cells the new dims invalidate. The tables are
+// indexed from the end of the chain, so a cell stays valid for any chain
+// that shares its suffix of dims: when only dims[0] changes, as the batch
+// dimension of a served chain does, only the n - 1 cells of the whole chain
+// and its prefixes are recomputed, O(n^2) instead of O(n^3), and chains that
+// only differ before a common suffix, even of other lengths, share the cells
+// of that suffix.
+// Subchain i..j of the current chain of n matrices is cell (lo, hi) =
+// (n - 1 - j, n - 1 - i), and its costs are stored twice like in
+// BasicMultOrderWorkspace: by hi, cell (lo..hi, hi) being contiguous, and by
+// lo, cell (lo, lo..) being contiguous, rows of m_capacity cells so that
+// longer chains only append to them. Split points run the same kernels as
+// calc_mult_order_table() in reverse, so the plans cost the same as those of
+// calc_optimal_mult_plan(), but may break ties the other way.
+template <typename Flops = int>
+class BasicIncrementalMultPlanner {
+public:
+    BasicMultPlan<Flops> plan(const int *dims, std::size_t n);
+    void clear();
+
+    std::size_t size() const;
+    std::size_t get_num_computed() const;
+
+private:
+    void reserve(std::size_t n);
+    void calc_cell(std::size_t lo, std::size_t hi, ArgminSplitKernel::Func argmin);
+    std::size_t hi_index(std::size_t lo, std::size_t hi) const;
+    std::size_t lo_index(std::size_t lo, std::size_t hi) const;
+
+    std::size_t m_n = 0;
+    std::size_t m_capacity = 0;
+    std::size_t m_num_computed = 0;
+    std::vector<int> m_rdims;       // dims reversed, m_rdims[t] = dims[n - t]
+    std::vector<Flops> m_cost_hi;   // by hi, column hi holding (0..hi, hi)
+    std::vector<Flops> m_cost_lo;   // by lo, row lo holding (lo, lo..m_capacity - 1)
+    std::vector<int> m_split;       // by hi, the lo of the left subchain
+};
+
+using IncrementalMultPlanner = BasicIncrementalMultPlanner<int>;
+
+//==============================================================================
+// size ()
+//==============================================================================
+template <typename Flops>
+std::size_t BasicIncrementalMultPlanner<Flops>::size() const
+{
+    return m_n;
+}
+
+//==============================================================================
+// get_num_computed ()
+//==============================================================================
+// Cells the last plan() computed, the others being reused
+template <typename Flops>
+std::size_t BasicIncrementalMultPlanner<Flops>::get_num_computed() const
+{
+    return m_num_computed;
+}
+
+//==============================================================================
+// clear ()
+//==============================================================================
+// Forgets the tables, the next plan() computes every cell
+template <typename Flops>
+void BasicIncrementalMultPlanner<Flops>::clear()
+{
+    m_n = 0;
+    m_num_computed = 0;
+    m_rdims.clear();
+}
+
+//==============================================================================
+// hi_index ()
+//==============================================================================
+template <typename Flops>
+std::size_t BasicIncrementalMultPlanner<Flops>::hi_index(std::size_t lo, std::size_t hi) const
+{
+    return hi * (hi + 1) / 2 + lo;
+}
+
+//==============================================================================
+// lo_index ()
+//==============================================================================
+template <typename Flops>
+std::size_t BasicIncrementalMultPlanner<Flops>::lo_index(std::size_t lo, std::size_t hi) const
+{
+    return lo * m_capacity - lo * (lo - 1) / 2 + (hi - lo);
+}
+
+//==============================================================================
+// reserve ()
+//==============================================================================
+// Room for chains of n matrices; rows by lo are laid out again, keeping the
+// cells of the current chain, when n exceeds the capacity
+template <typename Flops>
+void BasicIncrementalMultPlanner<Flops>::reserve(std::size_t n)
+{
+    if (n > m_capacity) {
+        const std::size_t capacity = std::max(n, 2 * m_capacity);
+        std::vector<Flops> cost_lo(capacity * (capacity + 1) / 2);
+        for (std::size_t lo = 0; lo < m_n; lo++) {
+            const Flops *first = m_cost_lo.data() + lo_index(lo, lo);
+            std::copy(first, first + (m_n - lo), cost_lo.data() + (lo * capacity - lo * (lo - 1) / 2));
+        }
+        m_cost_lo.swap(cost_lo);
+        m_capacity = capacity;
+    }
+
+    m_cost_hi.resize(std::max(m_cost_hi.size(), n * (n + 1) / 2));
+    m_split.resize(m_cost_hi.size());
+}
+
+//==============================================================================
+// calc_cell ()
+//==============================================================================
+// A split at s(k) = lo + 1 + t costs cell(lo + 1 + t, hi) + cell(lo, lo + t)
+// + flops(dims[i], dims[k + 1], dims[j + 1]), that is
+// m_rdims[hi + 1] * m_rdims[lo + 1 + t] * (2 * m_rdims[lo] - 1), and all
+// three terms are contiguous in t. Unless argmin is null, the costs cannot
+// overflow; otherwise, as calc_cell_checked() does, overflowing splits are
+// skipped.
+template <typename Flops>
+void BasicIncrementalMultPlanner<Flops>::calc_cell(std::size_t lo, std::size_t hi, ArgminSplitKernel::Func argmin)
+{
+    using traits = flops_traits<Flops>;
+    const Flops overflow = traits::max();
+
+    const Flops *cost_left = m_cost_hi.data() + hi_index(lo + 1, hi);
+    const Flops *cost_right = m_cost_lo.data() + lo_index(lo, lo);
+    const int *dims_k = m_rdims.data() + lo + 1;
+    const std::size_t count = hi - lo;
+
+    if constexpr (std::is_same_v<Flops, int>) {
+        if (argmin) {
+            const auto [best_cost, best_t] =
+                argmin(cost_left, cost_right, dims_k, m_rdims[hi + 1] * (2 * m_rdims[lo] - 1), count);
+
+            m_cost_hi[hi_index(lo, hi)] = best_cost;
+            m_cost_lo[lo_index(lo, hi)] = best_cost;
+            m_split[hi_index(lo, hi)] = int(lo + 1 + best_t);
+            return;
+        }
+    }
+
+    Flops twice_dim_j = 0;
+    Flops scale = 0;
+    const bool scale_fits = traits::add(Flops(m_rdims[lo]), Flops(m_rdims[lo] - 1), twice_dim_j) &&
+                            traits::mul(Flops(m_rdims[hi + 1]), twice_dim_j, scale);
+
+    Flops best_cost = overflow;
+    std::size_t best_t = 0;
+    for (std::size_t t = 0; t < count && scale_fits; t++) {
+        Flops mult = 0;
+        Flops subchains = 0;
+        Flops cost = 0;
+        if (cost_left[t] == overflow || cost_right[t] == overflow ||
+            !traits::mul(scale, Flops(dims_k[t]), mult) ||
+            !traits::add(cost_left[t], cost_right[t], subchains) ||
+            !traits::add(subchains, mult, cost)) {
+            continue;
+        }
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_t = t;
+        }
+    }
+
+    m_cost_hi[hi_index(lo, hi)] = best_cost;
+    m_cost_lo[lo_index(lo, hi)] = best_cost;
+    m_split[hi_index(lo, hi)] = int(lo + 1 + best_t);
+}
+
+//==============================================================================
+// plan ()
+//==============================================================================
+// Optimal plan of the chain of n matrices, the i-th one being dims[i] x
+// dims[i + 1]. Cells of the columns hi < v are kept, v + 1 being the number
+// of trailing dims the chain shares with the previous one, the others are
+// computed column by column, each column from its longest subchain down.
+// Same overflow handling as calc_mult_order_table().
+template <typename Flops>
+BasicMultPlan<Flops> BasicIncrementalMultPlanner<Flops>::plan(const int *dims, std::size_t n)
+{
+    std::size_t shared = 0;
+    while (shared <= std::min(n, m_n) && !m_rdims.empty() && dims[n - shared] == m_rdims[shared]) {
+        shared++;
+    }
+    const std::size_t valid = std::min(n, (shared ? shared - 1 : 0));
+
+    // same test as calc_mult_order_table(), on the whole chain
+    const double max_dim = (n ? *std::max_element(dims, dims + n + 1) : 0);
+    const double max_order_cost = (n ? n - 1 : 0) * max_dim * max_dim * (2 * max_dim - 1);
+    const ArgminSplitKernel::Func argmin =
+        (max_order_cost <= std::numeric_limits<int>::max() ? get_argmin_split_kernel().func : nullptr);
+
+    reserve(n);
+    m_n = n;
+    m_rdims.resize(n + 1);
+    for (std::size_t t = shared; t < n + 1; t++) {
+        m_rdims[t] = dims[n - t];
+    }
+
+    m_num_computed = 0;
+    for (std::size_t hi = valid; hi < n; hi++) {
+        m_cost_hi[hi_index(hi, hi)] = 0;
+        m_cost_lo[lo_index(hi, hi)] = 0;
+        for (std::size_t lo = hi; lo-- > 0;) {
+            calc_cell(lo, hi, argmin);
+            m_num_computed++;
+        }
+    }
+
+    if (!flops_traits<Flops>::saturates && n && m_cost_hi[hi_index(0, n - 1)] == flops_traits<Flops>::max()) {
+        throw std::overflow_error("mult order: flops overflow");
+    }
+
+    const auto split = [this, n](int i, int j) { return int(n) - 1 - m_split[hi_index(n - 1 - j, n - 1 - i)]; };
+    return build_mult_plan<Flops>(dims, n, split);
+}
+
+//==============================================================================
+// MultChainBatch
+//==============================================================================
+// Struct-of-arrays batch of short chains for calc_optimal_mult_plans(): the
+// dims of every chain back to back in one array, and where each one starts.
+// Chain c is the chain of get_length(c) matrices, the i-th one being
+// get_dims(c)[i] x get_dims(c)[i + 1].
+class MultChainBatch {
+public:
+    static constexpr std::size_t max_length = 8;
+
+    void reserve(std::size_t num_chains, std::size_t num_dims);
+    void add(const int *dims, std::size_t n);
+    void clear();
+
+    std::size_t size() const;
+    std::size_t get_length(std::size_t c) const;
+    const int *get_dims(std::size_t c) const;
+
+private:
+    std::vector<int> m_dims;
+    std::vector<std::uint32_t> m_offsets = {0};  // chain c: m_dims[m_offsets[c], m_offsets[c + 1])
+};
+
+//==============================================================================
+// reserve ()
+//==============================================================================
+void MultChainBatch::reserve(std::size_t num_chains, std::size_t num_dims)
+{
+    m_offsets.reserve(num_chains + 1);
+    m_dims.reserve(num_dims);
+}
+
+//==============================================================================
+// add ()
+//==============================================================================
+// Appends the chain of n matrices, the i-th one being dims[i] x dims[i + 1]
+void MultChainBatch::add(const int *dims, std::size_t n)
+{
+    if (n > max_length) {
+        throw std::logic_error("mult chain batch: chain too long: " + std::to_string(n));
+    }
+
+    m_dims.insert(m_dims.end(), dims, dims + n + 1);
+    m_offsets.push_back(m_dims.size());
+}
+
+//==============================================================================
+// clear ()
+//==============================================================================
+void MultChainBatch::clear()
+{
+    m_dims.clear();
+    m_offsets.resize(1);
+}
+
+//==============================================================================
+// size ()
+//==============================================================================
+std::size_t MultChainBatch::size() const
+{
+    return m_offsets.size() - 1;
+}
+
+//==============================================================================
+// get_length ()
+//==============================================================================
+std::size_t MultChainBatch::get_length(std::size_t c) const
+{
+    return m_offsets[c + 1] - m_offsets[c] - 1;
+}
+
+//==============================================================================
+// get_dims ()
+//==============================================================================
+const int *MultChainBatch::get_dims(std::size_t c) const
+{
+    return m_dims.data() + m_offsets[c];
+}
+
+//==============================================================================
+// CompactMultPlan
+//==============================================================================
+// BasicMultPlan of a chain of at most MultChainBatch::max_length matrices in
+// 24 bytes, with no allocation: node t multiplies operands[2 * t] by
+// operands[2 * t + 1], numbered as in BasicMultPlan. Shapes and the flops of
+// each node follow from the chain's dims, see to_plan().
+struct CompactMultPlan {
+    std::int64_t flops = 0;  // flops of the whole plan
+    std::uint8_t num_inputs = 0;
+    std::array<std::uint8_t, 2 * (MultChainBatch::max_length - 1)> operands = {};
+
+    BasicMultPlan<std::int64_t> to_plan(const int *dims) const;
+};
+
+//==============================================================================
+// to_plan ()
+//==============================================================================
+// The same plan in full, dims being those of the chain it was made for
+BasicMultPlan<std::int64_t> CompactMultPlan::to_plan(const int *dims) const
+{
+    BasicMultPlan<std::int64_t> plan;
+    plan.num_inputs = num_inputs;
+    plan.flops = flops;
+
+    // row of the first and column past the last matrix of each operand
+    std::array<std::pair<int, int>, 2 * MultChainBatch::max_length - 1> spans;
+    for (int i = 0; i < num_inputs; i++) {
+        spans[i] = {i, i + 1};
+    }
+    for (int t = 0; t + 1 < num_inputs; t++) {
+        const std::pair<int, int> left = spans[operands[2 * t]];
+        const std::pair<int, int> right = spans[operands[2 * t + 1]];
+        spans[num_inputs + t] = {left.first, right.second};
+        plan.nodes.push_back({operands[2 * t], operands[2 * t + 1], dims[left.first], dims[right.second],
+                              calc_mult_flops<std::int64_t>(dims[left.first], dims[left.second], dims[right.second])});
+    }
+
+    return plan;
+}
+
+//==============================================================================
+// build_compact_mult_plan ()
+//==============================================================================
+// Post-order walk of subchain i..j of the n-matrix chain, split at split(i, j)
+// like build_mult_plan(); returns the operand holding its product
+template <typename SplitFn>
+int build_compact_mult_plan(const int *dims, int n, int i, int j, const SplitFn& split, CompactMultPlan& plan,
+                            int& num_nodes)
+{
+    if (i == j) {
+        return i;
+    }
+
+    const int k = split(i, j);
+    const int left = build_compact_mult_plan(dims, n, i, k, split, plan, num_nodes);
+    const int right = build_compact_mult_plan(dims, n, k + 1, j, split, plan, num_nodes);
+    plan.operands[2 * num_nodes] = left;
+    plan.operands[2 * num_nodes + 1] = right;
+    plan.flops += calc_mult_flops<std::int64_t>(dims[i], dims[k + 1], dims[j + 1]);
+
+    return n + num_nodes++;
+}
+
+#if defined(__GNUC__)
+//==============================================================================
+// BatchMultOrderKernel
+//==============================================================================
+// Chain DP of calc_mult_order_table() over batch_lanes chains of the same
+// length n at once, one vector lane per chain: dims[p] holds dimension p of
+// every chain, and on return split[i * max_length + j] the split point of
+// subchain i..j of every chain. Costs are doubles, exact as long as no order
+// of the chains costs more than 2^53 flops. Ties keep the first split point,
+// so plans match calc_optimal_mult_plan() exactly.
+constexpr std::size_t batch_lanes = 8;
+typedef double BatchLanes __attribute__((vector_size(batch_lanes * sizeof(double))));
+
+struct BatchMultOrderKernel {
+    using Func = void (*)(const BatchLanes *dims, std::size_t n, BatchLanes *split);
+
+    const char *name;
+    Func func;
+};
+
+//==============================================================================
+// batch_mult_order_lanes ()
+//==============================================================================
+// Shared body of the kernels, compiled once per target they are built for
+__attribute__((always_inline))
+inline void batch_mult_order_lanes(const BatchLanes *dims, std::size_t n, BatchLanes *split)
+{
+    constexpr std::size_t max_length = MultChainBatch::max_length;
+    BatchLanes cost[max_length][max_length];
+    for (std::size_t i = 0; i < n; i++) {
+        cost[i][i] = BatchLanes{};
+    }
+
+    for (std::size_t length = 2; length < n + 1; length++) {
+        for (std::size_t i = 0; i + length < n + 1; i++) {
+            const std::size_t j = i + length - 1;
+            // flops(dim1, dim2, dim3) = dim1 * dim2 * (2 * dim3 - 1)
+            const BatchLanes scale = dims[i] * (2 * dims[j + 1] - 1);
+            BatchLanes best_cost = cost[i + 1][j] + dims[i + 1] * scale;
+            BatchLanes best_k = BatchLanes{} + double(i);
+            for (std::size_t k = i + 1; k < j; k++) {
+                const BatchLanes cost_k = cost[i][k] + cost[k + 1][j] + dims[k + 1] * scale;
+                const auto smaller = cost_k < best_cost;
+                best_cost = (smaller ? cost_k : best_cost);
+                best_k = (smaller ? BatchLanes{} + double(k) : best_k);
+            }
+            cost[i][j] = best_cost;
+            split[i * max_length + j] = best_k;
+        }
+    }
+}
+
+//==============================================================================
+// batch_mult_order_generic ()
+//==============================================================================
+static void batch_mult_order_generic(const BatchLanes *dims, std::size_t n, BatchLanes *split)
+{
+    batch_mult_order_lanes(dims, n, split);
+}
+
+#if defined(__x86_64__)
+//==============================================================================
+// batch_mult_order_avx2 ()
+//==============================================================================
+__attribute__((target("avx2")))
+static void batch_mult_order_avx2(const BatchLanes *dims, std::size_t n, BatchLanes *split)
+{
+    batch_mult_order_lanes(dims, n, split);
+}
+
+//==============================================================================
+// batch_mult_order_avx512 ()
+//==============================================================================
+__attribute__((target("avx512f")))
+static void batch_mult_order_avx512(const BatchLanes *dims, std::size_t n, BatchLanes *split)
+{
+    batch_mult_order_lanes(dims, n, split);
+}
+#endif
+
+//==============================================================================
+// get_batch_mult_order_kernels ()
+//==============================================================================
+// All kernels this CPU can run, best first
+static const std::vector<BatchMultOrderKernel>& get_batch_mult_order_kernels()
+{
+    static const std::vector<BatchMultOrderKernel> kernels = []() {
+        std::vector<BatchMultOrderKernel> res;
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            res.push_back({"avx512", batch_mult_order_avx512});
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            res.push_back({"avx2", batch_mult_order_avx2});
+        }
+#endif
+        // SSE2 on x86-64, NEON on aarch64
+        res.push_back({"generic", batch_mult_order_generic});
+        return res;
+    }();
+
+    return kernels;
+}
+#endif
+
+//==============================================================================
+// calc_optimal_mult_plans ()
+//==============================================================================
+// Optimal plans of every chain of batch, the same as calc_optimal_mult_plan()
+// would give one by one, without its allocations and string building. Chains
+// are bucketed by length and solved batch_lanes at a time, one SIMD lane per
+// chain; groups of lanes are split across pool when one is given. Chains that
+// might cost more than 2^53 flops go through the exact checked DP instead.
+// Throws std::overflow_error if a chain's cheapest order does not fit in
+// std::int64_t.
+// kernel_index picks one of get_batch_mult_order_kernels(), for the tests.
+std::vector<CompactMultPlan> calc_optimal_mult_plans(const MultChainBatch& batch, ThreadPool *pool = nullptr,
+                                                    std::size_t kernel_index = 0)
+{
+    constexpr std::size_t max_length = MultChainBatch::max_length;
+    constexpr double max_exact_cost = 9007199254740992.0;  // 2^53
+
+    std::vector<CompactMultPlan> plans(batch.size());
+    const auto solve_checked = [&](std::size_t c) {
+        const int *dims = batch.get_dims(c);
+        const int n = batch.get_length(c);
+        const BasicMultPlan<std::int64_t> plan = calc_optimal_mult_plan<std::int64_t>(dims, n);
+        plans[c].num_inputs = n;
+        plans[c].flops = plan.flops;
+        for (std::size_t t = 0; t < plan.nodes.size(); t++) {
+            plans[c].operands[2 * t] = plan.nodes[t].left;
+            plans[c].operands[2 * t + 1] = plan.nodes[t].right;
+        }
+    };
+
+#if defined(__GNUC__)
+    const BatchMultOrderKernel::Func kernel = get_batch_mult_order_kernels().at(kernel_index).func;
+
+    // chains of each length, in batch order; the others are solved on the spot
+    std::array<std::vector<std::uint32_t>, max_length + 1> by_length;
+    for (std::size_t c = 0; c < batch.size(); c++) {
+        const int *dims = batch.get_dims(c);
+        const std::size_t n = batch.get_length(c);
+        // any order costs at most (n - 1) products of max_dim * max_dim * (2 * max_dim - 1)
+        const double max_dim = *std::max_element(dims, dims + n + 1);
+        const double max_order_cost = (n ? n - 1 : 0) * max_dim * max_dim * (2 * max_dim - 1);
+        if (n < 3 || max_order_cost > max_exact_cost) {
+            solve_checked(c);
+        } else {
+            by_length[n].push_back(c);
+        }
+    }
+
+    struct Group {
+        const std::uint32_t *chains;
+        std::size_t count;  // at most batch_lanes
+        std::size_t n;
+    };
+    std::vector<Group> groups;
+    for (std::size_t n = 0; n < max_length + 1; n++) {
+        for (std::size_t first = 0; first < by_length[n].size(); first += batch_lanes) {
+            groups.push_back({by_length[n].data() + first, std::min(batch_lanes, by_length[n].size() - first), n});
+        }
+    }
+
+    const auto solve_groups = [&](std::size_t first, std::size_t last) {
+        for (std::size_t g = first; g < last; g++) {
+            const Group& group = groups[g];
+            // transpose to one vector per dimension, idle lanes repeating the first chain
+            BatchLanes dims[max_length + 1];
+            BatchLanes split[max_length * max_length];
+            for (std::size_t p = 0; p < group.n + 1; p++) {
+                for (std::size_t l = 0; l < batch_lanes; l++) {
+                    dims[p][l] = batch.get_dims(group.chains[l < group.count ? l : 0])[p];
+                }
+            }
+
+            kernel(dims, group.n, split);
+
+            for (std::size_t l = 0; l < group.count; l++) {
+                const std::size_t c = group.chains[l];
+                const auto split_at = [&split, l](int i, int j) {
+                    return int(split[i * MultChainBatch::max_length + j][l]);
+                };
+                int num_nodes = 0;
+                plans[c].num_inputs = group.n;
+                build_compact_mult_plan(batch.get_dims(c), group.n, 0, group.n - 1, split_at, plans[c],
+                                        num_nodes);
+            }
+        }
+    };
+
+    // groups of about 2^14 split iterations each
+    const std::size_t grain = 64;
+    if (pool) {
+        parallel_for(*pool, 0, groups.size(), grain, solve_groups);
+    } else {
+        solve_groups(0, groups.size());
+    }
+#else
+    (void)pool;
+    (void)kernel_index;
+    for (std::size_t c = 0; c < batch.size(); c++) {
+        solve_checked(c);
+    }
+#endif
+
+    return plans;
+}
+
+//==============================================================================
+// FlopsCostModel
+//==============================================================================
+// Cost models predict the seconds a dim1 x dim2 by dim2 x dim3 product takes,
+// through double predict(int dim1, int dim2, int dim3) const. Any such type
+// plugs into calc_fastest_mult_plan(). This one is calc_mult_flops() at a
+// fixed rate: it orders plans exactly as the flops DP.
+struct FlopsCostModel {
+    double gflops = 1;
+
+    double predict(int dim1, int dim2, int dim3) const;
+};
+
+//==============================================================================
+// predict ()
+//==============================================================================
+double FlopsCostModel::predict(int dim1, int dim2, int dim3) const
+{
+    return calc_mult_flops<double>(dim1, dim2, dim3) / (gflops * 1e9);
+}
+
+//==============================================================================
+// RooflineCostModel
+//==============================================================================
+// A product is bound either by compute, the 2 * dim1 * dim2 * dim3 flops gemm()
+// really executes, or by memory, both operands read and the result written
+// once, plus a fixed overhead per product. Skinny products come out memory
+// bound and tiny ones overhead bound, where raw flops call them nearly free.
+struct RooflineCostModel {
+    double peak_gflops = 50;
+    double bandwidth_gbs = 10;
+    std::size_t elem_size = sizeof(double);
+    double overhead_s = 1e-6;  // call, packing setup
+
+    double predict(int dim1, int dim2, int dim3) const;
+};
+
+//==============================================================================
+// predict ()
+//==============================================================================
+double RooflineCostModel::predict(int dim1, int dim2, int dim3) const
+{
+    const double flops = 2.0 * dim1 * dim2 * dim3;
+    const double bytes = (double(dim1) * dim2 + double(dim2) * dim3 + double(dim1) * dim3) * elem_size;
+
+    return std::max(flops / (peak_gflops * 1e9), bytes / (bandwidth_gbs * 1e9)) + overhead_s;
+}
+
+//==============================================================================
+// MeasuredCostModel
+//==============================================================================
+// GFLOP/s achieved by gemm() on a grid of shapes, every dimension taken from
+// the same ascending list of sizes. predict() interpolates the rate linearly
+// in log2 of the dimensions, clamped to the grid, so it follows how the
+// target machine really behaves on small and skinny shapes.
+class MeasuredCostModel {
+public:
+    // gflops[(a * nsizes + b) * nsizes + c] for a sizes[a] x sizes[b] by
+    // sizes[b] x sizes[c] product
+    MeasuredCostModel(std::vector<int> sizes, std::vector<double> gflops);
+
+    const std::vector<int>& get_sizes() const;
+    const std::vector<double>& get_gflops() const;
+    double predict(int dim1, int dim2, int dim3) const;
+
+    // measures gemm<double>() on this machine, each shape for min_seconds
+    static MeasuredCostModel calibrate(std::vector<int> sizes, double min_seconds = 0.01);
+
+private:
+    std::vector<int> m_sizes;
+    std::vector<double> m_log_sizes;
+    std::vector<double> m_gflops;
+};
+
+//==============================================================================
+// MeasuredCostModel ()
+//==============================================================================
+MeasuredCostModel::MeasuredCostModel(std::vector<int> sizes, std::vector<double> gflops)
+    : m_sizes(std::move(sizes)),
+      m_gflops(std::move(gflops))
+{
+    if (m_sizes.empty() || m_gflops.size() != m_sizes.size() * m_sizes.size() * m_sizes.size() ||
+        !std::is_sorted(m_sizes.begin(), m_sizes.end()) || m_sizes.front() < 1) {
+        throw std::logic_error("cost model: bad grid");
+    }
+
+    for (int size : m_sizes) {
+        m_log_sizes.push_back(std::log2(double(size)));
+    }
+}
+
+//==============================================================================
+// get_sizes ()
+//==============================================================================
+const std::vector<int>& MeasuredCostModel::get_sizes() const
+{
+    return m_sizes;
+}
+
+//==============================================================================
+// get_gflops ()
+//==============================================================================
+const std::vector<double>& MeasuredCostModel::get_gflops() const
+{
+    return m_gflops;
+}
+
+//==============================================================================
+// predict ()
+//==============================================================================
+double MeasuredCostModel::predict(int dim1, int dim2, int dim3) const
+{
+    const std::size_t nsizes = m_sizes.size();
+
+    // grid cell and weight of the upper corner along one dimension
+    const auto locate = [&](int dim, std::size_t& lo, double& weight) {
+        const double x = std::log2(double(std::max(dim, 1)));
+        const std::size_t hi = std::upper_bound(m_log_sizes.begin(), m_log_sizes.end(), x) - m_log_sizes.begin();
+        if (hi == 0 || hi == nsizes) {
+            lo = (hi == 0 ? 0 : nsizes - 1);
+            weight = 0;
+        } else {
+            lo = hi - 1;
+            weight = (x - m_log_sizes[lo]) / (m_log_sizes[hi] - m_log_sizes[lo]);
+        }
+    };
+
+    std::size_t lo[3] = {};
+    double weight[3] = {};
+    locate(dim1, lo[0], weight[0]);
+    locate(dim2, lo[1], weight[1]);
+    locate(dim3, lo[2], weight[2]);
+
+    double gflops = 0;
+    for (int corner = 0; corner < 8; corner++) {
+        double w = 1;
+        std::size_t index = 0;
+        for (int d = 0; d < 3; d++) {
+            const bool up = (corner >> d) & 1;
+            w *= (up ? weight[d] : 1 - weight[d]);
+            index = index * nsizes + std::min(lo[d] + up, nsizes - 1);
+        }
+        gflops += w * m_gflops[index];
+    }
+
+    return 2.0 * dim1 * dim2 * dim3 / (gflops * 1e9);
+}
+
+//==============================================================================
+// calibrate ()
+//==============================================================================
+MeasuredCostModel MeasuredCostModel::calibrate(std::vector<int> sizes, double min_seconds)
+{
+    // the same checks as the constructor, before the sizes are used
+    if (sizes.empty() || *std::min_element(sizes.begin(), sizes.end()) < 1) {
+        throw std::logic_error("cost model: bad grid");
+    }
+
+    const int max_size = *std::max_element(sizes.begin(), sizes.end());
+    std::vector<double> A(std::size_t(max_size) * max_size, 1.0);
+    std::vector<double> B(std::size_t(max_size) * max_size, 1.0);
+    std::vector<double> C(std::size_t(max_size) * max_size);
+
+    std::vector<double> gflops;
+    for (int dim1 : sizes) {
+        for (int dim2 : sizes) {
+            for (int dim3 : sizes) {
+                int reps = 0;
+                const auto start = std::chrono::steady_clock::now();
+                std::chrono::duration<double> elapsed(0);
+                do {
+                    gemm(dim1, dim3, dim2, 1.0, A.data(), dim2, B.data(), dim3, 0.0, C.data(), dim3);
+                    reps++;
+                    elapsed = std::chrono::steady_clock::now() - start;
+                } while (elapsed.count() < min_seconds);
+                gflops.push_back(2.0 * dim1 * dim2 * dim3 * reps / elapsed.count() / 1e9);
+            }
+        }
+    }
+
+    return MeasuredCostModel(std::move(sizes), std::move(gflops));
+}
+
+//==============================================================================
+// OutOfCoreCostModel
+//==============================================================================
+// in_memory, plus the disk traffic of products that do not fit in
+// memory_bytes: out_of_core_mult() reads the left operand once, the right
+// one once per panel of the left filling half the memory, and writes the
+// product. Plans that would spill a huge intermediate pay for it twice
+// (written, then streamed by its consumer), so the planner only does it when
+// every order has to.
+struct OutOfCoreCostModel {
+    RooflineCostModel in_memory;
+    double disk_gbs = 0.5;
+    std::int64_t memory_bytes = std::int64_t(1) << 30;
+
+    double predict(int dim1, int dim2, int dim3) const;
+};
+
+//==============================================================================
+// predict ()
+//==============================================================================
+double OutOfCoreCostModel::predict(int dim1, int dim2, int dim3) const
+{
+    const double elem_size = double(in_memory.elem_size);
+    const double a = double(dim1) * dim2 * elem_size;
+    const double b = double(dim2) * dim3 * elem_size;
+    const double c = double(dim1) * dim3 * elem_size;
+    const double seconds = in_memory.predict(dim1, dim2, dim3);
+    if (a + b + c <= double(memory_bytes)) {
+        return seconds;
+    }
+
+    const double panels = std::max(1.0, std::ceil(a / (double(memory_bytes) / 2)));
+    return seconds + (a + b * panels + c) / (disk_gbs * 1e9);
+}
+
+//==============================================================================
+// PrecisionCostModel
+//==============================================================================
+// RooflineCostModel of products run in one Precision: calc_mult_flops() still
+// counts the work, at the fp64 peak times the throughput of the precision,
+// and the traffic is that of the narrow elements in and the accumulators out.
+// The default throughputs, relative to fp64, are what the widest kernels of
+// mixed_mult() do per instruction on AVX-512 (FMA, BF16, VNNI); bench-mixed
+// measures them on the machine.
+struct PrecisionCostModel {
+    RooflineCostModel fp64;
+    std::array<double, num_precisions> throughput = {1, 2, 4, 2, 8};  // by Precision
+    Precision precision = Precision::fp64;
+
+    double predict(int dim1, int dim2, int dim3) const;
+};
+
+//==============================================================================
+// predict ()
+//==============================================================================
+double PrecisionCostModel::predict(int dim1, int dim2, int dim3) const
+{
+    const auto [elem_size, acc_size] = get_precision_sizes(precision);
+    const double flops = 2.0 * dim1 * dim2 * dim3;
+    const double bytes = (double(dim1) * dim2 + double(dim2) * dim3) * elem_size + double(dim1) * dim3 * acc_size;
+    const double gflops = fp64.peak_gflops * throughput[std::size_t(precision)];
+
+    return std::max(flops / (gflops * 1e9), bytes / (fp64.bandwidth_gbs * 1e9)) + fp64.overhead_s;
+}
+
+//==============================================================================
+// calc_fastest_mult_plan ()
+//==============================================================================
+// Plan of the chain of n matrices with the least time predicted by model (see
+// FlopsCostModel), instead of the fewest nominal flops. The nodes still count
+// calc_mult_flops().
+template <typename Flops = int, typename CostModel>
+BasicMultPlan<Flops> calc_fastest_mult_plan(const int *dims, std::size_t n, const CostModel& model)
+{
+    const auto mult_cost = [&model](int dim1, int dim2, int dim3) { return model.predict(dim1, dim2, dim3); };
+
+    return calc_mult_plan_with_cost<Flops>(dims, n, mult_cost, calc_mult_flops<Flops>);
+}
+
+//==============================================================================
+// predict_mult_plan_seconds ()
+//==============================================================================
+// Time model predicts for the plan of the chain dims was planned for
+template <typename Flops, typename CostModel>
+double predict_mult_plan_seconds(const BasicMultPlan<Flops>& plan, const int *dims, const CostModel& model)
+{
+    const auto ncol = [&](int op) {
+        return (op < plan.num_inputs ? dims[op + 1] : plan.nodes[op - plan.num_inputs].ncol);
+    };
+
+    double seconds = 0;
+    for (const auto& node : plan.nodes) {
+        seconds += model.predict(node.nrow, ncol(node.left), node.ncol);
+    }
+
+    return seconds;
+}
+
+//==============================================================================
+// PrecisionMultPlan
+//==============================================================================
+template <typename Flops>
+struct PrecisionMultPlan {
+    Precision precision;
+    BasicMultPlan<Flops> plan;
+    double seconds;  // as predicted
+};
+
+//==============================================================================
+// calc_mult_plan_for_latency ()
+//==============================================================================
+// Precision and plan for the chain of n matrices within latency_s: the first
+// of precisions (most accurate first) whose fastest plan under model takes at
+// most latency_s, or the fastest of all when none does. Order and precision
+// are picked together, as narrow elements move less data and can change
+// which order is the fastest.
+template <typename Flops = std::int64_t>
+PrecisionMultPlan<Flops> calc_mult_plan_for_latency(const int *dims, std::size_t n, double latency_s,
+                                                    PrecisionCostModel model,
+                                                    std::initializer_list<Precision> precisions = {
+                                                        Precision::fp64, Precision::fp32, Precision::fp16,
+                                                        Precision::bf16, Precision::int8})
+{
+    if (precisions.size() == 0) {
+        throw std::logic_error("latency plan: no precision to choose from");
+    }
+
+    std::optional<PrecisionMultPlan<Flops>> fastest;
+    for (Precision precision : precisions) {
+        model.precision = precision;
+        BasicMultPlan<Flops> plan = calc_fastest_mult_plan<Flops>(dims, n, model);
+        const double seconds = predict_mult_plan_seconds(plan, dims, model);
+        if (seconds <= latency_s) {
+            return {precision, std::move(plan), seconds};
+        }
+        if (!fastest || seconds < fastest->seconds) {
+            fastest = PrecisionMultPlan<Flops>{precision, std::move(plan), seconds};
+        }
+    }
+
+    return *fastest;
+}
+
+//==============================================================================
+// for_each_mult_plan ()
+//==============================================================================
+// Calls func(plan) for every parenthesization of the chain of n matrices,
+// there are Catalan(n - 1) of them: meant for short chains
+template <typename Flops, typename Func>
+void for_each_mult_plan(const int *dims, std::size_t n, const Func& func)
+{
+    std::vector<int> split(n * n, 0);
+    std::vector<std::pair<int, int>> pending = {{0, int(n) - 1}};
+    const std::function<void()> next = [&]() {
+        if (pending.empty()) {
+            func(build_mult_plan<Flops>(dims, n, [&](int i, int j) { return split[i * n + j]; }));
+            return;
+        }
+        const auto [i, j] = pending.back();
+        pending.pop_back();
+        if (i == j) {
+            next();
+        } else {
+            for (int k = i; k < j; k++) {
+                split[i * n + j] = k;
+                pending.push_back({k + 1, j});
+                pending.push_back({i, k});
+                next();
+                pending.pop_back();
+                pending.pop_back();
+            }
+        }
+        pending.push_back({i, j});
+    };
+    next();
+}
+
+//==============================================================================
+// MachineProfile
+//==============================================================================
+// What bench_autotune() measured on a machine, saved as "key values..." text
+// lines. apply() hands the kernel choices to gemm<double>() and
+// StrassenPolicy::global() and sizes ThreadPool::global(), so it must run
+// while no task does; the cost models are built from the rest.
+struct MachineProfile {
+    GemmTuning<double>::Blocks gemm_blocks = {GemmBlocking<double>::MC, GemmBlocking<double>::KC,
+                                              GemmBlocking<double>::NC};
+    int strassen_crossover = 0;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());  // fastest for the parallel kernels
+    double peak_gflops = RooflineCostModel().peak_gflops;       // best gemm() rate measured
+    double bandwidth_gbs = RooflineCostModel().bandwidth_gbs;   // best fused_sum() rate measured
+    std::vector<int> cost_sizes;
+    std::vector<double> cost_gflops;
+
+    void apply() const;
+    MeasuredCostModel get_measured_cost_model() const;
+    RooflineCostModel get_roofline_cost_model() const;
+    std::unique_ptr<ThreadPool> make_thread_pool() const;
+
+    void save(const std::string& path) const;
+    static MachineProfile load(const std::string& path);
+};
+
+//==============================================================================
+// apply ()
+//==============================================================================
+void MachineProfile::apply() const
+{
+    GemmTuning<double>::global().set_blocks(gemm_blocks);
+    StrassenPolicy::global().set_crossover(strassen_crossover);
+    if (ThreadPool::global().get_concurrency() != std::max(1u, threads)) {
+        ThreadPool::global().resize(std::max(1u, threads) - 1);
+    }
+}
+
+//==============================================================================
+// get_measured_cost_model ()
+//==============================================================================
+MeasuredCostModel MachineProfile::get_measured_cost_model() const
+{
+    return MeasuredCostModel(cost_sizes, cost_gflops);
+}
+
+//==============================================================================
+// get_roofline_cost_model ()
+//==============================================================================
+RooflineCostModel MachineProfile::get_roofline_cost_model() const
+{
+    RooflineCostModel model;
+    model.peak_gflops = peak_gflops;
+    model.bandwidth_gbs = bandwidth_gbs;
+
+    return model;
+}
+
+//==============================================================================
+// make_thread_pool ()
+//==============================================================================
+// Pool of the profiled thread count, the calling thread included
+std::unique_ptr<ThreadPool> MachineProfile::make_thread_pool() const
+{
+    return std::make_unique<ThreadPool>(std::max(1u, threads) - 1);
+}
+
+//==============================================================================
+// save ()
+//==============================================================================
+void MachineProfile::save(const std::string& path) const
+{
+    std::ofstream out(path);
+    out.precision(17);
+    out << "# machine profile, see bench_autotune()\n";
+    out << "gemm_blocks " << gemm_blocks.mc << ' ' << gemm_blocks.kc << ' ' << gemm_blocks.nc << '\n';
+    out << "strassen_crossover " << strassen_crossover << '\n';
+    out << "threads " << threads << '\n';
+    out << "peak_gflops " << peak_gflops << '\n';
+    out << "bandwidth_gbs " << bandwidth_gbs << '\n';
+    out << "cost_sizes";
+    for (int size : cost_sizes) {
+        out << ' ' << size;
+    }
+    out << "\ncost_gflops";
+    for (double gflops : cost_gflops) {
+        out << ' ' << gflops;
+    }
+    out << '\n';
+
+    if (!out) {
+        throw std::runtime_error("profile: cannot write " + path);
+    }
+}
+
+//==============================================================================
+// load ()
+//==============================================================================
+// Unknown keys are skipped, so that older binaries read newer profiles
+MachineProfile MachineProfile::load(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("profile: cannot read " + path);
+    }
+
+    MachineProfile profile;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        if (!(fields >> key) || key[0] == '#') {
+            continue;
+        }
+
+        if (key == "gemm_blocks") {
+            fields >> profile.gemm_blocks.mc >> profile.gemm_blocks.kc >> profile.gemm_blocks.nc;
+        } else if (key == "strassen_crossover") {
+            fields >> profile.strassen_crossover;
+        } else if (key == "threads") {
+            fields >> profile.threads;
+        } else if (key == "peak_gflops") {
+            fields >> profile.peak_gflops;
+        } else if (key == "bandwidth_gbs") {
+            fields >> profile.bandwidth_gbs;
+        } else if (key == "cost_sizes") {
+            for (int size = 0; fields >> size;) {
+                profile.cost_sizes.push_back(size);
+            }
+            if (fields.eof()) {
+                fields.clear(std::ios::eofbit);
+            }
+        } else if (key == "cost_gflops") {
+            for (double gflops = 0; fields >> gflops;) {
+                profile.cost_gflops.push_back(gflops);
+            }
+            if (fields.eof()) {
+                fields.clear(std::ios::eofbit);
+            }
+        }
+        if (fields.fail()) {
+            throw std::runtime_error("profile: bad line in " + path + ": " + line);
+        }
+    }
+
+    return profile;
+}
+
+//==============================================================================
+// calc_optimal_mult_plan ()
+//==============================================================================
+template <typename Flops = int>
+BasicMultPlan<Flops> calc_optimal_mult_plan(std::initializer_list<const BasicMatrix<Flops>> mats,
+                                            MultOrderSolver solver = MultOrderSolver::dp)
+{
+    std::vector<int> dims;
+    if (mats.size()) {
+        dims.reserve(mats.size() + 1);
+        for (const BasicMatrix<Flops>& mat : mats) {
+            dims.push_back(mat.get_nrow());
+        }
+        dims.push_back((mats.end() - 1)->get_ncol());
+    }
+
+    return calc_optimal_mult_plan<Flops>(dims.data(), mats.size(), solver);
+}
+
+//==============================================================================
+// calc_pareto_mult_plans ()
+//==============================================================================
+// Plans of the chain of n matrices on the Pareto front of flops vs peak bytes
+// (see get_peak_bytes()), by increasing flops and so decreasing peak bytes.
+// Plans peaking above max_peak_bytes, or whose flops overflow, are dropped.
+// The front of every subchain is built from the fronts of its two halves; this
+// is exact as the peak of a product only grows with the peaks of its operands,
+// but the fronts, and so the cost, can grow well past the O(n^3) of the
+// flops-only DP.
+template <typename Flops = int>
+std::vector<BasicMultPlan<Flops>> calc_pareto_mult_plans(const int *dims, std::size_t n, std::size_t elem_size,
+                                                         std::int64_t max_peak_bytes =
+                                                             std::numeric_limits<std::int64_t>::max())
+{
+    using traits = flops_traits<Flops>;
+
+    if (n < 2) {
+        return {build_mult_plan<Flops>(dims, n, [](int, int) { return 0; })};
+    }
+
+    struct Entry {
+        Flops flops;
+        std::int64_t peak;
+        int k;      // split of the subchain
+        int left;   // entry in the front of i..k
+        int right;  // entry in the front of k+1..j
+    };
+    std::vector<std::vector<Entry>> fronts(n * n);
+    const auto front = [&](std::size_t i, std::size_t j) -> std::vector<Entry>& { return fronts[i * n + j]; };
+    const auto bytes = [&](std::size_t i, std::size_t j) -> std::int64_t {
+        return (i == j ? 0 : checked_mul(checked_mul(std::int64_t(dims[i]), std::int64_t(dims[j + 1])),
+                                         std::int64_t(elem_size)));
+    };
+    for (std::size_t i = 0; i < n; i++) {
+        front(i, i).push_back({0, 0, int(i), 0, 0});
+    }
+
+    std::vector<Entry> candidates;
+    for (std::size_t length = 2; length < n + 1; length++) {
+        for (std::size_t i = 0; i < n - length + 1; i++) {
+            const std::size_t j = i + length - 1;
+            const std::int64_t res_bytes = bytes(i, j);
+
+            candidates.clear();
+            for (std::size_t k = i; k < j; k++) {
+                // flops(dim1, dim2, dim3) = dim1 * dim2 * (2 * dim3 - 1)
+                Flops twice_dim_j = 0;
+                Flops scale = 0;
+                Flops mult = 0;
+                if (!traits::add(Flops(dims[j + 1]), Flops(dims[j + 1] - 1), twice_dim_j) ||
+                    !traits::mul(Flops(dims[i]), twice_dim_j, scale) ||
+                    !traits::mul(scale, Flops(dims[k + 1]), mult)) {
+                    continue;
+                }
+
+                const std::int64_t left_bytes = bytes(i, k);
+                const std::int64_t right_bytes = bytes(k + 1, j);
+                const std::vector<Entry>& left_front = front(i, k);
+                const std::vector<Entry>& right_front = front(k + 1, j);
+                for (std::size_t l = 0; l < left_front.size(); l++) {
+                    for (std::size_t r = 0; r < right_front.size(); r++) {
+                        // the left operand stays alive while the right one is computed
+                        const std::int64_t peak = std::max({left_front[l].peak,
+                                                            checked_add(left_bytes, right_front[r].peak),
+                                                            checked_add(checked_add(left_bytes, right_bytes), res_bytes)});
+                        Flops subchains = 0;
+                        Flops flops = 0;
+                        if (peak > max_peak_bytes ||
+                            !traits::add(left_front[l].flops, right_front[r].flops, subchains) ||
+                            !traits::add(subchains, mult, flops)) {
+                            continue;
+                        }
+                        candidates.push_back({flops, peak, int(k), int(l), int(r)});
+                    }
+                }
+            }
+
+            // keep the non-dominated candidates, first found wins ties as in the DP
+            std::stable_sort(candidates.begin(), candidates.end(), [](const Entry& a, const Entry& b) {
+                return (a.flops < b.flops || (a.flops == b.flops && a.peak < b.peak));
+            });
+            std::vector<Entry>& res = front(i, j);
+            for (const Entry& candidate : candidates) {
+                if (res.empty() || candidate.peak < res.back().peak) {
+                    res.push_back(candidate);
+                }
+            }
+        }
+    }
+
+    // chosen entry of every subchain of a plan, each subchain appears once
+    std::vector<int> chosen(n * n, -1);
+    std::vector<BasicMultPlan<Flops>> plans;
+    plans.reserve(front(0, n - 1).size());
+    for (std::size_t e = 0; e < front(0, n - 1).size(); e++) {
+        std::vector<std::pair<std::size_t, std::size_t>> stack = {{0, n - 1}};
+        chosen[n - 1] = int(e);
+        while (!stack.empty()) {
+            const auto [i, j] = stack.back();
+            stack.pop_back();
+            const Entry& entry = front(i, j)[chosen[i * n + j]];
+            if (i == j) {
+                continue;
+            }
+            chosen[i * n + entry.k] = entry.left;
+            chosen[(entry.k + 1) * n + j] = entry.right;
+            stack.push_back({i, std::size_t(entry.k)});
+            stack.push_back({std::size_t(entry.k) + 1, j});
+        }
+        const auto split = [&](int i, int j) { return front(i, j)[chosen[i * n + j]].k; };
+        plans.push_back(build_mult_plan<Flops>(dims, n, split));
+    }
+
+    return plans;
+}
+
+//==============================================================================
+// calc_memory_bounded_mult_plan ()
+//==============================================================================
+// Plan with the fewest flops among those peaking at most max_peak_bytes
+// intermediate bytes, for elements of elem_size bytes
+template <typename Flops = int>
+BasicMultPlan<Flops> calc_memory_bounded_mult_plan(const int *dims, std::size_t n, std::size_t elem_size,
+                                                   std::int64_t max_peak_bytes)
+{
+    std::vector<BasicMultPlan<Flops>> plans = calc_pareto_mult_plans<Flops>(dims, n, elem_size, max_peak_bytes);
+    if (plans.empty()) {
+        throw std::runtime_error("mult order: no plan fits in " + std::to_string(max_peak_bytes) + " bytes");
+    }
+
+    return std::move(plans.front());
+}
+
+//==============================================================================
+// execute_mult_plan ()
+//==============================================================================
+// Multiplies inputs[0..n-1] following the plan. Every intermediate is used
+// exactly once, so it is released as soon as it has been consumed.
+template <typename Mat, typename Flops>
+Mat execute_mult_plan(const BasicMultPlan<Flops>& plan, const Mat *const *inputs)
+{
+    if (plan.num_inputs == 0) {
+        throw std::logic_error("no input mat");
+    }
+    if (plan.nodes.empty()) {
+        return *inputs[0];
+    }
+
+    std::vector<std::optional<Mat>> temps(plan.nodes.size());
+    const auto operand = [&](int op) -> const Mat& {
+        return (op < plan.num_inputs ? *inputs[op] : *temps[op - plan.num_inputs]);
+    };
+    for (std::size_t t = 0; t < plan.nodes.size(); t++) {
+        const auto& node = plan.nodes[t];
+        temps[t] = operand(node.left) * operand(node.right);
+        for (int op : {node.left, node.right}) {
+            if (op >= plan.num_inputs) {
+                temps[op - plan.num_inputs].reset();
+            }
+        }
+    }
+
+    return std::move(*temps.back());
+}
+
+//==============================================================================
+// MatrixArena
+//==============================================================================
+// Backing store of the intermediates of a chain evaluation. layout() places
+// the intermediates of a plan in one buffer from their lifetimes, which the
+// plan fixes, and the buffer only grows: once it has seen the largest chain,
+// evaluations allocate nothing. One arena per thread, see
+// thread_local_instance(), so threads never contend on it. The buffer is
+// placed by set_numa(), first touch by default.
+class MatrixArena {
+public:
+    static constexpr std::size_t alignment = 64;
+
+    void set_numa(NumaPolicy policy, int node = 0, const NumaTopology *topology = nullptr);
+
+    template <typename Plan>
+    void layout(const Plan& plan, std::size_t elem_size, std::size_t scratch_bytes = 0);
+
+    template <typename T>
+    T* get_buffer(std::size_t temp);
+    template <typename T>
+    T* get_scratch();
+
+    std::size_t get_capacity() const;
+    std::size_t get_num_allocs() const;
+
+    static MatrixArena& thread_local_instance();
+
+private:
+    struct Block {
+        std::size_t begin;
+        std::size_t end;
+        int temp;
+    };
+
+    numa_vector<unsigned char> m_buffer;
+    std::vector<std::size_t> m_offsets;  // of every intermediate
+    std::size_t m_scratch_offset = 0;
+    std::vector<Block> m_live;           // scratch of layout(), sorted by begin
+    std::size_t m_num_allocs = 0;
+};
+
+//==============================================================================
+// layout ()
+//==============================================================================
+// Intermediate t of the plan is the product of node t, except for the last
+// one which is the result and lives outside the arena. A linear chain (no
+// node multiplies two intermediates) has one intermediate alive when the next
+// is computed, so they take turns in two ping-pong buffers. Other plans place
+// every intermediate first-fit among the ones alive at that point. The
+// scratch_bytes of get_scratch() go after all of them.
+template <typename Plan>
+void MatrixArena::layout(const Plan& plan, std::size_t elem_size, std::size_t scratch_bytes)
+{
+    const int num_inputs = plan.num_inputs;
+    const std::size_t ntemps = (plan.nodes.size() ? plan.nodes.size() - 1 : 0);
+    const auto bytes = [&](std::size_t t) {
+        const std::size_t size = std::size_t(plan.nodes[t].nrow) * plan.nodes[t].ncol * elem_size;
+        return (size + alignment - 1) / alignment * alignment;
+    };
+
+    bool linear = true;
+    for (std::size_t t = 0; t < ntemps + 1; t++) {
+        linear = linear && (plan.nodes[t].left < num_inputs || plan.nodes[t].right < num_inputs);
+    }
+
+    m_offsets.resize(ntemps);
+    std::size_t size = 0;
+    if (linear) {
+        std::size_t ping = 0;
+        std::size_t pong = 0;
+        for (std::size_t t = 0; t < ntemps; t++) {
+            std::size_t& slot = (t % 2 ? pong : ping);
+            slot = std::max(slot, bytes(t));
+        }
+        for (std::size_t t = 0; t < ntemps; t++) {
+            m_offsets[t] = (t % 2 ? ping : 0);
+        }
+        size = ping + pong;
+    } else {
+        m_live.clear();
+        for (std::size_t t = 0; t < ntemps + 1; t++) {
+            if (t < ntemps) {
+                // first gap between the live blocks that fits
+                const std::size_t temp_bytes = bytes(t);
+                std::size_t begin = 0;
+                std::size_t pos = 0;
+                while (pos < m_live.size() && m_live[pos].begin < begin + temp_bytes) {
+                    begin = std::max(begin, m_live[pos].end);
+                    pos++;
+                }
+                m_live.insert(m_live.begin() + pos, {begin, begin + temp_bytes, int(t)});
+                m_offsets[t] = begin;
+                size = std::max(size, begin + temp_bytes);
+            }
+
+            // the operands of node t die once it is computed
+            for (int op : {plan.nodes[t].left, plan.nodes[t].right}) {
+                if (op >= num_inputs) {
+                    const auto it = std::find_if(m_live.begin(), m_live.end(),
+                                                 [&](const Block& block) { return block.temp == op - num_inputs; });
+                    m_live.erase(it);
+                }
+            }
+        }
+    }
+
+    m_scratch_offset = size;
+    size += (scratch_bytes + alignment - 1) / alignment * alignment;
+    if (size > m_buffer.size()) {
+        m_buffer = numa_vector<unsigned char>(size, m_buffer.get_allocator());
+        m_num_allocs++;
+    }
+}
+
+//==============================================================================
+// set_numa ()
+//==============================================================================
+// Placement of the buffer, see NumaAllocator. A new placement drops the
+// buffer, the next layout() allocating it again.
+void MatrixArena::set_numa(NumaPolicy policy, int node, const NumaTopology *topology)
+{
+    const NumaAllocator<unsigned char> allocator(policy, node, topology);
+    if (allocator != m_buffer.get_allocator()) {
+        m_buffer = numa_vector<unsigned char>(allocator);
+    }
+}
+
+//==============================================================================
+// get_buffer ()
+//==============================================================================
+// Storage of intermediate temp, as placed by the last layout()
+template <typename T>
+T* MatrixArena::get_buffer(std::size_t temp)
+{
+    return reinterpret_cast<T*>(m_buffer.data() + m_offsets[temp]);
+}
+
+//==============================================================================
+// get_scratch ()
+//==============================================================================
+// Scratch of the last layout(), which no intermediate overlaps
+template <typename T>
+T* MatrixArena::get_scratch()
+{
+    return reinterpret_cast<T*>(m_buffer.data() + m_scratch_offset);
+}
+
+//==============================================================================
+// get_capacity ()
+//==============================================================================
+std::size_t MatrixArena::get_capacity() const
+{
+    return m_buffer.size();
+}
+
+//==============================================================================
+// get_num_allocs ()
+//==============================================================================
+// Times the buffer had to grow
+std::size_t MatrixArena::get_num_allocs() const
+{
+    return m_num_allocs;
+}
+
+//==============================================================================
+// thread_local_instance ()
+//==============================================================================
+MatrixArena& MatrixArena::thread_local_instance()
+{
+    thread_local MatrixArena arena;
+
+    return arena;
+}
+
+//==============================================================================
+// get_mult_plan_shape ()
+//==============================================================================
+// (nrow, ncol) of an operand of the plan: an input or a product
+template <typename Plan, typename Mat>
+std::pair<int, int> get_mult_plan_shape(const Plan& plan, const Mat *const *inputs, int op)
+{
+    if (op < plan.num_inputs) {
+        return {inputs[op]->get_nrow(), inputs[op]->get_ncol()};
+    }
+    return {plan.nodes[op - plan.num_inputs].nrow, plan.nodes[op - plan.num_inputs].ncol};
+}
+
+//==============================================================================
+// check_mult_plan_shapes ()
+//==============================================================================
+// Throws unless every product of the plan gets operands of matching shapes
+template <typename Plan, typename Mat>
+void check_mult_plan_shapes(const Plan& plan, const Mat *const *inputs)
+{
+    for (const auto& node : plan.nodes) {
+        const auto [left_nrow, left_ncol] = get_mult_plan_shape(plan, inputs, node.left);
+        const auto [right_nrow, right_ncol] = get_mult_plan_shape(plan, inputs, node.right);
+        if (left_ncol != right_nrow || left_nrow != node.nrow || right_ncol != node.ncol) {
+            throw std::logic_error(("mult: dimensions do not match: " +
+                                    diff_dims_error(BasicMatrix<int>(left_nrow, left_ncol),
+                                                    BasicMatrix<int>(right_nrow, right_ncol))).c_str());
+        }
+    }
+}
+
+//==============================================================================
+// calc_mult_plan_numa_nodes ()
+//==============================================================================
+// NUMA node, out of num_nodes, each product of the plan runs on. The nodes are
+// dealt top-down: a product splits its nodes between its two subtrees by their
+// work (2mkn), the heavier one getting the first nodes, and runs on the first
+// one itself, so it always shares a node with its heavier producer. Subtrees
+// left with a single node stay on it whole.
+template <typename Plan, typename Mat>
+std::vector<int> calc_mult_plan_numa_nodes(const Plan& plan, const Mat *const *inputs, int num_nodes)
+{
+    const int nnodes = int(plan.nodes.size());
+    std::vector<double> work(nnodes, 0.0);
+    for (int t = 0; t < nnodes; t++) {
+        const auto& node = plan.nodes[t];
+        work[t] = 2.0 * node.nrow * get_mult_plan_shape(plan, inputs, node.left).second * node.ncol;
+        for (int op : {node.left, node.right}) {
+            if (op >= plan.num_inputs) {
+                work[t] += work[op - plan.num_inputs];
+            }
+        }
+    }
+
+    // operands come before their products, so this visits products before operands
+    std::vector<int> first(nnodes, 0);
+    std::vector<int> count(nnodes, std::max(num_nodes, 1));
+    for (int t = nnodes - 1; t >= 0; t--) {
+        const int left = plan.nodes[t].left - plan.num_inputs;
+        const int right = plan.nodes[t].right - plan.num_inputs;
+        if (left < 0 || right < 0 || count[t] == 1) {
+            for (int op : {left, right}) {
+                if (op >= 0) {
+                    first[op] = first[t];
+                    count[op] = count[t];
+                }
+            }
+            continue;
+        }
+
+        const int heavy = (work[left] >= work[right] ? left : right);
+        const int light = (heavy == left ? right : left);
+        const double share = count[t] * work[heavy] / (work[left] + work[right]);
+        count[heavy] = std::clamp(int(share + 0.5), 1, count[t] - 1);
+        first[heavy] = first[t];
+        count[light] = count[t] - count[heavy];
+        first[light] = first[t] + count[heavy];
+    }
+
+    return first;
+}
+
+//==============================================================================
+// execute_mult_plan_in_arena ()
+//==============================================================================
+// execute_mult_plan() for DenseMatrix: intermediates are multiplied by
+// dense_mult() straight into the arena, the last product into res, which has
+// the shape of the result. With accumulate it is added to res (gemm() with
+// beta = 1) instead of overwriting it; when res is also one of the inputs the
+// last product goes to the arena scratch first, then is added. The
+// temporaries of strassen_winograd() come from the scratch too, so a warm
+// arena allocates nothing whatever the policy. The plan must have at least
+// one node.
+template <typename T, typename Plan>
+void execute_mult_plan_in_arena(const Plan& plan, const DenseMatrix<T> *const *inputs, MatrixArena& arena,
+                                bool accumulate, DenseMatrix<T>& res)
+{
+    using flops_type = typename DenseMatrix<T>::flops_type;
+
+    // gemm() trusts the shapes, check them all before the first product
+    check_mult_plan_shapes(plan, inputs);
+    const auto shape = [&](int op) {
+        return get_mult_plan_shape(plan, inputs, op);
+    };
+    const auto& root = plan.nodes[plan.nodes.size() - 1];
+    if (res.m_nrow != root.nrow || res.m_ncol != root.ncol) {
+        throw std::logic_error(("add: dimensions do not match: " +
+                                diff_dims_error(res, BasicMatrix<int>(root.nrow, root.ncol))).c_str());
+    }
+
+    bool aliased = false;
+    for (int i = 0; i < plan.num_inputs && accumulate; i++) {
+        aliased = aliased || inputs[i]->data() == res.data();
+    }
+    // scratch: the last product when aliased, then what strassen_winograd() needs for any node
+    const std::size_t product_size = (aliased ? res.m_data.size() : 0);
+    std::size_t strassen_size = 0;
+    for (const auto& node : plan.nodes) {
+        const std::size_t size = StrassenPolicy::global().calc_scratch_size(node.nrow, shape(node.left).second,
+                                                                            node.ncol);
+        strassen_size = std::max(strassen_size, size);
+    }
+    arena.layout(plan, sizeof(T), (product_size + strassen_size) * sizeof(T));
+    T* product = arena.get_scratch<T>();
+
+    flops_type flops = (accumulate ? checked_add(res.m_flops, calc_mat_add_flops<flops_type>(res, res)) : 0);
+    for (int i = 0; i < plan.num_inputs; i++) {
+        flops = checked_add(flops, inputs[i]->m_flops);
+    }
+
+    const auto data = [&](int op) -> const T* {
+        return (op < plan.num_inputs ? inputs[op]->data() : arena.get_buffer<T>(op - plan.num_inputs));
+    };
+    for (std::size_t t = 0; t < plan.nodes.size(); t++) {
+        const auto& node = plan.nodes[t];
+        const int nk = shape(node.left).second;
+        const bool last = (t + 1 == plan.nodes.size());
+        T* out = (!last ? arena.get_buffer<T>(t) : aliased ? product : res.data());
+        const T beta = (last && accumulate && !aliased ? T(1) : T(0));
+        MATRIX_TRACE_SCOPE("mult", node.nrow, nk, node.ncol,
+                           beta == T(0) ? StrassenPolicy::global().calc_flops<flops_type>(node.nrow, nk, node.ncol)
+                                        : calc_mult_flops<flops_type>(node.nrow, nk, node.ncol));
+        flops = checked_add(flops, dense_mult<flops_type>(node.nrow, node.ncol, nk, data(node.left), nk,
+                                                          data(node.right), node.ncol, beta, out, node.ncol,
+                                                          StrassenPolicy::global(), nullptr,
+                                                          product + product_size));
+    }
+    if (aliased) {
+        MATRIX_TRACE_SCOPE("add", res.m_nrow, 0, res.m_ncol, calc_mat_add_flops<flops_type>(res, res));
+        MATRIX_TRACE_KERNEL("add");
+        for (std::size_t i = 0; i < res.m_data.size(); i++) {
+            res.m_data[i] += product[i];
+        }
+    }
+    res.m_flops = flops;
+}
+
+//==============================================================================
+// execute_mult_plan_in_arena ()
+//==============================================================================
+template <typename T, typename Plan>
+DenseMatrix<T> execute_mult_plan_in_arena(const Plan& plan, const DenseMatrix<T> *const *inputs, MatrixArena& arena)
+{
+    if (plan.num_inputs == 0) {
+        throw std::logic_error("no input mat");
+    }
+    if (plan.nodes.empty()) {
+        return *inputs[0];
+    }
+
+    const auto& root = plan.nodes[plan.nodes.size() - 1];
+    DenseMatrix<T> res(root.nrow, root.ncol);
+    execute_mult_plan_in_arena(plan, inputs, arena, false, res);
+
+    return res;
+}
+
+//==============================================================================
+// execute_mult_plan ()
+//==============================================================================
+template <typename T, typename Flops>
+DenseMatrix<T> execute_mult_plan(const BasicMultPlan<Flops>& plan, const DenseMatrix<T> *const *inputs,
+                                 MatrixArena& arena = MatrixArena::thread_local_instance())
+{
+    return execute_mult_plan_in_arena(plan, inputs, arena);
+}
+
+//==============================================================================
+// execute_mult_plan_in_pool ()
+//==============================================================================
+// execute_mult_plan() for DenseMatrix as a task graph on pool: a product is
+// submitted as soon as both its operands are ready, and run by the task that
+// finished the last of them. Independent subtrees thus run concurrently,
+// idle threads steal them, and the tiles of parallel_gemm() take whatever
+// threads the subtrees leave. An intermediate is freed once its consumer is
+// done. The plan must have at least one node.
+// On a pool pinned to several NUMA nodes the products go to the nodes of
+// calc_mult_plan_numa_nodes(): a consumer ready on another node is submitted
+// there rather than run inline, and the intermediates are placed by numa,
+// NumaPolicy::local meaning on the node of their producer and consumer.
+template <typename T, typename Plan>
+DenseMatrix<T> execute_mult_plan_in_pool(const Plan& plan, const DenseMatrix<T> *const *inputs, ThreadPool& pool,
+                                         NumaPolicy numa)
+{
+    using flops_type = typename DenseMatrix<T>::flops_type;
+
+    check_mult_plan_shapes(plan, inputs);
+
+    const int nnodes = int(plan.nodes.size());
+    const auto& root = plan.nodes[nnodes - 1];
+    DenseMatrix<T> res(root.nrow, root.ncol);
+
+    // consumer of each product, and the number of its operands still to come
+    std::vector<int> parent(nnodes, -1);
+    std::vector<std::atomic<int>> pending(nnodes);
+    for (int t = 0; t < nnodes; t++) {
+        int npending = 0;
+        for (int op : {plan.nodes[t].left, plan.nodes[t].right}) {
+            if (op >= plan.num_inputs) {
+                parent[op - plan.num_inputs] = t;
+                npending++;
+            }
+        }
+        pending[t].store(npending, std::memory_order_relaxed);
+    }
+
+    const NumaTopology& topology = pool.get_topology();
+    const std::vector<int> numa_node = calc_mult_plan_numa_nodes(plan, inputs, topology.get_num_nodes());
+    const auto submit_node = [&](int t) { return (topology.get_num_nodes() > 1 ? numa_node[t] : -1); };
+
+    std::vector<numa_vector<T>> temps(nnodes);
+    std::vector<flops_type> node_flops(nnodes, 0);
+    const auto data = [&](int op) -> const T* {
+        return (op < plan.num_inputs ? inputs[op]->data() : temps[op - plan.num_inputs].data());
+    };
+
+    TaskGroup group(pool);
+    // a loop rather than a call per consumer: linear chains can be far deeper
+    // than the call stack
+    const std::function<void(int)> run_node = [&](int start) {
+        for (int t = start; t != -1;) {
+            const auto& node = plan.nodes[t];
+            const int nk = get_mult_plan_shape(plan, inputs, node.left).second;
+            {
+                // traced apart from the consumer run next
+                MATRIX_TRACE_SCOPE("mult", node.nrow, nk, node.ncol,
+                                   StrassenPolicy::global().calc_flops<flops_type>(node.nrow, nk, node.ncol));
+                T* out = res.data();
+                if (t + 1 != nnodes) {
+                    MATRIX_TRACE_BYTES(std::int64_t(sizeof(T)) * node.nrow * node.ncol);
+                    temps[t] = numa_vector<T>(std::size_t(node.nrow) * node.ncol,
+                                              NumaAllocator<T>(numa, numa_node[t], &topology));
+                    out = temps[t].data();
+                }
+                node_flops[t] = dense_mult<flops_type>(node.nrow, node.ncol, nk, data(node.left), nk,
+                                                       data(node.right), node.ncol, T(0), out, node.ncol,
+                                                       StrassenPolicy::global(), &pool);
+                for (int op : {node.left, node.right}) {
+                    if (op >= plan.num_inputs) {
+                        numa_vector<T>().swap(temps[op - plan.num_inputs]);
+                    }
+                }
+            }
+
+            const int next = parent[t];
+            t = -1;
+            if (next != -1 && pending[next].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                if (submit_node(next) < 0 || submit_node(next) == pool.get_current_node()) {
+                    t = next;
+                } else {
+                    group.run([&run_node, next]() { run_node(next); }, submit_node(next));
+                }
+            }
+        }
+    };
+
+    // the products of two inputs, collected first: once submitted, they bring other counts to 0
+    std::vector<int> ready;
+    for (int t = 0; t < nnodes; t++) {
+        if (pending[t].load(std::memory_order_relaxed) == 0) {
+            ready.push_back(t);
+        }
+    }
+    for (int t : ready) {
+        group.run([&run_node, t]() { run_node(t); }, submit_node(t));
+    }
+    group.wait();
+
+    flops_type flops = 0;
+    for (int i = 0; i < plan.num_inputs; i++) {
+        flops = checked_add(flops, inputs[i]->m_flops);
+    }
+    for (flops_type product_flops : node_flops) {
+        flops = checked_add(flops, product_flops);
+    }
+    res.m_flops = flops;
+
+    return res;
+}
+
+//==============================================================================
+// execute_mult_plan ()
+//==============================================================================
+template <typename T, typename Flops>
+DenseMatrix<T> execute_mult_plan(const BasicMultPlan<Flops>& plan, const DenseMatrix<T> *const *inputs,
+                                 ThreadPool& pool, NumaPolicy numa = NumaPolicy::first_touch)
+{
+    if (plan.num_inputs == 0) {
+        throw std::logic_error("no input mat");
+    }
+    if (plan.nodes.empty()) {
+        return *inputs[0];
+    }
+
+    return execute_mult_plan_in_pool(plan, inputs, pool, numa);
+}
+
+//==============================================================================
+// product_left_to_right ()
+//==============================================================================
+// Left to right like the Matrix version, a linear chain: the intermediates
+// ping-pong between two buffers of the thread's arena
+template <typename T>
+DenseMatrix<T> product_left_to_right(const std::vector<const DenseMatrix<T>*>& inputs)
+{
+    if (inputs.empty()) {
+        throw std::logic_error("no input mat");
+    }
+    std::vector<int> dims;
+    for (const DenseMatrix<T> *input : inputs) {
+        dims.push_back(input->get_nrow());
+    }
+    dims.push_back(inputs.back()->get_ncol());
+
+    const auto left_to_right = [](int, int j) { return j - 1; };
+    const auto plan = build_mult_plan<typename DenseMatrix<T>::flops_type>(dims.data(), inputs.size(), left_to_right);
+
+    return execute_mult_plan(plan, inputs.data());
+}
+
+//==============================================================================
+// sum_using_initializer_list ()
+//==============================================================================
+// In one pass, see fused_sum()
+template <typename T>
+DenseMatrix<T> sum_using_initializer_list(std::initializer_list<const DenseMatrix<T>> mats)
+{
+    std::vector<const DenseMatrix<T>*> inputs;
+    inputs.reserve(mats.size());
+    for (const DenseMatrix<T>& mat : mats) {
+        inputs.push_back(&mat);
+    }
+
+    return fused_sum(inputs.data(), inputs.size());
+}
+
+//==============================================================================
+// product_using_initializer_list ()
+//==============================================================================
+template <typename T>
+DenseMatrix<T> product_using_initializer_list(std::initializer_list<const DenseMatrix<T>> mats)
+{
+    std::vector<const DenseMatrix<T>*> inputs;
+    inputs.reserve(mats.size());
+    for (const DenseMatrix<T>& mat : mats) {
+        inputs.push_back(&mat);
+    }
+
+    return product_left_to_right(inputs);
+}
+
+//==============================================================================
+// execute_mult_plan_async ()
+//==============================================================================
+// execute_mult_plan() on pool as a task, for the caller not to block while a
+// large chain runs. The inputs must outlive the future.
+template <typename T, typename Flops>
+PoolFuture<DenseMatrix<T>> execute_mult_plan_async(const BasicMultPlan<Flops>& plan,
+                                                   const DenseMatrix<T> *const *inputs,
+                                                   ThreadPool& pool = ThreadPool::global())
+{
+    std::vector<const DenseMatrix<T>*> input_vec(inputs, inputs + plan.num_inputs);
+
+    return run_async(pool, [plan, input_vec, &pool]() { return execute_mult_plan(plan, input_vec.data(), pool); });
+}
+
+//==============================================================================
+// product_using_initializer_list_async ()
+//==============================================================================
+// product_using_initializer_list() as a task of pool. The list does not
+// outlive the call, so the task multiplies copies of the matrices.
+template <typename T>
+PoolFuture<DenseMatrix<T>> product_using_initializer_list_async(std::initializer_list<const DenseMatrix<T>> mats,
+                                                                ThreadPool& pool = ThreadPool::global())
+{
+    if (mats.size() == 0) {
+        throw std::logic_error("no input mat");
+    }
+
+    return run_async(pool, [mats = std::vector<DenseMatrix<T>>(mats.begin(), mats.end())]() {
+        std::vector<const DenseMatrix<T>*> inputs;
+        for (const DenseMatrix<T>& mat : mats) {
+            inputs.push_back(&mat);
+        }
+        return product_left_to_right(inputs);
+    });
+}
+
+#if defined(__cpp_impl_coroutine)
+//==============================================================================
+// execute_mult_plan_async ()
+//==============================================================================
+// Chain whose i-th factor is load(i), from matrix files (see MappedMatrix) or
+// the network, multiplied following the plan by a coroutine. The loads run as
+// tasks of pool, up to prefetch factors ahead of those the current product
+// needs, so reading the next factors overlaps computing; the products run as
+// tasks too, and no thread blocks on either. Intermediates are dropped once
+// consumed.
+template <typename T, typename Flops>
+PoolFuture<DenseMatrix<T>> execute_mult_plan_async(BasicMultPlan<Flops> plan,
+                                                   std::function<DenseMatrix<T>(int)> load, ThreadPool& pool,
+                                                   int prefetch = 2)
+{
+    const int n = plan.num_inputs;
+    if (n == 0) {
+        throw std::logic_error("no input mat");
+    }
+    if (prefetch < 0) {
+        throw std::logic_error("async mult: negative prefetch");
+    }
+
+    // the tasks get copies of load: those prefetched run on if a product throws
+    std::vector<PoolFuture<DenseMatrix<T>>> loads(n);
+    int num_loads = 0;
+    const auto load_until = [&](int last) {
+        for (; num_loads < std::min(last + 1, n); num_loads++) {
+            loads[num_loads] = run_async(pool, [load, i = num_loads]() { return load(i); });
+        }
+    };
+
+    load_until(prefetch);
+    if (plan.nodes.empty()) {
+        co_return co_await loads[0];
+    }
+
+    std::vector<std::optional<DenseMatrix<T>>> operands(n + plan.nodes.size());
+    for (std::size_t t = 0; t < plan.nodes.size(); t++) {
+        const auto& node = plan.nodes[t];
+        for (int op : {node.left, node.right}) {
+            if (op < n) {
+                load_until(op + prefetch);
+                operands[op] = co_await loads[op];
+            }
+        }
+
+        const DenseMatrix<T>& left = *operands[node.left];
+        const DenseMatrix<T>& right = *operands[node.right];
+        operands[n + t] = co_await run_async(pool, [&left, &right]() { return left * right; });
+        operands[node.left].reset();
+        operands[node.right].reset();
+    }
+
+    co_return std::move(*operands.back());
+}
+#endif
+
+
+//==============================================================================
+// StaticMultPlan
+//==============================================================================
+// BasicMultPlan of a chain of N matrices, in fixed-size storage so that it can
+// be computed, inspected and executed at compile time
+template <typename Flops, std::size_t N>
+struct StaticMultPlan {
+    using Node = typename BasicMultPlan<Flops>::Node;
+
+    static constexpr int num_inputs = N;
+    std::array<Node, (N > 1 ? N - 1 : 0)> nodes = {};
+    Flops flops = 0;
+
+    constexpr int get_result() const { return (N > 1 ? 2 * int(N) - 2 : 0); }
+};
+
+//==============================================================================
+// build_static_mult_plan_node ()
+//==============================================================================
+// Appends the nodes of subchain i..j to the plan, in post-order, and returns
+// the operand holding its product
+template <typename Flops, std::size_t N>
+constexpr int build_static_mult_plan_node(StaticMultPlan<Flops, N>& plan, std::size_t& nnodes,
+                                          const std::array<int, N + 1>& dims,
+                                          const std::array<int, N * N>& split, int i, int j)
+{
+    if (i == j) {
+        return i;
+    }
+
+    const int k = split[i * N + j];
+    const int left = build_static_mult_plan_node(plan, nnodes, dims, split, i, k);
+    const int right = build_static_mult_plan_node(plan, nnodes, dims, split, k + 1, j);
+    const Flops flops = calc_mult_flops<Flops>(dims[i], dims[k + 1], dims[j + 1]);
+    plan.nodes[nnodes] = {left, right, dims[i], dims[j + 1], flops};
+    plan.flops = checked_add(plan.flops, flops);
+
+    return int(N + nnodes++);
+}
+
+//==============================================================================
+// calc_static_mult_plan ()
+//==============================================================================
+// constexpr counterpart of calc_optimal_mult_plan(): the same DP, with the same
+// overflow handling, over std::array tables. With dims known at compile time
+// the whole planning is done by the compiler, and an overflow is a compile
+// error.
+template <typename Flops = int, std::size_t M>
+constexpr StaticMultPlan<Flops, M - 1> calc_static_mult_plan(const std::array<int, M>& dims)
+{
+    using traits = flops_traits<Flops>;
+    constexpr std::size_t n = M - 1;
+
+    StaticMultPlan<Flops, n> plan;
+    if (n < 2) {
+        return plan;
+    }
+
+    std::array<Flops, n * n> min_cost = {};
+    std::array<int, n * n> min_index = {};
+    for (std::size_t length = 2; length < n + 1; length++) {
+        for (std::size_t i = 0; i < n - length + 1; i++) {
+            const std::size_t j = i + length - 1;
+
+            const auto [best_cost, best_t] = argmin_split_checked<Flops>(
+                [&min_cost, i](std::size_t t) { return min_cost[i * n + i + t]; },
+                [&min_cost, i, j](std::size_t t) { return min_cost[(i + t + 1) * n + j]; },
+                dims.data(), i, j);
+            min_cost[i * n + j] = best_cost;
+            min_index[i * n + j] = int(i + best_t);
+        }
+    }
+
+    if (!traits::saturates && min_cost[n - 1] == traits::max()) {
+        throw std::overflow_error("mult order: flops overflow");
+    }
+
+    std::size_t nnodes = 0;
+    build_static_mult_plan_node(plan, nnodes, dims, min_index, 0, n - 1);
+
+    return plan;
+}
+
+//==============================================================================
+// execute_static_mult_plan ()
+//==============================================================================
+// Evaluates operand Op of a plan known at compile time. The plan is a template
+// argument, so the sequence of products is generated by the compiler: no
+// planning, no bookkeeping left at run time.
+template <const auto& Plan, int Op, typename Mat, std::size_t N>
+constexpr Mat execute_static_mult_plan(const std::array<const Mat*, N>& inputs)
+{
+    static_assert(Plan.num_inputs == int(N), "wrong number of inputs");
+
+    if constexpr (Op < int(N)) {
+        return *inputs[Op];
+    } else {
+        constexpr auto node = Plan.nodes[Op - N];
+        return execute_static_mult_plan<Plan, node.left>(inputs) * execute_static_mult_plan<Plan, node.right>(inputs);
+    }
+}
+
+//==============================================================================
+// execute_static_mult_plan ()
+//==============================================================================
+template <const auto& Plan, typename Mat, std::size_t N>
+constexpr Mat execute_static_mult_plan(const std::array<const Mat*, N>& inputs)
+{
+    return execute_static_mult_plan<Plan, Plan.get_result()>(inputs);
+}
+
+//==============================================================================
+// calc_optimal_mult_order ()
+//==============================================================================
+template <typename Flops = int>
+std::pair<std::string, Flops> calc_optimal_mult_order(std::initializer_list<const BasicMatrix<Flops>> mats,
+                                                      std::initializer_list<const char *> mat_names = {},
+                                                      MultOrderSolver solver = MultOrderSolver::dp,
+                                                      BasicMultOrderWorkspace<Flops>& workspace =
+                                                          BasicMultOrderWorkspace<Flops>::thread_local_instance())
+{
+    //--------------------------------------------------------------------------
+    // Matrix Chain Multiplication
+    //--------------------------------------------------------------------------
+
+    // static_assert
+    if (mat_names.size() && mat_names.size() != mats.size()) {
+        throw std::logic_error("wrong input sizes");
+    }
+
+    if (mats.size() == 0) {
+        return {"", 0};
+    }
+
+    // assert mat dimensions are compatible
+    for_each_adjacent_pair(mats.begin(), mats.end(),
+        [](const BasicMatrix<Flops>& m1, const BasicMatrix<Flops>& m2) {
+            assert(m1.get_ncol() == m2.get_nrow());
+        }
+    );
+
+    const std::size_t n = mats.size();
+    std::vector<int> dims;
+    dims.reserve(n + 1);
+    for (const BasicMatrix<Flops>& mat : mats) {
+        dims.push_back(mat.get_nrow());
+    }
+    dims.push_back((mats.end() - 1)->get_ncol());
+
+    const BasicMultPlan<Flops>& plan = calc_optimal_mult_plan<Flops>(dims.data(), n, solver, workspace);
+
+    return {plan.to_string(mat_names), plan.flops};
+}
+
+//==============================================================================
+// calc_optimal_mult_order ()
+//==============================================================================
+// Same, costing every product by the kernel policy picks for it
+template <typename Flops = int>
+std::pair<std::string, Flops> calc_optimal_mult_order(std::initializer_list<const BasicMatrix<Flops>> mats,
+                                                      std::initializer_list<const char *> mat_names,
+                                                      const StrassenPolicy& policy)
+{
+    if (mat_names.size() && mat_names.size() != mats.size()) {
+        throw std::logic_error("wrong input sizes");
+    }
+
+    std::vector<int> dims;
+    for (const BasicMatrix<Flops>& mat : mats) {
+        dims.push_back(mat.get_nrow());
+    }
+    if (mats.size()) {
+        dims.push_back((mats.end() - 1)->get_ncol());
+    }
+
+    const BasicMultPlan<Flops> plan = calc_optimal_mult_plan<Flops>(dims.data(), mats.size(), policy);
+
+    return {plan.to_string(mat_names), plan.flops};
+}
+
+//==============================================================================
+// estimate_to_flops ()
+//==============================================================================
+// An estimated flops count as Flops, throws if it does not fit
+template <typename Flops>
+Flops estimate_to_flops(double estimate)
+{
+    if (!(estimate < double(flops_traits<Flops>::max()))) {
+        throw std::overflow_error("flops overflow");
+    }
+
+    return Flops(std::round(estimate));
+}
+
+//==============================================================================
+// estimate_chain_shapes ()
+//==============================================================================
+// Estimated shape of the product of every subchain i..j of the n matrices,
+// at [i * n + j]. The non-zeros of a product do not depend on the order it is
+// computed in, so neither does its estimate: always taken left to right,
+// which keeps the costs of all plans of the chain comparable.
+std::vector<SparseShape> estimate_chain_shapes(const SparseShape *shapes, std::size_t n)
+{
+    std::vector<SparseShape> res(n * n);
+    for (std::size_t i = 0; i < n; i++) {
+        res[i * n + i] = shapes[i];
+        for (std::size_t j = i + 1; j < n; j++) {
+            res[i * n + j] = estimate_mult_shape(res[i * n + j - 1], shapes[j]);
+        }
+    }
+
+    return res;
+}
+
+//==============================================================================
+// estimate_sparse_mult_plan ()
+//==============================================================================
+// Sets the flops of plan, of any order, to those estimated from the shapes of
+// its inputs
+template <typename Flops>
+void estimate_sparse_mult_plan(BasicMultPlan<Flops>& plan, const SparseShape *shapes)
+{
+    const std::size_t n = plan.num_inputs;
+    const std::vector<SparseShape> chain_shapes = estimate_chain_shapes(shapes, n);
+
+    // subchain of every operand
+    std::vector<std::pair<int, int>> ranges;
+    for (int i = 0; i < plan.num_inputs; i++) {
+        ranges.push_back({i, i});
+    }
+    plan.flops = 0;
+    for (auto& node : plan.nodes) {
+        const auto [i, k] = ranges[node.left];
+        const int j = ranges[node.right].second;
+        node.flops = estimate_to_flops<Flops>(estimate_sparse_mult_flops(chain_shapes[i * n + k],
+                                                                         chain_shapes[(k + 1) * n + j]));
+        plan.flops = checked_add(plan.flops, node.flops);
+        ranges.push_back({i, j});
+    }
+}
+
+//==============================================================================
+// calc_sparse_mult_plan ()
+//==============================================================================
+// Plan of the chain of n sparse matrices that minimizes the flops estimated
+// from their non-zeros, see estimate_sparse_mult_flops() and
+// estimate_chain_shapes(): calc_mult_plan_with_split_cost() on estimated
+// shapes instead of dims. Node flops are those estimates, rounded. Dense
+// operands (nnz = nrow * ncol) cost what the dense formula says, so they mix
+// with sparse ones.
+template <typename Flops = std::int64_t>
+BasicMultPlan<Flops> calc_sparse_mult_plan(const SparseShape *shapes, std::size_t n)
+{
+    std::vector<int> dims;
+    for (std::size_t i = 0; i < n; i++) {
+        if (i > 0 && shapes[i - 1].ncol != shapes[i].nrow) {
+            throw std::logic_error(("mult: dimensions do not match: " +
+                                    diff_dims_error(BasicMatrix<int>(shapes[i - 1].nrow, shapes[i - 1].ncol),
+                                                    BasicMatrix<int>(shapes[i].nrow, shapes[i].ncol))).c_str());
+        }
+        dims.push_back(shapes[i].nrow);
+    }
+    if (n > 0) {
+        dims.push_back(shapes[n - 1].ncol);
+    }
+
+    const std::vector<SparseShape> shape = estimate_chain_shapes(shapes, n);
+    const auto split_cost = [&shape, n](int i, int k, int j) {
+        return estimate_sparse_mult_flops(shape[i * n + k], shape[(k + 1) * n + j]);
+    };
+    BasicMultPlan<Flops> plan = calc_mult_plan_with_split_cost<Flops>(dims.data(), n, split_cost,
+                                                                      [](int, int, int) { return Flops(0); });
+    estimate_sparse_mult_plan(plan, shapes);
+
+    return plan;
+}
+
+//==============================================================================
+// calc_optimal_mult_order ()
+//==============================================================================
+// Same, for sparse factors: costed by estimated non-zeros instead of dims,
+// see calc_sparse_mult_plan(). Shape is deduced, never SparseShape from {},
+// so that an empty chain stays the overload of BasicMatrix.
+template <typename Flops = std::int64_t, typename Shape,
+          typename = std::enable_if_t<std::is_same_v<Shape, SparseShape>>>
+std::pair<std::string, Flops> calc_optimal_mult_order(std::initializer_list<Shape> shapes,
+                                                      std::initializer_list<const char *> mat_names = {})
+{
+    if (mat_names.size() && mat_names.size() != shapes.size()) {
+        throw std::logic_error("wrong input sizes");
+    }
+
+    const BasicMultPlan<Flops> plan = calc_sparse_mult_plan<Flops>(shapes.begin(), shapes.size());
+
+    return {plan.to_string(mat_names), plan.flops};
+}
+
+//==============================================================================
+// BasicMultOrderCache
+//==============================================================================
+// Bounded LRU cache of optimal plans, keyed by the chain's dimensions, safe
+// to share between threads. A hit does not allocate: the key is hashed in
+// place and the entry is handed out as a shared pointer. Misses run the DP
+// outside the lock, so concurrent misses do not serialize.
+template <typename Flops = int>
+class BasicMultOrderCache {
+public:
+    struct Entry {
+        std::vector<int> dims;      // n + 1 dims of the n matrices
+        BasicMultPlan<Flops> plan;  // optimal order
+    };
+
+    explicit BasicMultOrderCache(std::size_t capacity);
+
+    std::shared_ptr<const Entry> get(const int *dims, std::size_t n);
+
+    std::size_t get_capacity() const;
+    std::size_t get_size() const;
+    std::size_t get_hits() const;
+    std::size_t get_misses() const;
+
+private:
+    using LruList = std::list<std::pair<std::uint64_t, std::shared_ptr<const Entry>>>;
+
+    static std::uint64_t hash_dims(const int *dims, std::size_t ndims);
+    std::shared_ptr<const Entry> find(std::uint64_t hash, const int *dims, std::size_t ndims);
+
+    const std::size_t m_capacity;
+    mutable std::mutex m_mutex;
+    LruList m_lru;  // most recently used first
+    std::unordered_multimap<std::uint64_t, typename LruList::iterator> m_index;
+    std::atomic<std::size_t> m_hits;
+    std::atomic<std::size_t> m_misses;
+};
+
+using MultOrderCache = BasicMultOrderCache<int>;
+
+//==============================================================================
+// BasicMultOrderCache ()
+//==============================================================================
+template <typename Flops>
+BasicMultOrderCache<Flops>::BasicMultOrderCache(std::size_t capacity)
+    : m_capacity(std::max<std::size_t>(capacity, 1)),
+      m_hits(0),
+      m_misses(0)
+{
+    m_index.reserve(m_capacity);
+}
+
+//==============================================================================
+// hash_dims ()
+//==============================================================================
+template <typename Flops>
+std::uint64_t BasicMultOrderCache<Flops>::hash_dims(const int *dims, std::size_t ndims)
+{
+    // FNV-1a over the dims
+    std::uint64_t hash = 14695981039346656037ull;
+    for (std::size_t i = 0; i < ndims; i++) {
+        hash = (hash ^ std::uint32_t(dims[i])) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+//==============================================================================
+// find ()
+//==============================================================================
+// Must be called with m_mutex held
+template <typename Flops>
+std::shared_ptr<const typename BasicMultOrderCache<Flops>::Entry>
+BasicMultOrderCache<Flops>::find(std::uint64_t hash, const int *dims, std::size_t ndims)
+{
+    const auto [first, last] = m_index.equal_range(hash);
+    for (auto it = first; it != last; ++it) {
+        const std::shared_ptr<const Entry>& entry = it->second->second;
+        if (std::equal(dims, dims + ndims, entry->dims.begin(), entry->dims.end())) {
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            return entry;
+        }
+    }
+
+    return nullptr;
+}
+
+//==============================================================================
+// get ()
+//==============================================================================
+// Optimal order of the chain of n matrices, the i-th one being dims[i] x
+// dims[i + 1]
+template <typename Flops>
+std::shared_ptr<const typename BasicMultOrderCache<Flops>::Entry>
+BasicMultOrderCache<Flops>::get(const int *dims, std::size_t n)
+{
+    const std::size_t ndims = n + 1;
+    const std::uint64_t hash = hash_dims(dims, ndims);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (std::shared_ptr<const Entry> entry = find(hash, dims, ndims)) {
+            m_hits++;
+            return entry;
+        }
+    }
+
+    m_misses++;
+    auto entry = std::make_shared<Entry>();
+    entry->dims.assign(dims, dims + ndims);
+    entry->plan = calc_optimal_mult_plan<Flops>(dims, n);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (std::shared_ptr<const Entry> raced = find(hash, dims, ndims)) {
+        // another thread computed the same chain meanwhile
+        return raced;
+    }
+    if (m_lru.size() == m_capacity) {
+        const auto victim = std::prev(m_lru.end());
+        const auto [first, last] = m_index.equal_range(victim->first);
+        for (auto it = first; it != last; ++it) {
+            if (it->second == victim) {
+                m_index.erase(it);
+                break;
+            }
+        }
+        m_lru.pop_back();
+    }
+    m_lru.emplace_front(hash, entry);
+    m_index.emplace(hash, m_lru.begin());
+
+    return entry;
+}
+
+//==============================================================================
+// get_capacity ()
+//==============================================================================
+template <typename Flops>
+std::size_t BasicMultOrderCache<Flops>::get_capacity() const
+{
+    return m_capacity;
+}
+
+//==============================================================================
+// get_size ()
+//==============================================================================
+template <typename Flops>
+std::size_t BasicMultOrderCache<Flops>::get_size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_lru.size();
+}
+
+//==============================================================================
+// get_hits ()
+//==============================================================================
+template <typename Flops>
+std::size_t BasicMultOrderCache<Flops>::get_hits() const
+{
+    return m_hits;
+}
+
+//==============================================================================
+// get_misses ()
+//==============================================================================
+template <typename Flops>
+std::size_t BasicMultOrderCache<Flops>::get_misses() const
+{
+    return m_misses;
+}
+
+//==============================================================================
+// calc_optimal_mult_order ()
+//==============================================================================
+// Same as above, with the optimal order looked up in (or added to) a cache
+template <typename Flops = int>
+std::pair<std::string, Flops> calc_optimal_mult_order(BasicMultOrderCache<Flops>& cache,
+                                                      std::initializer_list<const BasicMatrix<Flops>> mats,
+                                                      std::initializer_list<const char *> mat_names = {})
+{
+    if (mat_names.size() && mat_names.size() != mats.size()) {
+        throw std::logic_error("wrong input sizes");
+    }
+
+    if (mats.size() == 0) {
+        return {"", 0};
+    }
+
+    const std::size_t n = mats.size();
+    std::vector<int> dims;
+    dims.reserve(n + 1);
+    for (const BasicMatrix<Flops>& mat : mats) {
+        dims.push_back(mat.get_nrow());
+    }
+    dims.push_back((mats.end() - 1)->get_ncol());
+
+    const auto entry = cache.get(dims.data(), n);
+
+    return {entry->plan.to_string(mat_names), entry->plan.flops};
+}
+
+//==============================================================================
+// operator+= ()
+//==============================================================================
+// C += lazy(A) * B * ...: the last product is accumulated into C by gemm()
+// with beta = 1, the others run in the thread's arena. No allocation once the
+// arena is warm. C may be one of the factors.
+template <typename T>
+template <std::size_t N>
+DenseMatrix<T>& DenseMatrix<T>::operator+=(const ProductExpr<DenseMatrix, N>& product)
+{
+    if constexpr (N == 1) {
+        return *this += *product.get_factors()[0];
+    } else {
+        std::array<int, N + 1> dims = {};
+        for (std::size_t i = 0; i < N; i++) {
+            dims[i] = product.get_factors()[i]->get_nrow();
+        }
+        dims[N] = product.get_ncol();
+
+        const auto plan = calc_static_mult_plan<flops_type>(dims);
+        execute_mult_plan_in_arena(plan, product.get_factors().data(), MatrixArena::thread_local_instance(), true,
+                                   *this);
+
+        return *this;
+    }
+}
+
+//==============================================================================
+// ProductExpr
+//==============================================================================
+// Lazy product of N factors, started with lazy(). Nothing is multiplied until
+// the expression is converted to Mat; the chain is then evaluated following
+// calc_static_mult_plan() instead of left to right as written. Everything is
+// constexpr: an expression over constexpr matrices is planned and evaluated
+// by the compiler.
+// Factors are held by pointer: an expression must not outlive its operands,
+// so assign it to a Mat within the same full-expression.
+template <typename Mat, std::size_t N>
+class ProductExpr {
+public:
+    using matrix_type = Mat;
+
+    constexpr explicit ProductExpr(const std::array<const Mat*, N>& factors);
+
+    constexpr int get_nrow() const;
+    constexpr int get_ncol() const;
+    constexpr const std::array<const Mat*, N>& get_factors() const;
+
+    constexpr Mat eval() const;
+    constexpr operator Mat() const;
+
+    void collect_terms(std::vector<std::vector<const Mat*>>& terms) const;
+
+private:
+    template <typename Plan>
+    constexpr Mat eval(const Plan& plan, int op) const;
+
+    std::array<const Mat*, N> m_factors;
+};
+
+//==============================================================================
+// SumExpr
+//==============================================================================
+// Lazy sum of two expressions. Each side is evaluated (product chains in their
+// optimal order) when the sum is converted to Mat.
+template <typename L, typename R>
+class SumExpr {
+public:
+    using matrix_type = typename L::matrix_type;
+
+    constexpr SumExpr(const L& lhs, const R& rhs);
+
+    constexpr int get_nrow() const;
+    constexpr int get_ncol() const;
+
+    constexpr matrix_type eval() const;
+    constexpr operator matrix_type() const;
+
+    void collect_terms(std::vector<std::vector<const matrix_type*>>& terms) const;
+
+private:
+    L m_lhs;
+    R m_rhs;
+};
+
+//==============================================================================
+// is_matrix_expr
+//==============================================================================
+template <typename T>
+struct is_matrix_expr : std::false_type {};
+
+template <typename Mat, std::size_t N>
+struct is_matrix_expr<ProductExpr<Mat, N>> : std::true_type {};
+
+template <typename L, typename R>
+struct is_matrix_expr<SumExpr<L, R>> : std::true_type {};
+
+template <typename T>
+inline constexpr bool is_matrix_expr_v = is_matrix_expr<T>::value;
+
+//==============================================================================
+// lazy ()
+//==============================================================================
+template <typename Mat>
+constexpr ProductExpr<Mat, 1> lazy(const Mat& mat)
+{
+    return ProductExpr<Mat, 1>({&mat});
+}
+
+//==============================================================================
+// ProductExpr ()
+//==============================================================================
+template <typename Mat, std::size_t N>
+constexpr ProductExpr<Mat, N>::ProductExpr(const std::array<const Mat*, N>& factors)
+    : m_factors(factors)
+{
+}
+
+//==============================================================================
+// get_nrow ()
+//==============================================================================
+template <typename Mat, std::size_t N>
+constexpr int ProductExpr<Mat, N>::get_nrow() const
+{
+    return m_factors.front()->get_nrow();
+}
+
+//==============================================================================
+// get_ncol ()
+//==============================================================================
+template <typename Mat, std::size_t N>
+constexpr int ProductExpr<Mat, N>::get_ncol() const
+{
+    return m_factors.back()->get_ncol();
+}
+
+//==============================================================================
+// get_factors ()
+//==============================================================================
+template <typename Mat, std::size_t N>
+constexpr const std::array<const Mat*, N>& ProductExpr<Mat, N>::get_factors() const
+{
+    return m_factors;
+}
+
+//==============================================================================
+// eval ()
+//==============================================================================
+template <typename Mat, std::size_t N>
+constexpr Mat ProductExpr<Mat, N>::eval() const
+{
+    std::array<int, N + 1> dims = {};
+    for (std::size_t i = 0; i < N; i++) {
+        dims[i] = m_factors[i]->get_nrow();
+    }
+    dims[N] = get_ncol();
+
+    const auto plan = calc_static_mult_plan<typename Mat::flops_type>(dims);
+
+    if constexpr (is_dense_matrix_v<Mat>) {
+        return execute_mult_plan_in_arena(plan, m_factors.data(), MatrixArena::thread_local_instance());
+    } else {
+        return eval(plan, plan.get_result());
+    }
+}
+
+//==============================================================================
+// eval ()
+//==============================================================================
+template <typename Mat, std::size_t N>
+template <typename Plan>
+constexpr Mat ProductExpr<Mat, N>::eval(const Plan& plan, int op) const
+{
+    if (op < int(N)) {
+        return *m_factors[op];
+    }
+
+    // factors are multiplied in place, only intermediates are materialized
+    const auto& node = plan.nodes[op - N];
+    return eval(plan, node.left) * eval(plan, node.right);
+}
+
+//==============================================================================
+// operator Mat ()
+//==============================================================================
+template <typename Mat, std::size_t N>
+constexpr ProductExpr<Mat, N>::operator Mat() const
+{
+    return eval();
+}
+
+//==============================================================================
+// collect_terms ()
+//==============================================================================
+// Appends the factors of the product, see ExprDag
+template <typename Mat, std::size_t N>
+void ProductExpr<Mat, N>::collect_terms(std::vector<std::vector<const Mat*>>& terms) const
+{
+    terms.emplace_back(m_factors.begin(), m_factors.end());
+}
+
+//==============================================================================
+// SumExpr ()
+//==============================================================================
+template <typename L, typename R>
+constexpr SumExpr<L, R>::SumExpr(const L& lhs, const R& rhs)
+    : m_lhs(lhs),
+      m_rhs(rhs)
+{
+}
+
+//==============================================================================
+// get_nrow ()
+//==============================================================================
+template <typename L, typename R>
+constexpr int SumExpr<L, R>::get_nrow() const
+{
+    return m_lhs.get_nrow();
+}
+
+//==============================================================================
+// get_ncol ()
+//==============================================================================
+template <typename L, typename R>
+constexpr int SumExpr<L, R>::get_ncol() const
+{
+    return m_lhs.get_ncol();
+}
+
+//==============================================================================
+// eval ()
+//==============================================================================
+template <typename L, typename R>
+constexpr typename SumExpr<L, R>::matrix_type SumExpr<L, R>::eval() const
+{
+    return m_lhs.eval() + m_rhs.eval();
+}
+
+//==============================================================================
+// operator matrix_type ()
+//==============================================================================
+template <typename L, typename R>
+constexpr SumExpr<L, R>::operator matrix_type() const
+{
+    return eval();
+}
+
+//==============================================================================
+// collect_terms ()
+//==============================================================================
+// Appends the factors of every product of the sum, left to right
+template <typename L, typename R>
+void SumExpr<L, R>::collect_terms(std::vector<std::vector<const matrix_type*>>& terms) const
+{
+    m_lhs.collect_terms(terms);
+    m_rhs.collect_terms(terms);
+}
+
+//==============================================================================
+// check_expr_dims ()
+//==============================================================================
+template <typename L, typename R>
+constexpr void check_expr_dims(const char *op, const L& lhs, const R& rhs)
+{
+    const bool ok = (op[0] == '+' ? lhs.get_nrow() == rhs.get_nrow() && lhs.get_ncol() == rhs.get_ncol()
+                                  : lhs.get_ncol() == rhs.get_nrow());
+    if (!ok) {
+        using Mat = typename L::matrix_type;
+        throw std::logic_error(std::string(op[0] == '+' ? "add" : "mult") + ": dimensions do not match: " +
+                               diff_dims_error(Mat(lhs.get_nrow(), lhs.get_ncol()),
+                                               Mat(rhs.get_nrow(), rhs.get_ncol())));
+    }
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+template <typename Mat, std::size_t N, std::size_t K>
+constexpr ProductExpr<Mat, N + K> operator*(const ProductExpr<Mat, N>& lhs, const ProductExpr<Mat, K>& rhs)
+{
+    check_expr_dims("*", lhs, rhs);
+
+    std::array<const Mat*, N + K> factors = {};
+    for (std::size_t i = 0; i < N; i++) {
+        factors[i] = lhs.get_factors()[i];
+    }
+    for (std::size_t i = 0; i < K; i++) {
+        factors[N + i] = rhs.get_factors()[i];
+    }
+
+    return ProductExpr<Mat, N + K>(factors);
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+template <typename Mat, std::size_t N>
+constexpr ProductExpr<Mat, N + 1> operator*(const ProductExpr<Mat, N>& lhs, const Mat& rhs)
+{
+    return lhs * lazy(rhs);
+}
+
+//==============================================================================
+// operator* ()
+//==============================================================================
+template <typename Mat, std::size_t N>
+constexpr ProductExpr<Mat, N + 1> operator*(const Mat& lhs, const ProductExpr<Mat, N>& rhs)
+{
+    return lazy(lhs) * rhs;
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+template <typename L, typename R, typename = std::enable_if_t<is_matrix_expr_v<L> && is_matrix_expr_v<R>>>
+constexpr SumExpr<L, R> operator+(const L& lhs, const R& rhs)
+{
+    check_expr_dims("+", lhs, rhs);
+
+    return SumExpr<L, R>(lhs, rhs);
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+template <typename L, typename = std::enable_if_t<is_matrix_expr_v<L>>>
+constexpr SumExpr<L, ProductExpr<typename L::matrix_type, 1>> operator+(const L& lhs,
+                                                                       const typename L::matrix_type& rhs)
+{
+    return lhs + lazy(rhs);
+}
+
+//==============================================================================
+// operator+ ()
+//==============================================================================
+template <typename R, typename = std::enable_if_t<is_matrix_expr_v<R>>>
+constexpr SumExpr<ProductExpr<typename R::matrix_type, 1>, R> operator+(const typename R::matrix_type& lhs,
+                                                                       const R& rhs)
+{
+    return lazy(lhs) + rhs;
+}
+
+//==============================================================================
+// BasicExprPlan
+//==============================================================================
+// Execution plan of a sum of product chains as a DAG: a product several terms
+// share, or one term uses twice, is a single node that all its users refer
+// to. Operands are numbered as in BasicMultPlan, 0..num_inputs-1 being the
+// distinct factors and num_inputs + t the result of nodes[t]. Nodes are in
+// topological order, the last one yielding the sum; an executor just runs
+// them in sequence.
+template <typename Flops>
+struct BasicExprPlan {
+    enum class Op {
+        mult,
+        add,
+    };
+
+    struct Node {
+        Op op;
+        int left;
+        int right;
+        int nrow;  // shape of the result
+        int ncol;
+        Flops flops;  // flops of this node only
+    };
+
+    int num_inputs = 0;
+    std::vector<Node> nodes;
+    Flops flops = 0;           // every node once
+    Flops unshared_flops = 0;  // every term planned and computed on its own, as SumExpr::eval() does
+
+    int get_result() const;
+    Flops get_saved_flops() const;
+    std::string to_string(std::initializer_list<const char *> input_names = {}) const;
+};
+
+using ExprPlan = BasicExprPlan<int>;
+
+//==============================================================================
+// get_result ()
+//==============================================================================
+template <typename Flops>
+int BasicExprPlan<Flops>::get_result() const
+{
+    return (nodes.empty() ? 0 : num_inputs + int(nodes.size()) - 1);
+}
+
+//==============================================================================
+// get_saved_flops ()
+//==============================================================================
+template <typename Flops>
+Flops BasicExprPlan<Flops>::get_saved_flops() const
+{
+    return unshared_flops - flops;
+}
+
+//==============================================================================
+// to_string ()
+//==============================================================================
+// Debug view: the products used more than once first, named t1, t2, ...,
+// then the whole expression using them, e.g.
+// "t1 = (M1 * M2); ((t1 * M3) + (t1 * M4))"
+template <typename Flops>
+std::string BasicExprPlan<Flops>::to_string(std::initializer_list<const char *> input_names) const
+{
+    if (num_inputs == 0) {
+        return "";
+    }
+    if (input_names.size() && input_names.size() != std::size_t(num_inputs)) {
+        throw std::logic_error("wrong input sizes");
+    }
+
+    std::vector<int> uses(nodes.size(), 0);
+    for (const Node& node : nodes) {
+        for (int op : {node.left, node.right}) {
+            if (op >= num_inputs) {
+                uses[op - num_inputs]++;
+            }
+        }
+    }
+    std::vector<std::string> names(nodes.size());
+    int num_names = 0;
+    for (std::size_t t = 0; t < nodes.size(); t++) {
+        if (uses[t] > 1) {
+            names[t] = "t" + std::to_string(++num_names);
+        }
+    }
+
+    // operands are at most as deep as expressions are long, recursion is fine
+    const std::function<std::string(int, bool)> print = [&](int op, bool define) {
+        if (op < num_inputs) {
+            return (input_names.size() ? std::string(*(input_names.begin() + op)) : "M" + std::to_string(op + 1));
+        }
+        const std::size_t t = op - num_inputs;
+        if (!define && !names[t].empty()) {
+            return names[t];
+        }
+        const Node& node = nodes[t];
+        return "(" + print(node.left, false) + (node.op == Op::mult ? " * " : " + ") + print(node.right, false) + ")";
+    };
+
+    std::string res;
+    for (std::size_t t = 0; t < nodes.size(); t++) {
+        if (!names[t].empty()) {
+            res += names[t] + " = " + print(num_inputs + int(t), true) + "; ";
+        }
+    }
+
+    return res + print(get_result(), true);
+}
+
+//==============================================================================
+// calc_expr_chain_cost ()
+//==============================================================================
+// Matrix chain DP over the factors seq of one term, input p being
+// shapes[p].first x shapes[p].second, where a subchain found in shared costs
+// nothing: it is computed once, elsewhere. The whole chain is looked up as
+// well unless whole_shared is false, for the shared chains themselves. On
+// return split[i * n + j] is the split point of subchain i..j, -1 for a
+// shared one. Splits that overflow are skipped, as in
+// calc_mult_plan_with_cost(); returns flops_traits<Flops>::max() if they all
+// do.
+template <typename Flops>
+Flops calc_expr_chain_cost(const std::vector<int>& seq, const std::vector<std::pair<int, int>>& shapes,
+                           const std::set<std::vector<int>>& shared, bool whole_shared, std::vector<int>& split)
+{
+    using traits = flops_traits<Flops>;
+    const Flops overflow = traits::max();
+    const std::size_t n = seq.size();
+
+    std::vector<Flops> min_cost(n * n, Flops(0));
+    split.assign(n * n, -1);
+    for (std::size_t length = 2; length < n + 1; length++) {
+        for (std::size_t i = 0; i < n - length + 1; i++) {
+            const std::size_t j = i + length - 1;
+            if ((length < n || whole_shared) && shared.count(std::vector<int>(seq.begin() + i, seq.begin() + j + 1))) {
+                continue;
+            }
+
+            min_cost[i * n + j] = overflow;
+            for (std::size_t k = i; k < j; k++) {
+                const Flops cost_ik = min_cost[i * n + k];
+                const Flops cost_kj = min_cost[(k + 1) * n + j];
+                if (cost_ik == overflow || cost_kj == overflow) {
+                    continue;
+                }
+
+                Flops mult = 0;
+                try {
+                    mult = calc_mult_flops<Flops>(shapes[seq[i]].first, shapes[seq[k + 1]].first, shapes[seq[j]].second);
+                } catch (const std::overflow_error&) {
+                    continue;
+                }
+                Flops subchains = 0;
+                Flops cost = 0;
+                if (!traits::add(cost_ik, cost_kj, subchains) || !traits::add(subchains, mult, cost)) {
+                    continue;
+                }
+                if (cost < min_cost[i * n + j]) {
+                    min_cost[i * n + j] = cost;
+                    split[i * n + j] = int(k);
+                }
+            }
+        }
+    }
+
+    return (n ? min_cost[n - 1] : Flops(0));
+}
+
+//==============================================================================
+// calc_shared_expr_plan ()
+//==============================================================================
+// Plan of the sum of the product chains terms, each a sequence of inputs,
+// input p being shapes[p].first x shapes[p].second, that computes shared
+// subchains once. Parenthesizations are optimized jointly: the subchains
+// occurring at least twice (without overlap) are candidates, and the one
+// whose sharing lowers the total the most is shared, greedily, until none
+// lowers it. The total is the DP cost of every term plus that of every shared
+// subchain, shared subchains costing nothing to the chains containing them;
+// so a term may be split where it is not optimal on its own, to reuse a
+// product of another term. Products that end up equal anyway are merged when
+// the DAG is built. Terms are then summed left to right.
+// Throws std::logic_error if shapes do not match, and std::overflow_error if
+// even the cheapest plan does not fit in Flops, unless it saturates.
+template <typename Flops = int>
+BasicExprPlan<Flops> calc_shared_expr_plan(const std::vector<std::pair<int, int>>& shapes,
+                                           const std::vector<std::vector<int>>& terms)
+{
+    using traits = flops_traits<Flops>;
+    using Plan = BasicExprPlan<Flops>;
+    const Flops overflow = traits::max();
+
+    if (terms.empty() || shapes.empty()) {
+        throw std::logic_error("no input mat");
+    }
+    const auto shape_of = [&](const std::vector<int>& term) {
+        if (term.empty()) {
+            throw std::logic_error("no input mat");
+        }
+        for (std::size_t p = 0; p + 1 < term.size(); p++) {
+            const auto& [nrow, ncol] = shapes[term[p]];
+            const auto& [next_nrow, next_ncol] = shapes[term[p + 1]];
+            if (ncol != next_nrow) {
+                throw std::logic_error("mult: dimensions do not match: " +
+                                       diff_dims_error(BasicMatrix<int>(nrow, ncol),
+                                                       BasicMatrix<int>(next_nrow, next_ncol)));
+            }
+        }
+        return std::make_pair(shapes[term.front()].first, shapes[term.back()].second);
+    };
+    const auto [nrow, ncol] = shape_of(terms[0]);
+    for (const std::vector<int>& term : terms) {
+        const auto [term_nrow, term_ncol] = shape_of(term);
+        if (term_nrow != nrow || term_ncol != ncol) {
+            throw std::logic_error("add: dimensions do not match: " +
+                                   diff_dims_error(BasicMatrix<int>(nrow, ncol),
+                                                   BasicMatrix<int>(term_nrow, term_ncol)));
+        }
+    }
+    const Flops add_flops = checked_mul(checked_mul<Flops>(nrow, ncol), Flops(terms.size() - 1));
+
+    // subchains occurring at least twice without overlapping: within a term
+    // the occurrences come by increasing start
+    std::map<std::vector<int>, std::vector<std::pair<std::size_t, std::size_t>>> occurrences;
+    for (std::size_t t = 0; t < terms.size(); t++) {
+        for (std::size_t i = 0; i < terms[t].size(); i++) {
+            for (std::size_t j = i + 2; j < terms[t].size() + 1; j++) {
+                occurrences[std::vector<int>(terms[t].begin() + i, terms[t].begin() + j)].push_back({t, i});
+            }
+        }
+    }
+    std::vector<std::vector<int>> candidates;
+    for (const auto& [seq, positions] : occurrences) {
+        std::size_t count = 0;
+        std::pair<std::size_t, std::size_t> last_end = {0, 0};
+        for (const auto& [t, i] : positions) {
+            if (count == 0 || t != last_end.first || i >= last_end.second) {
+                count++;
+                last_end = {t, i + seq.size()};
+            }
+        }
+        if (count > 1) {
+            candidates.push_back(seq);
+        }
+    }
+
+    std::vector<int> split;
+    const auto calc_total = [&](const std::set<std::vector<int>>& shared) {
+        Flops total = 0;
+        for (const std::vector<int>& term : terms) {
+            const Flops cost = calc_expr_chain_cost<Flops>(term, shapes, shared, true, split);
+            if (cost == overflow || !traits::add(total, cost, total)) {
+                return overflow;
+            }
+        }
+        for (const std::vector<int>& seq : shared) {
+            const Flops cost = calc_expr_chain_cost<Flops>(seq, shapes, shared, false, split);
+            if (cost == overflow || !traits::add(total, cost, total)) {
+                return overflow;
+            }
+        }
+        return total;
+    };
+
+    Plan plan;
+    plan.num_inputs = int(shapes.size());
+    const Flops unshared_total = calc_total({});
+    if (!traits::saturates && unshared_total == overflow) {
+        throw std::overflow_error("mult order: flops overflow");
+    }
+    plan.unshared_flops = checked_add(unshared_total, add_flops);
+
+    std::set<std::vector<int>> shared;
+    Flops total = unshared_total;
+    while (true) {
+        const std::vector<int> *best = nullptr;
+        Flops best_total = total;
+        for (const std::vector<int>& seq : candidates) {
+            if (shared.count(seq)) {
+                continue;
+            }
+            std::set<std::vector<int>> with_seq = shared;
+            with_seq.insert(seq);
+            const Flops candidate_total = calc_total(with_seq);
+            if (candidate_total < best_total) {
+                best = &seq;
+                best_total = candidate_total;
+            }
+        }
+        if (best == nullptr) {
+            break;
+        }
+        shared.insert(*best);
+        total = best_total;
+    }
+
+    // post-order walk of every term, each distinct subchain becoming one node;
+    // shared subchains are built from their own DP
+    std::map<std::vector<int>, int> operand_of;
+    const std::function<int(const std::vector<int>&, const std::vector<int>&, std::size_t, std::size_t)> build =
+        [&](const std::vector<int>& seq, const std::vector<int>& seq_split, std::size_t i, std::size_t j) {
+            if (i == j) {
+                return seq[i];
+            }
+            std::vector<int> sub(seq.begin() + i, seq.begin() + j + 1);
+            const auto it = operand_of.find(sub);
+            if (it != operand_of.end()) {
+                return it->second;
+            }
+
+            int op = 0;
+            const int k = seq_split[i * seq.size() + j];
+            if (k == -1) {
+                std::vector<int> sub_split;
+                calc_expr_chain_cost<Flops>(sub, shapes, shared, false, sub_split);
+                op = build(sub, sub_split, 0, sub.size() - 1);
+            } else {
+                const int left = build(seq, seq_split, i, k);
+                const int right = build(seq, seq_split, k + 1, j);
+                const int dim_j = shapes[seq[j]].second;
+                const Flops flops = calc_mult_flops<Flops>(shapes[seq[i]].first, shapes[seq[k + 1]].first, dim_j);
+                plan.nodes.push_back({Plan::Op::mult, left, right, shapes[seq[i]].first, dim_j, flops});
+                plan.flops = checked_add(plan.flops, flops);
+                op = plan.num_inputs + int(plan.nodes.size()) - 1;
+            }
+            operand_of.emplace(std::move(sub), op);
+            return op;
+        };
+
+    int sum = -1;
+    for (const std::vector<int>& term : terms) {
+        std::vector<int> term_split;
+        calc_expr_chain_cost<Flops>(term, shapes, shared, true, term_split);
+        const int op = build(term, term_split, 0, term.size() - 1);
+        if (sum == -1) {
+            sum = op;
+        } else {
+            const Flops flops = checked_mul<Flops>(nrow, ncol);
+            plan.nodes.push_back({Plan::Op::add, sum, op, nrow, ncol, flops});
+            plan.flops = checked_add(plan.flops, flops);
+            sum = plan.num_inputs + int(plan.nodes.size()) - 1;
+        }
+    }
+
+    return plan;
+}
+
+//==============================================================================
+// execute_expr_plan ()
+//==============================================================================
+// Runs the nodes of plan in sequence with the operators of Mat, freeing each
+// intermediate after its last use. The result is credited with the flops of
+// the plan plus those of every distinct input, each counted once.
+template <typename Mat>
+Mat execute_expr_plan(const BasicExprPlan<typename Mat::flops_type>& plan, const Mat *const *inputs)
+{
+    using Plan = BasicExprPlan<typename Mat::flops_type>;
+
+    if (plan.num_inputs == 0) {
+        throw std::logic_error("no input mat");
+    }
+
+    const int nnodes = int(plan.nodes.size());
+    std::vector<int> uses(nnodes, 0);
+    for (const typename Plan::Node& node : plan.nodes) {
+        for (int op : {node.left, node.right}) {
+            if (op >= plan.num_inputs) {
+                uses[op - plan.num_inputs]++;
+            }
+        }
+    }
+
+    std::vector<std::optional<Mat>> results(nnodes);
+    const auto operand = [&](int op) -> const Mat& {
+        return (op < plan.num_inputs ? *inputs[op] : *results[op - plan.num_inputs]);
+    };
+    for (int t = 0; t < nnodes; t++) {
+        const typename Plan::Node& node = plan.nodes[t];
+        const Mat& left = operand(node.left);
+        const Mat& right = operand(node.right);
+        results[t].emplace(node.op == Plan::Op::mult ? left * right : left + right);
+        for (int op : {node.left, node.right}) {
+            if (op >= plan.num_inputs && --uses[op - plan.num_inputs] == 0) {
+                results[op - plan.num_inputs].reset();
+            }
+        }
+    }
+
+    Mat res = (nnodes ? std::move(*results.back()) : *inputs[0]);
+    res.m_flops = plan.flops;
+    for (int i = 0; i < plan.num_inputs; i++) {
+        res.m_flops = checked_add(res.m_flops, inputs[i]->get_flops());
+    }
+
+    return res;
+}
+
+//==============================================================================
+// ExprDag
+//==============================================================================
+// A sum of product chains such as lazy(A) * B * C + lazy(A) * B * D, as its
+// distinct factors, told apart by address, and the calc_shared_expr_plan()
+// that computes its shared subchains once; get_plan() reports the flops
+// saved over SumExpr::eval(). Like the expressions, it holds the factors by
+// pointer and must not outlive them.
+template <typename Mat>
+class ExprDag {
+public:
+    using flops_type = typename Mat::flops_type;
+
+    template <typename Expr>
+    explicit ExprDag(const Expr& expr);
+
+    const std::vector<const Mat*>& get_inputs() const;
+    const BasicExprPlan<flops_type>& get_plan() const;
+
+    Mat eval() const;
+
+private:
+    std::vector<const Mat*> m_inputs;
+    BasicExprPlan<flops_type> m_plan;
+};
+
+template <typename Expr>
+ExprDag(const Expr& expr) -> ExprDag<typename Expr::matrix_type>;
+
+//==============================================================================
+// ExprDag ()
+//==============================================================================
+template <typename Mat>
+template <typename Expr>
+ExprDag<Mat>::ExprDag(const Expr& expr)
+{
+    std::vector<std::vector<const Mat*>> factors;
+    expr.collect_terms(factors);
+
+    std::vector<std::pair<int, int>> shapes;
+    std::vector<std::vector<int>> terms;
+    for (const std::vector<const Mat*>& term : factors) {
+        terms.emplace_back();
+        for (const Mat *factor : term) {
+            const auto it = std::find(m_inputs.begin(), m_inputs.end(), factor);
+            terms.back().push_back(int(it - m_inputs.begin()));
+            if (it == m_inputs.end()) {
+                m_inputs.push_back(factor);
+                shapes.push_back({factor->get_nrow(), factor->get_ncol()});
+            }
+        }
+    }
+
+    m_plan = calc_shared_expr_plan<flops_type>(shapes, terms);
+}
+
+//==============================================================================
+// get_inputs ()
+//==============================================================================
+template <typename Mat>
+const std::vector<const Mat*>& ExprDag<Mat>::get_inputs() const
+{
+    return m_inputs;
+}
+
+//==============================================================================
+// get_plan ()
+//==============================================================================
+template <typename Mat>
+const BasicExprPlan<typename ExprDag<Mat>::flops_type>& ExprDag<Mat>::get_plan() const
+{
+    return m_plan;
+}
+
+//==============================================================================
+// eval ()
+//==============================================================================
+template <typename Mat>
+Mat ExprDag<Mat>::eval() const
+{
+    return execute_expr_plan(m_plan, m_inputs.data());
+}
+
+//==============================================================================
+// eval_shared ()
+//==============================================================================
+// expr evaluated with its shared subchains computed once, see ExprDag
+template <typename Expr>
+typename Expr::matrix_type eval_shared(const Expr& expr)
+{
+    return ExprDag(expr).eval();
+}
+
+//==============================================================================
+// make_temp_path ()
+//==============================================================================
+// Path in the temp directory for the checks and benchmarks to write to,
+// unique to the process and the call, so that concurrent runs never clobber
+// each other's files
+static std::filesystem::path make_temp_path(const std::string& name)
+{
+    static std::atomic<unsigned> count(0);
+#if defined(__unix__) || defined(__APPLE__)
+    static const unsigned long id = getpid();
+#else
+    static const unsigned long id = std::random_device()();
+#endif
+    const std::string unique = name + '.' + std::to_string(id) + '.' + std::to_string(count++);
+
+    return std::filesystem::temp_directory_path() / unique;
+}
+
+//==============================================================================
+// compile_time_checks ()
+//==============================================================================
+constexpr void compile_time_checks()
+{
+    {
+        constexpr Matrix A(2, 10);
+
+        static_assert(A.get_nrow() == 2);
+        static_assert(A.get_ncol() == 10);
+        static_assert(A.get_flops() == 0);
+    }
+
+    {
+        constexpr Matrix A(2, 10);
+        constexpr Matrix B(2, 10);
+        constexpr Matrix C = A + B;
+
+        static_assert(C.get_nrow() == 2);
+        static_assert(C.get_ncol() == 10);
+        static_assert(C.get_flops() == 20);
+
+        // constexpr Matrix C = Matrix(2, 10) + Matrix(3, 10);  // compile error: non-matching dimensions
+    }
+
+    {
+        constexpr Matrix A(2, 5);
+        constexpr Matrix B(5, 10);
+        constexpr Matrix C = A * B;
+
+        static_assert(C.get_nrow() == 2);
+        static_assert(C.get_ncol() == 10);
+        static_assert(C.get_flops() == 190);
+
+        // constexpr Matrix C = Matrix(2, 5) * Matrix(4, 10);  // compile error: non-matching dimensions
+    }
+
+    {
+        constexpr Matrix A(2, 5);
+        constexpr Matrix B(5, 10);
+        constexpr Matrix C(10, 3);
+        constexpr Matrix D(3, 8);
+        constexpr Matrix E(2, 7);
+        constexpr Matrix F(7, 8);
+        constexpr Matrix G = A * B * C * D + E * F;
+        constexpr Matrix G2 = (A * (B * C)) * D + E * F;
+
+        static_assert(G.get_nrow() == 2);
+        static_assert(G.get_ncol() == 8);
+        static_assert(G2.get_nrow() == 2);
+        static_assert(G2.get_ncol() == 8);
+    }
+
+    {
+        constexpr Matrix A(2, 5);
+        constexpr Matrix B(2, 5);
+        constexpr Matrix C(2, 5);
+
+        static_assert((A + B + C) == sum_using_initializer_list({A, B, C}));
+        static_assert((A + B + C) == sum_using_fold_expression(A, B, C));
+    }
+
+    {
+        constexpr Matrix A(2, 5);
+        constexpr Matrix B(5, 10);
+        constexpr Matrix C(10, 3);
+        constexpr Matrix D(3, 8);
+
+        static_assert((A * B * C * D) == product_using_initializer_list({A, B, C, D}));
+        static_assert((A * B * C * D) == product_using_fold_expression(A, B, C, D));
+        static_assert([=]() { Matrix res = A; res *= B; res += A * B; return res; }() == A * B + A * B);
+    }
+
+    {
+        // 20000 x 20000 x 20000 products overflow int flops, not 64-bit ones
+        constexpr BasicMatrix<std::int64_t> A(20000, 20000);
+        constexpr BasicMatrix<std::int64_t> B(20000, 20000);
+        constexpr BasicMatrix<std::int64_t> C = A * B;
+
+        static_assert(C.get_flops() == std::int64_t(20000) * 20000 * 39999);
+        static_assert([]() { int flops = 0; return !flops_traits<int>::mul(20000 * 20000, 39999, flops); }());
+
+        // constexpr Matrix D = Matrix(20000, 20000) * Matrix(20000, 20000);  // compile error: flops overflow
+    }
+
+#if defined(__SIZEOF_INT128__)
+    {
+        constexpr BasicMatrix<int128_t> A(2000000000, 2000000000);
+        constexpr BasicMatrix<int128_t> B(2000000000, 2000000000);
+        constexpr BasicMatrix<int128_t> C = A * B * B;
+
+        static_assert(C.get_flops() == 2 * int128_t(2000000000) * 2000000000 * 3999999999);
+    }
+#endif
+
+    {
+        constexpr BasicMatrix<Saturating<int>> A(20000, 20000);
+        constexpr BasicMatrix<Saturating<int>> B(10, 10);
+        constexpr BasicMatrix<Saturating<int>> C = A * A + A * A;
+
+        static_assert((B * B).get_flops() == 10 * 10 * 19);
+        static_assert(!(B * B).get_flops().is_saturated());
+        static_assert(C.get_flops().is_saturated());
+    }
+
+    {
+        constexpr auto plan = calc_static_mult_plan(std::array<int, 5>{40, 20, 30, 10, 30});
+
+        static_assert(plan.flops == 50200);
+        static_assert(plan.get_result() == 6);
+        static_assert(plan.nodes[0].left == 1 && plan.nodes[0].right == 2);
+        static_assert(plan.nodes[1].left == 0 && plan.nodes[1].right == 4);
+        static_assert(plan.nodes[2].left == 5 && plan.nodes[2].right == 3);
+        static_assert(calc_static_mult_plan(std::array<int, 2>{40, 20}).flops == 0);
+        static_assert(calc_static_mult_plan<std::int64_t>(std::array<int, 4>{2000, 2000, 2000, 1}).flops == 8000000);
+
+        // compile error, the flops overflow:
+        // constexpr auto bad = calc_static_mult_plan(std::array<int, 4>{20000, 20000, 20000, 20000});
+    }
+
+    {
+        constexpr Matrix A(40, 20);
+        constexpr Matrix B(20, 30);
+        constexpr Matrix C(30, 10);
+        constexpr Matrix D(10, 30);
+        constexpr Matrix E(40, 5);
+        constexpr Matrix F(5, 30);
+        constexpr Matrix G = lazy(A) * B * C * D + lazy(E) * F;
+
+        static_assert(G == (A * (B * C)) * D + E * F);
+        static_assert(G.get_flops() == 50200 + 40 * 5 * 59 + 40 * 30);
+    }
+
+    {
+        constexpr auto A = []() {
+            FixedMatrix<int, 2, 3> mat;
+            mat(0, 0) = 1; mat(0, 1) = 2; mat(0, 2) = 3;
+            mat(1, 0) = 4; mat(1, 1) = 5; mat(1, 2) = 6;
+            return mat;
+        }();
+        constexpr auto B = []() {
+            FixedMatrix<int, 3, 2> mat;
+            mat(0, 0) = 1; mat(0, 1) = 0;
+            mat(1, 0) = 0; mat(1, 1) = 1;
+            mat(2, 0) = 1; mat(2, 1) = 1;
+            return mat;
+        }();
+        constexpr FixedMatrix<int, 2, 2> C = A * B + A * B;
+
+        static_assert(C.get_nrow() == 2 && C.get_ncol() == 2);
+        static_assert(C(0, 0) == 8 && C(0, 1) == 10 && C(1, 0) == 20 && C(1, 1) == 22);
+        static_assert(C.get_flops() == 2 * (2 * 3 * 3) + 4);
+        static_assert((FixedMatrix<int, 16, 16>() * FixedMatrix<int, 16, 16>()).get_flops() == 16 * 16 * 31);
+
+        // constexpr auto D = A * A;  // compile error: non-matching dimensions
+        // constexpr auto D = A + B;  // compile error: non-matching dimensions
+    }
+}
+
+//==============================================================================
+// run_time_checks ()
+//==============================================================================
+void run_time_checks()
+{
+    {
+        constexpr Matrix A(2, 10);
+        Matrix B(2, 10);
+        B += A;
+
+        assert(B.get_nrow() == 2);
+        assert(B.get_ncol() == 10);
+        assert(B.get_flops() == 20);
+    }
+
+    {
+        constexpr Matrix A(2, 10);
+        constexpr Matrix B(2, 10);
+        Matrix C(2, 10);
+        C += A + B;
+
+        assert(C.get_nrow() == 2);
+        assert(C.get_ncol() == 10);
+        assert(C.get_flops() == 40);
+    }
+
+    {
+        constexpr Matrix A(5, 10);
+        Matrix B(2, 5);
+        B *= A;
+
+        assert(B.get_nrow() == 2);
+        assert(B.get_ncol() == 10);
+        assert(B.get_flops() == 190);
+    }
+
+    {
+        constexpr Matrix A(2, 5);
+        constexpr Matrix B(5, 10);
+        Matrix C(10, 2);
+        C *= A * B;
+
+        assert(C.get_nrow() == 10);
+        assert(C.get_ncol() == 10);
+        assert(C.get_flops() == 570);
+    }
+
+    {
+        constexpr Matrix A(40, 20);
+        constexpr Matrix B(20, 30);
+        constexpr Matrix C(30, 10);
+        constexpr Matrix D(10, 30);
+
+        // when no mat names given, mats are named as "Mi"
+        assert(calc_optimal_mult_order({A, B, C, D}) ==
+               std::make_pair("((M1 * (M2 * M3)) * M4)"s, 50200));
+        assert(calc_optimal_mult_order({A, B, C, D}, {"A", "B", "C", "D"}) ==
+               std::make_pair("((A * (B * C)) * D)"s, 50200));
+    }
+
+    {
+        constexpr Matrix A(40, 20);
+        constexpr Matrix B(20, 30);
+        constexpr Matrix C(30, 10);
+        constexpr Matrix D(10, 30);
+
+        assert(calc_optimal_mult_order({A, B, C, D}, {"A", "B", "C", "D"}, MultOrderSolver::hu_shing) ==
+               std::make_pair("((A * (B * C)) * D)"s, 50200));
+        assert(calc_optimal_mult_order({A}, {"A"}, MultOrderSolver::hu_shing) == std::make_pair("A"s, 0));
+        assert(calc_optimal_mult_order({A, B}, {}, MultOrderSolver::hu_shing) == std::make_pair("(M1 * M2)"s, 47200));
+    }
+
+    {
+        bool thrown = false;
+        try {
+            const Matrix C = Matrix(20000, 20000) * Matrix(20000, 20000);
+            (void)C;
+        } catch (const std::overflow_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        // ((A * B) * C) would overflow int, the DP must skip it rather than wrap
+        constexpr Matrix A(2000, 2000);
+        constexpr Matrix B(2000, 2000);
+        constexpr Matrix C(2000, 1);
+        assert(calc_optimal_mult_order({A, B, C}) == std::make_pair("(M1 * (M2 * M3))"s, 8000000));
+        assert(calc_optimal_mult_order({A, B, C}, {}, MultOrderSolver::hu_shing) ==
+               std::make_pair("(M1 * (M2 * M3))"s, 8000000));
+
+        thrown = false;
+        try {
+            calc_optimal_mult_order({A, B, B});
+        } catch (const std::overflow_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        constexpr BasicMatrix<std::int64_t> A64(20000, 20000);
+        constexpr BasicMatrix<std::int64_t> B64(20000, 20000);
+        constexpr BasicMatrix<std::int64_t> C64(20000, 20000);
+        assert(calc_optimal_mult_order({A64, B64, C64}) ==
+               std::make_pair("(M1 * (M2 * M3))"s, (A64 * B64 * C64).get_flops()));
+
+        constexpr BasicMatrix<Saturating<int>> As(20000, 20000);
+        assert(calc_optimal_mult_order({As, As}).second.is_saturated());
+    }
+
+    {
+        constexpr Matrix A(40, 20);
+        constexpr Matrix B(20, 30);
+        constexpr Matrix C(30, 10);
+        constexpr Matrix D(10, 30);
+
+        // ((A * (B * C)) * D): B * C first, then A * (B * C), then (A * (B * C)) * D
+        const MultPlan plan = calc_optimal_mult_plan({A, B, C, D});
+        assert(plan.num_inputs == 4);
+        assert(plan.nodes.size() == 3);
+        assert(plan.nodes[0].left == 1 && plan.nodes[0].right == 2);
+        assert(plan.nodes[0].nrow == 20 && plan.nodes[0].ncol == 10 && plan.nodes[0].flops == 11400);
+        assert(plan.nodes[1].left == 0 && plan.nodes[1].right == 4);
+        assert(plan.nodes[1].nrow == 40 && plan.nodes[1].ncol == 10 && plan.nodes[1].flops == 15200);
+        assert(plan.nodes[2].left == 5 && plan.nodes[2].right == 3);
+        assert(plan.nodes[2].nrow == 40 && plan.nodes[2].ncol == 30 && plan.nodes[2].flops == 23600);
+        assert(plan.get_result() == 6);
+        assert(plan.flops == 50200);
+        assert(plan.to_string({"A", "B", "C", "D"}) == "((A * (B * C)) * D)");
+
+        const Matrix *inputs[] = {&A, &B, &C, &D};
+        assert(execute_mult_plan(plan, inputs) == (A * (B * C)) * D);
+        assert(execute_mult_plan(calc_optimal_mult_plan({B}), inputs + 1) == B);
+
+        // a long fan is as deep as the chain, plans are walked without recursion
+        const std::vector<int> dims(100001, 1);
+        const MultPlan long_plan = calc_optimal_mult_plan<int>(dims.data(), dims.size() - 1, MultOrderSolver::hu_shing);
+        assert(long_plan.nodes.size() == dims.size() - 2);
+        assert(long_plan.flops == int(dims.size() - 2));
+        assert(long_plan.to_string().size() > 6 * long_plan.nodes.size());
+    }
+
+    {
+        const int dims[] = {25, 26, 12, 12, 13};
+        const std::vector<MultPlan> plans = calc_pareto_mult_plans(dims, 4, sizeof(double));
+        assert(plans.size() == 3);
+        assert(plans[0].to_string() == "((M1 * M2) * (M3 * M4))" && plans[0].flops == 26050);
+        assert(plans[1].to_string() == "(M1 * (M2 * (M3 * M4)))" && plans[1].flops == 27650);
+        assert(plans[2].to_string() == "(((M1 * M2) * M3) * M4)" && plans[2].flops == 29350);
+        assert(plans[0].get_peak_bytes(sizeof(double)) == 6248);
+        assert(plans[1].get_peak_bytes(sizeof(double)) == 5304);
+        assert(plans[2].get_peak_bytes(sizeof(double)) == 5000);
+        assert(plans[0].flops == calc_optimal_mult_plan(dims, 4).flops);
+
+        assert(calc_memory_bounded_mult_plan(dims, 4, sizeof(double), 6000).flops == 27650);
+        assert(calc_memory_bounded_mult_plan(dims, 4, sizeof(double), 5000).flops == 29350);
+        bool thrown = false;
+        try {
+            calc_memory_bounded_mult_plan(dims, 4, sizeof(double), 4999);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        std::mt19937 gen(5);
+        std::uniform_int_distribution<int> dist(1, 50);
+        for (int t = 0; t < 100; t++) {
+            std::vector<int> random_dims(2 + t % 10);
+            for (int& dim : random_dims) {
+                dim = dist(gen);
+            }
+            const std::size_t n = random_dims.size() - 1;
+            const std::vector<MultPlan> front = calc_pareto_mult_plans(random_dims.data(), n, sizeof(float));
+            assert(front.front().flops == calc_optimal_mult_plan(random_dims.data(), n).flops);
+            for (std::size_t p = 1; p < front.size(); p++) {
+                assert(front[p].flops > front[p - 1].flops);
+                assert(front[p].get_peak_bytes(sizeof(float)) < front[p - 1].get_peak_bytes(sizeof(float)));
+            }
+        }
+    }
+
+    {
+        constexpr Matrix A(40, 20);
+        constexpr Matrix B(20, 30);
+        constexpr Matrix C(30, 10);
+        constexpr Matrix D(10, 30);
+
+        MultOrderCache cache(2);
+        assert(calc_optimal_mult_order(cache, {A, B, C, D}, {"A", "B", "C", "D"}) ==
+               std::make_pair("((A * (B * C)) * D)"s, 50200));
+        assert(calc_optimal_mult_order(cache, {A, B, C, D}) == std::make_pair("((M1 * (M2 * M3)) * M4)"s, 50200));
+        assert(cache.get_hits() == 1 && cache.get_misses() == 1);
+
+        // same shapes, cheaper batch dimension: a different key
+        constexpr Matrix A2(4, 20);
+        assert(calc_optimal_mult_order(cache, {A2, B, C, D}) == calc_optimal_mult_order({A2, B, C, D}));
+        assert(calc_optimal_mult_order(cache, {A}) == std::make_pair("M1"s, 0));
+        assert(cache.get_size() == 2 && cache.get_misses() == 3);
+
+        // {A, B, C, D} was the least recently used one and got evicted
+        const int dims[] = {40, 20, 30, 10, 30};
+        const auto entry = cache.get(dims, 4);
+        assert(cache.get_misses() == 4);
+        assert(entry->plan.flops == 50200);
+        assert(cache.get(dims, 4) == entry);
+        assert(cache.get_hits() == 2);
+
+        // concurrent lookups of a few keys, all consistent with the DP
+        MultOrderCache shared(3);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&shared, t]() {
+                for (int iter = 0; iter < 200; iter++) {
+                    const int batch = 1 + (iter + t) % 5;
+                    const int chain[] = {batch, 20, 30, 10, 30};
+                    const auto res = shared.get(chain, 4);
+                    assert(res->plan.flops == calc_optimal_mult_order({Matrix(batch, 20), B, C, D}).second);
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        assert(shared.get_hits() + shared.get_misses() == 800);
+        assert(shared.get_size() == 3);
+    }
+
+    {
+        // the checked 64-bit DP agrees with the int SIMD one wherever int does not overflow
+        std::mt19937 gen(11);
+        std::uniform_int_distribution<int> dist(1, 100);
+        MultOrderWorkspace ws;
+        BasicMultOrderWorkspace<std::int64_t> ws64;
+        for (int iter = 0; iter < 50; iter++) {
+            std::vector<int> dims(2 + iter);
+            for (int& dim : dims) {
+                dim = dist(gen);
+            }
+
+            calc_mult_order_table(dims.data(), dims.size() - 1, ws);
+            calc_mult_order_table(dims.data(), dims.size() - 1, ws64);
+            for (std::size_t i = 0; i < ws.size(); i++) {
+                for (std::size_t j = i; j < ws.size(); j++) {
+                    assert(ws.get_cost(i, j) == ws64.get_cost(i, j));
+                    assert(ws.get_split(i, j) == ws64.get_split(i, j));
+                }
+            }
+        }
+    }
+
+    {
+        // hu_shing returns a valid plan, never better than the exact one and close to it
+        std::mt19937 gen(42);
+        std::uniform_int_distribution<int> dist(1, 100);
+        double worst_ratio = 1.0;
+        MultOrderWorkspace ws;  // reused across chains of different lengths
+        for (int iter = 0; iter < 200; iter++) {
+            std::vector<int> dims(2 + iter % 30);
+            for (int& dim : dims) {
+                dim = dist(gen);
+            }
+
+            calc_mult_order_table(dims.data(), dims.size() - 1, ws);
+            std::unordered_map<std::int64_t, int> split_at;
+            const int approx = calc_mult_order_hu_shing(dims, split_at);
+            const int exact = ws.get_cost(0, dims.size() - 2);
+
+            assert(split_at.size() == dims.size() - 2);
+            assert(approx >= exact);
+            worst_ratio = std::max(worst_ratio, exact ? double(approx) / exact : 1.0);
+        }
+        assert(worst_ratio < 1.2);
+    }
+
+    {
+        // greedy plans refined by windowed DP: valid, never better than the exact one, exact when the window
+        // spans the chain; the lower bound never above the optimum
+        std::mt19937 gen(7);
+        std::uniform_int_distribution<int> dist(1, 100);
+        double worst_ratio = 1.0;
+        MultOrderWorkspace ws;
+        ApproxPlanOptions options;
+        options.time_budget_s = 10;  // converges long before
+        for (int iter = 0; iter < 200; iter++) {
+            std::vector<int> dims(2 + iter % 40);
+            for (int& dim : dims) {
+                dim = dist(gen);
+            }
+            const std::size_t n = dims.size() - 1;
+
+            calc_mult_order_table(dims.data(), n, ws);
+            const int exact = ws.get_cost(0, n - 1);
+            const MultPlan approx = calc_approx_mult_plan(dims.data(), n, options);
+            assert(approx.num_inputs == int(n) && approx.nodes.size() == n - 1);
+            assert(approx.flops >= exact && calc_mult_chain_lower_bound(dims.data(), n) <= exact);
+            worst_ratio = std::max(worst_ratio, double(approx.flops) / exact);
+
+            ApproxPlanOptions whole = options;
+            whole.window = int(n);
+            assert(calc_approx_mult_plan(dims.data(), n, whole).flops == exact);
+        }
+        assert(worst_ratio < 1.05);
+
+        const int dims[] = {30, 35, 15, 5, 10, 20, 25};
+        assert(calc_mult_chain_lower_bound(dims, 1) == 0 && calc_mult_chain_lower_bound(dims, 2) == 30 * 35 * 29);
+        assert(calc_approx_mult_plan(dims, 0).num_inputs == 0 && calc_approx_mult_plan(dims, 1).nodes.empty());
+        assert(calc_optimal_mult_plan(dims, 6, MultOrderSolver::greedy).flops ==
+               calc_optimal_mult_plan(dims, 6).flops);
+
+        // the budget bounds the refining only; the target factor cuts it short
+        std::vector<int> long_dims(100001);
+        for (int& dim : long_dims) {
+            dim = dist(gen);
+        }
+        const std::size_t long_n = long_dims.size() - 1;
+        const std::int64_t bound = calc_mult_chain_lower_bound<std::int64_t>(long_dims.data(), long_n);
+        ApproxPlanOptions no_time;
+        no_time.time_budget_s = 0;
+        const BasicMultPlan<std::int64_t> greedy_plan = calc_approx_mult_plan<std::int64_t>(long_dims.data(), long_n,
+                                                                                             no_time);
+        assert(greedy_plan.nodes.size() == long_n - 1 && greedy_plan.flops >= bound);
+        std::int64_t sum = 0;
+        for (const auto& node : greedy_plan.nodes) {
+            sum += node.flops;
+        }
+        assert(sum == greedy_plan.flops);
+        ApproxPlanOptions loose = options;
+        loose.target_factor = double(greedy_plan.flops) / bound * (1 + 1e-9);
+        assert(calc_approx_mult_plan<std::int64_t>(long_dims.data(), long_n, loose).flops <= greedy_plan.flops);
+
+        const int huge_dims[] = {100000, 100000, 100000};
+        bool thrown = false;
+        try {
+            calc_approx_mult_plan(huge_dims, 2);
+        } catch (const std::overflow_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        // every SIMD kernel matches the scalar one, ties included
+        std::mt19937 gen(3);
+        std::uniform_int_distribution<int> dist(0, 20);
+        for (std::size_t count = 0; count < 100; count++) {
+            std::vector<int> cost_ik(count);
+            std::vector<int> cost_kj(count);
+            std::vector<int> dims_k(count);
+            for (std::size_t t = 0; t < count; t++) {
+                cost_ik[t] = dist(gen);
+                cost_kj[t] = dist(gen);
+                dims_k[t] = dist(gen) % 3;
+            }
+
+            const auto expected = argmin_split_scalar(cost_ik.data(), cost_kj.data(), dims_k.data(), 5, count);
+            for (const ArgminSplitKernel& kernel : get_argmin_split_kernels()) {
+                assert(kernel.func(cost_ik.data(), cost_kj.data(), dims_k.data(), 5, count) == expected);
+            }
+        }
+    }
+
+    {
+        // batched products match the dense ones on every kernel that takes
+        // the shape, fixed and generic, full and partial last groups
+        ThreadPool pool(3);
+        const std::tuple<int, int, int, std::size_t> shapes[] = {
+            {2, 5, 3, 37}, {40, 20, 30, 9}, {4, 4, 4, 8}, {7, 3, 5, 20}, {3, 0, 2, 5}, {0, 4, 4, 3}, {5, 6, 7, 0}};
+        for (const auto& [m, k, n, count] : shapes) {
+            std::vector<DenseMatrix<double>> lefts;
+            std::vector<DenseMatrix<double>> rights;
+            std::vector<const DenseMatrix<double>*> left_ptrs;
+            std::vector<const DenseMatrix<double>*> right_ptrs;
+            for (std::size_t p = 0; p < count; p++) {
+                lefts.emplace_back(m, k);
+                rights.emplace_back(k, n);
+                for (int i = 0; i < m * k; i++) {
+                    lefts.back().data()[i] = int(i * 7 + p * 3) % 11 - 5;
+                }
+                for (int i = 0; i < k * n; i++) {
+                    rights.back().data()[i] = int(i * 5 + p) % 9 - 4;
+                }
+            }
+            for (std::size_t p = 0; p < count; p++) {
+                left_ptrs.push_back(&lefts[p]);
+                right_ptrs.push_back(&rights[p]);
+            }
+            const CompactBatch<double> A = CompactBatch<double>::pack(left_ptrs.data(), count);
+            const CompactBatch<double> B = CompactBatch<double>::pack(right_ptrs.data(), count);
+            assert(A.size() == count && A.get_num_groups() == (count + A.lanes - 1) / A.lanes);
+
+            const CompactBatch<double> AB = A * B;
+            const CompactBatch<double> AB_pool = batched_mult(A, B, &pool);
+            for (std::size_t p = 0; p < count; p++) {
+                const DenseMatrix<double> expected = lefts[p] * rights[p];
+                assert(A.unpack(p) == lefts[p]);
+                assert(AB.unpack(p) == expected && AB.get_flops(p) == expected.get_flops());
+                assert(AB_pool.unpack(p) == expected);
+            }
+
+            for (const CompactGemmKernel<double>& kernel : get_compact_gemm_kernels<double>()) {
+                if (kernel.m != 0 && (kernel.m != m || kernel.k != k || kernel.n != n)) {
+                    continue;
+                }
+                CompactBatch<double> C(m, n, count);
+                kernel.func(A.data(), B.data(), C.data(), 0, C.get_num_groups(), m, k, n);
+                for (std::size_t p = 0; p < count; p++) {
+                    const DenseMatrix<double> res = C.unpack(p);
+                    const DenseMatrix<double> expected = lefts[p] * rights[p];
+                    assert(std::equal(res.data(), res.data() + m * n, expected.data()));
+                }
+            }
+        }
+
+        // 16 float lanes, a fixed shape
+        DenseMatrix<float> left(2, 5);
+        DenseMatrix<float> right(5, 3);
+        for (int i = 0; i < 10; i++) {
+            left.data()[i] = i - 4;
+        }
+        for (int i = 0; i < 15; i++) {
+            right.data()[i] = 7 - i;
+        }
+        const std::vector<const DenseMatrix<float>*> left_ptrs(20, &left);
+        const std::vector<const DenseMatrix<float>*> right_ptrs(20, &right);
+        const CompactBatch<float> AB = CompactBatch<float>::pack(left_ptrs.data(), 20) *
+                                       CompactBatch<float>::pack(right_ptrs.data(), 20);
+        assert(AB.lanes == 16 && AB.get_num_groups() == 2 && AB.unpack(19) == left * right);
+
+        bool thrown = false;
+        try {
+            const CompactBatch<double> A(2, 3, 4);
+            const CompactBatch<double> B(2, 3, 4);
+            A * B;
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        thrown = false;
+        try {
+            const CompactBatch<double> A(2, 3, 4);
+            const CompactBatch<double> B(3, 3, 5);
+            A * B;
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        thrown = false;
+        try {
+            const CompactBatch<double> A(2, 3, 4);
+            const CompactBatch<double> B(3, 3, 4);
+            CompactBatch<double> C(3, 3, 4);
+            batched_mult(A, B, C);
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        thrown = false;
+        try {
+            const CompactBatch<double> A(3, 3, 4);
+            CompactBatch<double> B(3, 3, 4);
+            batched_mult(A, B, B);
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        thrown = false;
+        try {
+            const DenseMatrix<double> first(2, 3);
+            const DenseMatrix<double> other(3, 2);
+            const DenseMatrix<double> *mixed[] = {&first, &other};
+            CompactBatch<double>::pack(mixed, 2);
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        // conversions round to nearest even, keep subnormals, infinities and NaN
+        assert(float(bfloat16(1.0f)) == 1.0f && float(bfloat16(-2.5f)) == -2.5f);
+        assert(float(bfloat16(1 + 0x1p-8f)) == 1.0f);
+        assert(float(bfloat16(1 + 0x3p-8f)) == 1 + 0x1p-6f);
+        assert(std::isnan(float(bfloat16(std::numeric_limits<float>::quiet_NaN()))));
+        assert(float(float16(65504.0f)) == 65504.0f && float(float16(-0.375f)) == -0.375f);
+        assert(std::isinf(float(float16(65520.0f))) && float(float16(65519.0f)) == 65504.0f);
+        assert(float16(0x1p-24f).bits == 1 && float16(0x1p-25f).bits == 0 && float16(0x3p-25f).bits == 2);
+        assert(float(float16(0x3p-24f)) == 0x3p-24f && float(float16(0x1p-14f)) == 0x1p-14f);
+        assert(float(float16(1 + 0x1p-11f)) == 1.0f && float(float16(1 + 0x3p-11f)) == 1 + 0x1p-9f);
+        assert(std::isnan(float(float16(std::numeric_limits<float>::quiet_NaN()))));
+        assert(convert_element<std::int8_t>(200.0f) == 127 && convert_element<std::int8_t>(-2.5) == -2);
+
+        // every kernel of every precision against the double product, on
+        // shapes with row, column and k tails; small integers are exact in all
+        const auto check_kernels = [](auto elem, int range) {
+            using In = decltype(elem);
+            using Acc = accumulator_t<In>;
+            for (const auto& [m, k, n] : {std::tuple(37, 29, 45), std::tuple(4, 32, 32), std::tuple(1, 1, 1),
+                                          std::tuple(6, 3, 17), std::tuple(3, 0, 5)}) {
+                DenseMatrix<double> A(m, k);
+                DenseMatrix<double> B(k, n);
+                for (int i = 0; i < m * k; i++) {
+                    A.data()[i] = (i * 37 + 11) % (2 * range) - range;
+                }
+                for (int i = 0; i < k * n; i++) {
+                    B.data()[i] = (i * 53 + 5) % (2 * range) - range;
+                }
+                const DenseMatrix<In> A_in = convert_matrix<In>(A);
+                const DenseMatrix<In> B_in = convert_matrix<In>(B);
+                const DenseMatrix<double> expected = A * B;
+                assert(convert_matrix<double>(mixed_mult(A_in, B_in)) == expected);
+                for (const MixedGemmKernel<In>& kernel : get_mixed_gemm_kernels<In>()) {
+                    DenseMatrix<Acc> C(m, n);
+                    kernel.func(m, n, k, A_in.data(), k, B_in.data(), n, C.data(), n);
+                    assert(convert_matrix<double>(C).get_flops() == 0);
+                    for (int i = 0; i < m * n; i++) {
+                        assert(double(C.data()[i]) == expected.data()[i]);
+                    }
+                }
+            }
+        };
+        check_kernels(0.0, 100);
+        check_kernels(0.0f, 30);
+        check_kernels(bfloat16(), 8);
+        check_kernels(float16(), 8);
+        check_kernels(std::int8_t(), 128);
+
+        bool thrown = false;
+        try {
+            mixed_mult(DenseMatrix<bfloat16>(2, 3), DenseMatrix<bfloat16>(2, 3));
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        // narrower precisions are predicted faster; the planner keeps the most
+        // accurate one meeting the target, or the fastest of all
+        const int dims[] = {512, 2048, 256, 1024};
+        PrecisionCostModel model;
+        const auto seconds_in = [&](Precision precision) {
+            model.precision = precision;
+            return predict_mult_plan_seconds(calc_fastest_mult_plan<std::int64_t>(dims, 3, model), dims, model);
+        };
+        const double fp64_s = seconds_in(Precision::fp64);
+        const double fp32_s = seconds_in(Precision::fp32);
+        const double int8_s = seconds_in(Precision::int8);
+        assert(fp64_s > fp32_s && fp32_s > seconds_in(Precision::bf16) && seconds_in(Precision::bf16) > int8_s);
+
+        model.precision = Precision::fp64;
+        assert(calc_mult_plan_for_latency(dims, 3, 1e9, model).precision == Precision::fp64);
+        const PrecisionMultPlan<std::int64_t> fp32_plan = calc_mult_plan_for_latency(dims, 3, fp64_s * 0.9, model);
+        assert(fp32_plan.precision == Precision::fp32 && fp32_plan.seconds == fp32_s);
+        assert(fp32_plan.plan.flops == calc_optimal_mult_plan<std::int64_t>(dims, 3).flops);
+        assert(calc_mult_plan_for_latency(dims, 3, 0, model).precision == Precision::int8);
+        assert(calc_mult_plan_for_latency(dims, 3, 0, model, {Precision::fp64, Precision::fp32}).precision ==
+               Precision::fp32);
+        assert(std::string(get_precision_name(Precision::bf16)) == "bf16");
+    }
+
+    {
+        // batched plans are the ones calc_optimal_mult_plan() picks, on every
+        // kernel and with a pool; small dims make ties, large ones take the
+        // checked DP
+        ThreadPool pool(3);
+        std::mt19937 gen(11);
+        std::uniform_int_distribution<std::size_t> length_dist(0, MultChainBatch::max_length);
+        MultChainBatch batch;
+        for (int chain = 0; chain < 2000; chain++) {
+            std::uniform_int_distribution<int> dist(1, chain % 3 == 0 ? 4 : chain % 3 == 1 ? 100 : 1 << 20);
+            std::vector<int> dims(length_dist(gen) + 1);
+            for (int& dim : dims) {
+                dim = dist(gen);
+            }
+            batch.add(dims.data(), dims.size() - 1);
+        }
+
+        std::size_t num_kernels = 1;
+#if defined(__GNUC__)
+        num_kernels = get_batch_mult_order_kernels().size();
+#endif
+        for (std::size_t kernel_index = 0; kernel_index < num_kernels; kernel_index++) {
+            for (ThreadPool *plan_pool : {(ThreadPool *)nullptr, &pool}) {
+                const std::vector<CompactMultPlan> plans = calc_optimal_mult_plans(batch, plan_pool, kernel_index);
+                assert(plans.size() == batch.size());
+                for (std::size_t c = 0; c < batch.size(); c++) {
+                    const int *dims = batch.get_dims(c);
+                    const BasicMultPlan<std::int64_t> expected =
+                        calc_optimal_mult_plan<std::int64_t>(dims, batch.get_length(c));
+                    const BasicMultPlan<std::int64_t> plan = plans[c].to_plan(dims);
+                    assert(plans[c].flops == expected.flops && plan.flops == expected.flops);
+                    assert(plan.num_inputs == expected.num_inputs && plan.nodes.size() == expected.nodes.size());
+                    for (std::size_t t = 0; t < plan.nodes.size(); t++) {
+                        assert(plan.nodes[t].left == expected.nodes[t].left);
+                        assert(plan.nodes[t].right == expected.nodes[t].right);
+                        assert(plan.nodes[t].nrow == expected.nodes[t].nrow);
+                        assert(plan.nodes[t].ncol == expected.nodes[t].ncol);
+                        assert(plan.nodes[t].flops == expected.nodes[t].flops);
+                    }
+                    assert(plan.to_string() == expected.to_string());
+                }
+            }
+        }
+
+        bool thrown = false;
+        try {
+            const int dims[] = {3000000, 3000000, 3000000, 3000000};
+            batch.add(dims, 3);
+            calc_optimal_mult_plans(batch);
+        } catch (const std::overflow_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        thrown = false;
+        try {
+            const std::vector<int> dims(MultChainBatch::max_length + 2, 1);
+            batch.add(dims.data(), dims.size() - 1);
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        batch.clear();
+        assert(batch.size() == 0 && calc_optimal_mult_plans(batch).empty());
+    }
+
+    {
+        // incremental plans cost as much as plans from scratch; a new dims[0]
+        // only recomputes the n - 1 cells of the prefixes, a shared suffix
+        // is reused whatever the length of the chain
+        std::mt19937 gen(26);
+        std::uniform_int_distribution<int> dist(1, 40);
+        std::vector<int> dims(31);
+        for (int& dim : dims) {
+            dim = dist(gen);
+        }
+        const std::size_t n = dims.size() - 1;
+
+        IncrementalMultPlanner planner;
+        assert(planner.plan(dims.data(), n).flops == calc_optimal_mult_plan(dims.data(), n).flops);
+        assert(planner.size() == n && planner.get_num_computed() == n * (n - 1) / 2);
+        for (int rep = 0; rep < 5; rep++) {
+            dims[0] = dist(gen);
+            const MultPlan plan = planner.plan(dims.data(), n);
+            assert(plan.flops == calc_optimal_mult_plan(dims.data(), n).flops);
+            assert(plan.num_inputs == int(n) && plan.nodes.size() == n - 1);
+            assert(planner.get_num_computed() == n - 1);
+        }
+        planner.plan(dims.data(), n);
+        assert(planner.get_num_computed() == 0);
+
+        // 3 more matrices in front of dims[1..n], then the suffix from dims[10]
+        std::vector<int> longer = {41, 42, 43, 44};
+        longer.insert(longer.end(), dims.begin() + 1, dims.end());
+        assert(planner.plan(longer.data(), n + 3).flops == calc_optimal_mult_plan(longer.data(), n + 3).flops);
+        assert(planner.get_num_computed() == (n - 1) + n + (n + 1) + (n + 2));
+        assert(planner.plan(dims.data() + 10, n - 10).flops == calc_optimal_mult_plan(dims.data() + 10, n - 10).flops);
+        assert(planner.get_num_computed() == 0);
+
+        assert(planner.plan(dims.data(), 1).num_inputs == 1 && planner.plan(dims.data(), 0).num_inputs == 0);
+        planner.clear();
+        assert(planner.size() == 0);
+        assert(planner.plan(dims.data(), n).flops == calc_optimal_mult_plan(dims.data(), n).flops);
+        assert(planner.get_num_computed() == n * (n - 1) / 2);
+
+        // the checked DP, overflow included
+        const int big[] = {5000, 3000, 100000, 7000, 20};
+        BasicIncrementalMultPlanner<std::int64_t> wide;
+        assert(wide.plan(big, 4).flops == calc_optimal_mult_plan<std::int64_t>(big, 4).flops);
+        bool thrown = false;
+        try {
+            planner.plan(big, 4);
+        } catch (const std::overflow_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(planner.plan(dims.data(), n).flops == calc_optimal_mult_plan(dims.data(), n).flops);
+    }
+
+    {
+        // the wavefront DP fills exactly the same table as the serial one
+        ThreadPool pool(3);
+        std::mt19937 gen(7);
+        std::uniform_int_distribution<int> dist(1, 50);
+        std::vector<int> dims(601);
+        for (int& dim : dims) {
+            dim = dist(gen);
+        }
+
+        MultOrderWorkspace serial;
+        MultOrderWorkspace parallel;
+        calc_mult_order_table(dims.data(), dims.size() - 1, serial);
+        calc_mult_order_table(dims.data(), dims.size() - 1, parallel, &pool);
+        for (std::size_t i = 0; i < serial.size(); i++) {
+            for (std::size_t j = i; j < serial.size(); j++) {
+                assert(serial.get_cost(i, j) == parallel.get_cost(i, j));
+                assert(serial.get_split(i, j) == parallel.get_split(i, j));
+            }
+        }
+
+        std::atomic<std::size_t> sum(0);
+        parallel_for(pool, 0, 10000, 7, [&sum](std::size_t first, std::size_t last) {
+            for (std::size_t i = first; i < last; i++) {
+                sum += i;
+            }
+        });
+        assert(sum == 10000 * 9999 / 2);
+
+        bool thrown = false;
+        try {
+            parallel_for(pool, 0, 100, 1, [](std::size_t first, std::size_t) {
+                if (first == 42) {
+                    throw std::logic_error("task failed");
+                }
+            });
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        constexpr Matrix A(40, 20);
+        constexpr Matrix B(20, 30);
+        constexpr Matrix C(30, 10);
+        constexpr Matrix D(10, 30);
+        constexpr Matrix E(40, 7);
+        constexpr Matrix F(7, 30);
+
+        // lazy chains are reordered before evaluation, explicit products are not
+        const Matrix ABCD = lazy(A) * B * C * D;
+        assert(ABCD == (A * (B * C)) * D);
+        assert(ABCD.get_flops() == 50200);
+
+        const Matrix G = lazy(A) * B * C * D + lazy(E) * F;
+        assert(G == (A * (B * C)) * D + E * F);
+
+        const Matrix H = E * F + (lazy(A) * B) * (lazy(C) * D) + E * F;
+        assert(H == E * F + (A * (B * C)) * D + E * F);
+
+        const Matrix single = lazy(A);
+        assert(single == A);
+
+        bool thrown = false;
+        try {
+            const Matrix bad = lazy(A) * C;
+            (void)bad;
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        constexpr Matrix A(10, 100);
+        constexpr Matrix B(100, 100);
+        constexpr Matrix C(100, 10);
+        constexpr Matrix D(100, 10);
+        constexpr Matrix E(40, 7);
+        constexpr Matrix F(7, 30);
+        constexpr Matrix G(40, 20);
+        constexpr Matrix H(20, 30);
+
+        // on its own each term is A * (B * C), sharing A * B is cheaper
+        const auto sum = lazy(A) * B * C + lazy(A) * B * D;
+        const ExprDag dag(sum);
+        const ExprPlan& plan = dag.get_plan();
+        assert(dag.get_inputs().size() == 4 && plan.num_inputs == 4 && plan.nodes.size() == 4);
+        assert(plan.unshared_flops == Matrix(sum).get_flops());
+        assert(plan.unshared_flops == 2 * (190000 + 19000) + 100);
+        assert(plan.flops == 199000 + 2 * 19000 + 100 && plan.get_saved_flops() == 181000);
+        assert(plan.to_string({"A", "B", "C", "D"}) == "t1 = (A * B); ((t1 * C) + (t1 * D))");
+        const Matrix shared = dag.eval();
+        assert(shared.get_nrow() == 10 && shared.get_ncol() == 10 && shared.get_flops() == plan.flops);
+        assert(eval_shared(sum).get_flops() == plan.flops);
+
+        // a repeated term is computed once, unrelated chains are left alone
+        const auto repeated = lazy(E) * F + lazy(G) * H + lazy(E) * F;
+        const ExprPlan repeated_plan = ExprDag(repeated).get_plan();
+        assert(repeated_plan.unshared_flops == Matrix(repeated).get_flops());
+        assert(repeated_plan.get_saved_flops() == 40 * 7 * 59);
+        assert(repeated_plan.to_string({"E", "F", "G", "H"}) == "t1 = (E * F); ((t1 + (G * H)) + t1)");
+
+        const ExprPlan single = ExprDag(lazy(A) + lazy(A)).get_plan();
+        assert(single.nodes.size() == 1 && single.flops == 10 * 100 && single.get_saved_flops() == 0);
+        assert(ExprDag(lazy(A) * B).eval() == A * B);
+
+        bool thrown = false;
+        try {
+            calc_shared_expr_plan({{10, 100}, {20, 30}}, {{0, 1}});
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        thrown = false;
+        try {
+            calc_shared_expr_plan({{10, 100}, {100, 30}}, {{0, 1}, {0}});
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        // the shared DAG computes the same values as SumExpr::eval()
+        DenseMatrix<double> A(7, 9);
+        DenseMatrix<double> B(9, 9);
+        DenseMatrix<double> C(9, 4);
+        DenseMatrix<double> D(9, 4);
+        for (DenseMatrix<double> *mat : {&A, &B, &C, &D}) {
+            for (int i = 0; i < mat->get_nrow() * mat->get_ncol(); i++) {
+                mat->data()[i] = (i * 5 + mat->get_ncol()) % 7 - 3;
+            }
+        }
+
+        const auto sum = lazy(A) * B * C + lazy(A) * B * D + lazy(A) * C;
+        const ExprDag dag(sum);
+        const DenseMatrix<double> expected = sum;
+        const DenseMatrix<double> shared = dag.eval();
+        assert(shared.get_nrow() == expected.get_nrow() && shared.get_ncol() == expected.get_ncol());
+        assert(std::equal(shared.data(), shared.data() + 7 * 4, expected.data()));
+        assert(shared.get_flops() == dag.get_plan().flops && dag.get_plan().get_saved_flops() > 0);
+        assert(dag.get_plan().unshared_flops == expected.get_flops());
+    }
+
+    {
+        // shapes cross every blocking boundary (MR/NR edges, several KC and MC blocks).
+        // Small integer values keep the double results exact, whatever the summation order
+        for (const auto& [m, k, n] : {std::array<int, 3>{1, 1, 1}, {2, 5, 10}, {37, 53, 29}, {300, 530, 131}}) {
+            DenseMatrix<double> A(m, k);
+            DenseMatrix<double> B(k, n);
+            for (int i = 0; i < m; i++) {
+                for (int p = 0; p < k; p++) {
+                    A(i, p) = (i * 7 + p * 3) % 11 - 5;
+                }
+            }
+            for (int p = 0; p < k; p++) {
+                for (int j = 0; j < n; j++) {
+                    B(p, j) = (p * 5 + j * 2) % 13 - 6;
+                }
+            }
+
+            const DenseMatrix<double> C = A * B;
+
+            assert(C.get_nrow() == m);
+            assert(C.get_ncol() == n);
+            assert(C.get_flops() == (Matrix(m, k) * Matrix(k, n)).get_flops());
+            for (int i = 0; i < m; i++) {
+                for (int j = 0; j < n; j++) {
+                    double ref = 0;
+                    for (int p = 0; p < k; p++) {
+                        ref += A(i, p) * B(p, j);
+                    }
+                    assert(C(i, j) == ref);
+                }
+            }
+        }
+    }
+
+    {
+        DenseMatrix<float> A(2, 5);
+        DenseMatrix<float> B(5, 10);
+        DenseMatrix<float> C(10, 2);
+        C *= A * B;
+
+        assert(C.get_nrow() == 10);
+        assert(C.get_ncol() == 10);
+        assert(C.get_flops() == 570);
+
+        DenseMatrix<float> D(10, 10);
+        D += C + C;
+        assert(D.get_flops() == 570 * 2 + 100 + 100);
+    }
+
+    {
+        DenseMatrix<double> A(40, 20);
+        DenseMatrix<double> B(20, 30);
+        DenseMatrix<double> C(30, 10);
+        DenseMatrix<double> D(10, 30);
+        for (DenseMatrix<double>* mat : {&A, &B, &C, &D}) {
+            for (int i = 0; i < mat->get_nrow(); i++) {
+                for (int j = 0; j < mat->get_ncol(); j++) {
+                    (*mat)(i, j) = (i + 2 * j) % 5 - 2;
+                }
+            }
+        }
+
+        const DenseMatrix<double> ABCD = lazy(A) * B * C * D;
+        assert(ABCD == (A * (B * C)) * D);
+        assert(ABCD.get_flops() == 50200);
+
+        static constexpr auto plan = calc_static_mult_plan(std::array<int, 5>{40, 20, 30, 10, 30});
+        const DenseMatrix<double> ABCD2 = execute_static_mult_plan<plan>(std::array<const DenseMatrix<double>*, 4>{&A, &B, &C, &D});
+        assert(ABCD2 == ABCD);
+        assert(ABCD2.get_flops() == plan.flops);
+    }
+
+    {
+        FixedMatrix<float, 16, 16> A;
+        FixedMatrix<float, 16, 9> B;
+        DenseMatrix<float> dense_A(16, 16);
+        DenseMatrix<float> dense_B(16, 9);
+        for (int i = 0; i < 16; i++) {
+            for (int j = 0; j < 16; j++) {
+                A(i, j) = dense_A(i, j) = float((3 * i + j) % 7 - 3);
+                if (j < 9) {
+                    B(i, j) = dense_B(i, j) = float((i + 2 * j) % 5 - 2);
+                }
+            }
+        }
+
+        const FixedMatrix<float, 16, 9> AAB = A * A * B + B;
+        const DenseMatrix<float> dense_AAB = dense_A * dense_A * dense_B + dense_B;
+        assert(AAB.to_dense() == dense_AAB);
+        assert((FixedMatrix<float, 16, 9>(dense_AAB) == AAB));
+        assert(A * dense_B == dense_A * dense_B);
+        assert(dense_A * B == dense_A * dense_B);
+        assert(B + dense_B == dense_B + B);
+
+        A *= A;
+        assert(A.to_dense() == dense_A * dense_A);
+
+        bool thrown = false;
+        try {
+            const FixedMatrix<float, 16, 16> bad(dense_B);
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        DenseMatrix<double> A(300, 200);
+        DenseMatrix<double> B(200, 100);
+        DenseMatrix<double> C(300, 100);
+        for (DenseMatrix<double>* mat : {&A, &B, &C}) {
+            for (int i = 0; i < mat->get_nrow(); i++) {
+                for (int j = 0; j < mat->get_ncol(); j++) {
+                    (*mat)(i, j) = (2 * i + j) % 7 - 3;
+                }
+            }
+        }
+        const DenseMatrix<double> AB = A * B;
+        const DenseMatrix<double> C_AB = C + AB;
+
+        // in place, or reusing the buffer of a dying operand
+        DenseMatrix<double> X = A;
+        const double *X_data = X.data();
+        X *= B;
+        assert(X == AB && X.data() == X_data);
+        X += C;
+        assert(X == AB + C && X.data() == X_data);
+        DenseMatrix<double> Y = std::move(X) + C;
+        assert(Y == AB + C + C && Y.data() == X_data);
+        DenseMatrix<double> Z = C + std::move(Y);
+        assert(Z.data() == X_data);
+        const double *A_data = A.data();
+        const DenseMatrix<double> A2 = DenseMatrix<double>(A) * B;
+        assert(A2 == AB);
+        DenseMatrix<double> sq = B * DenseMatrix<double>(100, 200);
+        sq *= sq;
+        assert(sq.get_nrow() == 200 && sq.get_ncol() == 200);
+
+        // fused C += A * B
+        DenseMatrix<double> acc = C;
+        const double *acc_data = acc.data();
+        acc += lazy(A) * B;
+        assert(acc == C_AB && acc.data() == acc_data);
+        DenseMatrix<double> I(100, 100);
+        for (int i = 0; i < 100; i++) {
+            I(i, i) = 1;
+        }
+        acc = C;
+        acc += lazy(A) * B * I;
+        assert(acc == C + A * (B * I));
+        acc = C;
+        acc += lazy(C);
+        assert(acc == C + C && A.data() == A_data);
+
+        // the result among the factors: the product is computed aside, then added
+        DenseMatrix<double> S(300, 300);
+        DenseMatrix<double> W(300, 300);
+        for (int i = 0; i < 300; i++) {
+            for (int j = 0; j < 300; j++) {
+                S(i, j) = (i + 3 * j) % 5 - 2;
+                W(i, j) = (2 * i + j) % 7 - 3;
+            }
+        }
+        const DenseMatrix<double> W0 = W;
+        W += lazy(W) * S;
+        assert(W == W0 + W0 * S);
+        W = W0;
+        W += lazy(S) * W;
+        assert(W == W0 + S * W0);
+        W = W0;
+        W += lazy(W) * S * W;
+        assert(W == W0 + W0 * S * W0);
+    }
+
+    {
+        const StrassenPolicy policy(16);
+        const std::vector<std::array<int, 3>> shapes = {{64, 64, 64}, {67, 45, 53}, {130, 129, 131}, {16, 200, 15}};
+        for (const auto& shape : shapes) {
+            const int m = shape[0];
+            const int k = shape[1];
+            const int n = shape[2];
+            std::vector<double> A(std::size_t(m) * k);
+            std::vector<double> B(std::size_t(k) * n);
+            for (std::size_t i = 0; i < A.size(); i++) {
+                A[i] = int(i * 7 % 11) - 5;
+            }
+            for (std::size_t i = 0; i < B.size(); i++) {
+                B[i] = int(i * 5 % 13) - 6;
+            }
+
+            std::vector<double> C(std::size_t(m) * n, -1);
+            std::vector<double> ref(std::size_t(m) * n);
+            strassen_winograd(m, n, k, A.data(), k, B.data(), n, C.data(), n, policy);
+            gemm(m, n, k, 1.0, A.data(), k, B.data(), n, 0.0, ref.data(), n);
+            assert(C == ref);
+        }
+
+        const auto classical = [](std::int64_t m, std::int64_t k, std::int64_t n) { return m * k * (2 * n - 1); };
+        assert(policy.calc_flops<std::int64_t>(15, 100, 100) == classical(15, 100, 100));
+        assert(StrassenPolicy(32).calc_flops<std::int64_t>(32, 32, 32) == 7 * classical(16, 16, 16) + 15 * 16 * 16);
+        assert(policy.calc_flops<std::int64_t>(1024, 1024, 1024) < classical(1024, 1024, 1024) * 3 / 4);
+        assert(StrassenPolicy().calc_flops<std::int64_t>(1024, 1024, 1024) == classical(1024, 1024, 1024));
+
+        // planner and executor agree on costs
+        const int dims[] = {130, 129, 131, 40, 128};
+        std::vector<DenseMatrix<double>> mats;
+        for (int m = 0; m < 4; m++) {
+            mats.emplace_back(dims[m], dims[m + 1]);
+        }
+        const DenseMatrix<double> *inputs[] = {&mats[0], &mats[1], &mats[2], &mats[3]};
+        const auto plan = calc_optimal_mult_plan<std::int64_t>(dims, 4, policy);
+        assert(plan.flops < calc_optimal_mult_plan<std::int64_t>(dims, 4).flops);
+        assert(calc_optimal_mult_plan<std::int64_t>(dims, 4, StrassenPolicy()).flops ==
+               calc_optimal_mult_plan<std::int64_t>(dims, 4).flops);
+        {
+            // restores the global crossover on any way out of the block
+            struct CrossoverGuard {
+                const int crossover = StrassenPolicy::global().get_crossover();
+                ~CrossoverGuard() { StrassenPolicy::global().set_crossover(crossover); }
+            } guard;
+            StrassenPolicy::global().set_crossover(16);
+            assert(execute_mult_plan(plan, inputs).get_flops() == plan.flops);
+            assert((mats[0] * mats[1]).get_flops() == policy.calc_flops<std::int64_t>(130, 129, 131));
+
+            // the Strassen-Winograd temporaries are in the arena scratch
+            MatrixArena arena;
+            const auto pair = calc_optimal_mult_plan<std::int64_t>(dims, 2, policy);
+            const DenseMatrix<double> res = execute_mult_plan(pair, inputs, arena);
+            const std::size_t num_allocs = arena.get_num_allocs();
+            assert(execute_mult_plan(pair, inputs, arena) == res && res == mats[0] * mats[1]);
+            assert(arena.get_num_allocs() == num_allocs);
+            assert(arena.get_capacity() >= policy.calc_scratch_size(130, 129, 131) * sizeof(double));
+        }
+        assert(StrassenPolicy::global().get_crossover() == 0);
+        assert((mats[0] * mats[1]).get_flops() == classical(130, 129, 131));
+        assert(policy.calc_scratch_size(15, 100, 100) == 0);
+        assert(StrassenPolicy(32).calc_scratch_size(64, 64, 64) == 6 * 32 * 32 + 6 * 16 * 16);
+
+        constexpr Matrix A(40, 20);
+        constexpr Matrix B(20, 30);
+        constexpr Matrix C(30, 10);
+        assert(calc_optimal_mult_order({A, B, C}, {"A", "B", "C"}, StrassenPolicy()) ==
+               calc_optimal_mult_order({A, B, C}, {"A", "B", "C"}));
+    }
+
+    {
+        std::mt19937 gen(11);
+        std::uniform_int_distribution<int> dist(1, 100);
+        for (int t = 0; t < 50; t++) {
+            std::vector<int> dims(2 + t % 12);
+            for (int& dim : dims) {
+                dim = dist(gen);
+            }
+            const MultPlan plan = calc_fastest_mult_plan(dims.data(), dims.size() - 1, FlopsCostModel());
+            assert(plan.to_string() == calc_optimal_mult_plan(dims.data(), dims.size() - 1).to_string());
+            assert(plan.flops == calc_optimal_mult_plan(dims.data(), dims.size() - 1).flops);
+        }
+
+        // the fewest flops make the skinny 1024 x 32 operand go through memory twice
+        const int dims[] = {1, 1024, 32, 1};
+        const RooflineCostModel roofline;
+        const MultPlan flops_plan = calc_optimal_mult_plan(dims, 3);
+        const MultPlan fast_plan = calc_fastest_mult_plan(dims, 3, roofline);
+        assert(flops_plan.to_string() == "(M1 * (M2 * M3))");
+        assert(fast_plan.to_string() == "((M1 * M2) * M3)" && fast_plan.flops == 64544);
+        assert(predict_mult_plan_seconds(fast_plan, dims, roofline) < predict_mult_plan_seconds(flops_plan, dims, roofline));
+
+        // a flat measured rate of 1 GFLOP/s predicts the real flops
+        const MeasuredCostModel flat({1, 64, 1024}, std::vector<double>(27, 1.0));
+        assert(std::abs(flat.predict(20, 30, 40) - 2 * 20 * 30 * 40 / 1e9) < 1e-15);
+        assert(std::abs(flat.predict(4096, 1, 1) - 2 * 4096 / 1e9) < 1e-15);
+        const MeasuredCostModel grid({1, 2}, {1, 2, 3, 4, 5, 6, 7, 8});
+        assert(std::abs(grid.predict(2, 1, 2) - 2 * 4 / 6e9) < 1e-15);
+
+        const MeasuredCostModel measured = MeasuredCostModel::calibrate({1, 8, 32}, 1e-4);
+        assert(measured.get_gflops().size() == 27);
+        assert(measured.predict(10, 20, 30) > 0 && std::isfinite(measured.predict(10, 20, 30)));
+        assert(calc_fastest_mult_plan(dims, 3, measured).nodes.size() == 2);
+        for (const std::vector<int>& bad_sizes : std::vector<std::vector<int>>{{}, {0, 8}, {4, -1}}) {
+            bool thrown = false;
+            try {
+                MeasuredCostModel::calibrate(bad_sizes, 1e-4);
+            } catch (const std::logic_error&) {
+                thrown = true;
+            }
+            assert(thrown);
+        }
+    }
+
+    {
+        std::vector<DenseMatrix<double>> mats;
+        std::vector<const DenseMatrix<double>*> inputs;
+        for (int m = 0; m < 10; m++) {
+            mats.emplace_back(137, 253);
+            for (int i = 0; i < 137; i++) {
+                for (int j = 0; j < 253; j++) {
+                    mats[m](i, j) = 1.0 / (1 + (i * m + j) % 11);
+                }
+            }
+        }
+        for (const DenseMatrix<double>& mat : mats) {
+            inputs.push_back(&mat);
+        }
+
+        DenseMatrix<double> fold = mats[0];
+        for (int m = 1; m < 10; m++) {
+            fold = fold + mats[m];
+        }
+        ThreadPool pool(3);
+        assert(fused_sum(inputs.data(), inputs.size()) == fold);
+        assert(fused_sum(inputs.data(), inputs.size(), &pool) == fold);
+        assert(fused_sum({&mats[0], &mats[1]}) == mats[0] + mats[1]);
+        assert(fused_sum({&mats[3]}) == mats[3]);
+        assert(sum_using_initializer_list({mats[0], mats[1], mats[2]}) == mats[0] + mats[1] + mats[2]);
+        assert(sum_using_fold_expression(mats[0], mats[1], mats[2]) == mats[0] + mats[1] + mats[2]);
+        assert(sum_using_fold_expression(mats[4]) == mats[4]);
+
+        const DenseMatrix<double> other(137, 252);
+        bool thrown = false;
+        try {
+            fused_sum({&mats[0], &other});
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        const int dims[] = {25, 26, 12, 12, 13};
+        std::vector<DenseMatrix<double>> mats;
+        for (int m = 0; m < 4; m++) {
+            mats.emplace_back(dims[m], dims[m + 1]);
+            for (int i = 0; i < dims[m]; i++) {
+                for (int j = 0; j < dims[m + 1]; j++) {
+                    mats[m](i, j) = (i + 3 * j + m) % 5 - 2;
+                }
+            }
+        }
+        const DenseMatrix<double> *inputs[] = {&mats[0], &mats[1], &mats[2], &mats[3]};
+        const DenseMatrix<double>& A = mats[0];
+        const DenseMatrix<double>& B = mats[1];
+        const DenseMatrix<double>& C = mats[2];
+        const DenseMatrix<double>& D = mats[3];
+
+        // ((A * B) * (C * D)) has two intermediates alive at once, the others are linear
+        MatrixArena arena;
+        const std::vector<BasicMultPlan<std::int64_t>> plans = calc_pareto_mult_plans<std::int64_t>(dims, 4, sizeof(double));
+        assert(execute_mult_plan(plans[0], inputs, arena) == (A * B) * (C * D));
+        assert(execute_mult_plan(plans[1], inputs, arena) == A * (B * (C * D)));
+        assert(execute_mult_plan(plans[2], inputs, arena) == ((A * B) * C) * D);
+        const std::size_t num_allocs = arena.get_num_allocs();
+        for (const auto& plan : plans) {
+            execute_mult_plan(plan, inputs, arena);
+        }
+        assert(arena.get_num_allocs() == num_allocs);
+
+        // 25 x 12 intermediates, one per ping-pong buffer
+        MatrixArena linear_arena;
+        execute_mult_plan(plans[2], inputs, linear_arena);
+        assert(linear_arena.get_capacity() == 2 * 2432);
+
+        assert(product_using_initializer_list({A, B, C, D}) == ((A * B) * C) * D);
+        assert(product_using_initializer_list({A}) == A);
+
+        bool thrown = false;
+        try {
+            const DenseMatrix<double> *bad_inputs[] = {&A, &C, &C, &D};
+            execute_mult_plan(plans[0], bad_inputs, arena);
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        ThreadPool pool(3);
+        for (const auto [m, n, k] : {std::array<int, 3>{200, 190, 70}, std::array<int, 3>{3, 500, 300},
+                                       std::array<int, 3>{300, 2, 301}, std::array<int, 3>{50, 50, 50}}) {
+            std::vector<double> A(std::size_t(m) * k);
+            std::vector<double> B(std::size_t(k) * n);
+            for (std::size_t i = 0; i < A.size(); i++) {
+                A[i] = double(i % 13) - 6;
+            }
+            for (std::size_t i = 0; i < B.size(); i++) {
+                B[i] = double(i % 7) - 3;
+            }
+            std::vector<double> expected(std::size_t(m) * n, 1.0);
+            std::vector<double> C(expected);
+            gemm(m, n, k, 2.0, A.data(), k, B.data(), n, 1.0, expected.data(), n);
+            parallel_gemm(pool, m, n, k, 2.0, A.data(), k, B.data(), n, 1.0, C.data(), n);
+            assert(C == expected);
+        }
+    }
+
+    {
+        const int dims[] = {25, 26, 12, 12, 13, 30};
+        std::vector<DenseMatrix<double>> mats;
+        std::vector<const DenseMatrix<double>*> inputs;
+        for (int m = 0; m < 5; m++) {
+            mats.emplace_back(dims[m], dims[m + 1]);
+            for (int i = 0; i < dims[m]; i++) {
+                for (int j = 0; j < dims[m + 1]; j++) {
+                    mats[m](i, j) = (2 * i + j + m) % 5 - 2;
+                }
+            }
+        }
+        for (const DenseMatrix<double>& mat : mats) {
+            inputs.push_back(&mat);
+        }
+
+        ThreadPool pool(3);
+        ThreadPool single(0);
+        for_each_mult_plan<std::int64_t>(dims, 5, [&](const BasicMultPlan<std::int64_t>& plan) {
+            const DenseMatrix<double> expected = execute_mult_plan(plan, inputs.data());
+            const DenseMatrix<double> res = execute_mult_plan(plan, inputs.data(), pool);
+            assert(res == expected);
+            assert(res.get_flops() == expected.get_flops());
+            assert(res.get_flops() == plan.flops);
+            assert(execute_mult_plan(plan, inputs.data(), single) == expected);
+        });
+        const BasicMultPlan<std::int64_t> one = calc_optimal_mult_plan<std::int64_t>(dims, 1);
+        assert(execute_mult_plan(one, inputs.data(), pool) == mats[0]);
+
+        bool thrown = false;
+        try {
+            const DenseMatrix<double> *bad_inputs[] = {&mats[0], &mats[2], &mats[2], &mats[3], &mats[4]};
+            execute_mult_plan(calc_optimal_mult_plan<std::int64_t>(dims, 5), bad_inputs, pool);
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        const MachineProfile profile;
+        assert(profile.make_thread_pool()->get_concurrency() == profile.threads);
+    }
+
+    {
+        // ((A * B) * C) ... of 1 x 1 factors, far deeper than a call per product would fit in the stack
+        constexpr int n = 200000;
+        const std::vector<int> dims(n + 1, 1);
+        std::vector<DenseMatrix<double>> mats(n, DenseMatrix<double>(1, 1));
+        std::vector<const DenseMatrix<double>*> inputs;
+        for (int m = 0; m < n; m++) {
+            mats[m](0, 0) = (m % 3 == 0 ? -1 : 1);
+            inputs.push_back(&mats[m]);
+        }
+        const MultPlan plan = build_mult_plan<int>(dims.data(), n, [](int, int j) { return j - 1; });
+        ThreadPool pool(2);
+        const DenseMatrix<double> res = execute_mult_plan(plan, inputs.data(), pool);
+        // n / 3 + 1 factors of -1
+        assert(res(0, 0) == ((n / 3 + 1) % 2 == 0 ? 1 : -1) && res.get_flops() == n - 1);
+    }
+
+    {
+        assert(NumaTopology::parse_cpu_list("0-3,8, 10-11\n") == std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+        assert(NumaTopology::parse_cpu_list("\n").empty());
+        for (const char *bad : {"1-", "3-1", "a", "1,,x"}) {
+            bool thrown = false;
+            try {
+                NumaTopology::parse_cpu_list(bad);
+            } catch (const std::runtime_error&) {
+                thrown = true;
+            }
+            assert(thrown);
+        }
+
+        // os node numbers kept, memory-only nodes dropped, no sysfs meaning one node
+        const std::filesystem::path sysfs = make_temp_path("matrix_check_numa");
+        for (const auto& [name, list] : {std::pair<std::string, std::string>{"node3", "2,3\n"},
+                                         {"node0", "0-1\n"}, {"node1", "\n"}, {"possible", "0-3\n"}}) {
+            std::filesystem::create_directories(sysfs / name);
+            std::ofstream(sysfs / name / "cpulist") << list;
+        }
+        const NumaTopology topology = NumaTopology::detect(sysfs);
+        assert(topology.get_num_nodes() == 2 && topology.get_os_node(0) == 0 && topology.get_os_node(1) == 3);
+        assert(topology.get_cpus(0) == std::vector<int>({0, 1}) && topology.get_cpus(1) == std::vector<int>({2, 3}));
+        std::filesystem::remove_all(sysfs);
+        assert(NumaTopology::detect(sysfs).get_num_nodes() == 1);
+        assert(NumaTopology::detect(sysfs).get_cpus(0).size() == std::max(1u, std::thread::hardware_concurrency()));
+        assert(NumaTopology::system().get_num_nodes() >= 1);
+
+        // (A * B) * (C * D) split over 2 nodes, the root with its heavier half
+        const int dims[] = {40, 40, 40, 20, 20};
+        std::vector<DenseMatrix<double>> mats;
+        std::vector<const DenseMatrix<double>*> inputs;
+        mats.reserve(4);
+        for (int m = 0; m < 4; m++) {
+            mats.emplace_back(dims[m], dims[m + 1]);
+            for (int i = 0; i < dims[m]; i++) {
+                for (int j = 0; j < dims[m + 1]; j++) {
+                    mats[m](i, j) = (i + 3 * j + m) % 7 - 3;
+                }
+            }
+            inputs.push_back(&mats[m]);
+        }
+        const auto balanced = [](int i, int j) { return (i == 0 && j == 3 ? 1 : i); };
+        const MultPlan plan = build_mult_plan<int>(dims, 4, balanced);
+        assert(calc_mult_plan_numa_nodes(plan, inputs.data(), 2) == std::vector<int>({0, 1, 0}));
+        assert(calc_mult_plan_numa_nodes(plan, inputs.data(), 1) == std::vector<int>({0, 0, 0}));
+        assert(calc_mult_plan_numa_nodes(plan, inputs.data(), 4) == std::vector<int>({0, 3, 0}));
+        const MultPlan linear = build_mult_plan<int>(dims, 4, [](int, int j) { return j - 1; });
+        assert(calc_mult_plan_numa_nodes(linear, inputs.data(), 2) == std::vector<int>({0, 0, 0}));
+
+        // placed buffers are page aligned where mapped; the placement itself may be refused
+        numa_vector<double> interleaved(1 << 16, NumaAllocator<double>(NumaPolicy::interleave, 0));
+        numa_vector<double> small(3, NumaAllocator<double>(NumaPolicy::local, 0));
+        assert(interleaved.get_allocator().is_mapped(interleaved.size()) && !small.get_allocator().is_mapped(3));
+        assert(reinterpret_cast<std::uintptr_t>(interleaved.data()) % sysconf(_SC_PAGESIZE) == 0);
+        assert(interleaved[12345] == 0.0 && small[2] == 0.0);
+        numa_vector<double>().swap(interleaved);
+        assert(interleaved.get_allocator().policy == NumaPolicy::first_touch);
+
+        // two nodes sharing CPU 0: same products whatever the node or placement
+        const DenseMatrix<double> expected = execute_mult_plan(plan, inputs.data());
+        ThreadPool pinned(3, NumaTopology(std::vector<std::vector<int>>{{0}, {0}}));
+        assert(pinned.get_topology().get_num_nodes() == 2 && pinned.get_current_node() == -1);
+        std::atomic<int> num_run(0);
+        {
+            TaskGroup group(pinned);
+            for (int task = 0; task < 8; task++) {
+                group.run([&]() { num_run++; }, task % 3 - 1);
+            }
+            group.wait();
+        }
+        assert(num_run == 8);
+
+        // workers on nodes 0, 0 and 1: with two of them held, a task submitted
+        // to the node of the third runs there
+        {
+            const auto spin_until = [](const auto& done) {
+                while (!done()) {
+                    std::this_thread::yield();
+                }
+            };
+            std::vector<int> free_nodes = {0, 0, 1};
+            std::atomic<int> node(-2);
+            std::atomic<bool> released(false);
+            TaskGroup group(pinned);
+            for (int held = 0; held < 2; held++) {
+                group.run([&]() {
+                    node = pinned.get_current_node();
+                    spin_until([&]() { return released.load(); });
+                });
+                spin_until([&]() { return node != -2; });
+                free_nodes.erase(std::find(free_nodes.begin(), free_nodes.end(), node.exchange(-2)));
+            }
+            group.run([&]() { node = pinned.get_current_node(); }, free_nodes[0]);
+            spin_until([&]() { return node != -2; });
+            assert(node == free_nodes[0]);
+            released = true;
+            group.wait();
+        }
+        for (NumaPolicy numa : {NumaPolicy::first_touch, NumaPolicy::local, NumaPolicy::interleave}) {
+            const DenseMatrix<double> res = execute_mult_plan(plan, inputs.data(), pinned, numa);
+            assert(std::equal(res.data(), res.data() + 40 * 20, expected.data()));
+            assert(res.get_flops() == expected.get_flops());
+
+            MatrixArena arena;
+            arena.set_numa(numa);
+            const DenseMatrix<double> in_arena = execute_mult_plan(linear, inputs.data(), arena);
+            assert(in_arena.get_flops() == linear.flops && arena.get_num_allocs() == 1);
+        }
+    }
+
+    {
+        ThreadPool pool(2);
+        PoolFuture<int> answer = run_async(pool, []() { return 6 * 7; });
+        assert(answer.valid() && answer.get() == 42 && !answer.valid());
+        bool thrown = false;
+        try {
+            run_async(pool, []() -> int { throw std::runtime_error("load failed"); }).get();
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        // waiting runs the task when the pool has no worker
+        ThreadPool single(0);
+        assert(run_async(single, []() { return 1; }).get() == 1);
+
+        const int dims[] = {5, 4, 3, 6};
+        DenseMatrix<double> A(5, 4);
+        DenseMatrix<double> B(4, 3);
+        DenseMatrix<double> C(3, 6);
+        for (DenseMatrix<double> *mat : {&A, &B, &C}) {
+            for (int i = 0; i < mat->get_nrow(); i++) {
+                for (int j = 0; j < mat->get_ncol(); j++) {
+                    (*mat)(i, j) = (i + 2 * j + mat->get_ncol()) % 5 - 2;
+                }
+            }
+        }
+        const DenseMatrix<double> expected = product_using_initializer_list({A, B, C});
+        const DenseMatrix<double> res = product_using_initializer_list_async({A, B, C}, pool).get();
+        assert(res == expected);
+
+        const std::vector<const DenseMatrix<double>*> inputs = {&A, &B, &C};
+        const BasicMultPlan<std::int64_t> plan = calc_optimal_mult_plan<std::int64_t>(dims, 3);
+        const DenseMatrix<double> planned = execute_mult_plan(plan, inputs.data());
+        assert(execute_mult_plan_async(plan, inputs.data(), pool).get() == planned);
+
+#if defined(__cpp_impl_coroutine)
+        // coroutines awaiting futures
+        const auto sum = [](ThreadPool& pool) -> PoolFuture<int> {
+            const int a = co_await run_async(pool, []() { return 1; });
+            PoolFuture<int> b = run_async(pool, []() { return 2; });
+            co_return a + co_await b;
+        };
+        assert(sum(pool).get() == 3);
+
+        // chains loaded factor by factor, each factor once, whatever the prefetch
+        std::array<std::atomic<int>, 3> num_loads = {};
+        const std::function<DenseMatrix<double>(int)> load = [&](int i) {
+            num_loads[i]++;
+            return *inputs[i];
+        };
+        for (int prefetch : {0, 1, 5}) {
+            assert(execute_mult_plan_async(plan, load, pool, prefetch).get() == planned);
+        }
+        assert(num_loads[0] == 3 && num_loads[1] == 3 && num_loads[2] == 3);
+        assert(execute_mult_plan_async(calc_optimal_mult_plan<std::int64_t>(dims, 1), load, pool).get() == A);
+        thrown = false;
+        try {
+            execute_mult_plan_async(plan, load, pool, -1).get();
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        // waiting runs the tasks of the coroutine's own pool, which may have no workers
+        ThreadPool no_workers(0);
+        assert(sum(no_workers).get() == 3);
+        assert(execute_mult_plan_async(plan, load, no_workers).get() == planned);
+
+        // a failed load fails the chain; the loads prefetched may run on after, so the loader owns its captures
+        const auto fail_second = [dims](int i) {
+            if (i == 1) {
+                throw std::runtime_error("load failed");
+            }
+            return DenseMatrix<double>(dims[i], dims[i + 1]);
+        };
+        thrown = false;
+        try {
+            execute_mult_plan_async<double>(plan, fail_second, pool).get();
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+#endif
+    }
+
+    {
+        // duplicates summed, entries out of order
+        const CsrMatrix<double> A = CsrMatrix<double>::from_triplets(3, 4, {{2, 1, 5}, {0, 3, 1}, {0, 0, 2},
+                                                                            {2, 1, -1}, {1, 2, 3}});
+        assert(A.get_nnz() == 4);
+        assert(A.get(2, 1) == 4 && A.get(0, 0) == 2 && A.get(0, 3) == 1 && A.get(1, 2) == 3);
+        assert(A.get(1, 1) == 0 && A.get(2, 3) == 0);
+
+        const CscMatrix<double> A_csc = A.to_format<SparseFormat::csc>();
+        assert(A_csc.get_nnz() == 4 && A_csc.get(2, 1) == 4 && A_csc.get(1, 2) == 3);
+        assert(A_csc.to_format<SparseFormat::csr>() == A);
+        assert(CscMatrix<double>(A.to_dense()) == A_csc);
+        assert(CscMatrix<double>::from_triplets(3, 4, {{1, 2, 3}, {2, 1, 4}, {0, 0, 2}, {0, 3, 1}}) == A_csc);
+
+        // [2 0 0 1; 0 0 3 0; 0 4 0 0] * [1 0; 0 2; 1 0; 0 -1]
+        const CsrMatrix<double> B = CsrMatrix<double>::from_triplets(4, 2,
+                                                                     {{0, 0, 1}, {1, 1, 2}, {2, 0, 1}, {3, 1, -1}});
+        const CsrMatrix<double> AB = A * B;
+        assert(AB.get(0, 0) == 2 && AB.get(0, 1) == -1 && AB.get(1, 0) == 3 && AB.get(2, 1) == 8);
+        assert(AB.get_nnz() == 4);
+        // a_00, a_03, a_12 and a_21 each scale a row of B with one non-zero
+        assert(AB.get_flops() == 4);
+        assert((A_csc * B.to_format<SparseFormat::csc>()).to_format<SparseFormat::csr>() == AB);
+        assert(A * B.to_format<SparseFormat::csc>() == AB);
+
+        const DenseMatrix<double> AB_dense = A.to_dense() * B.to_dense();
+        assert(A * B.to_dense() == A_csc * B.to_dense());
+        assert(A.to_dense() * B == A.to_dense() * B.to_format<SparseFormat::csc>());
+        for (const DenseMatrix<double>& res : {A * B.to_dense(), A.to_dense() * B, AB.to_dense()}) {
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 2; j++) {
+                    assert(res(i, j) == AB_dense(i, j));
+                }
+            }
+        }
+        // 4 non-zeros scale rows of 2: 4 * 3 flops
+        assert((A * B.to_dense()).get_flops() == 12);
+        // 12 entries scale rows of 1 non-zero: 12 * 1 flops
+        assert((A.to_dense() * B).get_flops() == 12);
+        assert((A.to_dense() * B.to_dense()).get_flops() == 3 * 4 * 3);
+
+        for (int which = 0; which < 3; which++) {
+            bool thrown = false;
+            try {
+                if (which == 0) {
+                    A * A;
+                } else if (which == 1) {
+                    A * A.to_dense();
+                } else {
+                    A.to_dense() * A;
+                }
+            } catch (const std::logic_error&) {
+                thrown = true;
+            }
+            assert(thrown);
+        }
+    }
+
+    {
+        // dense shapes cost what the dense formula says
+        const SparseShape A = {10, 20, 200};
+        const SparseShape B = {20, 30, 600};
+        assert(estimate_mult_shape(A, B).nnz == 300);
+        assert(estimate_sparse_mult_flops(A, B) == calc_mult_flops<double>(10, 20, 30));
+        const SparseShape C = {30, 40, 1200};
+        const BasicMatrix<std::int64_t> dense_A(10, 20);
+        const BasicMatrix<std::int64_t> dense_B(20, 30);
+        const BasicMatrix<std::int64_t> dense_C(30, 40);
+        assert(calc_optimal_mult_order({A, B, C}) ==
+               calc_optimal_mult_order<std::int64_t>({dense_A, dense_B, dense_C}));
+
+        // one non-zero per row and column: products stay that sparse
+        const SparseShape P = {1000, 1000, 1000};
+        assert(std::abs(estimate_mult_shape(P, P).nnz - 1e6 * -std::expm1(-1e-3)) < 1e-2);
+        assert(estimate_sparse_mult_flops(P, P) < 2000);
+
+        // dense ends around sparse middles: the dense formula keeps the large
+        // products away from the dense ends, the sparse cost puts them on the sparse ones
+        const SparseShape shapes[] = {{200, 2000, 200 * 2000.0}, {2000, 2000, 4000}, {2000, 2000, 4000},
+                                      {2000, 100, 2000 * 100.0}};
+        const int dims[] = {200, 2000, 2000, 2000, 100};
+        assert(calc_optimal_mult_plan<std::int64_t>(dims, 4).to_string() == "(M1 * (M2 * (M3 * M4)))");
+        assert(calc_sparse_mult_plan(shapes, 4).to_string() == "((M1 * M2) * (M3 * M4))");
+        assert(calc_sparse_mult_plan(shapes, 4).flops < calc_optimal_mult_plan<std::int64_t>(dims, 4).flops / 20);
+
+        bool thrown = false;
+        try {
+            calc_optimal_mult_order({A, C});
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        // executed like any other Mat: the sparse plan does fewer flops
+        std::vector<CsrMatrix<double>> mats;
+        const int dims[] = {20, 200, 200, 200, 10};
+        for (int m = 0; m < 4; m++) {
+            std::vector<std::tuple<int, int, double>> triplets;
+            const bool dense = (m == 0 || m == 3);
+            for (int i = 0; i < dims[m]; i++) {
+                for (int j = 0; j < dims[m + 1]; j++) {
+                    if (dense || (i * 7 + j * 13 + m) % 397 == 0) {
+                        triplets.emplace_back(i, j, double((i + j) % 5) - 2);
+                    }
+                }
+            }
+            mats.push_back(CsrMatrix<double>::from_triplets(dims[m], dims[m + 1], triplets));
+        }
+        const CsrMatrix<double> *inputs[] = {&mats[0], &mats[1], &mats[2], &mats[3]};
+        const SparseShape shapes[] = {mats[0].get_shape(), mats[1].get_shape(), mats[2].get_shape(),
+                                      mats[3].get_shape()};
+        const BasicMultPlan<std::int64_t> dense_plan = calc_optimal_mult_plan<std::int64_t>(dims, 4);
+        const BasicMultPlan<std::int64_t> sparse_plan = calc_sparse_mult_plan(shapes, 4);
+        const CsrMatrix<double> dense_res = execute_mult_plan(dense_plan, inputs);
+        const CsrMatrix<double> sparse_res = execute_mult_plan(sparse_plan, inputs);
+        const DenseMatrix<double> dense_values = dense_res.to_dense();
+        const DenseMatrix<double> sparse_values = sparse_res.to_dense();
+        assert(std::equal(dense_values.data(), dense_values.data() + 20 * 10, sparse_values.data()));
+        assert(sparse_plan.to_string() == "((M1 * (M2 * M3)) * M4)");
+        assert(sparse_res.get_flops() < dense_res.get_flops());
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    {
+        const auto fill = [](DenseMatrix<double>& mat, int seed) {
+            for (int i = 0; i < mat.get_nrow(); i++) {
+                for (int j = 0; j < mat.get_ncol(); j++) {
+                    mat(i, j) = (i * 3 + j * 5 + seed) % 7 - 3;
+                }
+            }
+        };
+        DenseMatrix<double> A(37, 29);
+        DenseMatrix<double> B(29, 45);
+        fill(A, 0);
+        fill(B, 1);
+        const DenseMatrix<double> AB = A * B;
+
+        const std::string path_a = make_temp_path("matrix_check_a.mat").string();
+        const std::string path_b = make_temp_path("matrix_check_b.mat").string();
+        const std::string path_c = make_temp_path("matrix_check_c.mat").string();
+        {
+            const MappedMatrix<double> mapped_a = MappedMatrix<double>::from_dense(path_a, A, 16, 8);
+            MappedMatrix<double>::from_dense(path_b, B, 8, 16).sync();
+            assert(mapped_a.get_nrow() == 37 && mapped_a.get_ncol() == 29);
+            assert(mapped_a.get_num_tile_rows() == 3 && mapped_a.get_num_tile_cols() == 4);
+            assert(mapped_a.get(36, 28) == A(36, 28));
+            // tiles start on pages
+            assert(reinterpret_cast<std::uintptr_t>(mapped_a.tile(1, 2)) % sysconf(_SC_PAGESIZE) == 0);
+            mapped_a.sync();
+        }
+
+        const MappedMatrix<double> mapped_a = MappedMatrix<double>::open(path_a);
+        const MappedMatrix<double> mapped_b = MappedMatrix<double>::open(path_b);
+        assert(mapped_a.to_dense() == A);
+        assert(mapped_b.to_dense() == B);
+        // a tile row of A per panel, and the whole of A
+        for (std::int64_t memory_bytes : {std::int64_t(1), std::int64_t(1) << 30}) {
+            const MappedMatrix<double> C = out_of_core_mult(mapped_a, mapped_b, path_c, memory_bytes);
+            assert(C.get_tile_rows() == 16 && C.get_tile_cols() == 16);
+            assert(C.to_dense() == AB);
+        }
+
+        bool thrown = false;
+        try {
+            MappedMatrix<float>::open(path_a);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        thrown = false;
+        try {
+            out_of_core_mult(mapped_a, mapped_a, path_c, 1 << 20);
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        thrown = false;
+        try {
+            const_cast<MappedMatrix<double>&>(mapped_a).tile(0, 0);
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        thrown = false;
+        try {
+            const_cast<MappedMatrix<double>&>(mapped_a).set_flops(1);
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown && mapped_a.get_flops() == A.get_flops());
+
+        // moved-to objects drop their own mapping first
+        MappedMatrix<double> moved = MappedMatrix<double>::open(path_b);
+        moved = MappedMatrix<double>::open(path_a);
+        assert(moved.to_dense() == A);
+
+        // corrupt headers are rejected before any tile is located
+        const auto open_corrupt = [&](const auto& corrupt) {
+            MappedMatrix<double>::from_dense(path_c, A, 16, 8).sync();
+            MatrixFileHeader header = {};
+            {
+                std::fstream file(path_c, std::ios::in | std::ios::out | std::ios::binary);
+                file.read(reinterpret_cast<char *>(&header), sizeof(header));
+                corrupt(header);
+                file.seekp(0);
+                file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            }
+            try {
+                MappedMatrix<double>::open(path_c);
+            } catch (const std::runtime_error&) {
+                return true;
+            }
+            return false;
+        };
+        constexpr std::int32_t max_int32 = std::numeric_limits<std::int32_t>::max();
+        assert(!open_corrupt([](MatrixFileHeader&) {}));
+        assert(open_corrupt([](MatrixFileHeader& header) { header.nrow = -1; }));
+        assert(open_corrupt([](MatrixFileHeader& header) { header.ncol = -29; }));
+        assert(open_corrupt([](MatrixFileHeader& header) { header.nrow = max_int32; }));
+        assert(open_corrupt([](MatrixFileHeader& header) { header.data_offset = 0; }));
+        assert(open_corrupt([](MatrixFileHeader& header) { header.data_offset = -4096; }));
+        assert(open_corrupt([](MatrixFileHeader& header) { header.data_offset = 4097; }));
+        assert(open_corrupt([](MatrixFileHeader& header) { header.tile_bytes = std::int64_t(1) << 61; }));
+        assert(open_corrupt([](MatrixFileHeader& header) { header.tile_rows = header.tile_cols = max_int32; }));
+        {
+            std::ofstream(path_c) << "not a matrix file";
+        }
+        thrown = false;
+        try {
+            MappedMatrix<double>::open(path_c);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        std::remove(path_a.c_str());
+        std::remove(path_b.c_str());
+        std::remove(path_c.c_str());
+    }
+#endif
+
+    {
+        // M2 (8 MB) as the left operand of M2 * M3 is streamed in 16 panels,
+        // each reading M3; (M1 * M2) reads it once
+        const int dims[] = {64, 1024, 1024, 64, 256};
+        OutOfCoreCostModel model;
+        model.memory_bytes = 1 << 20;
+        assert(calc_optimal_mult_plan<std::int64_t>(dims, 4).to_string() == "((M1 * (M2 * M3)) * M4)");
+        assert(calc_fastest_mult_plan<std::int64_t>(dims, 4, model).to_string() == "(((M1 * M2) * M3) * M4)");
+        assert(model.predict(1024, 1024, 64) > model.in_memory.predict(1024, 1024, 64) +
+                                                   (8 << 20) / (model.disk_gbs * 1e9));
+
+        // everything fits: only the in-memory model is left
+        model.memory_bytes = std::int64_t(1) << 30;
+        assert(model.predict(1024, 1024, 64) == model.in_memory.predict(1024, 1024, 64));
+        assert(calc_fastest_mult_plan<std::int64_t>(dims, 4, model).to_string() ==
+               calc_fastest_mult_plan<std::int64_t>(dims, 4, model.in_memory).to_string());
+    }
+
+    {
+        const int dims[] = {10, 20, 30, 40, 30};
+        int num_plans = 0;
+        for_each_mult_plan<int>(dims, 4, [&](const BasicMultPlan<int>& plan) {
+            assert(plan.flops >= calc_optimal_mult_plan<int>(dims, 4).flops);
+            num_plans++;
+        });
+        assert(num_plans == 5);
+    }
+
+    {
+        // odd blocks only change the speed of gemm()
+        DenseMatrix<double> A(37, 37);
+        DenseMatrix<double> B(37, 41);
+        for (int i = 0; i < 37; i++) {
+            for (int j = 0; j < 37; j++) {
+                A(i, j) = (i * j) % 7 - 3;
+            }
+            for (int j = 0; j < 41; j++) {
+                B(i, j) = i - j;
+            }
+        }
+        const DenseMatrix<double> expected = A * B;
+        const GemmTuning<double>::Blocks blocks = GemmTuning<double>::global().get_blocks();
+        GemmTuning<double>::global().set_blocks({5, 7, 9});
+        assert(A * B == expected);
+        GemmTuning<double>::global().set_blocks(blocks);
+
+        bool thrown = false;
+        try {
+            GemmTuning<double>::global().set_blocks({0, 7, 9});
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(GemmTuning<double>::global().get_blocks().mc == blocks.mc);
+    }
+
+    {
+        MachineProfile profile;
+        profile.gemm_blocks = {96, 192, 1536};
+        profile.strassen_crossover = 384;
+        profile.threads = 3;
+        profile.peak_gflops = 12.5;
+        profile.bandwidth_gbs = 1.0 / 3;
+        profile.cost_sizes = {1, 8, 64};
+        profile.cost_gflops.assign(27, 0.1);
+        profile.cost_gflops[26] = 9.75;
+
+        const std::string path = make_temp_path("matrix_check.profile").string();
+        profile.save(path);
+        const MachineProfile loaded = MachineProfile::load(path);
+        {
+            std::ofstream(path) << "threads x\n";
+        }
+        bool thrown = false;
+        try {
+            MachineProfile::load(path);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        std::remove(path.c_str());
+
+        assert(loaded.gemm_blocks.mc == 96 && loaded.gemm_blocks.kc == 192 && loaded.gemm_blocks.nc == 1536);
+        assert(loaded.strassen_crossover == 384);
+        assert(loaded.threads == 3);
+        assert(loaded.peak_gflops == 12.5);
+        assert(loaded.bandwidth_gbs == 1.0 / 3);
+        assert(loaded.cost_sizes == profile.cost_sizes);
+        assert(loaded.cost_gflops == profile.cost_gflops);
+        assert(loaded.get_measured_cost_model().get_gflops() == profile.cost_gflops);
+
+        // the thread count sizes the global pool, which keeps working
+        const unsigned concurrency = ThreadPool::global().get_concurrency();
+        MachineProfile threaded;
+        threaded.threads = 3;
+        threaded.apply();
+        assert(ThreadPool::global().get_concurrency() == 3);
+        std::atomic<int> num_run(0);
+        parallel_for(ThreadPool::global(), 0, 64, 1, [&](std::size_t first, std::size_t last) {
+            num_run += int(last - first);
+        });
+        assert(num_run == 64);
+        MachineProfile().apply();
+        assert(ThreadPool::global().get_concurrency() == concurrency);
+
+        thrown = false;
+        try {
+            MachineProfile::load(path);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        TraceRecorder recorder;
+        assert(!recorder.is_enabled());
+        recorder.record({"mult", "gemm", 4, 5, 6, 240, 192, 100, 3, 0});
+        std::thread([&]() { recorder.record({"mult", "gemm", 4, 5, 6, 240, 192, 50, 1000, 0}); }).join();
+        recorder.record({"add", "add", 4, 0, 6, 24, 0, 200, 1, 0});
+
+        const std::vector<TraceEvent> events = recorder.get_events();
+        assert(events.size() == 3);
+        assert(events[0].start_ns == 50 && events[0].thread == 1);
+        assert(events[1].start_ns == 100 && events[1].thread == 0);
+        assert(events[2].start_ns == 200 && events[2].thread == 0);
+        assert(recorder.get_num_dropped() == 0);
+
+        const std::map<std::string, TraceHistogram> histograms = recorder.get_histograms();
+        assert(histograms.size() == 2);
+        const TraceHistogram& mult = histograms.at("mult/gemm");
+        assert(mult.count == 2 && mult.flops == 480 && mult.bytes == 384 && mult.total_ns == 1003);
+        assert(mult.buckets[1] == 1 && mult.buckets[9] == 1);  // 3 ns, 1000 ns
+        assert(histograms.at("add/add").buckets[0] == 1);
+
+        std::ostringstream trace;
+        recorder.write_chrome_trace(trace);
+        assert(trace.str().rfind("{\"traceEvents\":[\n{\"name\":\"mult\",\"cat\":\"gemm\",\"ph\":\"X\",\"pid\":1,"
+                                 "\"tid\":1,\"ts\":0.050,\"dur\":1.000,", 0) == 0);
+        assert(trace.str().find("\"shape\":\"4x5 * 5x6\",\"kernel\":\"gemm\",\"flops\":240,\"bytes\":192}") !=
+               std::string::npos);
+        assert(trace.str().find("\"shape\":\"4x6\"") != std::string::npos);
+        std::ostringstream summary;
+        recorder.write_histograms(summary);
+        assert(summary.str().rfind("add/add: 1 calls", 0) == 0);
+        assert(summary.str().find("mult/gemm: 2 calls") != std::string::npos);
+
+        recorder.clear();
+        assert(recorder.get_events().empty());
+    }
+
+#if defined(MATRIX_TRACE)
+    {
+        using flops_type = DenseMatrix<double>::flops_type;
+
+        TraceRecorder& recorder = TraceRecorder::global();
+        recorder.clear();
+        recorder.set_enabled(true);
+        const DenseMatrix<double> A(4, 5);
+        const DenseMatrix<double> B(5, 6);
+        const DenseMatrix<double> S(5, 5);
+        const DenseMatrix<double> AB = A * B;
+        const DenseMatrix<double> sum = AB + AB;
+        DenseMatrix<double> AS = A;
+        AS *= S;
+        bool thrown = false;
+        try {
+            A + B;
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        recorder.set_enabled(false);
+        A * B;
+
+        const std::vector<TraceEvent> events = recorder.get_events();
+        assert(events.size() == 3);
+        assert(events[0].op == "mult"s && events[0].kernel == "gemm"s);
+        assert(events[0].m == 4 && events[0].k == 5 && events[0].n == 6);
+        assert(events[0].flops == calc_mult_flops<flops_type>(4, 5, 6));
+        assert(events[0].bytes == 4 * 6 * sizeof(double));
+        assert(events[1].op == "add"s && events[1].kernel == "add"s);  // the += under the + folded into it
+        assert(events[1].k == 0 && events[1].flops == calc_mat_add_flops<flops_type>(AB, AB));
+        assert(events[1].bytes == 4 * 6 * sizeof(double));
+        assert(events[2].op == "mult"s && events[2].kernel == "gemm_in_place"s && events[2].bytes == 0);
+        assert(events[0].duration_ns >= 0 && events[1].start_ns >= events[0].start_ns);
+        recorder.clear();
+    }
+
+    {
+        // threads waiting on a product run other nodes: still one event per node
+        int dims[17];
+        std::vector<DenseMatrix<double>> mats;
+        std::vector<const DenseMatrix<double>*> inputs;
+        for (int m = 0; m <= 16; m++) {
+            dims[m] = (m % 2 == 0 ? 100 : 300);
+        }
+        for (int m = 0; m < 16; m++) {
+            mats.emplace_back(dims[m], dims[m + 1]);
+        }
+        for (const DenseMatrix<double>& mat : mats) {
+            inputs.push_back(&mat);
+        }
+        const auto plan = calc_optimal_mult_plan<std::int64_t>(dims, 16);
+
+        // m, k, n and bytes of every node
+        std::vector<std::array<std::int64_t, 4>> expected;
+        for (std::size_t t = 0; t < plan.nodes.size(); t++) {
+            const auto& node = plan.nodes[t];
+            const int nk = get_mult_plan_shape(plan, inputs.data(), node.left).second;
+            const std::int64_t bytes = (t + 1 < plan.nodes.size() ? node.nrow * node.ncol * sizeof(double) : 0);
+            expected.push_back({node.nrow, nk, node.ncol, bytes});
+        }
+        std::sort(expected.begin(), expected.end());
+
+        TraceRecorder& recorder = TraceRecorder::global();
+        ThreadPool pool(2);
+        for (int run = 0; run < 20; run++) {
+            recorder.clear();
+            recorder.set_enabled(true);
+            execute_mult_plan(plan, inputs.data(), pool);
+            recorder.set_enabled(false);
+
+            std::vector<std::array<std::int64_t, 4>> traced;
+            for (const TraceEvent& event : recorder.get_events()) {
+                assert(event.op == "mult"s && event.kernel == "parallel_gemm"s);
+                traced.push_back({event.m, event.k, event.n, event.bytes});
+            }
+            std::sort(traced.begin(), traced.end());
+            assert(traced == expected);
+        }
+        recorder.clear();
+    }
+#endif
+}
+
+//==============================================================================
+// bench_mult_order ()
+//==============================================================================
+// Planning time of the exact DP (serial and wavefront on ThreadPool::global())
+// vs the Hu-Shing partition, and how far the latter is from optimal. The DP
+// is skipped where it would take minutes.
+void bench_mult_order()
+{
+    constexpr std::size_t max_dp_n = 1000;
+
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<int> dist(1, 10);
+    MultOrderWorkspace ws;
+
+    printf("split kernel: %s\n", get_argmin_split_kernel().name);
+    printf("%8s %14s %14s %14s %12s %12s %8s\n", "n", "dp_ms", "dp_par_ms", "hu_shing_ms", "dp_flops", "hs_flops",
+           "ratio");
+    for (std::size_t n : {10, 30, 100, 300, 1000, 3000, 10000, 30000, 100000}) {
+        std::vector<int> dims(n + 1);
+        for (int& dim : dims) {
+            dim = dist(gen);
+        }
+
+        const auto start_hs = std::chrono::steady_clock::now();
+        std::unordered_map<std::int64_t, int> split_at;
+        const int hs_flops = calc_mult_order_hu_shing(dims, split_at);
+        const std::chrono::duration<double, std::milli> hs_ms = std::chrono::steady_clock::now() - start_hs;
+
+        if (n <= max_dp_n) {
+            const auto start_dp = std::chrono::steady_clock::now();
+            calc_mult_order_table(dims.data(), n, ws);
+            const std::chrono::duration<double, std::milli> dp_ms = std::chrono::steady_clock::now() - start_dp;
+            const int dp_flops = ws.get_cost(0, n - 1);
+
+            const auto start_par = std::chrono::steady_clock::now();
+            calc_mult_order_table(dims.data(), n, ws, &ThreadPool::global());
+            const std::chrono::duration<double, std::milli> par_ms = std::chrono::steady_clock::now() - start_par;
+
+            printf("%8zu %14.3f %14.3f %14.3f %12d %12d %8.4f\n", n, dp_ms.count(), par_ms.count(), hs_ms.count(),
+                   dp_flops, hs_flops, double(hs_flops) / dp_flops);
+        } else {
+            printf("%8zu %14s %14s %14.3f %12s %12d %8s\n", n, "-", "-", hs_ms.count(), "-", hs_flops, "-");
+        }
+    }
+}
+
+//==============================================================================
+// bench_approx ()
+//==============================================================================
+// Plan quality and planning time of calc_approx_mult_plan() (default budget,
+// and greedy only) vs Hu-Shing, as ratios to the exact DP where it runs, to
+// calc_mult_chain_lower_bound() beyond
+void bench_approx()
+{
+    constexpr std::size_t max_dp_n = 1000;
+    using Flops = std::int64_t;
+
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<int> dist(1, 100);
+    ApproxPlanOptions greedy_only;
+    greedy_only.time_budget_s = 0;
+
+    printf("%8s %6s %12s %12s %12s %12s %10s %10s %10s\n", "n", "ref", "ref_ms", "approx_ms", "greedy_ms",
+           "hs_ms", "approx", "greedy", "hs");
+    for (std::size_t n : {10, 30, 100, 300, 1000, 10000, 100000, 1000000}) {
+        std::vector<int> dims(n + 1);
+        for (int& dim : dims) {
+            dim = dist(gen);
+        }
+
+        const auto start_ref = std::chrono::steady_clock::now();
+        const Flops ref = (n <= max_dp_n ? calc_optimal_mult_plan<Flops>(dims.data(), n).flops
+                                         : calc_mult_chain_lower_bound<Flops>(dims.data(), n));
+        const std::chrono::duration<double, std::milli> ref_ms = std::chrono::steady_clock::now() - start_ref;
+
+        const auto start_approx = std::chrono::steady_clock::now();
+        const Flops approx = calc_approx_mult_plan<Flops>(dims.data(), n).flops;
+        const std::chrono::duration<double, std::milli> approx_ms = std::chrono::steady_clock::now() - start_approx;
+
+        const auto start_greedy = std::chrono::steady_clock::now();
+        const Flops greedy = calc_approx_mult_plan<Flops>(dims.data(), n, greedy_only).flops;
+        const std::chrono::duration<double, std::milli> greedy_ms = std::chrono::steady_clock::now() - start_greedy;
+
+        const auto start_hs = std::chrono::steady_clock::now();
+        const Flops hs = calc_optimal_mult_plan<Flops>(dims.data(), n, MultOrderSolver::hu_shing).flops;
+        const std::chrono::duration<double, std::milli> hs_ms = std::chrono::steady_clock::now() - start_hs;
+
+        printf("%8zu %6s %12.3f %12.3f %12.3f %12.3f %10.4f %10.4f %10.4f\n", n, n <= max_dp_n ? "dp" : "bound",
+               ref_ms.count(), approx_ms.count(), greedy_ms.count(), hs_ms.count(), double(approx) / ref,
+               double(greedy) / ref, double(hs) / ref);
+    }
+}
+
+//==============================================================================
+// bench_batch_plans ()
+//==============================================================================
+// Planning a million random chains of 3 to 8 matrices one by one, as
+// calc_optimal_mult_order() does (plan and string) and plan only, vs batched,
+// serial and on ThreadPool::global()
+void bench_batch_plans()
+{
+    constexpr std::size_t num_chains = 1000000;
+
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<std::size_t> length_dist(3, MultChainBatch::max_length);
+    std::uniform_int_distribution<int> dim_dist(1, 1000);
+    MultChainBatch batch;
+    batch.reserve(num_chains, num_chains * (MultChainBatch::max_length + 1));
+    for (std::size_t c = 0; c < num_chains; c++) {
+        int dims[MultChainBatch::max_length + 1];
+        const std::size_t n = length_dist(gen);
+        for (std::size_t p = 0; p < n + 1; p++) {
+            dims[p] = dim_dist(gen);
+        }
+        batch.add(dims, n);
+    }
+
+    const auto time_ms = [](const auto& func) {
+        const auto start = std::chrono::steady_clock::now();
+        func();
+        const std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+        return ms.count();
+    };
+
+    std::int64_t checksum = 0;
+#if defined(__GNUC__)
+    printf("batch kernel: %s\n", get_batch_mult_order_kernels().front().name);
+#endif
+    printf("%-22s %12s %12s\n", "planner", "ms", "ns/chain");
+    const auto report = [](const char *name, double ms) {
+        printf("%-22s %12.3f %12.1f\n", name, ms, ms * 1e6 / num_chains);
+    };
+    report("one by one + string", time_ms([&]() {
+        for (std::size_t c = 0; c < batch.size(); c++) {
+            const BasicMultPlan<std::int64_t> plan =
+                calc_optimal_mult_plan<std::int64_t>(batch.get_dims(c), batch.get_length(c));
+            checksum += plan.flops + plan.to_string().size();
+        }
+    }));
+    report("one by one", time_ms([&]() {
+        for (std::size_t c = 0; c < batch.size(); c++) {
+            checksum += calc_optimal_mult_plan<std::int64_t>(batch.get_dims(c), batch.get_length(c)).flops;
+        }
+    }));
+    report("batched", time_ms([&]() { checksum += calc_optimal_mult_plans(batch).back().flops; }));
+    report("batched, pool", time_ms([&]() {
+        checksum += calc_optimal_mult_plans(batch, &ThreadPool::global()).back().flops;
+    }));
+    printf("(checksum %lld)\n", (long long)checksum);
+}
+
+//==============================================================================
+// bench_replan ()
+//==============================================================================
+// Serving loop where only dims[0], the batch dimension, changes between
+// requests: calc_optimal_mult_plan() from scratch vs IncrementalMultPlanner,
+// then the incremental planner alternating between two chains of other
+// lengths sharing a suffix
+void bench_replan()
+{
+    constexpr int reps = 20;
+
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<int> dist(1, 40);
+    const auto time_us = [](const auto& func) {
+        const auto start = std::chrono::steady_clock::now();
+        for (int rep = 0; rep < reps; rep++) {
+            func(rep);
+        }
+        const std::chrono::duration<double, std::micro> us = std::chrono::steady_clock::now() - start;
+        return us.count() / reps;
+    };
+
+    std::int64_t checksum = 0;
+    printf("%6s %14s %14s %14s %10s\n", "n", "scratch_us", "new_p0_us", "suffix_us", "speedup");
+    for (std::size_t n : {50, 100, 200, 500, 1000, 2000}) {
+        std::vector<int> dims(n + 1);
+        for (int& dim : dims) {
+            dim = dist(gen);
+        }
+
+        IncrementalMultPlanner planner;
+        planner.plan(dims.data(), n);
+        const double scratch_us = time_us([&](int rep) {
+            dims[0] = 1 + rep;
+            checksum += calc_optimal_mult_plan(dims.data(), n).flops;
+        });
+        const double p0_us = time_us([&](int rep) {
+            dims[0] = 1 + rep;
+            checksum += planner.plan(dims.data(), n).flops;
+        });
+        // every other request has one more matrix in front
+        std::vector<int> longer = {41, 42};
+        longer.insert(longer.end(), dims.begin() + 1, dims.end());
+        const double suffix_us = time_us([&](int rep) {
+            checksum += (rep % 2 ? planner.plan(longer.data(), n + 1) : planner.plan(dims.data(), n)).flops;
+        });
+
+        printf("%6zu %14.1f %14.1f %14.1f %10.1f\n", n, scratch_us, p0_us, suffix_us, scratch_us / p0_us);
+    }
+    printf("(checksum %lld)\n", (long long)checksum);
+}
+
+//==============================================================================
+// bench_batch_gemm ()
+//==============================================================================
+// 10^5 small products of several shapes: one DenseMatrix product per pair,
+// one gemm() call per pair into preallocated storage, and batched in the
+// compact layout (into a new batch, into a reused one, and on
+// ThreadPool::global()). A large gemm() gives the rate the small ones are
+// measured against.
+void bench_batch_gemm()
+{
+    constexpr std::size_t count = 100000;
+
+    const auto best_seconds = [](const auto& func) {
+        double best = std::numeric_limits<double>::infinity();
+        for (int rep = 0; rep < 3; rep++) {
+            const auto start = std::chrono::steady_clock::now();
+            func();
+            const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+            best = std::min(best, seconds.count());
+        }
+        return best;
+    };
+
+    {
+        const int n = 512;
+        DenseMatrix<double> A(n, n);
+        DenseMatrix<double> B(n, n);
+        DenseMatrix<double> C(n, n);
+        std::fill(A.data(), A.data() + n * n, 1.0);
+        std::fill(B.data(), B.data() + n * n, 1.0);
+        const double seconds = best_seconds([&]() {
+            gemm(n, n, n, 1.0, A.data(), n, B.data(), n, 0.0, C.data(), n);
+        });
+        printf("gemm %dx%dx%d: %.2f GFLOP/s\n\n", n, n, n, calc_mult_flops<double>(n, n, n) / seconds * 1e-9);
+    }
+
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<double> value(-1, 1);
+    printf("%-12s %-8s %12s %12s %12s %12s %12s\n", "shape", "kernel", "dense", "gemm", "batched", "batched_into",
+           "into_pool");
+    for (const auto& [m, k, n] : {std::tuple(2, 5, 3), std::tuple(5, 3, 10), std::tuple(8, 8, 8),
+                                  std::tuple(16, 16, 16), std::tuple(40, 20, 30), std::tuple(7, 9, 11)}) {
+        std::vector<DenseMatrix<double>> lefts(count, DenseMatrix<double>(m, k));
+        std::vector<DenseMatrix<double>> rights(count, DenseMatrix<double>(k, n));
+        std::vector<DenseMatrix<double>> products(count, DenseMatrix<double>(m, n));
+        std::vector<const DenseMatrix<double>*> left_ptrs;
+        std::vector<const DenseMatrix<double>*> right_ptrs;
+        for (std::size_t p = 0; p < count; p++) {
+            std::generate(lefts[p].data(), lefts[p].data() + m * k, [&]() { return value(gen); });
+            std::generate(rights[p].data(), rights[p].data() + k * n, [&]() { return value(gen); });
+            left_ptrs.push_back(&lefts[p]);
+            right_ptrs.push_back(&rights[p]);
+        }
+        const CompactBatch<double> A = CompactBatch<double>::pack(left_ptrs.data(), count);
+        const CompactBatch<double> B = CompactBatch<double>::pack(right_ptrs.data(), count);
+
+        double checksum = 0;
+        const double dense_s = best_seconds([&]() {
+            for (std::size_t p = 0; p < count; p++) {
+                checksum += (lefts[p] * rights[p])(0, 0);
+            }
+        });
+        const double gemm_s = best_seconds([&]() {
+            for (std::size_t p = 0; p < count; p++) {
+                gemm(m, n, k, 1.0, lefts[p].data(), k, rights[p].data(), n, 0.0, products[p].data(), n);
+            }
+        });
+        CompactBatch<double> AB(m, n, count);
+        const double batched_s = best_seconds([&]() { checksum += batched_mult(A, B)(0, 0, 0); });
+        const double into_s = best_seconds([&]() { batched_mult(A, B, AB); });
+        const double pool_s = best_seconds([&]() { batched_mult(A, B, AB, &ThreadPool::global()); });
+
+        const double gflop = count * calc_mult_flops<double>(m, k, n) * 1e-9;
+        const std::string shape = std::to_string(m) + "x" + std::to_string(k) + "x" + std::to_string(n);
+        printf("%-12s %-8s %12.2f %12.2f %12.2f %12.2f %12.2f GFLOP/s (checksum %g)\n", shape.c_str(),
+               get_compact_gemm_kernel<double>(m, k, n).m ? "fixed" : "generic", gflop / dense_s, gflop / gemm_s,
+               gflop / batched_s, gflop / into_s, gflop / pool_s, checksum + AB(0, 0, 0));
+    }
 }
 
 //==============================================================================
-// product_using_initializer_list ()
+// bench_mixed ()
 //==============================================================================
-constexpr Matrix product_using_initializer_list(std::initializer_list<const Matrix> mats)
+// 512^3 products in every precision on the best kernel of the CPU; the rates
+// relative to fp64 are PrecisionCostModel::throughput for this machine. Then
+// the precision calc_mult_plan_for_latency() picks for a chain under a few
+// targets.
+void bench_mixed()
 {
-    if (mats.size() == 0) {
-        throw std::logic_error("no input mat");
-    }
+    const int n = 512;
+    std::array<double, num_precisions> gflops = {};
+    const auto bench = [&](auto elem) {
+        using In = decltype(elem);
+        DenseMatrix<double> A(n, n);
+        for (int i = 0; i < n * n; i++) {
+            A.data()[i] = i % 7 - 3;
+        }
+        const DenseMatrix<In> A_in = convert_matrix<In>(A);
 
-    Matrix res = *(mats.begin());
-    for (auto it = mats.begin() + 1; it != mats.end(); it++) {
-        res *= *it;
-    }
+        double best = std::numeric_limits<double>::infinity();
+        for (int rep = 0; rep < 3; rep++) {
+            const auto start = std::chrono::steady_clock::now();
+            mixed_mult(A_in, A_in);
+            const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+            best = std::min(best, seconds.count());
+        }
+        const Precision precision = precision_traits<In>::precision;
+        gflops[std::size_t(precision)] = 2.0 * n * n * n / best * 1e-9;
+        printf("%-6s %-12s %10.2f %10.2f\n", get_precision_name(precision), get_mixed_gemm_kernels<In>().front().name,
+               gflops[std::size_t(precision)], gflops[std::size_t(precision)] / gflops[0]);
+    };
 
-    return res;
+    printf("%-6s %-12s %10s %10s\n", "type", "kernel", "GFLOP/s", "vs_fp64");
+    bench(0.0);
+    bench(0.0f);
+    bench(bfloat16());
+    bench(float16());
+    bench(std::int8_t());
+
+    PrecisionCostModel model;
+    model.fp64.peak_gflops = gflops[0];
+    for (std::size_t p = 0; p < num_precisions; p++) {
+        model.throughput[p] = gflops[p] / gflops[0];
+    }
+    const int dims[] = {1024, 4096, 512, 2048, 1024};
+    model.precision = Precision::fp64;
+    const double fp64_s = predict_mult_plan_seconds(calc_fastest_mult_plan<std::int64_t>(dims, 4, model), dims, model);
+    printf("\n%-12s %-6s %-26s %12s\n", "target_ms", "picked", "plan", "predicted_ms");
+    for (double fraction : {2.0, 0.75, 0.4, 0.2, 0.01}) {
+        const PrecisionMultPlan<std::int64_t> res = calc_mult_plan_for_latency(dims, 4, fp64_s * fraction, model);
+        printf("%-12.3f %-6s %-26s %12.3f\n", fp64_s * fraction * 1e3, get_precision_name(res.precision),
+               res.plan.to_string().c_str(), res.seconds * 1e3);
+    }
 }
 
+#if defined(MATRIX_TRACE)
 //==============================================================================
-// sum_using_fold_expression ()
+// trace_workload ()
 //==============================================================================
-template <typename... Args>
-static constexpr Matrix sum_using_fold_expression(Args&&... args)
+// Traces a chain and a sum of dense matrices, serial and on
+// ThreadPool::global(), writes the events to path as a Chrome trace and
+// prints their histograms, then the cost of a hook on tiny products.
+void trace_workload(const char *path)
 {
-    return (... + args);  // ((arg1 + arg2) + arg3) + ...
-//    return (args + ...);  // arg1 + (arg2 + (arg3 + ...))
+    DenseMatrix<double> A(400, 200);
+    DenseMatrix<double> B(200, 300);
+    DenseMatrix<double> C(300, 100);
+    DenseMatrix<double> D(100, 300);
+    const DenseMatrix<double> *inputs[] = {&A, &B, &C, &D};
+    const int dims[] = {400, 200, 300, 100, 300};
+    const BasicMultPlan<std::int64_t> plan = calc_optimal_mult_plan<std::int64_t>(dims, 4);
+
+    TraceRecorder& recorder = TraceRecorder::global();
+    recorder.clear();
+    recorder.set_enabled(true);
+    for (int rep = 0; rep < 10; rep++) {
+        const DenseMatrix<double> ABCD = (A * B) * (C * D);
+        const DenseMatrix<double> sum = ABCD + ABCD;
+        const DenseMatrix<double> *terms[] = {&ABCD, &sum, &ABCD, &sum};
+        fused_sum(terms, 4);
+        fused_sum(terms, 4, &ThreadPool::global());
+        execute_mult_plan(plan, inputs);
+        execute_mult_plan(plan, inputs, ThreadPool::global());
+    }
+    recorder.set_enabled(false);
+
+    std::ofstream os(path);
+    recorder.write_chrome_trace(os);
+    if (!os) {
+        throw std::runtime_error("trace: cannot write " + std::string(path));
+    }
+    printf("%zu events written to %s\n\n", recorder.get_events().size(), path);
+    recorder.write_histograms(std::cout);
+    recorder.clear();
+
+    // 2 x 2 products, enabled vs disabled
+    constexpr int reps = 100000;
+    const DenseMatrix<double> tiny(2, 2);
+    const auto time_it = [&](bool enabled) {
+        recorder.set_enabled(enabled);
+        const auto start = std::chrono::steady_clock::now();
+        for (int rep = 0; rep < reps; rep++) {
+            tiny * tiny;
+        }
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        recorder.set_enabled(false);
+        return elapsed.count() / reps;
+    };
+    time_it(true);  // grows the event buffer, which clear() keeps
+    recorder.clear();
+    const double disabled_ns = time_it(false);
+    const double enabled_ns = time_it(true);
+    recorder.clear();
+    printf("\n2x2 product: %.1f ns disabled, %.1f ns enabled, %.1f ns per event\n", disabled_ns, enabled_ns,
+           enabled_ns - disabled_ns);
 }
+#endif
 
 //==============================================================================
-// product_using_fold_expression ()
+// bench_sum ()
 //==============================================================================
-template <typename... Args>
-static constexpr Matrix product_using_fold_expression(Args&&... args)
+// Summing k matrices: left fold vs fused_sum(), serial and on
+// ThreadPool::global(). GB/s counts reading the k inputs and writing the result.
+void bench_sum()
 {
-    return (... * args);  // ((arg1 * arg2) * arg3) * ...
-//    return (args * ...);  // arg1 * (arg2 * (arg3 * ...))
+    constexpr int size = 512;
+
+    printf("threads: %u\n", ThreadPool::global().get_concurrency());
+    printf("%4s %12s %12s %12s\n", "k", "fold_GB/s", "fused_GB/s", "par_GB/s");
+    for (std::size_t k : {2, 4, 8, 16, 32, 64}) {
+        std::vector<DenseMatrix<double>> mats(k, DenseMatrix<double>(size, size));
+        std::vector<const DenseMatrix<double>*> inputs;
+        for (const DenseMatrix<double>& mat : mats) {
+            inputs.push_back(&mat);
+        }
+        const double gb = double(k + 1) * size * size * sizeof(double) / 1e9;
+
+        const auto time_it = [&](const auto& func) {
+            constexpr int reps = 5;
+            const auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < reps; r++) {
+                const DenseMatrix<double> res = func();
+                assert(res.get_nrow() == size);
+            }
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return gb * reps / elapsed.count();
+        };
+
+        const double fold = time_it([&]() {
+            DenseMatrix<double> res = mats[0];
+            for (std::size_t m = 1; m < k; m++) {
+                res += mats[m];
+            }
+            return res;
+        });
+        const double fused = time_it([&]() { return fused_sum(inputs.data(), k); });
+        const double par = time_it([&]() { return fused_sum(inputs.data(), k, &ThreadPool::global()); });
+
+        printf("%4zu %12.2f %12.2f %12.2f\n", k, fold, fused, par);
+    }
 }
 
 //==============================================================================
-// order_to_string ()
+// bench_strassen ()
 //==============================================================================
-std::string order_to_string(std::vector<std::vector<int>>& min_index, int i, int j,
-                            std::initializer_list<const char *>& mat_names)
+// gemm() vs strassen_winograd() on square products for a few crossovers, to
+// pick the one to set on StrassenPolicy::global()
+void bench_strassen()
 {
-    if (i == j) {
-        return (mat_names.size() ? *(mat_names.begin() + i) : std::string("M") + std::to_string(i + 1));
-    } else {
-        return "(" + order_to_string(min_index, i, min_index[i][j], mat_names) +
-        " * " + order_to_string(min_index, min_index[i][j] + 1, j, mat_names) + ")";
+    printf("%6s %10s %12s %12s %12s\n", "n", "crossover", "gemm_ms", "strassen_ms", "flops_ratio");
+    for (int n : {256, 512, 1024}) {
+        std::vector<double> A(std::size_t(n) * n, 1.0);
+        std::vector<double> B(std::size_t(n) * n, 1.0);
+        std::vector<double> C(std::size_t(n) * n);
+
+        const auto start_gemm = std::chrono::steady_clock::now();
+        gemm(n, n, n, 1.0, A.data(), n, B.data(), n, 0.0, C.data(), n);
+        const std::chrono::duration<double, std::milli> gemm_ms = std::chrono::steady_clock::now() - start_gemm;
+
+        for (int crossover : {64, 128, 256, 512}) {
+            if (crossover > n) {
+                continue;
+            }
+            const StrassenPolicy policy(crossover);
+            const auto start = std::chrono::steady_clock::now();
+            strassen_winograd(n, n, n, A.data(), n, B.data(), n, C.data(), n, policy);
+            const std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+
+            const double flops_ratio = double(policy.calc_flops<std::int64_t>(n, n, n)) /
+                                       StrassenPolicy().calc_flops<std::int64_t>(n, n, n);
+            printf("%6d %10d %12.3f %12.3f %12.4f\n", n, crossover, gemm_ms.count(), ms.count(), flops_ratio);
+        }
     }
 }
 
 //==============================================================================
-// calc_optimal_mult_order ()
+// bench_parallel ()
 //==============================================================================
-std::pair<std::string, int> calc_optimal_mult_order(std::initializer_list<const Matrix> mats,
-                                                    std::initializer_list<const char *> mat_names = {})
+// Chains run in their optimal order by the arena (one thread) and as a task
+// graph for a few thread counts. The first chain's order is
+// ((A * B) * (C * D)), with independent subtrees. The second's is
+// ((A * (B * C)) * D), a linear chain that only parallel_gemm() can spread.
+void bench_parallel()
 {
-    //--------------------------------------------------------------------------
-    // Matrix Chain Multiplication
-    //--------------------------------------------------------------------------
-
-    // static_assert
-    if (mat_names.size() && mat_names.size() != mats.size()) {
-        throw std::logic_error("wrong input sizes");
-    }
-
-    if (mats.size() == 0) {
-        return {"", 0};
-    }
+    const unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (const std::vector<int>& dims : std::vector<std::vector<int>>{{600, 600, 60, 600, 600},
+                                                                      {400, 200, 300, 100, 300}}) {
+        const std::size_t n = dims.size() - 1;
+        std::vector<DenseMatrix<double>> mats;
+        std::vector<const DenseMatrix<double>*> inputs;
+        for (std::size_t m = 0; m < n; m++) {
+            mats.emplace_back(dims[m], dims[m + 1]);
+        }
+        for (const DenseMatrix<double>& mat : mats) {
+            inputs.push_back(&mat);
+        }
+        const BasicMultPlan<std::int64_t> plan = calc_optimal_mult_plan<std::int64_t>(dims.data(), n);
 
-    // assert mat dimensions are compatible
-    for_each_adjacent_pair(mats.begin(), mats.end(),
-        [](const Matrix& m1, const Matrix& m2) {
-            assert(m1.get_ncol() == m2.get_nrow());
+        const auto time_ms = [](const auto& func) {
+            const auto start = std::chrono::steady_clock::now();
+            func();
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        };
+        execute_mult_plan(plan, inputs.data());
+        printf("%s: arena %10.3f ms\n", plan.to_string().c_str(),
+               time_ms([&]() { execute_mult_plan(plan, inputs.data()); }));
+        for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+            ThreadPool pool(threads - 1);
+            printf("  %3u threads %10.3f ms\n", threads,
+                   time_ms([&]() { execute_mult_plan(plan, inputs.data(), pool); }));
         }
-    );
 
-    const auto get_mat = [&mats](int i) { return *(mats.begin() + i); };
-    const std::size_t n = mats.size();
-    std::vector<std::vector<int>> min_cost(n, std::vector<int>(n));
-    std::vector<std::vector<int>> min_index(n, std::vector<int>(n));
-    for (std::size_t length = 2; length < n + 1; length++) {
-        // find minimum flops for all chains of size 'length'
-        for (std::size_t i = 0; i < n - length + 1; i++) {
-            const std::size_t j = i + length - 1;
+        // pinned per node of NumaTopology::system(), all hardware threads
+        ThreadPool pinned(max_threads - 1, NumaTopology::system());
+        for (const auto& [name, numa] : {std::pair<const char*, NumaPolicy>{"first_touch", NumaPolicy::first_touch},
+                                         {"local", NumaPolicy::local}, {"interleave", NumaPolicy::interleave}}) {
+            printf("  %d nodes, %-11s %10.3f ms\n", pinned.get_topology().get_num_nodes(), name,
+                   time_ms([&]() { execute_mult_plan(plan, inputs.data(), pinned, numa); }));
+        }
+    }
+}
 
-            min_cost[i][j] = std::numeric_limits<int>::max();
-            for (std::size_t k = i; k < j; k++) {
-                const int cost = min_cost[i][k] + min_cost[k + 1][j] +
-                    // flops(dim1, dim2, dim3) = dim1 * dim2 * (2 * dim3 - 1)
-                    get_mat(i).get_nrow() * get_mat(k).get_ncol() * (2 * get_mat(j).get_ncol() - 1);
-                if (cost < min_cost[i][j]) {
-                    min_cost[i][j] = cost;
-                    min_index[i][j] = k;
+//==============================================================================
+// bench_sparse ()
+//==============================================================================
+// Random CSR chains of 0.1% to 5% density, run in the order the dense DP
+// picks and in the order the sparse one picks
+void bench_sparse()
+{
+    std::mt19937 rng(42);
+    const auto random_csr = [&rng](int nrow, int ncol, double density) {
+        std::bernoulli_distribution keep(density);
+        std::uniform_real_distribution<double> value(-1, 1);
+        std::vector<std::tuple<int, int, double>> triplets;
+        for (int i = 0; i < nrow; i++) {
+            for (int j = 0; j < ncol; j++) {
+                if (keep(rng)) {
+                    triplets.emplace_back(i, j, value(rng));
                 }
             }
         }
-    }
+        return CsrMatrix<double>::from_triplets(nrow, ncol, std::move(triplets));
+    };
 
-    const std::string& opt_order = order_to_string(min_index, 0, n - 1, mat_names);
-    const int opt_flops = min_cost[0][n - 1];
+    struct Chain {
+        std::vector<int> dims;
+        std::vector<double> densities;
+    };
+    const std::vector<Chain> chains = {{{300, 3000, 3000, 3000, 100}, {1, 0.001, 0.001, 1}},
+                                       {{2000, 2000, 2000, 2000, 2000}, {0.05, 0.001, 0.01, 0.05}},
+                                       {{100, 5000, 5000, 5000, 100}, {0.02, 0.002, 0.002, 0.02}}};
+    printf("%-26s %-8s %14s %14s %12s\n", "plan", "costing", "est_flops", "flops", "ms");
+    for (const Chain& chain : chains) {
+        const std::size_t n = chain.dims.size() - 1;
+        std::vector<CsrMatrix<double>> mats;
+        std::vector<SparseShape> shapes;
+        for (std::size_t i = 0; i < n; i++) {
+            mats.push_back(random_csr(chain.dims[i], chain.dims[i + 1], chain.densities[i]));
+            shapes.push_back(mats.back().get_shape());
+        }
+        std::vector<const CsrMatrix<double>*> inputs;
+        for (const CsrMatrix<double>& mat : mats) {
+            inputs.push_back(&mat);
+        }
 
-    return {opt_order, opt_flops};
+        // the dense order, estimated as the sparse one is
+        BasicMultPlan<std::int64_t> dense_plan = calc_optimal_mult_plan<std::int64_t>(chain.dims.data(), n);
+        estimate_sparse_mult_plan(dense_plan, shapes.data());
+        const BasicMultPlan<std::int64_t> sparse_plan = calc_sparse_mult_plan(shapes.data(), n);
+        const std::pair<const BasicMultPlan<std::int64_t>*, const char *> plans[] = {{&dense_plan, "dense"},
+                                                                                      {&sparse_plan, "sparse"}};
+        for (const auto& [plan, costing] : plans) {
+            const auto start = std::chrono::steady_clock::now();
+            const CsrMatrix<double> res = execute_mult_plan(*plan, inputs.data());
+            const std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+            printf("%-26s %-8s %14lld %14lld %12.3f\n", plan->to_string().c_str(), costing, (long long)plan->flops,
+                   (long long)res.get_flops(), ms.count());
+        }
+        printf("\n");
+    }
 }
 
 //==============================================================================
-// compile_time_checks ()
+// bench_out_of_core ()
 //==============================================================================
-constexpr void compile_time_checks()
+// A 2048x2048 by 2048x2048 product from mapped files under shrinking memory
+// budgets, against the same product in memory
+#if defined(__unix__) || defined(__APPLE__)
+void bench_out_of_core()
 {
-    {
-        constexpr Matrix A(2, 10);
-
-        static_assert(A.get_nrow() == 2);
-        static_assert(A.get_ncol() == 10);
-        static_assert(A.get_flops() == 0);
+    const int n = 2048;
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> value(-1, 1);
+    DenseMatrix<double> A(n, n);
+    DenseMatrix<double> B(n, n);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            A(i, j) = value(rng);
+            B(i, j) = value(rng);
+        }
     }
 
-    {
-        constexpr Matrix A(2, 10);
-        constexpr Matrix B(2, 10);
-        constexpr Matrix C = A + B;
-
-        static_assert(C.get_nrow() == 2);
-        static_assert(C.get_ncol() == 10);
-        static_assert(C.get_flops() == 20);
+    const std::string path_a = make_temp_path("matrix_bench_a.mat").string();
+    const std::string path_b = make_temp_path("matrix_bench_b.mat").string();
+    const std::string path_c = make_temp_path("matrix_bench_c.mat").string();
+    MappedMatrix<double>::from_dense(path_a, A).sync();
+    MappedMatrix<double>::from_dense(path_b, B).sync();
+    const MappedMatrix<double> mapped_a = MappedMatrix<double>::open(path_a);
+    const MappedMatrix<double> mapped_b = MappedMatrix<double>::open(path_b);
 
-        // constexpr Matrix C = Matrix(2, 10) + Matrix(3, 10);  // compile error: non-matching dimensions
+    printf("%-12s %12s %12s\n", "memory_mb", "ms", "predicted_ms");
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const DenseMatrix<double> C = A * B;
+        const std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+        printf("%-12s %12.3f %12.3f\n", "in-memory", ms.count(), RooflineCostModel().predict(n, n, n) * 1e3);
+    }
+    for (std::int64_t memory_mb : {64, 16, 4, 1}) {
+        OutOfCoreCostModel model;
+        model.memory_bytes = memory_mb << 20;
+        const auto start = std::chrono::steady_clock::now();
+        out_of_core_mult(mapped_a, mapped_b, path_c, model.memory_bytes).sync();
+        const std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+        printf("%-12lld %12.3f %12.3f\n", (long long)memory_mb, ms.count(), model.predict(n, n, n) * 1e3);
     }
 
-    {
-        constexpr Matrix A(2, 5);
-        constexpr Matrix B(5, 10);
-        constexpr Matrix C = A * B;
+    std::remove(path_a.c_str());
+    std::remove(path_b.c_str());
+    std::remove(path_c.c_str());
+}
+#endif
 
-        static_assert(C.get_nrow() == 2);
-        static_assert(C.get_ncol() == 10);
-        static_assert(C.get_flops() == 190);
+//==============================================================================
+// bench_async ()
+//==============================================================================
+// A chain of factors read from matrix files with some latency on top (a
+// sleep, as from the network): fetched then multiplied, vs the coroutine of
+// execute_mult_plan_async(), which overlaps the fetches with the products
+#if (defined(__unix__) || defined(__APPLE__)) && defined(__cpp_impl_coroutine)
+void bench_async()
+{
+    constexpr int num_factors = 8;
+    constexpr int dim = 400;
 
-        // constexpr Matrix C = Matrix(2, 5) * Matrix(4, 10);  // compile error: non-matching dimensions
+    std::vector<std::string> paths;
+    for (int i = 0; i < num_factors; i++) {
+        DenseMatrix<double> factor(dim, dim);
+        for (int r = 0; r < dim; r++) {
+            for (int c = 0; c < dim; c++) {
+                factor(r, c) = double((r + c + i) % 3) / dim;
+            }
+        }
+        paths.push_back(make_temp_path("matrix_bench_async_" + std::to_string(i) + ".mat").string());
+        MappedMatrix<double>::from_dense(paths.back(), factor).sync();
     }
+    const std::vector<int> dims(num_factors + 1, dim);
+    const BasicMultPlan<std::int64_t> plan = calc_optimal_mult_plan<std::int64_t>(dims.data(), num_factors);
+    ThreadPool pool(3);
 
-    {
-        constexpr Matrix A(2, 5);
-        constexpr Matrix B(5, 10);
-        constexpr Matrix C(10, 3);
-        constexpr Matrix D(3, 8);
-        constexpr Matrix E(2, 7);
-        constexpr Matrix F(7, 8);
-        constexpr Matrix G = A * B * C * D + E * F;
-        constexpr Matrix G2 = (A * (B * C)) * D + E * F;
+    printf("%12s %12s %12s\n", "latency_ms", "fetch_ms", "async_ms");
+    for (int latency_ms : {0, 20, 50}) {
+        const std::function<DenseMatrix<double>(int)> fetch = [&paths, latency_ms](int i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(latency_ms));
+            return MappedMatrix<double>::open(paths[i]).to_dense();
+        };
 
-        static_assert(G.get_nrow() == 2);
-        static_assert(G.get_ncol() == 8);
-        static_assert(G2.get_nrow() == 2);
-        static_assert(G2.get_ncol() == 8);
-    }
+        const auto start_fetch = std::chrono::steady_clock::now();
+        std::vector<DenseMatrix<double>> factors;
+        std::vector<const DenseMatrix<double>*> inputs;
+        factors.reserve(num_factors);
+        for (int i = 0; i < num_factors; i++) {
+            factors.push_back(fetch(i));
+            inputs.push_back(&factors.back());
+        }
+        execute_mult_plan(plan, inputs.data());
+        const std::chrono::duration<double, std::milli> fetch_ms = std::chrono::steady_clock::now() - start_fetch;
 
-    {
-        constexpr Matrix A(2, 5);
-        constexpr Matrix B(2, 5);
-        constexpr Matrix C(2, 5);
+        const auto start_async = std::chrono::steady_clock::now();
+        execute_mult_plan_async(plan, fetch, pool).get();
+        const std::chrono::duration<double, std::milli> async_ms = std::chrono::steady_clock::now() - start_async;
 
-        static_assert((A + B + C) == sum_using_initializer_list({A, B, C}));
-        static_assert((A + B + C) == sum_using_fold_expression(A, B, C));
+        printf("%12d %12.3f %12.3f\n", latency_ms, fetch_ms.count(), async_ms.count());
     }
 
-    {
-        constexpr Matrix A(2, 5);
-        constexpr Matrix B(5, 10);
-        constexpr Matrix C(10, 3);
-        constexpr Matrix D(3, 8);
-
-        static_assert((A * B * C * D) == product_using_initializer_list({A, B, C, D}));
-        static_assert((A * B * C * D) == product_using_fold_expression(A, B, C, D));
+    for (const std::string& path : paths) {
+        std::remove(path.c_str());
     }
 }
+#endif
 
 //==============================================================================
-// run_time_checks ()
+// bench_autotune ()
 //==============================================================================
-void run_time_checks()
+// Sweeps gemm() blocking, the Strassen-Winograd crossover, thread counts and a
+// grid of shapes, saves the resulting MachineProfile to path, then compares
+// the time the cost models predict for every plan of a few chains with the
+// time they really take.
+void bench_autotune(const std::string& path)
 {
-    {
-        constexpr Matrix A(2, 10);
-        Matrix B(2, 10);
-        B += A;
+    using clock = std::chrono::steady_clock;
+    MachineProfile profile;
 
-        assert(B.get_nrow() == 2);
-        assert(B.get_ncol() == 10);
-        assert(B.get_flops() == 20);
-    }
+    // best of reps runs, in seconds
+    const auto time_it = [](int reps, const auto& func) {
+        double best = std::numeric_limits<double>::infinity();
+        for (int r = 0; r < reps; r++) {
+            const auto start = clock::now();
+            func();
+            best = std::min(best, std::chrono::duration<double>(clock::now() - start).count());
+        }
+        return best;
+    };
 
+    //--------------------------------------------------------------------------
+    // gemm() blocking, on a square and a skinny shape
+    //--------------------------------------------------------------------------
     {
-        constexpr Matrix A(2, 10);
-        constexpr Matrix B(2, 10);
-        Matrix C(2, 10);
-        C += A + B;
+        const int size = 512;
+        std::vector<double> A(std::size_t(size) * size, 1.0);
+        std::vector<double> B(std::size_t(size) * size, 1.0);
+        std::vector<double> C(std::size_t(size) * size);
+        const auto run = [&]() {
+            gemm(size, size, size, 1.0, A.data(), size, B.data(), size, 0.0, C.data(), size);
+            gemm(size, size / 16, size, 1.0, A.data(), size, B.data(), size / 16, 0.0, C.data(), size / 16);
+        };
+        const double flops = 2.0 * size * size * size * (1 + 1.0 / 16);
 
-        assert(C.get_nrow() == 2);
-        assert(C.get_ncol() == 10);
-        assert(C.get_flops() == 40);
+        printf("gemm blocking (%d^3 and %d x %d x %d):\n", size, size, size, size / 16);
+        double best = std::numeric_limits<double>::infinity();
+        for (int mc : {64, 128, 256}) {
+            for (int kc : {128, 256, 512}) {
+                for (int nc : {1024, 2048, 4096}) {
+                    GemmTuning<double>::global().set_blocks({mc, kc, nc});
+                    const double seconds = time_it(3, run);
+                    printf("  mc %4d kc %4d nc %5d: %8.2f GFLOP/s\n", mc, kc, nc, flops / seconds / 1e9);
+                    if (seconds < best) {
+                        best = seconds;
+                        profile.gemm_blocks = {mc, kc, nc};
+                    }
+                }
+            }
+        }
+        GemmTuning<double>::global().set_blocks(profile.gemm_blocks);
+        profile.peak_gflops = flops / best / 1e9;
+        printf("  best: mc %d kc %d nc %d\n\n", profile.gemm_blocks.mc, profile.gemm_blocks.kc, profile.gemm_blocks.nc);
     }
 
+    //--------------------------------------------------------------------------
+    // Strassen-Winograd crossover, 0 if it never pays off
+    //--------------------------------------------------------------------------
     {
-        constexpr Matrix A(5, 10);
-        Matrix B(2, 5);
-        B *= A;
-
-        assert(B.get_nrow() == 2);
-        assert(B.get_ncol() == 10);
-        assert(B.get_flops() == 190);
+        printf("strassen crossover:\n");
+        double best = std::numeric_limits<double>::infinity();
+        for (int crossover : {0, 128, 256, 512}) {
+            const StrassenPolicy policy(crossover);
+            double seconds = 0;
+            for (int size : {256, 512, 1024}) {
+                std::vector<double> A(std::size_t(size) * size, 1.0);
+                std::vector<double> C(std::size_t(size) * size);
+                seconds += time_it(2, [&]() {
+                    strassen_winograd(size, size, size, A.data(), size, A.data(), size, C.data(), size, policy);
+                });
+            }
+            printf("  %4d: %10.3f ms\n", crossover, seconds * 1e3);
+            if (seconds < best) {
+                best = seconds;
+                profile.strassen_crossover = crossover;
+            }
+        }
+        printf("  best: %d\n\n", profile.strassen_crossover);
     }
 
+    //--------------------------------------------------------------------------
+    // threads, and memory bandwidth, on fused_sum()
+    //--------------------------------------------------------------------------
     {
-        constexpr Matrix A(2, 5);
-        constexpr Matrix B(5, 10);
-        Matrix C(10, 2);
-        C *= A * B;
+        constexpr int size = 1024;
+        constexpr std::size_t k = 16;
+        std::vector<DenseMatrix<double>> mats(k, DenseMatrix<double>(size, size));
+        std::vector<const DenseMatrix<double>*> inputs;
+        for (const DenseMatrix<double>& mat : mats) {
+            inputs.push_back(&mat);
+        }
+        const double bytes = double(k + 1) * size * size * sizeof(double);
 
-        assert(C.get_nrow() == 10);
-        assert(C.get_ncol() == 10);
-        assert(C.get_flops() == 570);
+        printf("threads (fused_sum of %zu %d^2):\n", k, size);
+        double best = std::numeric_limits<double>::infinity();
+        for (unsigned threads = 1; threads <= std::max(1u, std::thread::hardware_concurrency()); threads *= 2) {
+            ThreadPool pool(threads - 1);
+            const double seconds = time_it(3, [&]() { fused_sum(inputs.data(), k, &pool); });
+            printf("  %3u: %8.2f GB/s\n", threads, bytes / seconds / 1e9);
+            if (seconds < best) {
+                best = seconds;
+                profile.threads = threads;
+            }
+        }
+        profile.bandwidth_gbs = bytes / best / 1e9;
+        printf("  best: %u\n\n", profile.threads);
     }
 
+    //--------------------------------------------------------------------------
+    // grid of shapes for MeasuredCostModel
+    //--------------------------------------------------------------------------
     {
-        constexpr Matrix A(40, 20);
-        constexpr Matrix B(20, 30);
-        constexpr Matrix C(30, 10);
-        constexpr Matrix D(10, 30);
+        const MeasuredCostModel measured = MeasuredCostModel::calibrate({1, 4, 16, 64, 256, 1024}, 0.005);
+        profile.cost_sizes = measured.get_sizes();
+        profile.cost_gflops = measured.get_gflops();
+    }
 
-        // when no mat names given, mats are named as "Mi"
-        assert(calc_optimal_mult_order({A, B, C, D}) ==
-               std::make_pair("((M1 * (M2 * M3)) * M4)"s, 50200));
-        assert(calc_optimal_mult_order({A, B, C, D}, {"A", "B", "C", "D"}) ==
-               std::make_pair("((A * (B * C)) * D)"s, 50200));
+    profile.save(path);
+    profile.apply();
+    printf("profile saved to %s\n\n", path.c_str());
+
+    //--------------------------------------------------------------------------
+    // predicted vs measured time of every plan
+    //--------------------------------------------------------------------------
+    const MeasuredCostModel measured = profile.get_measured_cost_model();
+    const RooflineCostModel roofline = profile.get_roofline_cost_model();
+    for (const std::vector<int>& dims : std::vector<std::vector<int>>{{400, 200, 300, 100, 300},
+                                                                      {1, 2048, 64, 2048, 1},
+                                                                      {1000, 10, 1000, 10, 1000}}) {
+        const std::size_t n = dims.size() - 1;
+        std::vector<DenseMatrix<double>> mats;
+        std::vector<const DenseMatrix<double>*> inputs;
+        for (std::size_t m = 0; m < n; m++) {
+            mats.emplace_back(dims[m], dims[m + 1]);
+        }
+        for (const DenseMatrix<double>& mat : mats) {
+            inputs.push_back(&mat);
+        }
+
+        printf("chain");
+        for (int dim : dims) {
+            printf(" %d", dim);
+        }
+        printf(" (fastest measured: %s, roofline: %s, flops: %s)\n",
+               calc_fastest_mult_plan<std::int64_t>(dims.data(), n, measured).to_string().c_str(),
+               calc_fastest_mult_plan<std::int64_t>(dims.data(), n, roofline).to_string().c_str(),
+               calc_optimal_mult_plan<std::int64_t>(dims.data(), n).to_string().c_str());
+        printf("  %-26s %14s %12s %12s %12s\n", "plan", "flops", "measured_ms", "table_ms", "roofline_ms");
+        for_each_mult_plan<std::int64_t>(dims.data(), n, [&](const BasicMultPlan<std::int64_t>& plan) {
+            const double seconds = time_it(3, [&]() { execute_mult_plan(plan, inputs.data()); });
+            printf("  %-26s %14lld %12.3f %12.3f %12.3f\n", plan.to_string().c_str(), (long long)plan.flops,
+                   seconds * 1e3, predict_mult_plan_seconds(plan, dims.data(), measured) * 1e3,
+                   predict_mult_plan_seconds(plan, dims.data(), roofline) * 1e3);
+        });
+        printf("\n");
     }
 }
 
 //==============================================================================
 // main ()
 //==============================================================================
-int main()
+int main(int argc, char *argv[])
 {
+    // a profile written by "autotune", applied to the benchmarks and after the
+    // checks, which expect the default tuning
+    const char *profile_path = std::getenv("MATRIX_PROFILE");
+    const auto bench = [&](const char *name) {
+        if (argc < 2 || argv[1] != std::string(name)) {
+            return false;
+        }
+        if (profile_path != nullptr) {
+            MachineProfile::load(profile_path).apply();
+        }
+        return true;
+    };
+
+    if (bench("bench-order")) {
+        bench_mult_order();
+        return 0;
+    }
+    if (bench("bench-approx")) {
+        bench_approx();
+        return 0;
+    }
+    if (bench("bench-batch")) {
+        bench_batch_plans();
+        return 0;
+    }
+    if (bench("bench-replan")) {
+        bench_replan();
+        return 0;
+    }
+    if (bench("bench-batch-gemm")) {
+        bench_batch_gemm();
+        return 0;
+    }
+    if (bench("bench-mixed")) {
+        bench_mixed();
+        return 0;
+    }
+    if (bench("bench-sum")) {
+        bench_sum();
+        return 0;
+    }
+    if (bench("bench-strassen")) {
+        bench_strassen();
+        return 0;
+    }
+    if (bench("bench-parallel")) {
+        bench_parallel();
+        return 0;
+    }
+    if (bench("bench-sparse")) {
+        bench_sparse();
+        return 0;
+    }
+#if defined(__unix__) || defined(__APPLE__)
+    if (bench("bench-ooc")) {
+        bench_out_of_core();
+        return 0;
+    }
+#endif
+#if (defined(__unix__) || defined(__APPLE__)) && defined(__cpp_impl_coroutine)
+    if (bench("bench-async")) {
+        bench_async();
+        return 0;
+    }
+#endif
+#if defined(MATRIX_TRACE)
+    if (bench("trace")) {
+        trace_workload(argc > 2 ? argv[2] : "matrix.trace.json");
+        return 0;
+    }
+#endif
+    if (argc > 1 && argv[1] == "autotune"s) {
+        bench_autotune(argc > 2 ? argv[2] : "matrix.profile");
+        return 0;
+    }
+
     compile_time_checks();
     run_time_checks();
+    if (profile_path != nullptr) {
+        MachineProfile::load(profile_path).apply();
+    }
 
     {
         constexpr Matrix A(2, 5);
@@ -513,6 +13101,58 @@ int main()
         printf("  ((A * (B * C)) * D): %10d\n", ((A * (B * C)) * D).get_flops());
         printf("  (A * ((B * C) * D)): %10d\n", (A * ((B * C) * D)).get_flops());
         printf("  (A * (B * (C * D))): %10d\n", (A * (B * (C * D))).get_flops());
+        printf("lazy:\n");
+        printf("  lazy(A) * B * C * D: %10d\n", Matrix(lazy(A) * B * C * D).get_flops());
         printf("\n");
    }
+
+    {
+        constexpr Matrix A(10, 100);
+        constexpr Matrix B(100, 100);
+        constexpr Matrix C(100, 10);
+        constexpr Matrix D(100, 10);
+
+        const ExprDag dag(lazy(A) * B * C + lazy(A) * B * D);
+        const ExprPlan& plan = dag.get_plan();
+
+        printf("shared subexpressions:\n");
+        printf("  lazy(A) * B * C + lazy(A) * B * D: %s\n", plan.to_string({"A", "B", "C", "D"}).c_str());
+        printf("  %10d flops, %10d unshared, %10d saved\n", plan.flops, plan.unshared_flops, plan.get_saved_flops());
+        printf("\n");
+    }
+
+    {
+        const int dims[] = {25, 26, 12, 12, 13};
+
+        printf("flops vs peak bytes (double):\n");
+        for (const MultPlan& plan : calc_pareto_mult_plans(dims, 4, sizeof(double))) {
+            printf("  %s: %10d flops, %10lld bytes\n", plan.to_string({"A", "B", "C", "D"}).c_str(), plan.flops,
+                   (long long)plan.get_peak_bytes(sizeof(double)));
+        }
+        printf("\n");
+    }
+
+    {
+        // same chain as above scaled by 10, this time really multiplied
+        DenseMatrix<double> A(400, 200);
+        DenseMatrix<double> B(200, 300);
+        DenseMatrix<double> C(300, 100);
+        DenseMatrix<double> D(100, 300);
+
+        const auto time_it = [](const char *name, const auto& func) {
+            const auto start = std::chrono::steady_clock::now();
+            const DenseMatrix<double>& res = func();
+            const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            printf("  %s: %10lld flops, %8.3f ms, %6.2f GFLOP/s\n", name, (long long)res.get_flops(), elapsed.count(),
+                   res.get_flops() / elapsed.count() / 1e6);
+        };
+
+        printf("dense (x10):\n");
+        time_it("(((A * B) * C) * D)", [&]() { return ((A * B) * C) * D; });
+        time_it("((A * B) * (C * D))", [&]() { return (A * B) * (C * D); });
+        time_it("((A * (B * C)) * D)", [&]() { return (A * (B * C)) * D; });
+        time_it("(A * ((B * C) * D))", [&]() { return A * ((B * C) * D); });
+        time_it("(A * (B * (C * D)))", [&]() { return A * (B * (C * D)); });
+        printf("\n");
+    }
 }
\ No newline at end of file